@@ -22,6 +22,7 @@
 #include <netdb.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <xtables.h>
 #include <linux/netfilter/xt_service.h>
@@ -155,7 +156,24 @@ static struct xtables_match service = {
 	.extra_opts	= service_opts
 };
 
+/* revision 1 has the same options, the kernel caches the service id per CPU */
+static struct xtables_match service_v1 = {
+	.name		= "service",
+	.family		= NFPROTO_UNSPEC,
+	.revision	= 1,
+	.version	= XTABLES_VERSION,
+	.size		= XT_ALIGN(sizeof(struct ipt_service_info_v1)),
+	.userspacesize	= offsetof(struct ipt_service_info_v1, priv),
+	.help		= service_help,
+	.parse		= service_parse,
+	.final_check	= service_final_check,
+	.print		= service_print,
+	.save		= service_save,
+	.extra_opts	= service_opts
+};
+
 void _init(void)
 {
 	xtables_register_match(&service);
+	xtables_register_match(&service_v1);
 }
@@ -24,6 +24,7 @@
 #include <netdb.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <xtables.h>
 #include <linux/netfilter/xt_zone.h>
@@ -396,8 +397,25 @@ static struct xtables_match zone_match_v1 = {
 	.extra_opts	= zone_opts_v1,
 };
 
+/* revision 2 has the same options, the kernel resolves the zone names */
+static struct xtables_match zone_match_v2 = {
+	.name		= "zone",
+	.family		= NFPROTO_UNSPEC,
+	.revision	= 2,
+	.version	= XTABLES_VERSION,
+	.size		= XT_ALIGN(sizeof(struct ipt_zone_info_v2)),
+	.userspacesize	= offsetof(struct ipt_zone_info_v2, priv),
+	.help		= zone_help_v1,
+	.parse		= zone_parse_v1,
+	.final_check	= zone_final_check,
+	.print		= zone_print_v1,
+	.save		= zone_save_v1,
+	.extra_opts	= zone_opts_v1,
+};
+
 void _init(void)
 {
 	xtables_register_match(&zone_match_v0);
 	xtables_register_match(&zone_match_v1);
+	xtables_register_match(&zone_match_v2);
 }
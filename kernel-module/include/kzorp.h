@@ -22,6 +22,8 @@
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_conntrack_extend.h>
 #include "kzorp_netlink.h"
+#include "kzorp_session_ring.h"
+#include "kzorp_nat6.h"
 #include <net/xfrm.h>
 #include <linux/if.h>
 #include <linux/netdevice.h>
@@ -105,6 +107,7 @@ struct nf_conntrack_kzorp {
 	struct kz_zone *szone;		/* server zone */
 	struct kz_dispatcher *dpt;	/* dispatcher */
 	struct kz_service *svc;		/* service */
+	bool redirected;		/* proxied flow assigned to an established socket */
 };
 
 #define NF_CT_EXT_KZ_TYPE struct nf_conntrack_kzorp
@@ -121,8 +124,14 @@ struct kz_bind {
 	sa_family_t family;
 	__u16 port;
 	__u8 proto;
+	/* share of the connections relative to the other binds of the same protocols */
+	unsigned int weight;
+	/* cached listener socket of the bind, holds a reference */
+	struct sock *listener_sk;
 };
 
+#define KZ_BIND_WEIGHT_MAX 256
+
 enum kz_bind_l3proto {
 	KZ_BIND_L3PROTO_IPV4,
 	KZ_BIND_L3PROTO_IPV6,
@@ -161,8 +170,13 @@ struct kz_bind_lookup {
 	/* array of pointers to the appropriate element of the binds array */
 	const struct kz_bind const **binds_by_type[KZ_BIND_L3PROTO_COUNT][KZ_BIND_L4PROTO_COUNT];
 	unsigned int bind_nums[KZ_BIND_L3PROTO_COUNT][KZ_BIND_L4PROTO_COUNT];
+	/* Maglev lookup tables, the entries are indexes into binds_by_type */
+	u16 *maglev[KZ_BIND_L3PROTO_COUNT][KZ_BIND_L4PROTO_COUNT];
 };
 
+/* number of entries in a Maglev lookup table, must be a power of two */
+#define KZ_BIND_MAGLEV_SIZE 1024
+
 struct kz_instance {
 	struct list_head list;
 	struct kz_bind_lookup *bind_lookup;
@@ -179,29 +193,56 @@ enum kzf_transaction_flags {
 	KZF_TRANSACTION_FLUSH_BIND		= 1 << 3,
 };
 
+enum kznl_op_data_type {
+	KZNL_OP_ZONE,
+	KZNL_OP_SERVICE,
+	KZNL_OP_DISPATCHER,
+	KZNL_OP_BIND,
+	KZNL_OP_DELETE,
+	KZNL_OP_TYPE_COUNT,
+};
+
+#define KZ_TRANSACTION_HASH_SIZE 256
+
 struct kz_transaction {
+	struct list_head list;
 	unsigned int instance_id;
 	netlink_port_t peer_pid;
 	unsigned int flags;
 	u_int64_t cookie;
+	/* config the transaction is applied to, replaced when another transaction commits */
 	const struct kz_config * cfg;
+	/* generation of the config when the transaction was started */
+	kz_generation_t generation;
 	struct list_head op;
-};
-
-enum kznl_op_data_type {
-	KZNL_OP_ZONE,
-	KZNL_OP_SERVICE,
-	KZNL_OP_DISPATCHER,
-	KZNL_OP_BIND,
+	/* operations of each type hashed by name, binds by address and port,
+	 * deletions by the name of the deleted object */
+	struct hlist_head op_hash[KZNL_OP_TYPE_COUNT][KZ_TRANSACTION_HASH_SIZE];
+	/* dispatcher added last, rules and entries are uploaded to it */
+	struct kz_dispatcher *last_dispatcher;
 };
 
 struct kz_operation {
 	struct list_head list;
+	struct hlist_node hlist;
 	enum kznl_op_data_type type;
 	void *data;
 	void (*data_destroy)(void *);
 };
 
+/*
+ * Data of a KZNL_OP_DELETE operation: removes an object of the previous
+ * config by name, or a single rule of a dispatcher if has_rule_id is
+ * set. Adding an object with the same name in the same transaction
+ * replaces it.
+ */
+struct kz_operation_delete {
+	enum kznl_op_data_type type;
+	char *name;
+	bool has_rule_id;
+	u_int32_t rule_id;
+};
+
 struct kz_port_range {
 	u_int16_t from;
 	u_int16_t to;
@@ -229,11 +270,25 @@ struct kz_dispatcher_n_dimension_rule_entry_params {
 #undef DECLARE_RULE_ENTRY_PARAM
 };
 
+/*
+ * Storage of the dimensions of a rule other than the zones, allocated
+ * in a single block right after this header. The block is immutable
+ * once the rule is committed and shared by the copies of the rule in
+ * later config generations; zone dimensions refer to zones of a single
+ * generation, so those are copied.
+ */
+struct kz_rule_dims {
+	atomic_t refcnt;
+	/* the arrays have been sorted for the lookup */
+	bool sorted;
+};
+
 struct kz_dispatcher_n_dimension_rule {
 	u_int32_t id;
 
 	struct kz_service *service;
 	struct kz_dispatcher *dispatcher;
+	struct kz_rule_dims *dims;
 
 #define DECLARE_RULE_ENTRY(DIM_NAME, _, TYPE, ...) \
 	u_int32_t alloc_##DIM_NAME; \
@@ -267,6 +322,18 @@ typedef struct {
 	void *p;
 } kz_vfree_work_t;
 
+/*
+ * The lookup data of the rules of a dispatcher, struct kz_rule_lookup_data
+ * records aligned to 8 bytes. It refers to the rules by their position and
+ * to the zones by their index, so it is shared with the clone of the
+ * dispatcher in the next config as long as neither of them changes.
+ */
+struct kz_dispatcher_lookup {
+	atomic_t refcnt;
+	enum KZ_ALLOC_TYPE allocator;
+	u_int64_t data[0];
+};
+
 struct kz_dispatcher {
 	struct list_head list;
 	atomic_t refcnt;
@@ -276,6 +343,12 @@ struct kz_dispatcher {
 	unsigned int num_rule;
 	struct kz_dispatcher_n_dimension_rule *rule;
 	enum KZ_ALLOC_TYPE rule_allocator;
+	/* dimensions of the rules are sorted for the lookup, kept by clones */
+	bool rules_sorted;
+	/* position in the dispatcher list, set when the lookup data is built */
+	unsigned int index;
+	/* NULL if the dispatcher has no rules or they changed since the last build */
+	struct kz_dispatcher_lookup *lookup;
 
 	char *name;
 };
@@ -287,9 +360,49 @@ struct kz_service_nat_entry {
 	struct nf_nat_range map;
 };
 
+/*
+ * Sorted interval index over the source address ranges of a NAT list:
+ * the address space is cut into segments at the range boundaries and
+ * each segment lists the entries whose source range covers it, in list
+ * order, so first-match semantics are kept.
+ */
+struct kz_service_nat_index {
+	enum KZ_ALLOC_TYPE allocator;
+	unsigned int segment_num;
+	/* first address of each segment in host byte order, ascending */
+	u32 *segment_start;
+	/* candidates of segment i are candidate[candidate_offset[i]] up to candidate[candidate_offset[i + 1]] */
+	unsigned int *candidate_offset;
+	const struct kz_service_nat_entry **candidate;
+};
+
+struct kz_service_nat6_entry {
+	struct list_head list;
+	struct kz_nat6_range src;
+	struct kz_nat6_range dst;
+	struct kz_nat6_range map;
+};
+
+/* IPv6 counterpart of kz_service_nat_index */
+struct kz_service_nat6_index {
+	enum KZ_ALLOC_TYPE allocator;
+	unsigned int segment_num;
+	/* first address of each segment, ascending */
+	struct in6_addr *segment_start;
+	unsigned int *candidate_offset;
+	const struct kz_service_nat6_entry **candidate;
+};
+
 struct kz_service_info_fwd {
 	struct list_head snat;
 	struct list_head dnat;
+	/* lookup indexes of the NAT lists, built on commit */
+	struct kz_service_nat_index *snat_index;
+	struct kz_service_nat_index *dnat_index;
+	struct list_head snat6;
+	struct list_head dnat6;
+	struct kz_service_nat6_index *snat6_index;
+	struct kz_service_nat6_index *dnat6_index;
 
 	sa_family_t router_dst_addr_family;
 	union nf_inet_addr router_dst_addr;
@@ -301,6 +414,45 @@ struct kz_service_info_deny {
 	enum kz_service_ipv6_deny_method ipv6_reject_method;
 };
 
+/*
+ * Token bucket, credit is measured in 1/HZ rejects. The low 32 bits of
+ * the jiffies of the last refill and the credit share a single word,
+ * so the bucket is updated with cmpxchg instead of a lock.
+ */
+struct kz_reject_bucket {
+	atomic64_t state;
+};
+
+#define KZ_REJECT_SRC_BUCKETS 256
+
+struct kz_reject_src_bucket {
+	union nf_inet_addr addr;
+	struct kz_reject_bucket bucket;
+};
+
+struct kz_reject_stats {
+	u64 sent;
+	u64 suppressed;
+};
+
+/*
+ * Limits the rejects generated by a deny service. Shared by the clones
+ * of the service, and taken over by a service of the same name and
+ * limits uploaded again, so buckets and counters survive config reloads.
+ */
+struct kz_reject_limiter {
+	atomic_t refcnt;
+	u32 rate;
+	u32 burst;
+	u32 src_rate;
+	u32 src_burst;
+	u32 hash_seed;
+	struct kz_reject_bucket global;
+	/* direct-mapped by source address, NULL if there is no per-source limit */
+	struct kz_reject_src_bucket *src;
+	struct kz_reject_stats __percpu *stats;
+};
+
 #define KZ_SERVICE_CNT_LOCKED_BIT 16
 
 enum kzf_service_internal_flags {
@@ -319,6 +471,8 @@ struct kz_service {
 		struct kz_service_info_fwd fwd;
 		struct kz_service_info_deny deny;
 	} a;
+	/* deny services only; outside of the union, which is set up for forwarded ones on allocation */
+	struct kz_reject_limiter *reject;
 	char *name;
 };
 
@@ -379,9 +533,7 @@ struct kz_head_z {
 /* config holder for dispatchers */
 struct kz_head_d {
 	struct list_head head;
-	/* lookup data structures */
-	struct kz_rule_lookup_data *lookup_data;
-	enum KZ_ALLOC_TYPE lookup_data_allocator;
+	/* the lookup data is kept by the dispatchers */
 };
 
 /* config holder for services */
@@ -467,6 +619,8 @@ extern void kz_head_destroy_dispatcher(struct kz_head_d *h);
 struct kz_bind * kz_bind_new(void);
 struct kz_bind * kz_bind_clone(const struct kz_bind const *_bind);
 void kz_bind_destroy(struct kz_bind *bind);
+struct sock *kz_bind_listener_get(const struct kz_bind *bind);
+void kz_bind_listener_cache(const struct kz_bind *bind, struct sock *sk);
 
 const struct kz_bind * const
 kz_instance_bind_lookup_v4(const struct kz_instance const *instance, u8 l4proto,
@@ -511,7 +665,15 @@ extern struct kz_service *__kz_service_lookup_name(const struct list_head * cons
 extern struct kz_service *kz_service_lookup_name(const struct kz_config *cfg, const char *name);
 extern int kz_service_add_nat_entry(struct list_head *head, struct nf_nat_range *src,
 				    struct nf_nat_range *dst, struct nf_nat_range *map);
+extern int kz_service_add_nat6_entry(struct list_head *head, struct kz_nat6_range *src,
+				     struct kz_nat6_range *dst, struct kz_nat6_range *map);
 extern struct kz_service *kz_service_clone(const struct kz_service * const o);
+
+extern struct kz_reject_limiter *kz_reject_limiter_new(u32 rate, u32 burst, u32 src_rate, u32 src_burst);
+extern void kz_reject_limiter_put(struct kz_reject_limiter *limiter);
+extern void kz_reject_limiter_migrate(struct kz_reject_limiter **limiter, struct kz_reject_limiter *orig);
+extern bool kz_reject_limiter_allow(struct kz_reject_limiter *limiter, const union nf_inet_addr *saddr);
+extern void kz_reject_limiter_stats(const struct kz_reject_limiter *limiter, struct kz_reject_stats *stats);
 extern int kz_service_lock(struct kz_service * const service);
 extern void kz_service_unlock(struct kz_service * const service);
 
@@ -544,6 +706,8 @@ extern int kz_dispatcher_copy_rules(struct kz_dispatcher *dst, const struct kz_d
 extern struct kz_dispatcher *kz_dispatcher_clone(const struct kz_dispatcher * const o);
 extern struct kz_dispatcher *kz_dispatcher_clone_pure(const struct kz_dispatcher * const o);
 extern void kz_dispatcher_relink(struct kz_dispatcher *d, const struct list_head * zonelist, const struct list_head * servicelist);
+extern int kz_dispatcher_remove_rule(struct kz_dispatcher *d, u_int32_t id);
+extern void kz_dispatcher_truncate_rules(struct kz_dispatcher *d, unsigned int num_rule);
 
 static inline struct kz_dispatcher *
 kz_dispatcher_get(struct kz_dispatcher *dispatcher)
@@ -559,6 +723,31 @@ kz_dispatcher_put(struct kz_dispatcher *dispatcher)
 		kz_dispatcher_destroy(dispatcher);
 }
 
+extern void kz_dispatcher_lookup_destroy(struct kz_dispatcher_lookup *lookup);
+
+static inline struct kz_dispatcher_lookup *
+kz_dispatcher_lookup_get(struct kz_dispatcher_lookup *lookup)
+{
+	if (lookup != NULL)
+		atomic_inc(&lookup->refcnt);
+	return lookup;
+}
+
+static inline void
+kz_dispatcher_lookup_put(struct kz_dispatcher_lookup *lookup)
+{
+	if (lookup != NULL && atomic_dec_and_test(&lookup->refcnt))
+		kz_dispatcher_lookup_destroy(lookup);
+}
+
+/* the lookup data is rebuilt by kz_head_dispatcher_build() after the rules change */
+static inline void
+kz_dispatcher_drop_lookup(struct kz_dispatcher *dispatcher)
+{
+	kz_dispatcher_lookup_put(dispatcher->lookup);
+	dispatcher->lookup = NULL;
+}
+
 int kz_log_ratelimit(void);
 
 /***********************************************************
@@ -628,6 +817,59 @@ extern void nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * pkzorp,
 */
 extern void kz_destroy_kzorp(struct nf_conntrack_kzorp *kzorp);
 
+/* L3/L4 headers of a packet as used by the kzorp lookup; addresses and
+   ports are in network byte order, ports are 0 unless TCP or UDP */
+struct kz_packet_tuple {
+	union nf_inet_addr saddr;
+	union nf_inet_addr daddr;
+	__be16 sport;
+	__be16 dport;
+	u8 l3proto;
+	u8 l4proto;
+};
+
+extern bool kz_packet_tuple_parse(const struct sk_buff *skb, u8 l3proto,
+				  struct kz_packet_tuple *tuple);
+
+/* per-CPU context of the packet being processed in a netfilter hook;
+   shared by the KZORP target and the zone and service matches so the
+   headers are parsed and the lookup is done only once per packet
+*/
+struct kz_packet_ctx {
+	const struct sk_buff *skb;
+	unsigned int hooknum;
+	struct nf_conn *ct;
+	enum ip_conntrack_info ctinfo;
+	/* false if the headers are malformed, the lookup finds nothing then */
+	bool tuple_valid;
+	struct kz_packet_tuple tuple;
+	/* lookup result, either in ct or local_kzorp; NULL if not looked up yet */
+	const struct nf_conntrack_kzorp *kzorp;
+	const struct kz_config *cfg;
+	struct nf_conntrack_kzorp local_kzorp;
+};
+
+/* returns the context of skb, parsing its headers if the packet is not
+   the cached one; ctinfo is IP_CT_NEW if there is no conntrack entry
+   call with bottom halves disabled
+*/
+extern struct kz_packet_ctx *kz_packet_ctx_get(const struct sk_buff *skb,
+					       unsigned int hooknum, u8 l3proto);
+
+/* returns the lookup result of the packet, never NULL; the config is
+   stored in ctx->cfg
+   call under rcu_read_lock() with bottom halves disabled
+*/
+extern const struct nf_conntrack_kzorp *
+kz_packet_ctx_kzorp_rcu(struct kz_packet_ctx *ctx, const struct net_device * const in);
+
+/* users of the context must be registered while they may be called:
+   the hooks invalidating the context exist only while there are users
+   call in process context
+*/
+extern int kz_packet_ctx_users_get(void);
+extern void kz_packet_ctx_users_put(void);
+
 /***********************************************************
  * Hook functions
  ***********************************************************/
@@ -652,7 +894,6 @@ extern struct nf_conntrack_kzorp *kz_extension_find(struct nf_conn *ct);
 extern int kz_lookup_init(void);
 extern void kz_lookup_cleanup(void);
 
-extern void kz_head_dispatcher_init(struct kz_head_d *h);
 extern int kz_head_dispatcher_build(struct kz_head_d *h);
 extern void kz_head_dispatcher_destroy(struct kz_head_d *h);
 
@@ -660,8 +901,18 @@ extern void kz_head_zone_init(struct kz_head_z *h);
 extern int kz_head_zone_build(struct kz_head_z *h);
 extern void kz_head_zone_destroy(struct kz_head_z *h);
 extern struct kz_zone *kz_head_zone_ipv4_lookup(const struct kz_head_z *h, const struct in_addr * const addr);
-
-extern const struct nf_nat_range *kz_service_nat_lookup(const struct list_head * const head,
+extern struct kz_zone *kz_head_zone_ipv6_lookup(const struct kz_head_z *h, const struct in6_addr * const addr);
+
+extern int kz_head_service_build(struct kz_head_s *h);
+extern void kz_service_nat6_index_destroy(struct kz_service_nat6_index *index);
+extern const struct kz_nat6_range *kz_service_nat6_lookup(const struct kz_service_nat6_index * const index,
+							  const struct in6_addr * const saddr,
+							  const struct in6_addr * const daddr,
+							  const __be16 sport, const __be16 dport,
+							  const u_int8_t proto);
+extern void kz_service_nat_index_destroy(struct kz_service_nat_index *index);
+
+extern const struct nf_nat_range *kz_service_nat_lookup(const struct kz_service_nat_index * const index,
 						    const __be32 saddr, const __be32 daddr,
 						    const __be16 sport, const __be16 dport,
 						    const u_int8_t proto);
@@ -675,6 +926,14 @@ extern void kz_lookup_session(const struct kz_config *cfg,
 			      struct kz_dispatcher **dispatcher,
 			      struct kz_zone **clientzone, struct kz_zone **serverzone,
 			      struct kz_service **service, int reply);
+extern void kz_lookup_session_rule(const struct kz_config *cfg,
+				   const struct kz_reqids *reqids,
+				   const struct net_device *in,
+				   u_int8_t l3proto,
+				   const union nf_inet_addr * const saddr, const union nf_inet_addr * const daddr,
+				   u_int8_t l4proto, u_int16_t sport, u_int16_t dport,
+				   struct kz_zone **clientzone, struct kz_zone **serverzone,
+				   const struct kz_dispatcher_n_dimension_rule **rule, int reply);
 
 /***********************************************************
  * Netlink functions
@@ -731,3 +990,19 @@ extern void kz_sockopt_cleanup(void);
 
 extern int kz_netlink_init(void);
 extern void kz_netlink_cleanup(void);
+
+extern bool kz_session_event(enum kz_session_event_type event, unsigned int verdict, unsigned long sid,
+			     const struct kz_service *svc,
+			     const struct kz_zone *czone, const struct kz_zone *szone,
+			     u8 l3proto, const union nf_inet_addr *saddr, const union nf_inet_addr *daddr,
+			     u8 l4proto, __be16 sport, __be16 dport);
+
+/***********************************************************
+ * Session accounting ring buffers
+ ***********************************************************/
+
+extern int kz_session_ring_init(void);
+extern void kz_session_ring_cleanup(void);
+extern void kz_session_ring_write(enum kz_session_ring_event event,
+				  const struct nf_conn *ct,
+				  const struct nf_conntrack_kzorp *kzorp);
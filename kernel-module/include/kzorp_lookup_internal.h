@@ -33,6 +33,27 @@
 
 #define KZ_NOT_MATCHING_SCORE ((u_int64_t)-1)
 
+/* processes the items in [first, last) */
+typedef void (*kz_parallel_fn_t)(void *ctx, unsigned int first, unsigned int last);
+
+/* the userspace builds use the pthread based implementation of
+ * libkzorp-lookup/kzorp_lookup_threads.c, the number of threads used
+ * there is set by kz_parallel_threads, zero meaning one for each online
+ * CPU */
+void
+kz_parallel_for(unsigned int n, kz_parallel_fn_t fn, void *ctx);
+
+#ifdef KZ_USERSPACE
+extern unsigned int kz_parallel_threads;
+
+unsigned int
+kz_parallel_online_cpus(void);
+
+/* processes [0, n) in at most thread_num threads */
+void
+kz_parallel_run(unsigned int n, unsigned int thread_num, kz_parallel_fn_t fn, void *ctx);
+#endif
+
 struct kz_lookup_ipv6_node {
   struct kz_lookup_ipv6_node *parent;
   struct kz_lookup_ipv6_node *left;
@@ -45,9 +66,9 @@ struct kz_lookup_ipv6_node {
 /* header of the lookup data. After dimension_map there are additional data,
  * for the dimensions in the rule, as specified by the dimension_map. */
 struct kz_rule_lookup_data {
-	/* back-pointer to original rule structure so that we have the
-	 * service and dispatcher pointers */
-	const struct kz_dispatcher_n_dimension_rule *orig;
+	/* position of the rule in the rule array of the dispatcher, so that the
+	 * lookup data can be shared by the clones of the dispatcher */
+	u_int32_t rule_index;
 
 	u_int32_t bytes_to_next; /* number of bytes to the next rule (includes
 				  * the full kz_rule_lookup_data header size),
@@ -110,6 +131,11 @@ struct kz_percpu_env {
   size_t result_size;
 };
 
+#ifdef KZ_USERSPACE
+/* work area of kz_lookup_session() in the calling thread */
+extern __thread struct kz_percpu_env *kz_lookup_thread_env;
+#endif
+
 KZ_PROTECTED u_int32_t
 kz_ndim_eval(
   const struct kz_reqids *reqids, const struct net_device *iface, u_int8_t l3proto,
@@ -130,9 +156,12 @@ mask_to_size_v4(const struct in_addr * const mask);
 KZ_PROTECTED inline unsigned int
 mask_to_size_v6(const struct in6_addr * const mask);
 
-KZ_PROTECTED void
+KZ_PROTECTED int
 kz_generate_lookup_data(struct kz_head_d *dispatchers);
 
+KZ_PROTECTED int
+kz_bind_lookup_maglev_fill(u16 *table, const struct kz_bind const **binds, unsigned int bind_num);
+
 KZ_PROTECTED inline struct kz_lookup_ipv6_node *
 ipv6_node_new(void);
 
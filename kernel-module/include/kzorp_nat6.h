@@ -0,0 +1,45 @@
+/*
+ * KZorp IPv6 NAT support
+ *
+ * Copyright (C) 2006-2010, BalaBit IT Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef _KZORP_NAT6_H
+#define _KZORP_NAT6_H
+
+#include <linux/types.h>
+#include <linux/in6.h>
+#include <linux/version.h>
+
+/* the NAT core handles IPv6 connections since 3.7 */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0) ) && IS_ENABLED(CONFIG_NF_NAT_IPV6)
+	#define KZ_NAT_IPV6
+#endif
+
+/* IPv6 counterpart of nf_nat_range, flags are IP_NAT_RANGE_* */
+struct kz_nat6_range {
+	unsigned int flags;
+	struct in6_addr min_ip, max_ip;
+	__be16 min_port, max_port;
+};
+
+#ifdef KZ_NAT_IPV6
+struct nf_conn;
+
+/*
+ * Sets up NAT of the given manip type for the connection. kzorp.h
+ * renames nf_nat_range to its IPv4 variant for the rest of the code,
+ * so the conversion to the generic range of the NAT core lives in its
+ * own translation unit, which does not include kzorp.h.
+ */
+extern unsigned int kz_nat6_setup_info(struct nf_conn *ct, const struct kz_nat6_range *r,
+				       unsigned int manip);
+#endif
+
+#endif /* _KZORP_NAT6_H */
@@ -40,6 +40,15 @@ enum kznl_msg_types {
 	KZNL_MSG_GET_BIND,
 	KZNL_MSG_FLUSH_BIND,
 	KZNL_MSG_QUERY_REPLY,
+	KZNL_MSG_SESSION_EVENT,
+	KZNL_MSG_DELETE_ZONE,
+	KZNL_MSG_DELETE_SERVICE,
+	KZNL_MSG_DELETE_DISPATCHER,
+	KZNL_MSG_DELETE_RULE,
+	KZNL_MSG_ADD_RULE_BULK,
+	KZNL_MSG_COMMIT_DONE,
+	KZNL_MSG_QUERY_BATCH,
+	KZNL_MSG_QUERY_BATCH_REPLY,
 	KZNL_MSG_TYPE_COUNT
 };
 
@@ -94,6 +103,21 @@ enum kznl_attr_types {
 	KZNL_ATTR_N_DIMENSION_DST_IFGROUP,
 	KZNL_ATTR_N_DIMENSION_REQID,
 	KZNL_ATTR_QUERY_PARAMS_REQID,
+	KZNL_ATTR_SESSION_RECORDS,
+	KZNL_ATTR_BIND_WEIGHT,
+	KZNL_ATTR_SERVICE_NAT6_SRC,
+	KZNL_ATTR_SERVICE_NAT6_DST,
+	KZNL_ATTR_SERVICE_NAT6_MAP,
+	KZNL_ATTR_SERVICE_REJECT_LIMIT,
+	KZNL_ATTR_SERVICE_REJECT_STATS,
+	KZNL_ATTR_N_DIMENSION_RULE_BULK,
+	KZNL_ATTR_COMMIT_ASYNC,
+	KZNL_ATTR_COMMIT_RESULT,
+	KZNL_ATTR_CONFIG_GENERATION,
+	KZNL_ATTR_QUERY_BATCH,
+	KZNL_ATTR_QUERY_BATCH_RESULTS,
+	KZNL_ATTR_ZONE_INDEX,
+	KZNL_ATTR_DISPATCHER_INDEX,
 	KZNL_ATTR_TYPE_COUNT
 };
 
@@ -150,10 +174,31 @@ struct kza_service_nat_params {
 	__be16 min_port, max_port;
 } __attribute__ ((packed));
 
+struct kza_service_nat6_params {
+	__be32 flags;
+	struct in6_addr min_ip, max_ip;
+	__be16 min_port, max_port;
+} __attribute__ ((packed));
+
 struct kza_service_session_cnt {
 	__be32 count;
 } __attribute__ ((packed));
 
+/* rejects per second and bucket size, zero rate means unlimited */
+struct kza_service_reject_limit {
+	__be32 rate;
+	__be32 burst;
+	__be32 src_rate;
+	__be32 src_burst;
+} __attribute__ ((packed));
+
+#define KZ_SERVICE_REJECT_LIMIT_MAX 1000000
+
+struct kza_service_reject_stats {
+	__be64 sent;
+	__be64 suppressed;
+} __attribute__ ((packed));
+
 enum kz_service_ipv4_deny_method {
 	KZ_SERVICE_DENY_METHOD_V4_DROP,
 	KZ_SERVICE_DENY_METHOD_V4_TCP_RESET,
@@ -185,6 +230,38 @@ struct kza_n_dimension_rule_params {
 	__be32 id;
 } __attribute__ ((packed));
 
+/*
+ * KZNL_ATTR_N_DIMENSION_RULE_BULK carries a header followed by
+ * num_rules rule records. Each record is a struct kza_rule_bulk_rule
+ * followed by netlink attributes: a KZNL_ATTR_N_DIMENSION_RULE_SERVICE
+ * and any number of entry attributes (KZNL_ATTR_N_DIMENSION_IFACE, ...)
+ * with the same payload as in KZNL_MSG_ADD_RULE_ENTRY. The length of a
+ * record includes its header and is a multiple of 4.
+ */
+#define KZ_RULE_BULK_VERSION 1
+
+struct kza_rule_bulk_header {
+	__be32 version;
+	__be32 num_rules;
+} __attribute__ ((packed));
+
+struct kza_rule_bulk_rule {
+	__be32 length;
+	__be32 id;
+} __attribute__ ((packed));
+
+/*
+ * A KZNL_MSG_COMMIT with the KZNL_ATTR_COMMIT_ASYNC flag is acknowledged
+ * as soon as it has been queued; the transaction is merged with the
+ * running config and the lookup structures are built in the background.
+ * If another transaction is committed during the build, the transaction
+ * is merged again with the config installed by it. The outcome is sent to the
+ * committing socket in a KZNL_MSG_COMMIT_DONE message with the sequence
+ * number of the commit. KZNL_ATTR_COMMIT_RESULT holds the errno value (0
+ * on success), KZNL_ATTR_CONFIG_GENERATION and KZNL_ATTR_CONFIG_COOKIE
+ * identify the installed config.
+ */
+
 struct kza_query_params {
 	__be16 src_port;
 	__be16 dst_port;
@@ -192,4 +269,92 @@ struct kza_query_params {
 	__u8 proto;
 } __attribute__ ((packed));
 
+/*
+ * KZNL_MSG_QUERY_BATCH is a dump request, KZNL_ATTR_QUERY_BATCH carries
+ * a header followed by num_queries struct kza_query_batch_tuple records.
+ * The results are streamed in KZNL_MSG_QUERY_BATCH_REPLY messages, each
+ * with a KZNL_ATTR_CONFIG_GENERATION of the config the queries were
+ * evaluated in and a KZNL_ATTR_QUERY_BATCH_RESULTS holding a header and
+ * num_results struct kza_query_batch_result records for the queries
+ * starting at index first, in request order.
+ *
+ * Results refer to objects by id: zones and dispatchers by their index,
+ * services by the id also used in session records, rules by the id given
+ * on upload. Indexes are assigned anew on each commit, so they are only
+ * meaningful together with the config generation. The zone and dispatcher
+ * dumps carry both the index of the object in KZNL_ATTR_ZONE_INDEX or
+ * KZNL_ATTR_DISPATCHER_INDEX and the generation it belongs to in
+ * KZNL_ATTR_CONFIG_GENERATION.
+ */
+#define KZ_QUERY_BATCH_VERSION 1
+
+/* used in results for objects not found */
+#define KZ_QUERY_BATCH_NO_ID 0xffffffff
+
+struct kza_query_batch_header {
+	__be32 version;
+	__be32 num_queries;
+} __attribute__ ((packed));
+
+/* addresses are stored in the first four bytes of the address fields for IPv4 */
+struct kza_query_batch_tuple {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be32 ifindex;
+	/* 0 if the query has no request id */
+	__be32 reqid;
+	__be16 sport;
+	__be16 dport;
+	__u8 l3proto;
+	__u8 l4proto;
+	__u8 reserved[2];
+} __attribute__ ((packed));
+
+struct kza_query_batch_results {
+	__be32 first;
+	__be32 num_results;
+} __attribute__ ((packed));
+
+struct kza_query_batch_result {
+	__be32 dispatcher_id;
+	__be32 client_zone_id;
+	__be32 server_zone_id;
+	__be32 service_id;
+	__be32 rule_id;
+} __attribute__ ((packed));
+
+/* session events */
+#define KZNL_MCGRP_SESSION_EVENTS "sessions"
+
+enum kz_session_event_type {
+	KZ_SESSION_EVENT_INVALID,
+	KZ_SESSION_EVENT_START,
+	KZ_SESSION_EVENT_REJECT,
+	KZ_SESSION_EVENT_DROP,
+	KZ_SESSION_EVENT_TYPE_COUNT
+};
+
+/*
+ * One record of the KZNL_ATTR_SESSION_RECORDS attribute, the attribute
+ * payload is an array of these. Addresses are stored in the first four
+ * bytes of the address fields for IPv4.
+ */
+struct kza_session_record {
+	__be64 sid;
+	__be32 service_id;
+	__be32 client_zone_id;
+	__be32 server_zone_id;
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 l3proto;
+	__u8 l4proto;
+	__u8 event;
+	__u8 verdict;
+} __attribute__ ((packed));
+
+/* zone id used in session records when the zone is not known */
+#define KZ_SESSION_RECORD_NO_ZONE 0xffffffff
+
 #endif
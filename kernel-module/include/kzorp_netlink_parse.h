@@ -0,0 +1,73 @@
+/*
+ * KZorp netlink attribute parsing
+ *
+ * Copyright (C) 2006-2010, BalaBit IT Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef _KZORP_NETLINK_PARSE_H
+#define _KZORP_NETLINK_PARSE_H
+
+#include <net/netlink.h>
+#include "kzorp.h"
+#include "kzorp_netlink.h"
+
+/*
+ * The parsers of the attributes of the configuration messages, used by
+ * the kernel module and by libkzorp-lookup as well. Attributes nested
+ * into other ones, like the records of bulk rule uploads, are not
+ * checked against a netlink policy, so the length of each attribute is
+ * checked here. All of them return zero or a negative errno value.
+ */
+
+/* returns the payload of the attribute if it is at least min_len bytes long */
+static inline const void *
+kznl_attr_data(const struct nlattr *attr, int min_len)
+{
+	return attr != NULL && nla_len(attr) >= min_len ? nla_data(attr) : NULL;
+}
+
+/* looks up a zone for the zone dimensions of a rule */
+typedef struct kz_zone *(*kznl_zone_lookup_fn)(void *ctx, const char *name);
+
+extern int kznl_parse_name(const struct nlattr *attr, char *name, unsigned long nsize);
+/* the name is allocated with kzalloc() */
+extern int kznl_parse_name_alloc(const struct nlattr *attr, char **name);
+extern int kznl_parse_in_addr(const struct nlattr *attr, struct in_addr *addr);
+extern int kznl_parse_in6_addr(const struct nlattr *attr, struct in6_addr *addr);
+extern int kznl_parse_inet_addr(const struct nlattr *attr, union nf_inet_addr *addr, sa_family_t *family);
+extern int kznl_parse_in_subnet(const struct nlattr *attr, struct in_addr *subnet_addr, struct in_addr *subnet_mask);
+extern int kznl_parse_in6_subnet(const struct nlattr *attr, struct in6_addr *addr, struct in6_addr *mask);
+extern int kznl_parse_inet_subnet(const struct nlattr *attr, union nf_inet_addr *addr,
+				  union nf_inet_addr *mask, sa_family_t *family);
+extern int kznl_parse_port(const struct nlattr *attr, __u16 *port);
+extern int kznl_parse_port_range(const struct nlattr *attr, u_int16_t *range_from, u_int16_t *range_to);
+extern int kznl_parse_proto(const struct nlattr *attr, __u8 *proto);
+extern int kznl_parse_be32(const struct nlattr *attr, __u32 *value);
+extern int kznl_parse_service_params(const struct nlattr *attr, struct kz_service *svc);
+extern int kznl_parse_rule_entry(const struct nlattr *attr,
+				 struct kz_dispatcher_n_dimension_rule_entry_params *entry,
+				 kznl_zone_lookup_fn lookup_zone, void *ctx);
+extern int kznl_parse_rule_entry_num(const struct nlattr *attr, struct kz_dispatcher_n_dimension_rule *rule);
+/* sets the entry numbers of rule, service is the service name attribute of the record */
+extern int kznl_count_rule_bulk_entries(const struct nlattr *head, int len,
+					struct kz_dispatcher_n_dimension_rule *rule,
+					const struct nlattr **service);
+
+/*
+ * The checks of the rules built from the messages: the number of rules
+ * of a dispatcher and the number of entries in each dimension of a rule
+ * are announced in advance and the rules are added in increasing id
+ * order. Used by kz_dispatcher_add_rule() and by libkzorp-lookup.
+ */
+extern int kznl_check_rule_add(const struct kz_dispatcher *d, u_int32_t id);
+extern int kznl_check_rule_entry(const struct kz_dispatcher_n_dimension_rule *rule,
+				 const struct kz_dispatcher_n_dimension_rule_entry_params *entry);
+extern int kznl_check_dispatcher_rules(const struct kz_dispatcher *d);
+
+#endif /* _KZORP_NETLINK_PARSE_H */
@@ -0,0 +1,78 @@
+/*
+ * KZorp session accounting ring buffers
+ *
+ * Copyright (C) 2006-2010, BalaBit IT Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#ifndef _KZORP_SESSION_RING_H
+#define _KZORP_SESSION_RING_H
+
+#include <linux/types.h>
+
+/*
+ * The /dev/kzorp_sessions character device exposes one ring buffer for
+ * each possible CPU. A ring consists of a header page followed by
+ * record_count fixed-size records. Ring of CPU n starts at mmap() offset
+ * n * size, where size is read from the header of the ring of CPU 0
+ * (which can be mapped on its own first).
+ *
+ * The kernel is the only writer of the records and of head, userspace is
+ * the only writer of tail. Records between tail and head (modulo
+ * record_count) are valid; userspace must issue a read barrier after
+ * reading head and a full barrier before advancing tail. When the ring
+ * is full new records are dropped and lost is incremented. The kernel
+ * keeps its own copy of head and record_count and only reads the low 32
+ * bits of tail, changes of the other header fields by userspace are
+ * ignored. Records are only written while at least one ring is mapped.
+ *
+ * Records are stored in host byte order, except for addresses and ports
+ * which are in network byte order.
+ */
+
+#define KZ_SESSION_RING_DEVICE "kzorp_sessions"
+#define KZ_SESSION_RING_VERSION 1
+
+enum kz_session_ring_event {
+	KZ_SESSION_RING_EVENT_INVALID,
+	KZ_SESSION_RING_EVENT_START,
+	KZ_SESSION_RING_EVENT_END,
+};
+
+struct kz_session_ring_header {
+	__u32 version;
+	__u32 record_size;
+	__u32 record_count;
+	__u32 cpu;
+	__u64 size;
+	__u64 lost;
+	/* producer index, written by the kernel */
+	__u64 head __attribute__ ((aligned(64)));
+	/* consumer index, written by userspace */
+	__u64 tail __attribute__ ((aligned(64)));
+};
+
+struct kz_session_acct_record {
+	__u64 sid;
+	__u64 timestamp_ns;
+	__u64 packets[2];
+	__u64 bytes[2];
+	__u32 service_id;
+	__u32 client_zone_id;
+	__u32 server_zone_id;
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 l3proto;
+	__u8 l4proto;
+	__u8 event;
+	__u8 reserved;
+};
+
+#endif
@@ -40,4 +40,16 @@ struct ipt_service_info {
 	unsigned int service_id;
 };
 
+struct xt_service_priv;
+
+/* same as v0, the resolved service id is kept by the kernel per CPU */
+struct ipt_service_info_v1 {
+	u_int8_t type;
+	u_int8_t name_match;
+	unsigned char name[IPT_SERVICE_NAME_LENGTH + 1];
+
+	/* used internally by the kernel */
+	struct xt_service_priv *priv __attribute__((aligned(8)));
+};
+
 #endif
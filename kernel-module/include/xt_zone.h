@@ -38,4 +38,16 @@ struct ipt_zone_info_v1 {
 	unsigned char names[IPT_ZONE_NAME_COUNT][IPT_ZONE_NAME_LENGTH + 1];
 };
 
+struct xt_zone_priv;
+
+/* same as v1, the zone names are resolved to zone indexes by the kernel */
+struct ipt_zone_info_v2 {
+	u_int8_t flags;
+	u_int8_t count;
+	unsigned char names[IPT_ZONE_NAME_COUNT][IPT_ZONE_NAME_LENGTH + 1];
+
+	/* used internally by the kernel */
+	struct xt_zone_priv *priv __attribute__((aligned(8)));
+};
+
 #endif
@@ -18,16 +18,22 @@
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
 #include <linux/skbuff.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/workqueue.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 #ifdef CONFIG_SYSCTL
 #include <linux/sysctl.h>
 #endif
 
 #include <net/ip.h>
 #include <net/ipv6.h>
+#include <net/sock.h>
+#include <net/tcp_states.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_l3proto.h>
@@ -38,6 +44,7 @@
 
 #include "include/kzorp.h"
 #include "include/kzorp_netlink.h"
+#include "include/kzorp_netlink_parse.h"
 
 static const char *const kz_log_null = "(NULL)";
 
@@ -137,6 +144,7 @@ kz_bind_new(void)
 		return NULL;
 
 	INIT_LIST_HEAD(&bind->list);
+	bind->weight = 1;
 
 	return bind;
 }
@@ -155,6 +163,7 @@ kz_bind_clone(const struct kz_bind const *_bind)
 	bind->proto = _bind->proto;
 	bind->addr = _bind->addr;
 	bind->port = _bind->port;
+	bind->weight = _bind->weight;
 
 	return bind;
 }
@@ -162,9 +171,89 @@ kz_bind_clone(const struct kz_bind const *_bind)
 void
 kz_bind_destroy(struct kz_bind *bind)
 {
+	if (bind->listener_sk != NULL)
+		sock_put(bind->listener_sk);
 	kfree(bind);
 }
 
+/*
+ * The TCP listener socket a bind redirects to is cached in the bind, so
+ * new proxied connections need no listener hash lookup. The cache holds
+ * a reference to the socket; it is dropped when the socket is found to
+ * be no longer listening or when the bind is destroyed. Sockets bound to
+ * a device or sharing their port are not cached, as the listener chosen
+ * for them depends on the packet. UDP lookups may find sockets connected
+ * to a single client, so those are never cached.
+ */
+
+static void
+kz_bind_listener_invalidate(const struct kz_bind *bind, struct sock *sk)
+{
+	if (cmpxchg(&((struct kz_bind *) bind)->listener_sk, sk, NULL) == sk)
+		sock_put(sk);
+}
+
+/**
+ * kz_bind_listener_get - get the cached listener socket of a bind
+ * @bind: the bind
+ *
+ * Returns the socket with a reference taken, or NULL if there is no
+ * valid cached socket. Call under rcu_read_lock().
+ */
+struct sock *
+kz_bind_listener_get(const struct kz_bind *bind)
+{
+	struct sock *sk = ACCESS_ONCE(bind->listener_sk);
+
+	if (sk == NULL)
+		return NULL;
+
+	/* TCP and UDP sockets are freed with SLAB_DESTROY_BY_RCU: the
+	 * memory is a socket until the end of the grace period, but it
+	 * may have been reused, so check it is still the cached one */
+	if (unlikely(!atomic_inc_not_zero(&sk->sk_refcnt)))
+		return NULL;
+
+	if (unlikely(ACCESS_ONCE(bind->listener_sk) != sk)) {
+		sock_put(sk);
+		return NULL;
+	}
+
+	if (unlikely(sk->sk_state != TCP_LISTEN)) {
+		kz_bind_debug(bind, "cached listener socket closed");
+		kz_bind_listener_invalidate(bind, sk);
+		sock_put(sk);
+		return NULL;
+	}
+
+	return sk;
+}
+EXPORT_SYMBOL_GPL(kz_bind_listener_get);
+
+/**
+ * kz_bind_listener_cache - cache the listener socket of a bind
+ * @bind: the bind
+ * @sk: listener socket looked up for the bind, the reference of the
+ *      caller is not consumed
+ */
+void
+kz_bind_listener_cache(const struct kz_bind *bind, struct sock *sk)
+{
+	if (bind->proto != IPPROTO_TCP || sk->sk_state != TCP_LISTEN)
+		return;
+	if (sk->sk_bound_dev_if != 0)
+		return;
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0) )
+	if (sk->sk_reuseport)
+		return;
+#endif
+
+	sock_hold(sk);
+	if (cmpxchg(&((struct kz_bind *) bind)->listener_sk, NULL, sk) != NULL)
+		sock_put(sk);
+}
+EXPORT_SYMBOL_GPL(kz_bind_listener_cache);
+
 /* !!! must be called with the instance mutex held !!! */
 struct kz_instance *
 kz_instance_create(const char *name, const unsigned int len, const netlink_port_t peer_pid)
@@ -261,7 +350,6 @@ kz_config_init(struct kz_config *cfg)
 	INIT_LIST_HEAD(&cfg->services.head);
 	INIT_LIST_HEAD(&cfg->dispatchers.head);
 	kz_head_zone_init(&cfg->zones);
-	kz_head_dispatcher_init(&cfg->dispatchers);
 }
 
 static int __init
@@ -285,6 +373,7 @@ static_cfg_cleanup(void)
 }
 
 struct kz_config *kz_config_rcu = &static_config;
+EXPORT_SYMBOL_GPL(kz_config_rcu);
 
 struct kz_config *kz_config_new(void)
 {
@@ -332,59 +421,34 @@ kz_config_swap(struct kz_config * new_cfg)
  ***********************************************************/
 
 
-void nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * kzorp,
-	enum ip_conntrack_info ctinfo,
-	const struct sk_buff *skb,
-	const struct net_device * const in,
-	const u8 l3proto,
-	const struct kz_config **p_cfg)
+/* parses the L3/L4 headers of the packet, returns false if they are malformed */
+bool
+kz_packet_tuple_parse(const struct sk_buff *skb, u8 l3proto,
+		      struct kz_packet_tuple *tuple)
 {
-	struct kz_zone *czone = NULL;
-	struct kz_zone *szone = NULL;
-	struct kz_dispatcher *dpt = NULL;
-	struct kz_service *svc = NULL;
 	struct {
-		u16 src;
-		u16 dst;
-	} __attribute__((packed)) *ports, _ports = { .src = 0, .dst = 0 };
-	const struct kz_config * loc_cfg;
-	u8 l4proto;
-	union nf_inet_addr *saddr, *daddr;
-        struct kz_reqids reqids;
-	int sp_idx;
-
-	ports = &_ports;
-
-	if (p_cfg == NULL)
-		p_cfg = &loc_cfg;
+		__be16 src;
+		__be16 dst;
+	} __attribute__((packed)) *ports, _ports;
+	int thoff;
 
-	*p_cfg = rcu_dereference(kz_config_rcu);
+	memset(tuple, 0, sizeof(*tuple));
+	tuple->l3proto = l3proto;
 
-	BUG_ON(*p_cfg == NULL);
-	kzorp->generation = (*p_cfg)->generation;
-	
 	switch (l3proto) {
 	case NFPROTO_IPV4:
 	{
 		const struct iphdr * const iph = ip_hdr(skb);
 
-		l4proto = iph->protocol;
-		saddr = (union nf_inet_addr *) &iph->saddr;
-		daddr = (union nf_inet_addr *) &iph->daddr;
-
-		if ((l4proto == IPPROTO_TCP) || (l4proto == IPPROTO_UDP)) {
-			ports = skb_header_pointer(skb, ip_hdrlen(skb), sizeof(_ports), &_ports);
-			if (unlikely(ports == NULL))
-				goto done;
-		}
-		kz_debug("kzorp lookup for packet: protocol='%u', src='%pI4:%u', dst='%pI4:%u'\n",
-			 iph->protocol, &iph->saddr, ntohs(ports->src), &iph->daddr, ntohs(ports->dst));
+		tuple->l4proto = iph->protocol;
+		tuple->saddr.ip = iph->saddr;
+		tuple->daddr.ip = iph->daddr;
+		thoff = ip_hdrlen(skb);
 	}
 		break;
 	case NFPROTO_IPV6:
 	{
 		const struct ipv6hdr * const iph = ipv6_hdr(skb);
-		int thoff;
 		u8 tproto = iph->nexthdr;
 
 		/* find transport header */
@@ -394,22 +458,15 @@ void nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * kzorp,
 #else
 		thoff = ipv6_skip_exthdr(skb, sizeof(*iph), &tproto);
 #endif
-		if (unlikely(thoff < 0))
-			goto done;
-
-		l4proto = tproto;
-		saddr = (union nf_inet_addr *) &iph->saddr;
-		daddr = (union nf_inet_addr *) &iph->daddr;
-
-		if ((l4proto == IPPROTO_TCP) || (l4proto == IPPROTO_UDP)) {
-			/* get info from transport header */
-			ports = skb_header_pointer(skb, thoff, sizeof(_ports), &_ports);
-			if (unlikely(ports == NULL))
-				goto done;
+		if (unlikely(thoff < 0)) {
+			kz_debug("unable to find transport header in IPv6 packet; src='%pI6', dst='%pI6'\n",
+				 &iph->saddr, &iph->daddr);
+			return false;
 		}
 
-		kz_debug("kzorp lookup for packet: protocol='%u', src='%pI6:%u', dst='%pI6:%u'\n", l4proto,
-			 &iph->saddr, ntohs(ports->src), &iph->daddr, ntohs(ports->dst));
+		tuple->l4proto = tproto;
+		tuple->saddr.in6 = iph->saddr;
+		tuple->daddr.in6 = iph->daddr;
 	}
 		break;
 	default:
@@ -417,6 +474,57 @@ void nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * kzorp,
 		break;
 	}
 
+	if ((tuple->l4proto == IPPROTO_TCP) || (tuple->l4proto == IPPROTO_UDP)) {
+		/* get info from transport header */
+		ports = skb_header_pointer(skb, thoff, sizeof(_ports), &_ports);
+		if (unlikely(ports == NULL)) {
+			kz_debug("failed to get ports; protocol='%u'\n", tuple->l4proto);
+			return false;
+		}
+		tuple->sport = ports->src;
+		tuple->dport = ports->dst;
+	}
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(kz_packet_tuple_parse);
+
+/* tuple is NULL if the headers of the packet could not be parsed */
+static void
+__nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * kzorp,
+	enum ip_conntrack_info ctinfo,
+	const struct sk_buff *skb,
+	const struct net_device * const in,
+	const struct kz_packet_tuple *tuple,
+	const struct kz_config **p_cfg)
+{
+	struct kz_zone *czone = NULL;
+	struct kz_zone *szone = NULL;
+	struct kz_dispatcher *dpt = NULL;
+	struct kz_service *svc = NULL;
+	const struct kz_config * loc_cfg;
+        struct kz_reqids reqids;
+	int sp_idx;
+
+	if (p_cfg == NULL)
+		p_cfg = &loc_cfg;
+
+	*p_cfg = rcu_dereference(kz_config_rcu);
+
+	BUG_ON(*p_cfg == NULL);
+	kzorp->generation = (*p_cfg)->generation;
+	kzorp->redirected = false;
+
+	if (unlikely(tuple == NULL))
+		goto done;
+
+	if (tuple->l3proto == NFPROTO_IPV4)
+		kz_debug("kzorp lookup for packet: protocol='%u', src='%pI4:%u', dst='%pI4:%u'\n",
+			 tuple->l4proto, &tuple->saddr.ip, ntohs(tuple->sport), &tuple->daddr.ip, ntohs(tuple->dport));
+	else
+		kz_debug("kzorp lookup for packet: protocol='%u', src='%pI6:%u', dst='%pI6:%u'\n",
+			 tuple->l4proto, &tuple->saddr.in6, ntohs(tuple->sport), &tuple->daddr.in6, ntohs(tuple->dport));
+
 	/* copy IPSEC reqids from secpath to our own structure */
 	if (skb->sp != NULL) {
 		reqids.len = skb->sp->len;
@@ -426,9 +534,9 @@ void nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * kzorp,
 		reqids.len = 0;
 	}
 
-	kz_lookup_session(*p_cfg, &reqids, in, l3proto,
-			  saddr, daddr,
-			  l4proto, ntohs(ports->src), ntohs(ports->dst),
+	kz_lookup_session(*p_cfg, &reqids, in, tuple->l3proto,
+			  &tuple->saddr, &tuple->daddr,
+			  tuple->l4proto, ntohs(tuple->sport), ntohs(tuple->dport),
 			  &dpt, &czone, &szone, &svc,
 			  (ctinfo >= IP_CT_IS_REPLY));
 
@@ -455,15 +563,31 @@ done:
 
 	return;
 }
+
+void nfct_kzorp_lookup_rcu(struct nf_conntrack_kzorp * kzorp,
+	enum ip_conntrack_info ctinfo,
+	const struct sk_buff *skb,
+	const struct net_device * const in,
+	const u8 l3proto,
+	const struct kz_config **p_cfg)
+{
+	struct kz_packet_tuple tuple;
+
+	if (kz_packet_tuple_parse(skb, l3proto, &tuple))
+		__nfct_kzorp_lookup_rcu(kzorp, ctinfo, skb, in, &tuple, p_cfg);
+	else
+		__nfct_kzorp_lookup_rcu(kzorp, ctinfo, skb, in, NULL, p_cfg);
+}
 EXPORT_SYMBOL_GPL(nfct_kzorp_lookup_rcu);
 
 // FIXME: should be rewritten
-const struct nf_conntrack_kzorp * nfct_kzorp_cached_lookup_rcu(
+static const struct nf_conntrack_kzorp *
+__nfct_kzorp_cached_lookup_rcu(
 	struct nf_conn *ct,
 	enum ip_conntrack_info ctinfo,
 	const struct sk_buff *skb,
 	const struct net_device * const in,
-	const u8 l3proto,
+	const struct kz_packet_tuple *tuple,
 	const struct kz_config **p_cfg)
 {
 	struct nf_conntrack_kzorp *kzorp;
@@ -479,7 +603,7 @@ const struct nf_conntrack_kzorp * nfct_kzorp_cached_lookup_rcu(
 		/* no kzorp extension, we need to try and add it only
 		 * if the conntrack is not yet confirmed */
 		if (unlikely(nf_ct_is_confirmed(ct))) {
-			switch (l3proto) {
+			switch (nf_ct_l3num(ct)) {
 			case NFPROTO_IPV4:
 			{
 				const struct iphdr * const iph = ip_hdr(skb);
@@ -506,19 +630,252 @@ const struct nf_conntrack_kzorp * nfct_kzorp_cached_lookup_rcu(
 			return NULL;
 		}
 		/* implicit:  kzorp->sid = 0; */
-		nfct_kzorp_lookup_rcu(kzorp, ctinfo, skb, in, l3proto, p_cfg);
+		__nfct_kzorp_lookup_rcu(kzorp, ctinfo, skb, in, tuple, p_cfg);
 		return kzorp;
 	}
 	
 	/* use existing kzorp, make sure it is okay */
 	if (unlikely(!kz_generation_valid(*p_cfg, kzorp->generation))) {
-		nfct_kzorp_lookup_rcu(kzorp, ctinfo, skb, in, l3proto, p_cfg);
+		__nfct_kzorp_lookup_rcu(kzorp, ctinfo, skb, in, tuple, p_cfg);
 	}
 
 	return kzorp;
 }
+
+const struct nf_conntrack_kzorp * nfct_kzorp_cached_lookup_rcu(
+	struct nf_conn *ct,
+	enum ip_conntrack_info ctinfo,
+	const struct sk_buff *skb,
+	const struct net_device * const in,
+	const u8 l3proto,
+	const struct kz_config **p_cfg)
+{
+	struct kz_packet_tuple tuple;
+
+	if (kz_packet_tuple_parse(skb, l3proto, &tuple))
+		return __nfct_kzorp_cached_lookup_rcu(ct, ctinfo, skb, in, &tuple, p_cfg);
+	else
+		return __nfct_kzorp_cached_lookup_rcu(ct, ctinfo, skb, in, NULL, p_cfg);
+}
 EXPORT_SYMBOL_GPL(nfct_kzorp_cached_lookup_rcu);
 
+/***********************************************************
+ * Per-packet context
+ ***********************************************************/
+
+/*
+ * The KZORP target and the zone and service matches evaluated for the
+ * same packet in one hook invocation share the parsed headers and the
+ * result of the kzorp lookup through a per-CPU context. The context is
+ * keyed by the skb, the hook and the conntrack entry; it is invalidated
+ * by our own hooks at the start of every hook and right after NAT has
+ * rewritten the headers, so a freed skb reallocated at the same address
+ * is never mistaken for the cached one. The hooks are registered only
+ * while a KZORP target or a zone or service match using the context
+ * exists, so packets pay nothing for them otherwise.
+ *
+ * The context may only be used with bottom halves disabled, which is
+ * the case in iptables matches and targets.
+ */
+
+static DEFINE_PER_CPU(struct kz_packet_ctx, kz_packet_ctx);
+
+static void
+kz_packet_ctx_put_kzorp(struct kz_packet_ctx *ctx)
+{
+	if (ctx->kzorp == &ctx->local_kzorp) {
+		kz_destroy_kzorp(&ctx->local_kzorp);
+		memset(&ctx->local_kzorp, 0, sizeof(ctx->local_kzorp));
+	}
+	ctx->kzorp = NULL;
+	ctx->cfg = NULL;
+}
+
+static void
+kz_packet_ctx_reset(struct kz_packet_ctx *ctx)
+{
+	kz_packet_ctx_put_kzorp(ctx);
+	ctx->skb = NULL;
+}
+
+/**
+ * kz_packet_ctx_get - get the kzorp context of a packet
+ * @skb: the packet
+ * @hooknum: netfilter hook the packet is processed in
+ * @l3proto: NFPROTO_IPV4 or NFPROTO_IPV6
+ *
+ * The headers are parsed only when the packet is not the one cached on
+ * this CPU. Call with bottom halves disabled.
+ */
+struct kz_packet_ctx *
+kz_packet_ctx_get(const struct sk_buff *skb, unsigned int hooknum, u8 l3proto)
+{
+	struct kz_packet_ctx *ctx = &__get_cpu_var(kz_packet_ctx);
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get((struct sk_buff *) skb, &ctinfo);
+	if (ct == NULL) /* we're really only interested if REPLY or not... */
+		ctinfo = IP_CT_NEW;
+
+	if (likely(ctx->skb == skb && ctx->hooknum == hooknum &&
+		   ctx->tuple.l3proto == l3proto &&
+		   ctx->ct == ct && ctx->ctinfo == ctinfo))
+		return ctx;
+
+	kz_packet_ctx_reset(ctx);
+
+	ctx->skb = skb;
+	ctx->hooknum = hooknum;
+	ctx->ct = ct;
+	ctx->ctinfo = ctinfo;
+	ctx->tuple_valid = kz_packet_tuple_parse(skb, l3proto, &ctx->tuple);
+
+	return ctx;
+}
+EXPORT_SYMBOL_GPL(kz_packet_ctx_get);
+
+/**
+ * kz_packet_ctx_kzorp_rcu - get the kzorp lookup result of a packet
+ * @ctx: context returned by kz_packet_ctx_get()
+ * @in: input device of the packet
+ *
+ * Uses the result cached in the conntrack entry if there is one,
+ * otherwise does a lookup into the context. The lookup is done only
+ * once per packet unless the configuration changes meanwhile. The
+ * config the result belongs to is stored in ctx->cfg.
+ *
+ * Call under rcu_read_lock() with bottom halves disabled.
+ */
+const struct nf_conntrack_kzorp *
+kz_packet_ctx_kzorp_rcu(struct kz_packet_ctx *ctx, const struct net_device * const in)
+{
+	const struct kz_packet_tuple * const tuple = ctx->tuple_valid ? &ctx->tuple : NULL;
+	const struct nf_conntrack_kzorp *kzorp = NULL;
+
+	if (likely(ctx->kzorp != NULL && ctx->cfg == rcu_dereference(kz_config_rcu)))
+		return ctx->kzorp;
+
+	kz_packet_ctx_put_kzorp(ctx);
+
+	if (ctx->ct != NULL)
+		kzorp = __nfct_kzorp_cached_lookup_rcu(ctx->ct, ctx->ctinfo, ctx->skb, in, tuple, &ctx->cfg);
+
+	if (kzorp == NULL) {
+		kz_debug("no kzorp extension, doing local lookup\n");
+		__nfct_kzorp_lookup_rcu(&ctx->local_kzorp, ctx->ctinfo, ctx->skb, in, tuple, &ctx->cfg);
+		kzorp = &ctx->local_kzorp;
+	}
+
+	ctx->kzorp = kzorp;
+	return kzorp;
+}
+EXPORT_SYMBOL_GPL(kz_packet_ctx_kzorp_rcu);
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0) )
+static unsigned int
+kz_packet_ctx_hook(const struct nf_hook_ops *ops, struct sk_buff *skb,
+		   const struct net_device *in, const struct net_device *out,
+		   int (*okfn)(struct sk_buff *))
+#else
+static unsigned int
+kz_packet_ctx_hook(unsigned int hooknum, struct sk_buff *skb,
+		   const struct net_device *in, const struct net_device *out,
+		   int (*okfn)(struct sk_buff *))
+#endif
+{
+	/* LOCAL_OUT and POST_ROUTING may run in process context */
+	local_bh_disable();
+	kz_packet_ctx_reset(&__get_cpu_var(kz_packet_ctx));
+	local_bh_enable();
+
+	return NF_ACCEPT;
+}
+
+#define KZ_PACKET_CTX_HOOK_OPS(_hook, _pf, _priority) \
+	{ \
+		.hook		= kz_packet_ctx_hook, \
+		.owner		= THIS_MODULE, \
+		.pf		= _pf, \
+		.hooknum	= _hook, \
+		.priority	= _priority, \
+	}
+
+static struct nf_hook_ops kz_packet_ctx_ops[] __read_mostly = {
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV4, NF_IP_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV4, NF_IP_PRI_NAT_DST + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_IN, NFPROTO_IPV4, NF_IP_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_IN, NFPROTO_IPV4, NF_IP_PRI_NAT_SRC + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_FORWARD, NFPROTO_IPV4, NF_IP_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_OUT, NFPROTO_IPV4, NF_IP_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_OUT, NFPROTO_IPV4, NF_IP_PRI_NAT_DST + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_POST_ROUTING, NFPROTO_IPV4, NF_IP_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_POST_ROUTING, NFPROTO_IPV4, NF_IP_PRI_NAT_SRC + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV6, NF_IP6_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV6, NF_IP6_PRI_NAT_DST + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_IN, NFPROTO_IPV6, NF_IP6_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_IN, NFPROTO_IPV6, NF_IP6_PRI_NAT_SRC + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_FORWARD, NFPROTO_IPV6, NF_IP6_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_OUT, NFPROTO_IPV6, NF_IP6_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_LOCAL_OUT, NFPROTO_IPV6, NF_IP6_PRI_NAT_DST + 1),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_POST_ROUTING, NFPROTO_IPV6, NF_IP6_PRI_FIRST),
+	KZ_PACKET_CTX_HOOK_OPS(NF_INET_POST_ROUTING, NFPROTO_IPV6, NF_IP6_PRI_NAT_SRC + 1),
+};
+
+#undef KZ_PACKET_CTX_HOOK_OPS
+
+static DEFINE_MUTEX(kz_packet_ctx_users_mutex);
+static unsigned int kz_packet_ctx_users;
+
+/**
+ * kz_packet_ctx_users_get - register a user of the packet context
+ *
+ * Registers the hooks invalidating the context for the first user.
+ * Called from the checkentry functions of the users, in process context.
+ */
+int
+kz_packet_ctx_users_get(void)
+{
+	int res = 0;
+
+	mutex_lock(&kz_packet_ctx_users_mutex);
+	if (kz_packet_ctx_users == 0) {
+		res = nf_register_hooks(kz_packet_ctx_ops, ARRAY_SIZE(kz_packet_ctx_ops));
+		if (res < 0)
+			kz_err("failed to register packet context hooks\n");
+	}
+	if (res == 0)
+		kz_packet_ctx_users++;
+	mutex_unlock(&kz_packet_ctx_users_mutex);
+
+	return res;
+}
+EXPORT_SYMBOL_GPL(kz_packet_ctx_users_get);
+
+/**
+ * kz_packet_ctx_users_put - unregister a user of the packet context
+ *
+ * Unregisters the hooks after the last user; the contexts are reset so
+ * that nothing cached before is found when the hooks are registered
+ * again.
+ */
+void
+kz_packet_ctx_users_put(void)
+{
+	int cpu;
+
+	mutex_lock(&kz_packet_ctx_users_mutex);
+	if (--kz_packet_ctx_users == 0) {
+		/* waits for the packets in the hooks */
+		nf_unregister_hooks(kz_packet_ctx_ops, ARRAY_SIZE(kz_packet_ctx_ops));
+
+		for_each_possible_cpu(cpu)
+			kz_packet_ctx_reset(&per_cpu(kz_packet_ctx, cpu));
+	}
+	mutex_unlock(&kz_packet_ctx_users_mutex);
+}
+EXPORT_SYMBOL_GPL(kz_packet_ctx_users_put);
+
 /***********************************************************
  * Zones
  ***********************************************************/
@@ -628,6 +985,232 @@ kz_head_destroy_zone(struct kz_head_z *head)
 	}
 }
 
+/***********************************************************
+ * Reject rate limiting
+ ***********************************************************/
+
+#define KZ_REJECT_BUCKET_STATE(last, credit) (((u64) (u32) (last) << 32) | (u32) (credit))
+#define KZ_REJECT_BUCKET_LAST(state) ((u32) ((state) >> 32))
+#define KZ_REJECT_BUCKET_CREDIT(state) ((u32) (state))
+
+static void
+kz_reject_bucket_init(struct kz_reject_bucket *bucket, u32 burst, unsigned long now)
+{
+	atomic64_set(&bucket->state, KZ_REJECT_BUCKET_STATE(now, burst * HZ));
+}
+
+struct kz_reject_limiter *
+kz_reject_limiter_new(u32 rate, u32 burst, u32 src_rate, u32 src_burst)
+{
+	struct kz_reject_limiter *limiter;
+	int i;
+
+	limiter = kzalloc(sizeof(struct kz_reject_limiter), GFP_KERNEL);
+	if (limiter == NULL)
+		return NULL;
+
+	limiter->stats = alloc_percpu(struct kz_reject_stats);
+	if (limiter->stats == NULL)
+		goto error_free;
+
+	if (src_rate != 0) {
+		limiter->src = kcalloc(KZ_REJECT_SRC_BUCKETS, sizeof(struct kz_reject_src_bucket), GFP_KERNEL);
+		if (limiter->src == NULL)
+			goto error_free_stats;
+		for (i = 0; i < KZ_REJECT_SRC_BUCKETS; i++)
+			kz_reject_bucket_init(&limiter->src[i].bucket, src_burst, jiffies);
+	}
+
+	atomic_set(&limiter->refcnt, 1);
+	limiter->rate = rate;
+	limiter->burst = burst;
+	limiter->src_rate = src_rate;
+	limiter->src_burst = src_burst;
+	get_random_bytes(&limiter->hash_seed, sizeof(limiter->hash_seed));
+	kz_reject_bucket_init(&limiter->global, burst, jiffies);
+
+	return limiter;
+
+error_free_stats:
+	free_percpu(limiter->stats);
+error_free:
+	kfree(limiter);
+
+	return NULL;
+}
+
+void
+kz_reject_limiter_put(struct kz_reject_limiter *limiter)
+{
+	if (limiter == NULL || !atomic_dec_and_test(&limiter->refcnt))
+		return;
+
+	kfree(limiter->src);
+	free_percpu(limiter->stats);
+	kfree(limiter);
+}
+
+/**
+ * kz_reject_limiter_migrate - take over the limiter of a replaced service
+ * @limiter: the limiter of the new service, replaced if migrated
+ * @orig: the limiter of the service with the same name in the running config
+ *
+ * A service uploaded again in a transaction gets a fresh limiter. If its
+ * limits are the same as those of the service it replaces, the old
+ * limiter is used instead, so that buckets and counters are kept.
+ */
+void
+kz_reject_limiter_migrate(struct kz_reject_limiter **limiter, struct kz_reject_limiter *orig)
+{
+	const struct kz_reject_limiter * const new = *limiter;
+
+	if (new == NULL || orig == NULL || new == orig)
+		return;
+
+	if (new->rate != orig->rate || new->burst != orig->burst ||
+	    new->src_rate != orig->src_rate || new->src_burst != orig->src_burst)
+		return;
+
+	atomic_inc(&orig->refcnt);
+	kz_reject_limiter_put(*limiter);
+	*limiter = orig;
+}
+
+/**
+ * kz_reject_bucket_take - refill the bucket and take a token from it
+ * @bucket: the bucket
+ * @rate: tokens added in a second
+ * @burst: the capacity of the bucket in tokens
+ * @now: jiffies of the packet
+ *
+ * Returns true if there was a token. A bucket without tokens is not
+ * written, so a flood denied by the limit only reads its cache line.
+ */
+static bool
+kz_reject_bucket_take(struct kz_reject_bucket *bucket, u32 rate, u32 burst, unsigned long now)
+{
+	const u32 cap = burst * HZ;
+	u64 state = atomic64_read(&bucket->state);
+
+	for (;;) {
+		u32 last = KZ_REJECT_BUCKET_LAST(state);
+		u32 elapsed = (u32) now - last;
+		u32 credit;
+		u64 prev;
+
+		/* another CPU may have refilled it with a slightly later jiffies
+		 * value; anything else is a bucket idle since long ago */
+		if ((s32) elapsed < 0 && (s32) elapsed > -HZ)
+			elapsed = 0;
+		else
+			last = now;
+
+		/* rate and burst are range checked, this keeps the credit within u32 */
+		if (elapsed > cap / rate + 1)
+			elapsed = cap / rate + 1;
+
+		credit = min_t(u32, KZ_REJECT_BUCKET_CREDIT(state) + elapsed * rate, cap);
+		if (credit < HZ)
+			return false;
+
+		prev = atomic64_cmpxchg(&bucket->state, state, KZ_REJECT_BUCKET_STATE(last, credit - HZ));
+		if (prev == state)
+			return true;
+		state = prev;
+	}
+}
+
+/* gives back a token taken by kz_reject_bucket_take() */
+static void
+kz_reject_bucket_put(struct kz_reject_bucket *bucket, u32 burst)
+{
+	const u32 cap = burst * HZ;
+	u64 state = atomic64_read(&bucket->state);
+
+	for (;;) {
+		const u32 credit = min_t(u32, KZ_REJECT_BUCKET_CREDIT(state) + HZ, cap);
+		u64 prev;
+
+		prev = atomic64_cmpxchg(&bucket->state, state,
+					KZ_REJECT_BUCKET_STATE(KZ_REJECT_BUCKET_LAST(state), credit));
+		if (prev == state)
+			return;
+		state = prev;
+	}
+}
+
+/**
+ * kz_reject_limiter_allow - take a token for generating a reject
+ * @limiter: limiter of the deny service, may be NULL
+ * @saddr: source address of the denied packet
+ *
+ * Returns true if the reject may be sent, both the global and the
+ * per-source bucket must have a token. Updates the counters of the
+ * limiter accordingly. Call with bottom halves disabled.
+ *
+ * The buckets are lockless. A source bucket is taken over by a new
+ * source without synchronization, so sources racing for the same
+ * bucket may each start with a full one; the global limit still holds.
+ */
+bool
+kz_reject_limiter_allow(struct kz_reject_limiter *limiter, const union nf_inet_addr *saddr)
+{
+	struct kz_reject_bucket *src_bucket = NULL;
+	const unsigned long now = jiffies;
+	bool allow = true;
+
+	if (limiter == NULL)
+		return true;
+
+	if (limiter->src != NULL) {
+		struct kz_reject_src_bucket *src;
+
+		src = &limiter->src[jhash2((const u32 *) saddr->all, ARRAY_SIZE(saddr->all), limiter->hash_seed) &
+				    (KZ_REJECT_SRC_BUCKETS - 1)];
+		/* a new source evicts the previous one and starts with a full bucket */
+		if (!nf_inet_addr_cmp(&src->addr, saddr)) {
+			src->addr = *saddr;
+			kz_reject_bucket_init(&src->bucket, limiter->src_burst, now);
+		}
+
+		src_bucket = &src->bucket;
+		allow = kz_reject_bucket_take(src_bucket, limiter->src_rate, limiter->src_burst, now);
+	}
+
+	if (allow && limiter->rate != 0) {
+		allow = kz_reject_bucket_take(&limiter->global, limiter->rate, limiter->burst, now);
+		/* the source is not charged for a reject suppressed by the global limit */
+		if (!allow && src_bucket != NULL)
+			kz_reject_bucket_put(src_bucket, limiter->src_burst);
+	}
+
+	if (allow)
+		this_cpu_inc(limiter->stats->sent);
+	else
+		this_cpu_inc(limiter->stats->suppressed);
+
+	return allow;
+}
+EXPORT_SYMBOL_GPL(kz_reject_limiter_allow);
+
+void
+kz_reject_limiter_stats(const struct kz_reject_limiter *limiter, struct kz_reject_stats *stats)
+{
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (limiter == NULL)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		const struct kz_reject_stats *s = per_cpu_ptr(limiter->stats, cpu);
+
+		stats->sent += s->sent;
+		stats->suppressed += s->suppressed;
+	}
+}
+
 /***********************************************************
  * Services
  ***********************************************************/
@@ -650,6 +1233,8 @@ kz_service_new(void)
 
 	INIT_LIST_HEAD(&service->a.fwd.snat);
 	INIT_LIST_HEAD(&service->a.fwd.dnat);
+	INIT_LIST_HEAD(&service->a.fwd.snat6);
+	INIT_LIST_HEAD(&service->a.fwd.dnat6);
 
 	return service;
 }
@@ -658,6 +1243,7 @@ void
 kz_service_destroy(struct kz_service *service)
 {
 	struct kz_service_nat_entry *i, *s;
+	struct kz_service_nat6_entry *i6, *s6;
 
 	if (service->name)
 		kfree(service->name);
@@ -672,8 +1258,22 @@ kz_service_destroy(struct kz_service *service)
 			list_del(&i->list);
 			kfree(i);
 		}
+		list_for_each_entry_safe(i6, s6, &service->a.fwd.snat6, list) {
+			list_del(&i6->list);
+			kfree(i6);
+		}
+		list_for_each_entry_safe(i6, s6, &service->a.fwd.dnat6, list) {
+			list_del(&i6->list);
+			kfree(i6);
+		}
+		kz_service_nat_index_destroy(service->a.fwd.snat_index);
+		kz_service_nat_index_destroy(service->a.fwd.dnat_index);
+		kz_service_nat6_index_destroy(service->a.fwd.snat6_index);
+		kz_service_nat6_index_destroy(service->a.fwd.dnat6_index);
 	}
 
+	kz_reject_limiter_put(service->reject);
+
 	kfree(service);
 }
 
@@ -722,6 +1322,44 @@ kz_service_add_nat_entry(struct list_head *head, struct nf_nat_range *src,
 	return 0;
 }
 
+int
+kz_service_add_nat6_entry(struct list_head *head, struct kz_nat6_range *src,
+			  struct kz_nat6_range *dst, struct kz_nat6_range *map)
+{
+	struct kz_service_nat6_entry *entry;
+
+	BUG_ON(!src);
+	BUG_ON(!map);
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	entry->src = *src;
+	if (dst != NULL)
+		entry->dst = *dst;
+	entry->map = *map;
+
+	list_add_tail(&entry->list, head);
+
+	return 0;
+}
+
+static int
+service_clone_nat6_list(const struct list_head * const src, struct list_head *dst)
+{
+	struct kz_service_nat6_entry *i;
+	int res = 0;
+
+	list_for_each_entry(i, src, list) {
+		res = kz_service_add_nat6_entry(dst, &i->src, &i->dst, &i->map);
+		if (res < 0)
+			break;
+	}
+
+	return res;
+}
+
 static int
 service_clone_nat_list(const struct list_head * const src, struct list_head *dst)
 {
@@ -749,19 +1387,35 @@ kz_service_clone(const struct kz_service * const o)
 		return NULL;
 
 	svc->instance_id = o->instance_id;
-	svc->flags = o->flags;
+	/* the original may be locked by a commit in progress */
+	svc->flags = o->flags & ~KZF_SERVICE_CNT_LOCKED;
 	svc->type = o->type;
 	svc->a = o->a;
 	svc->name = kz_name_dup(o->name);
 	if (svc->name == NULL)
 		goto error_put;
 	if (svc->type == KZ_SERVICE_FORWARD) {
+		/* indexes are built for the new config on commit */
+		svc->a.fwd.snat_index = NULL;
+		svc->a.fwd.dnat_index = NULL;
+		svc->a.fwd.snat6_index = NULL;
+		svc->a.fwd.dnat6_index = NULL;
 		INIT_LIST_HEAD(&svc->a.fwd.snat);
+		INIT_LIST_HEAD(&svc->a.fwd.dnat);
+		INIT_LIST_HEAD(&svc->a.fwd.snat6);
+		INIT_LIST_HEAD(&svc->a.fwd.dnat6);
 		if (service_clone_nat_list(&o->a.fwd.snat, &svc->a.fwd.snat) < 0)
 			goto error_put;
-		INIT_LIST_HEAD(&svc->a.fwd.dnat);
 		if (service_clone_nat_list(&o->a.fwd.dnat, &svc->a.fwd.dnat) < 0)
 			goto error_put;
+		if (service_clone_nat6_list(&o->a.fwd.snat6, &svc->a.fwd.snat6) < 0)
+			goto error_put;
+		if (service_clone_nat6_list(&o->a.fwd.dnat6, &svc->a.fwd.dnat6) < 0)
+			goto error_put;
+	}
+	if (o->reject != NULL) {
+		atomic_inc(&o->reject->refcnt);
+		svc->reject = o->reject;
 	}
 
 	return svc;
@@ -929,6 +1583,67 @@ kz_dispatcher_new(void)
 	return dispatcher;
 }
 
+/* dimensions other than the zones, these are shared between the copies of a rule */
+#define KZ_RULE_SHARED_DIMS(ACTION) \
+	ACTION(src_in_subnet); \
+	ACTION(dst_in_subnet); \
+	ACTION(src_in6_subnet); \
+	ACTION(dst_in6_subnet); \
+	ACTION(ifname); \
+	ACTION(ifgroup); \
+	ACTION(src_port); \
+	ACTION(dst_port); \
+	ACTION(proto); \
+	ACTION(dst_ifname); \
+	ACTION(dst_ifgroup); \
+	ACTION(reqid)
+
+#define KZ_RULE_DIM_SIZE(dim_name, rule) \
+	ALIGN((rule)->alloc_##dim_name * sizeof(*(rule)->dim_name), sizeof(long))
+
+/* allocates the shared dimensions of rule with the sizes given in params */
+static int
+kz_rule_alloc_dims(struct kz_dispatcher_n_dimension_rule *rule,
+		   const struct kz_dispatcher_n_dimension_rule * const params)
+{
+	size_t size = ALIGN(sizeof(struct kz_rule_dims), sizeof(long));
+	char *p;
+
+#define KZ_RULE_ADD_DIM_SIZE(dim_name) size += KZ_RULE_DIM_SIZE(dim_name, params)
+	KZ_RULE_SHARED_DIMS(KZ_RULE_ADD_DIM_SIZE);
+#undef KZ_RULE_ADD_DIM_SIZE
+
+	rule->dims = kzalloc(size, GFP_KERNEL);
+	if (rule->dims == NULL)
+		return -ENOMEM;
+
+	atomic_set(&rule->dims->refcnt, 1);
+
+	p = (char *) rule->dims + ALIGN(sizeof(struct kz_rule_dims), sizeof(long));
+#define KZ_RULE_PLACE_DIM(dim_name) \
+	rule->alloc_##dim_name = params->alloc_##dim_name; \
+	rule->dim_name = rule->alloc_##dim_name ? (void *) p : NULL; \
+	p += KZ_RULE_DIM_SIZE(dim_name, params)
+	KZ_RULE_SHARED_DIMS(KZ_RULE_PLACE_DIM);
+#undef KZ_RULE_PLACE_DIM
+
+	return 0;
+}
+
+static inline void
+kz_rule_dims_get(struct kz_rule_dims *dims)
+{
+	if (dims != NULL)
+		atomic_inc(&dims->refcnt);
+}
+
+static inline void
+kz_rule_dims_put(struct kz_rule_dims *dims)
+{
+	if (dims != NULL && atomic_dec_and_test(&dims->refcnt))
+		kfree(dims);
+}
+
 static void
 kz_rule_destroy(struct kz_dispatcher_n_dimension_rule *rule)
 {
@@ -944,20 +1659,9 @@ kz_rule_destroy(struct kz_dispatcher_n_dimension_rule *rule)
 
 	kz_service_put(rule->service);
 
-	kfree(rule->src_in_subnet);
-	kfree(rule->dst_in_subnet);
-	kfree(rule->src_in6_subnet);
-	kfree(rule->dst_in6_subnet);
-	kfree(rule->ifname);
-	kfree(rule->ifgroup);
-	kfree(rule->src_port);
-	kfree(rule->dst_port);
+	kz_rule_dims_put(rule->dims);
 	kfree(rule->src_zone);
 	kfree(rule->dst_zone);
-	kfree(rule->proto);
-	kfree(rule->dst_ifname);
-	kfree(rule->dst_ifgroup);
-	kfree(rule->reqid);
 
 	memset(rule, 0, sizeof(*rule));
 }
@@ -978,6 +1682,7 @@ kz_dispatcher_destroy(struct kz_dispatcher *dispatcher)
 		kz_dispatcher_free_rule_array(dispatcher);
 	}
 
+	kz_dispatcher_lookup_put(dispatcher->lookup);
 	kfree(dispatcher);
 }
 
@@ -1014,45 +1719,22 @@ kz_dispatcher_add_rule(struct kz_dispatcher *d, struct kz_service *service,
 {
 	int res = 0;
 	struct kz_dispatcher_n_dimension_rule *rule = NULL;
-	int64_t last_id = -1L;
 
-	if (d->num_rule + 1 > d->alloc_rule) {
-		kz_err("each rule has already been added to this dispatcher; num_rule='%d'\n",
-		       d->alloc_rule);
-		res = -EINVAL;
-		goto error;
-	}
-
-	/* check that the ID of the rule to be added is larger than
-	 * the ID of the last rule */
-	if (d->num_rule > 0)
-		last_id = d->rule[d->num_rule - 1].id;
-
-	if (rule_params->id <= last_id) {
-		kz_err("rule id is not larger than the id of the last rule; id='%u', last_id='%lld'\n", rule_params->id, last_id);
-		res = -EINVAL;
+	res = kznl_check_rule_add(d, rule_params->id);
+	if (res < 0)
 		goto error;
-	}
 
 	rule = &d->rule[d->num_rule];
 	rule->id = rule_params->id;
 	rule->service = kz_service_get(service);
 	rule->dispatcher = d;
 
-	kz_alloc_rule_dimension(src_in_subnet, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(dst_in_subnet, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(src_in6_subnet, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(dst_in6_subnet, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(ifname, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(ifgroup, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(src_port, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(dst_port, rule, rule_params, error_free_dimensions);
+	res = kz_rule_alloc_dims(rule, rule_params);
+	if (res < 0)
+		goto error_free_dimensions;
+
 	kz_alloc_rule_dimension(src_zone, rule, rule_params, error_free_dimensions);
 	kz_alloc_rule_dimension(dst_zone, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(proto, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(dst_ifname, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(dst_ifgroup, rule, rule_params, error_free_dimensions);
-	kz_alloc_rule_dimension(reqid, rule, rule_params, error_free_dimensions);
 
 	d->num_rule++;
 
@@ -1065,49 +1747,26 @@ error:
 	return res;
 }
 
+/* the entry has been checked against the number of entries announced for the rule */
 #define kz_dispatcher_append_rule_entry(entry_name)			\
 	if (rule_entry_params->has_##entry_name) {			\
-		if (rule->num_##entry_name + 1 > rule->alloc_##entry_name) { \
-			kz_err("each " #entry_name " has already been added to the rule; alloc_" #entry_name "='%d'", \
-			       rule->num_##entry_name);			\
-			res = -ENOMEM;					\
-			goto error;					\
-		}							\
 		rule->entry_name[rule->num_##entry_name] = rule_entry_params->entry_name; \
 	}
 
 #define kz_dispatcher_append_rule_entry_portrange(entry_name)		\
 	if (rule_entry_params->has_##entry_name) {			\
-		if (rule->num_##entry_name + 1 > rule->alloc_##entry_name) { \
-			kz_err("each " #entry_name " has already been added to the rule; alloc_" #entry_name "='%d'", \
-			       rule->num_##entry_name);			\
-			res = -ENOMEM;					\
-			goto error;					\
-		}							\
 		rule->entry_name[rule->num_##entry_name].from = rule_entry_params->entry_name.from; \
 		rule->entry_name[rule->num_##entry_name].to = rule_entry_params->entry_name.to; \
 	}
 
 #define kz_dispatcher_append_rule_entry_subnet(entry_name)		\
 	if (rule_entry_params->has_##entry_name) {			\
-		if (rule->num_##entry_name + 1 > rule->alloc_##entry_name) { \
-			kz_err("each " #entry_name " has already been added to the rule; alloc_" #entry_name "='%d'", \
-			       rule->num_##entry_name);			\
-			res = -ENOMEM;					\
-			goto error;					\
-		}							\
 		rule->entry_name[rule->num_##entry_name].addr = rule_entry_params->entry_name.addr; \
 		rule->entry_name[rule->num_##entry_name].mask = rule_entry_params->entry_name.mask; \
 	}
 
 #define kz_dispatcher_append_rule_entry_ifname(entry_name) \
 	if (rule_entry_params->has_##entry_name) { \
-		if (rule->num_##entry_name + 1 > rule->alloc_##entry_name) { \
-			kz_err("each " #entry_name " has already been added to the rule; alloc_" #entry_name "='%d'", \
-			       rule->num_##entry_name); \
-			res = -ENOMEM; \
-			goto error; \
-		} \
 		memcpy(rule->entry_name[rule->num_##entry_name], rule_entry_params->entry_name, IFNAMSIZ); \
 	}
 
@@ -1124,6 +1783,10 @@ kz_dispatcher_add_rule_entry(struct kz_dispatcher_n_dimension_rule *rule,
 	int res = 0;
 	struct kz_zone *zone;
 
+	res = kznl_check_rule_entry(rule, rule_entry_params);
+	if (res < 0)
+		goto error;
+
 	kz_dispatcher_append_rule_entry_ifname(ifname);
 	kz_dispatcher_append_rule_entry(ifgroup);
 	kz_dispatcher_append_rule_entry_subnet(src_in_subnet);
@@ -1203,64 +1866,50 @@ kz_rule_relink_zones(struct kz_dispatcher_n_dimension_rule *r, const struct list
 	kz_rule_arr_relink_zones(&r->num_dst_zone, r->dst_zone, zonelist);
 }
 
-#define kz_clone_rule_dimension(dim_name, dst_name, src_name) \
-	dst_name->num_##dim_name = src_name->num_##dim_name; \
-	memcpy(dst_name->dim_name, src_name->dim_name, \
-	       dst_name->alloc_##dim_name * sizeof(*dst_name->dim_name))
-
-
+/*
+ * Copies a rule for the next config generation: the shared dimensions
+ * are referenced, only the zone arrays are duplicated as they are
+ * relinked to the zones of the new generation.
+ */
 int
 kz_rule_copy(struct kz_dispatcher_n_dimension_rule *dst,
 	     const struct kz_dispatcher_n_dimension_rule * const src)
 {
-	int res = 0;
+	struct kz_zone **src_zone = NULL, **dst_zone = NULL;
 	int i;
 
-	dst->id = src->id;
-	dst->service = kz_service_get(src->service);
+	if (src->alloc_src_zone) {
+		src_zone = kmemdup(src->src_zone, src->alloc_src_zone * sizeof(*src_zone), GFP_KERNEL);
+		if (src_zone == NULL)
+			goto error;
+	}
+
+	if (src->alloc_dst_zone) {
+		dst_zone = kmemdup(src->dst_zone, src->alloc_dst_zone * sizeof(*dst_zone), GFP_KERNEL);
+		if (dst_zone == NULL)
+			goto error;
+	}
+
+	*dst = *src;
 	dst->dispatcher = NULL;
+	dst->src_zone = src_zone;
+	dst->dst_zone = dst_zone;
 
-	kz_alloc_rule_dimension(src_in_subnet, dst, src, error);
-	kz_alloc_rule_dimension(dst_in_subnet, dst, src, error);
-	kz_alloc_rule_dimension(src_in6_subnet, dst, src, error);
-	kz_alloc_rule_dimension(dst_in6_subnet, dst, src, error);
-	kz_alloc_rule_dimension(ifname, dst, src, error);
-	kz_alloc_rule_dimension(ifgroup, dst, src, error);
-	kz_alloc_rule_dimension(src_port, dst, src, error);
-	kz_alloc_rule_dimension(dst_port, dst, src, error);
-	kz_alloc_rule_dimension(src_zone, dst, src, error);
-	kz_alloc_rule_dimension(dst_zone, dst, src, error);
-	kz_alloc_rule_dimension(proto, dst, src, error);
-	kz_alloc_rule_dimension(dst_ifname, dst, src, error);
-	kz_alloc_rule_dimension(dst_ifgroup, dst, src, error);
-	kz_alloc_rule_dimension(reqid, dst, src, error);
-
-	kz_clone_rule_dimension(src_in_subnet, dst, src);
-	kz_clone_rule_dimension(dst_in_subnet, dst, src);
-	kz_clone_rule_dimension(src_in6_subnet, dst, src);
-	kz_clone_rule_dimension(dst_in6_subnet, dst, src);
-	kz_clone_rule_dimension(ifname, dst, src);
-	kz_clone_rule_dimension(ifgroup, dst, src);
-	kz_clone_rule_dimension(src_port, dst, src);
-	kz_clone_rule_dimension(dst_port, dst, src);
-	kz_clone_rule_dimension(src_zone, dst, src);
-	kz_clone_rule_dimension(dst_zone, dst, src);
-	kz_clone_rule_dimension(proto, dst, src);
-	kz_clone_rule_dimension(dst_ifname, dst, src);
-	kz_clone_rule_dimension(dst_ifgroup, dst, src);
-	kz_clone_rule_dimension(reqid, dst, src);
+	kz_service_get(dst->service);
+	kz_rule_dims_get(dst->dims);
 
 	for (i = 0; i < dst->num_src_zone; i++)
-		dst->src_zone[i] = kz_zone_get(dst->src_zone[i]);
+		kz_zone_get(dst->src_zone[i]);
 	for (i = 0; i < dst->num_dst_zone; i++)
-		dst->dst_zone[i] = kz_zone_get(dst->dst_zone[i]);
+		kz_zone_get(dst->dst_zone[i]);
 
 	return 0;
 
 error:
-	kz_rule_destroy(dst);
+	kfree(src_zone);
+	kfree(dst_zone);
 
-	return res;
+	return -ENOMEM;
 }
 
 int
@@ -1341,6 +1990,9 @@ kz_dispatcher_clone(const struct kz_dispatcher * const o)
 	if (kz_dispatcher_copy_rules(dpt, o) < 0)
 		goto error_put;
 
+	/* relinking to zones of the same depth keeps the order of the rule dimensions */
+	dpt->rules_sorted = o->rules_sorted;
+
 	return dpt;
 
 error_put:
@@ -1373,7 +2025,8 @@ kz_dispatcher_relink_n_dim(struct kz_dispatcher *d, const struct list_head * zon
 	}
 	if (!drop)
 		return;
-	/* sweep dropped rules */
+	/* sweep dropped rules, the positions of the others change */
+	kz_dispatcher_drop_lookup(d);
 	for (i = 0, put = 0; i < d->num_rule; ++i) {
 		if (d->rule[i].service != NULL)
 			d->rule[put++] = d->rule[i];
@@ -1388,6 +2041,41 @@ kz_dispatcher_relink(struct kz_dispatcher *d, const struct list_head * zonelist,
 	kz_debug("re-linked n-dim dispatcher; name='%s', num_rules='%u'\n", d->name, d->num_rule);
 }
 
+/* removes the rule with the given id keeping the order of the others, returns -ENOENT if not found */
+int
+kz_dispatcher_remove_rule(struct kz_dispatcher *d, u_int32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->num_rule; ++i) {
+		if (d->rule[i].id == id)
+			break;
+	}
+
+	if (i == d->num_rule)
+		return -ENOENT;
+
+	kz_rule_destroy(&d->rule[i]);
+	memmove(&d->rule[i], &d->rule[i + 1], (d->num_rule - i - 1) * sizeof(d->rule[0]));
+	d->num_rule--;
+	kz_dispatcher_drop_lookup(d);
+
+	kz_debug("removed rule; dispatcher='%s', rule_id='%u', num_rules='%u'\n", d->name, id, d->num_rule);
+
+	return 0;
+}
+
+/* removes the rules added after the first num_rule ones */
+void
+kz_dispatcher_truncate_rules(struct kz_dispatcher *d, unsigned int num_rule)
+{
+	if (d->num_rule > num_rule)
+		kz_dispatcher_drop_lookup(d);
+
+	while (d->num_rule > num_rule)
+		kz_rule_destroy(&d->rule[--d->num_rule]);
+}
+
 void
 kz_head_destroy_dispatcher(struct kz_head_d *head)
 {
@@ -1813,8 +2501,15 @@ int __init kzorp_core_init(void)
 	if (res < 0)
 		goto cleanup_sockopt;
 
+	res = kz_session_ring_init();
+	if (res < 0)
+		goto cleanup_netlink;
+
 	return res;
 
+cleanup_netlink:
+	kz_netlink_cleanup();
+
 cleanup_sockopt:
 	kz_sockopt_cleanup();
 
@@ -1852,6 +2547,8 @@ static void __exit kzorp_core_fini(void)
 {
 	struct kz_instance *global;
 
+	kz_session_ring_cleanup();
+	kz_netlink_cleanup();
 	kz_sockopt_cleanup();
 
 #ifdef CONFIG_KZORP_PROC_FS
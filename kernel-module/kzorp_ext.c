@@ -92,6 +92,9 @@ kz_extension_timer(unsigned long ctp)
   BUG_ON(!kzorp);
 	oldtimer = kzorp->timerfunc_save;
   BUG_ON(!oldtimer);
+	/* sessions having a session id are reported on the accounting ring */
+	if (kzorp->sid != 0)
+		kz_session_ring_write(KZ_SESSION_RING_EVENT_END, (struct nf_conn *)ctp, kzorp);
 	// not reinstating ct->timeout.function, we hope no one tries to call it once more.
   kz_extension_dealloc(kzorp);
 	(*oldtimer)(ctp);
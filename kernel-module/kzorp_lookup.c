@@ -21,8 +21,11 @@
 #include <linux/if.h>
 #include <linux/list.h>
 #include <linux/jhash.h>
+#include <linux/random.h>
 #include <linux/percpu.h>
 #include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/workqueue.h>
 #include <linux/netdevice.h>
 #include <linux/inetdevice.h>
 #include <linux/sort.h>
@@ -50,10 +53,23 @@ struct zone_lookup_t
 	u_int16_t depth;
 };
 
-void kz_generate_lookup_data(struct kz_head_d *dispatchers);
+KZ_PROTECTED int kz_generate_lookup_data(struct kz_head_d *dispatchers);
 
 static DEFINE_PER_CPU(struct kz_percpu_env *, kz_percpu);
 
+#ifdef KZ_USERSPACE
+/* userspace users set up the work area of the lookups of each thread */
+__thread struct kz_percpu_env *kz_lookup_thread_env;
+#define kz_lookup_env_get() kz_lookup_thread_env
+#define kz_lookup_env_put() do { } while (0)
+#else
+#define kz_lookup_env_get() ({ preempt_disable(); __get_cpu_var(kz_percpu); })
+#define kz_lookup_env_put() preempt_enable()
+#endif
+
+/* seed of the bind selection hashes, must not change while the module is loaded */
+static u32 kz_bind_hash_seed __read_mostly;
+
 void
 kz_lookup_cleanup(void)
 {
@@ -76,6 +92,8 @@ kz_lookup_init(void)
 {
 	int cpu;
 
+	get_random_bytes(&kz_bind_hash_seed, sizeof(kz_bind_hash_seed));
+
 	for_each_possible_cpu(cpu) {
 		struct kz_percpu_env *l;
 
@@ -209,6 +227,91 @@ match_iface_local(const struct net_device * in, u_int8_t proto, const union nf_i
 	return res;
 }
 
+/***********************************************************
+ * Parallel building of lookup structures
+ ***********************************************************/
+
+#ifndef KZ_USERSPACE
+/* do not bother other CPUs with less items than this */
+#define KZ_PARALLEL_MIN_CHUNK 1024
+
+struct kz_parallel_work {
+	struct work_struct work;
+	kz_parallel_fn_t fn;
+	void *ctx;
+	unsigned int first;
+	unsigned int last;
+};
+
+static void
+kz_parallel_work_fn(struct work_struct *work)
+{
+	struct kz_parallel_work *w = container_of(work, struct kz_parallel_work, work);
+
+	w->fn(w->ctx, w->first, w->last);
+}
+
+/**
+ * kz_parallel_for - call a function on the ranges of [0, n) on the online CPUs
+ * @n: the number of items
+ * @fn: function processing the items in [first, last)
+ * @ctx: context passed to @fn
+ *
+ * The ranges are disjoint, @fn must not touch items outside of its range.
+ * The caller processes the last range itself and returns when all the
+ * ranges are done. Falls back to a single call of @fn if there are not
+ * enough items or the memory for the work items cannot be allocated.
+ */
+void
+kz_parallel_for(unsigned int n, kz_parallel_fn_t fn, void *ctx)
+{
+	struct kz_parallel_work *works;
+	unsigned int chunk_num, chunk, queued = 0, i;
+	int cpu;
+
+	get_online_cpus();
+
+	chunk_num = min_t(unsigned int, num_online_cpus(), DIV_ROUND_UP(n, KZ_PARALLEL_MIN_CHUNK));
+	if (chunk_num <= 1)
+		goto serial;
+
+	works = kcalloc(chunk_num - 1, sizeof(*works), GFP_KERNEL);
+	if (works == NULL)
+		goto serial;
+
+	chunk = DIV_ROUND_UP(n, chunk_num);
+
+	for_each_online_cpu(cpu) {
+		struct kz_parallel_work *w;
+
+		if (queued == chunk_num - 1)
+			break;
+
+		w = &works[queued++];
+		INIT_WORK(&w->work, kz_parallel_work_fn);
+		w->fn = fn;
+		w->ctx = ctx;
+		w->first = min(n, (queued - 1) * chunk);
+		w->last = min(n, queued * chunk);
+		schedule_work_on(cpu, &w->work);
+	}
+
+	fn(ctx, min(n, queued * chunk), n);
+
+	for (i = 0; i < queued; i++)
+		flush_work(&works[i].work);
+
+	put_online_cpus();
+	kfree(works);
+
+	return;
+
+serial:
+	put_online_cpus();
+	fn(ctx, 0, n);
+}
+#endif
+
 /***********************************************************
  * Dispatchers
  ***********************************************************/
@@ -390,6 +493,11 @@ dpt_ndim_rule_sort(struct kz_dispatcher_n_dimension_rule *rule)
 
 	kz_debug("sorting rule; id='%u'\n", rule->id);
 
+	/* the shared dimensions of copied rules are sorted already and
+	 * may be in use by the previous config */
+	if (rule->dims != NULL && rule->dims->sorted)
+		goto sort_zones;
+
 	res = dpt_ndim_rule_sort_ports(rule->num_src_port, rule->src_port);
 	if (res < 0)
 		return res;
@@ -414,6 +522,10 @@ dpt_ndim_rule_sort(struct kz_dispatcher_n_dimension_rule *rule)
 	if (res < 0)
 		return res;
 
+	if (rule->dims != NULL)
+		rule->dims->sorted = true;
+
+sort_zones:
 	res = dpt_ndim_rule_sort_zones(rule->num_src_zone, rule->src_zone);
 	if (res < 0)
 		return res;
@@ -423,61 +535,89 @@ dpt_ndim_rule_sort(struct kz_dispatcher_n_dimension_rule *rule)
 	return res;
 }
 
-static int
-dpt_ndim_sort(struct kz_dispatcher *dispatcher)
+struct dpt_ndim_sort_ctx {
+	struct kz_dispatcher_n_dimension_rule **rules;
+	int res;
+};
+
+static void
+dpt_ndim_sort_rules(void *_ctx, unsigned int first, unsigned int last)
 {
+	struct dpt_ndim_sort_ctx *ctx = _ctx;
 	unsigned int i;
 	int res;
 
-	kz_debug("sorting dispatcher; name='%s'\n", dispatcher->name);
-
-	for (i = 0; i < dispatcher->num_rule; i++) {
-		res = dpt_ndim_rule_sort(&dispatcher->rule[i]);
-		if (res < 0)
-			return res;
+	for (i = first; i < last; i++) {
+		res = dpt_ndim_rule_sort(ctx->rules[i]);
+		if (res < 0) {
+			ctx->res = res;
+			return;
+		}
 	}
-
-	return 0;
 }
 
 /***********************************************************
  * Dispatcher lookup
  ***********************************************************/
 
-void
-kz_head_dispatcher_init(struct kz_head_d *h)
-{
-	h->lookup_data = NULL;
-}
-EXPORT_SYMBOL_GPL(kz_head_dispatcher_init);
-
 int
 kz_head_dispatcher_build(struct kz_head_d *h)
 {
 	struct kz_dispatcher *i;
-	int res = 0;
+	struct dpt_ndim_sort_ctx ctx = { .res = 0 };
+	enum KZ_ALLOC_TYPE rules_allocator;
+	unsigned int num_rule = 0, rule_idx, index = 0;
+	int res;
 
-	list_for_each_entry(i, &h->head, list) {
-		/* n-dim dispatchers do not have a complex
-		 * lookup data structure yet, but we still
-		 * have to do some preparation for the lookup
-		 * here:
-		 *
-		 *  - port range lists should be sorted by on the 'from' entry
-		 *  - subnet lists should be sorted by the subnet size
-		 *  - zone lists should be sorted by the zone depth
-		 */
-		res = dpt_ndim_sort(i);
-		if (res < 0)
-			goto cleanup;
-	}
+	/* n-dim dispatchers do not have a complex
+	 * lookup data structure yet, but we still
+	 * have to do some preparation for the lookup
+	 * here:
+	 *
+	 *  - port range lists should be sorted by on the 'from' entry
+	 *  - subnet lists should be sorted by the subnet size
+	 *  - zone lists should be sorted by the zone depth
+	 *
+	 * dispatchers carried over from the previous config
+	 * are sorted already, the rules of the others are
+	 * independent of each other, so they are sorted in
+	 * parallel. Only the lookup data of the dispatchers
+	 * not sharing it with the previous config is generated.
+	 */
+	list_for_each_entry(i, &h->head, list)
+		if (!i->rules_sorted)
+			num_rule += i->num_rule;
+
+	if (num_rule > 0) {
+		ctx.rules = kz_big_alloc(num_rule * sizeof(*ctx.rules), &rules_allocator);
+		if (ctx.rules == NULL)
+			return -ENOMEM;
+
+		num_rule = 0;
+		list_for_each_entry(i, &h->head, list) {
+			if (i->rules_sorted)
+				continue;
+			kz_debug("sorting dispatcher; name='%s'\n", i->name);
+			for (rule_idx = 0; rule_idx < i->num_rule; rule_idx++)
+				ctx.rules[num_rule++] = &i->rule[rule_idx];
+		}
 
-	kz_generate_lookup_data(h);
+		kz_parallel_for(num_rule, dpt_ndim_sort_rules, &ctx);
 
-	return res;
+		kz_big_free(ctx.rules, rules_allocator);
 
-cleanup:
-	kz_debug("problem, cleaning up\n");
+		if (ctx.res < 0) {
+			kz_debug("problem, cleaning up\n");
+			return ctx.res;
+		}
+	}
+
+	list_for_each_entry(i, &h->head, list) {
+		i->rules_sorted = true;
+		i->index = index++;
+	}
+
+	res = kz_generate_lookup_data(h);
 
 	return res;
 }
@@ -486,11 +626,20 @@ EXPORT_SYMBOL_GPL(kz_head_dispatcher_build);
 void
 kz_head_dispatcher_destroy(struct kz_head_d *h)
 {
-	if (h->lookup_data != NULL)
-		kz_big_free(h->lookup_data, h->lookup_data_allocator);
+	struct kz_dispatcher *i;
+
+	list_for_each_entry(i, &h->head, list)
+		kz_dispatcher_drop_lookup(i);
 }
 EXPORT_SYMBOL_GPL(kz_head_dispatcher_destroy);
 
+void
+kz_dispatcher_lookup_destroy(struct kz_dispatcher_lookup *lookup)
+{
+	kz_big_free(lookup, lookup->allocator);
+}
+EXPORT_SYMBOL_GPL(kz_dispatcher_lookup_destroy);
+
 /***********************************************************
  * Helper functions for weighted zone checks
  ***********************************************************/
@@ -1068,7 +1217,7 @@ kz_generate_lookup_data_rule(const struct kz_dispatcher_n_dimension_rule * const
 	struct kz_rule_lookup_data *current_rule = buf;
 
 	pos += sizeof(struct kz_rule_lookup_data);
-	current_rule->orig = rule;
+	current_rule->rule_index = 0;
 
 	GENERATE_DIM(map, reqid);
 
@@ -1139,40 +1288,136 @@ kz_generate_lookup_data_rule(const struct kz_dispatcher_n_dimension_rule * const
 	return buf;
 }
 
-KZ_PROTECTED void
+/* a rule to generate lookup data for, by its position in the dispatcher */
+struct kz_generate_lookup_data_rule_ref {
+	struct kz_dispatcher *dispatcher;
+	unsigned int rule_index;
+};
+
+struct kz_generate_lookup_data_ctx {
+	struct kz_generate_lookup_data_rule_ref *rules;
+	/* offset of each rule in the lookup data of its dispatcher, sizes before the prefix sum */
+	size_t *offset;
+};
+
+static void
+kz_generate_lookup_data_sizes(void *_ctx, unsigned int first, unsigned int last)
+{
+	struct kz_generate_lookup_data_ctx *ctx = _ctx;
+	unsigned int i;
+
+	for (i = first; i < last; i++) {
+		const struct kz_generate_lookup_data_rule_ref *ref = &ctx->rules[i];
+
+		ctx->offset[i] = kz_generate_lookup_data_rule_size(&ref->dispatcher->rule[ref->rule_index]);
+	}
+}
+
+static void
+kz_generate_lookup_data_fill(void *_ctx, unsigned int first, unsigned int last)
+{
+	struct kz_generate_lookup_data_ctx *ctx = _ctx;
+	unsigned int i;
+
+	for (i = first; i < last; i++) {
+		const struct kz_generate_lookup_data_rule_ref *ref = &ctx->rules[i];
+		struct kz_rule_lookup_data *rule;
+
+		rule = kz_generate_lookup_data_rule(&ref->dispatcher->rule[ref->rule_index],
+						    (void *) ref->dispatcher->lookup->data + ctx->offset[i]);
+		rule->rule_index = ref->rule_index;
+	}
+}
+
+/* generates the lookup data of the dispatchers that do not have one */
+KZ_PROTECTED int
 kz_generate_lookup_data(struct kz_head_d *dispatchers)
 {
 	struct kz_dispatcher *dispatcher;
-	struct kz_rule_lookup_data *lookup_data, *current_rule, *prev_rule = NULL;
-	void *pos;
-	u_int32_t rules_data_size = 0;
+	struct kz_generate_lookup_data_ctx ctx;
+	struct kz_rule_lookup_data *last_rule;
+	enum KZ_ALLOC_TYPE rules_allocator, offset_allocator;
+	unsigned int num_rule = 0, first, rule_idx;
+	size_t rules_data_size, size;
+	int res = -ENOMEM;
+
+	list_for_each_entry(dispatcher, &dispatchers->head, list)
+		if (dispatcher->lookup == NULL)
+			num_rule += dispatcher->num_rule;
+
+	if (num_rule == 0)
+		return 0;
+
+	ctx.rules = kz_big_alloc(num_rule * sizeof(*ctx.rules), &rules_allocator);
+	if (ctx.rules == NULL)
+		return -ENOMEM;
+
+	ctx.offset = kz_big_alloc(num_rule * sizeof(*ctx.offset), &offset_allocator);
+	if (ctx.offset == NULL)
+		goto free_rules;
+
+	num_rule = 0;
+	list_for_each_entry(dispatcher, &dispatchers->head, list) {
+		if (dispatcher->lookup != NULL)
+			continue;
 
-	/* First pass calculates total size */
-        list_for_each_entry(dispatcher, &dispatchers->head, list) {
-		unsigned int rule_idx;
 		for (rule_idx = 0; rule_idx < dispatcher->num_rule; rule_idx++) {
-			rules_data_size += kz_generate_lookup_data_rule_size(&dispatcher->rule[rule_idx]);
+			ctx.rules[num_rule].dispatcher = dispatcher;
+			ctx.rules[num_rule].rule_index = rule_idx;
+			num_rule++;
 		}
 	}
 
-	if (rules_data_size > 0) {
-		pos = current_rule = lookup_data = kz_big_alloc(rules_data_size, &dispatchers->lookup_data_allocator);
+	/* the size of each rule is independent of the others, the
+	 * prefix sum of the sizes gives the position of the rules,
+	 * after which the rules can be generated independently as well */
+	kz_parallel_for(num_rule, kz_generate_lookup_data_sizes, &ctx);
 
-		/* Second pass builds up the lookup data */
-		list_for_each_entry(dispatcher, &dispatchers->head, list) {
-			unsigned int rule_idx;
-			for (rule_idx = 0; rule_idx < dispatcher->num_rule; rule_idx++) {
-				prev_rule = current_rule;
-				current_rule = kz_generate_lookup_data_rule(&dispatcher->rule[rule_idx], pos);
-				pos += current_rule->bytes_to_next;
-			}
+	for (first = 0; first < num_rule; first += dispatcher->num_rule) {
+		struct kz_dispatcher_lookup *lookup;
+		enum KZ_ALLOC_TYPE allocator;
+
+		dispatcher = ctx.rules[first].dispatcher;
+
+		rules_data_size = 0;
+		for (rule_idx = first; rule_idx < first + dispatcher->num_rule; rule_idx++) {
+			size = ctx.offset[rule_idx];
+			ctx.offset[rule_idx] = rules_data_size;
+			rules_data_size += size;
 		}
 
-		if (current_rule)
-			current_rule->bytes_to_next = 0;
+		lookup = kz_big_alloc(sizeof(*lookup) + rules_data_size, &allocator);
+		if (lookup == NULL)
+			goto free_lookup;
 
-		dispatchers->lookup_data = lookup_data;
+		atomic_set(&lookup->refcnt, 1);
+		lookup->allocator = allocator;
+		dispatcher->lookup = lookup;
 	}
+
+	kz_parallel_for(num_rule, kz_generate_lookup_data_fill, &ctx);
+
+	for (first = 0; first < num_rule; first += dispatcher->num_rule) {
+		dispatcher = ctx.rules[first].dispatcher;
+		last_rule = (void *) dispatcher->lookup->data + ctx.offset[first + dispatcher->num_rule - 1];
+		last_rule->bytes_to_next = 0;
+	}
+
+	res = 0;
+	goto free_offset;
+
+free_lookup:
+	/* drop the lookup data allocated so far, the others still have none */
+	for (rule_idx = 0; rule_idx < first; rule_idx += dispatcher->num_rule) {
+		dispatcher = ctx.rules[rule_idx].dispatcher;
+		kz_dispatcher_drop_lookup(dispatcher);
+	}
+free_offset:
+	kz_big_free(ctx.offset, offset_allocator);
+free_rules:
+	kz_big_free(ctx.rules, rules_allocator);
+
+	return res;
 }
 
 #define RULE_LOOKUP_GET_TYPE(dimension_name, out_num, out_data) \
@@ -1320,6 +1565,7 @@ kz_ndim_eval(const struct kz_reqids *reqids, const struct net_device *iface, u_i
 	kz_ndim_score best;
 	const size_t max_out_idx = lenv->max_result_size;
 	size_t out_idx = 0;
+	const struct kz_dispatcher *dispatcher;
 	struct kz_rule_lookup_cursor cursor;
 	struct kz_rule_lookup_data *rule;
 
@@ -1342,36 +1588,42 @@ kz_ndim_eval(const struct kz_reqids *reqids, const struct net_device *iface, u_i
 
 	best.all = 0;
 
-	cursor.rule = dispatchers->lookup_data;
-	cursor.pos = sizeof(struct kz_rule_lookup_data);
-	rule = dispatchers->lookup_data;
-
-	while (rule) {
-		int64_t score;
-		prefetch(rule->bytes_to_next + (void*)rule);
-		score = kz_ndim_eval_rule(&cursor, best.all, reqids, iface,
-					  l3proto, src_addr, dst_addr,
-					  l4proto, src_port, dst_port,
-					  src_zone, dst_zone,
-					  lenv->src_mask, lenv->dst_mask);
-
-		if (score == -1 || best.all > score) {
-			/* no match or worse than the current best */
-			rule = kz_rule_lookup_cursor_next_rule(&cursor);
+	list_for_each_entry(dispatcher, &dispatchers->head, list) {
+		if (dispatcher->lookup == NULL)
 			continue;
-		} else if (best.all < score) {
-			/* better match, so reset result list */
-			kz_debug("reset result list\n");
-			out_idx = 0;
-			best.all = score;
-		}
-		if (out_idx < max_out_idx) {
-			kz_debug("appending rule to result list; id='%u', score='%llu'\n", rule->orig->id, score);
-			lenv->result_rules[out_idx] = rule->orig;
-		}
-		rule = kz_rule_lookup_cursor_next_rule(&cursor);
 
-		out_idx++;
+		cursor.rule = (struct kz_rule_lookup_data *) dispatcher->lookup->data;
+		cursor.pos = sizeof(struct kz_rule_lookup_data);
+		rule = cursor.rule;
+
+		while (rule) {
+			int64_t score;
+			prefetch(rule->bytes_to_next + (void*)rule);
+			score = kz_ndim_eval_rule(&cursor, best.all, reqids, iface,
+						  l3proto, src_addr, dst_addr,
+						  l4proto, src_port, dst_port,
+						  src_zone, dst_zone,
+						  lenv->src_mask, lenv->dst_mask);
+
+			if (score == -1 || best.all > score) {
+				/* no match or worse than the current best */
+				rule = kz_rule_lookup_cursor_next_rule(&cursor);
+				continue;
+			} else if (best.all < score) {
+				/* better match, so reset result list */
+				kz_debug("reset result list\n");
+				out_idx = 0;
+				best.all = score;
+			}
+			if (out_idx < max_out_idx) {
+				kz_debug("appending rule to result list; id='%u', score='%llu'\n",
+					 dispatcher->rule[rule->rule_index].id, score);
+				lenv->result_rules[out_idx] = &dispatcher->rule[rule->rule_index];
+			}
+			rule = kz_rule_lookup_cursor_next_rule(&cursor);
+
+			out_idx++;
+		}
 	}
 
 	/* clean up helpers */
@@ -1384,7 +1636,7 @@ kz_ndim_eval(const struct kz_reqids *reqids, const struct net_device *iface, u_i
 }
 
 /**
- * kz_ndim_lookup -- look up service for a session by evaluating n-dimensional rules
+ * kz_ndim_lookup -- look up the rule for a session by evaluating n-dimensional rules
  * @iface: input interface
  * @l3proto: L3 protocol number (IPv4/IPv6)
  * @src_addr: source address
@@ -1394,13 +1646,13 @@ kz_ndim_eval(const struct kz_reqids *reqids, const struct net_device *iface, u_i
  * @dst_port: destination TCP/UDP port (if meaningful for @proto)
  * @src_zone: the zone @src_addr belongs to
  * @dst_zone: the zone @dst_addr belongs to
- * @dispatcher: pointer to a kz_dispatcher pointer to return the dispatcher in (OUTPUT)
  *
  * Evaluate our n-dimensional rules in all dispatchers and return the
- * resulting service as a result. If no matching rule was found or
- * there were more than one matching rule, we return NULL.
+ * matching rule, which refers to the dispatcher and the service. If no
+ * matching rule was found or there were more than one matching rule, we
+ * return NULL.
  */
-static struct kz_service *
+static const struct kz_dispatcher_n_dimension_rule *
 kz_ndim_lookup(const struct kz_config *cfg,
 	       const struct kz_reqids *reqids,
 	       const struct net_device *iface,
@@ -1408,20 +1660,18 @@ kz_ndim_lookup(const struct kz_config *cfg,
 	       const union nf_inet_addr * const src_addr, const union nf_inet_addr * const dst_addr,
 	       u_int8_t l4proto, u_int16_t src_port, u_int16_t dst_port,
 	       const struct kz_zone * src_zone,
-	       const struct kz_zone * dst_zone,
-	       struct kz_dispatcher **dispatcher)
+	       const struct kz_zone * dst_zone)
 {
 	struct kz_percpu_env *lenv;
 	const struct kz_head_d * const d = &cfg->dispatchers;
-	struct kz_service *service = NULL;
+	const struct kz_dispatcher_n_dimension_rule *rule = NULL;
 	u_int32_t num_results;
 
 	kz_debug("src_zone='%s', dst_zone='%s'\n",
 		 src_zone ? src_zone->unique_name : kz_log_null,
 		 dst_zone ? dst_zone->unique_name : kz_log_null);
 
-	preempt_disable();
-	lenv = __get_cpu_var(kz_percpu);
+	lenv = kz_lookup_env_get();
 
 	num_results = kz_ndim_eval(reqids, iface, l3proto, src_addr, dst_addr,
 				    l4proto, src_port, dst_port, src_zone, dst_zone,
@@ -1430,20 +1680,19 @@ kz_ndim_lookup(const struct kz_config *cfg,
 	kz_debug("num_results='%u'\n", num_results);
 
 	if (num_results == 1) {
-		service = lenv->result_rules[0]->service;
-		*dispatcher = lenv->result_rules[0]->dispatcher;
+		rule = lenv->result_rules[0];
 
 		kz_debug("found service; dispatcher='%s', rule_id='%u', name='%s'\n",
-			 lenv->result_rules[0]->dispatcher->name,
-			 lenv->result_rules[0]->id,
-			 service ? service->name : kz_log_null);
+			 rule->dispatcher->name,
+			 rule->id,
+			 rule->service ? rule->service->name : kz_log_null);
 	}
 
-	preempt_enable();
+	kz_lookup_env_put();
 
-	kz_debug("service='%s'\n", service ? service->name : "null");
+	kz_debug("service='%s'\n", rule && rule->service ? rule->service->name : "null");
 
-	return service;
+	return rule;
 }
 
 /***********************************************************
@@ -1766,6 +2015,7 @@ kz_head_zone_ipv6_lookup(const struct kz_head_z *h, const struct in6_addr * cons
 
 	return node->zone;
 }
+EXPORT_SYMBOL_GPL(kz_head_zone_ipv6_lookup);
 
 /***********************************************************
  * Generic zones
@@ -1889,6 +2139,8 @@ static void
 bind_lookup_destroy(struct kz_bind_lookup *bind_lookup)
 {
 	struct kz_bind *pos_bind, *n_bind;
+	enum kz_bind_l3proto l3proto;
+	enum kz_bind_l4proto l4proto;
 
 	list_for_each_entry_safe(pos_bind, n_bind, &bind_lookup->list_bind, list) {
 		list_del(&pos_bind->list);
@@ -1898,6 +2150,11 @@ bind_lookup_destroy(struct kz_bind_lookup *bind_lookup)
 	if (bind_lookup->binds)
 		kfree(bind_lookup->binds);
 
+	for (l3proto = KZ_BIND_L3PROTO_IPV4; l3proto < KZ_BIND_L3PROTO_COUNT; l3proto++)
+		for (l4proto = KZ_BIND_L4PROTO_TCP; l4proto < KZ_BIND_L4PROTO_COUNT; l4proto++)
+			if (bind_lookup->maglev[l3proto][l4proto])
+				kfree(bind_lookup->maglev[l3proto][l4proto]);
+
 	kfree(bind_lookup);
 }
 
@@ -1945,6 +2202,100 @@ bind_lookup_get_l4proto(const u8 l4proto)
 	BUG();
 }
 
+/*
+ * Binds of an (l3proto, l4proto) class are selected with Maglev
+ * consistent hashing. Each bind owns entries of a lookup table in
+ * proportion to its weight, and a connection goes to the owner of the
+ * entry its hash points at. The order in which a bind claims entries is
+ * a permutation derived from the address, port and protocol of the bind
+ * only, so a rebuild after binds come and go moves roughly 1/N of the
+ * connections instead of nearly all of them.
+ */
+
+#define KZ_BIND_MAGLEV_EMPTY 0xffff
+
+struct bind_lookup_maglev_perm {
+	unsigned int offset;
+	unsigned int skip;
+	unsigned int next;
+};
+
+static void
+bind_lookup_maglev_perm_init(const struct kz_bind const *bind, struct bind_lookup_maglev_perm *perm)
+{
+	u32 hash;
+
+	hash = jhash2((const u32 *) bind->addr.all, ARRAY_SIZE(bind->addr.all), kz_bind_hash_seed);
+	hash = jhash_3words(hash, bind->port, bind->proto, kz_bind_hash_seed);
+
+	perm->offset = hash & (KZ_BIND_MAGLEV_SIZE - 1);
+	/* the table size is a power of two, any odd skip visits every entry */
+	perm->skip = (jhash_1word(hash, kz_bind_hash_seed) & (KZ_BIND_MAGLEV_SIZE - 1)) | 1;
+	perm->next = 0;
+}
+
+/* fills the table of KZ_BIND_MAGLEV_SIZE entries with indexes into binds */
+KZ_PROTECTED int
+kz_bind_lookup_maglev_fill(u16 *table, const struct kz_bind const **binds, unsigned int bind_num)
+{
+	struct bind_lookup_maglev_perm *perms;
+	enum KZ_ALLOC_TYPE perms_allocator;
+	unsigned int filled = 0;
+	unsigned int i, w;
+
+	if (bind_num == 0 || bind_num > KZ_BIND_MAGLEV_SIZE)
+		return -EINVAL;
+
+	perms = kz_big_alloc(bind_num * sizeof(*perms), &perms_allocator);
+	if (perms == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < KZ_BIND_MAGLEV_SIZE; i++)
+		table[i] = KZ_BIND_MAGLEV_EMPTY;
+
+	for (i = 0; i < bind_num; i++)
+		bind_lookup_maglev_perm_init(binds[i], &perms[i]);
+
+	/* binds take turns claiming their next preferred free entries, as many as their weight */
+	while (filled < KZ_BIND_MAGLEV_SIZE) {
+		for (i = 0; i < bind_num && filled < KZ_BIND_MAGLEV_SIZE; i++) {
+			for (w = 0; w < max(binds[i]->weight, 1U) && filled < KZ_BIND_MAGLEV_SIZE; w++) {
+				struct bind_lookup_maglev_perm *perm = &perms[i];
+				unsigned int entry;
+
+				do {
+					entry = (perm->offset + perm->next * perm->skip) & (KZ_BIND_MAGLEV_SIZE - 1);
+					perm->next++;
+				} while (table[entry] != KZ_BIND_MAGLEV_EMPTY);
+
+				table[entry] = i;
+				filled++;
+			}
+		}
+	}
+
+	kz_big_free(perms, perms_allocator);
+
+	return 0;
+}
+
+static u16 *
+bind_lookup_maglev_build(const struct kz_bind const **binds, unsigned int bind_num)
+{
+	u16 *table;
+
+	table = kmalloc(KZ_BIND_MAGLEV_SIZE * sizeof(*table), GFP_KERNEL);
+	if (table == NULL)
+		return NULL;
+
+	if (kz_bind_lookup_maglev_fill(table, binds, bind_num) < 0) {
+		kfree(table);
+		return NULL;
+	}
+
+	return table;
+}
+
 static void
 bind_lookup_build(struct kz_bind_lookup *bind_lookup)
 {
@@ -1981,6 +2332,18 @@ bind_lookup_build(struct kz_bind_lookup *bind_lookup)
 
 		bind_lookup->binds_by_type[l3proto][l4proto][filled_bind_nums[l3proto][l4proto]++] = bind;
 	}
+
+	for (l3proto = KZ_BIND_L3PROTO_IPV4; l3proto < KZ_BIND_L3PROTO_COUNT; l3proto++) {
+		for (l4proto = KZ_BIND_L4PROTO_TCP; l4proto < KZ_BIND_L4PROTO_COUNT; l4proto++) {
+			if (bind_lookup->bind_nums[l3proto][l4proto] == 0)
+				continue;
+
+			/* falls back to modulo selection if NULL */
+			bind_lookup->maglev[l3proto][l4proto] =
+				bind_lookup_maglev_build(bind_lookup->binds_by_type[l3proto][l4proto],
+							 bind_lookup->bind_nums[l3proto][l4proto]);
+		}
+	}
 }
 
 static void
@@ -2031,6 +2394,7 @@ kz_instance_remove_bind(struct kz_instance *instance, const netlink_port_t pid_t
 			if (io->type == KZNL_OP_BIND) {
 				new_bind = (struct kz_bind *) (io->data);
 				list_del(&io->list);
+				hlist_del(&io->hlist);
 				list_add(&new_bind->list, &bind_lookup->list_bind);
 				kz_bind_debug(new_bind, "bind from transaction added");
 			}
@@ -2043,50 +2407,57 @@ EXPORT_SYMBOL_GPL(kz_instance_remove_bind);
 
 /* Bind lookup */
 
-static inline unsigned int
-bind_lookup_hash_v4(__be32 saddr, __be16 sport, __be32 daddr, __be16 dport)
-{
-	/* FIXME: seed */
-	return jhash_3words(saddr, daddr, (sport << 16) + dport, 0);
-}
-
-const struct kz_bind * const
-kz_instance_bind_lookup_v4(const struct kz_instance const *instance, u8 l4proto,
-			__be32 saddr, __be16 sport,
-			__be32 daddr, __be16 dport)
+static inline const struct kz_bind *
+bind_lookup_select(const struct kz_bind_lookup *bind_lookup,
+		   enum kz_bind_l3proto l3proto, enum kz_bind_l4proto l4proto, u32 hash)
 {
 	unsigned int bind_num;
 	unsigned int lookup_bind_num;
-	enum kz_bind_l4proto bind_l4proto = bind_lookup_get_l4proto(l4proto);
 	const struct kz_bind const *bind;
 
-	kz_debug("lookup bind; l4proto='%d', saddr='%pI4', sport='%d', daddr='%pI4', dport='%d'\n", l4proto, &saddr, htons(sport), &daddr, htons(dport));
-
-	bind_num = instance->bind_lookup->bind_nums[KZ_BIND_L3PROTO_IPV4][bind_l4proto];
+	bind_num = bind_lookup->bind_nums[l3proto][l4proto];
 	if (bind_num == 0) {
 		kz_debug("no potential bind found;\n");
 		return NULL;
 	}
 
-	lookup_bind_num = bind_lookup_hash_v4(saddr, sport, daddr, dport) % bind_num;
+	if (likely(bind_lookup->maglev[l3proto][l4proto] != NULL))
+		lookup_bind_num = bind_lookup->maglev[l3proto][l4proto][hash & (KZ_BIND_MAGLEV_SIZE - 1)];
+	else
+		lookup_bind_num = hash % bind_num;
 	kz_debug("potential bind found; bind_num='%d', selected_bind_num='%d'\n", bind_num, lookup_bind_num);
 
-	bind = instance->bind_lookup->binds_by_type[KZ_BIND_L3PROTO_IPV4][bind_l4proto][lookup_bind_num];
+	bind = bind_lookup->binds_by_type[l3proto][l4proto][lookup_bind_num];
 
 	kz_bind_debug(bind, "bind found");
 
 	return bind;
+}
 
+static inline u32
+bind_lookup_hash_v4(__be32 saddr, __be16 sport, __be32 daddr, __be16 dport)
+{
+	return jhash_3words(saddr, daddr, (sport << 16) + dport, kz_bind_hash_seed);
+}
+
+const struct kz_bind * const
+kz_instance_bind_lookup_v4(const struct kz_instance const *instance, u8 l4proto,
+			__be32 saddr, __be16 sport,
+			__be32 daddr, __be16 dport)
+{
+	kz_debug("lookup bind; l4proto='%d', saddr='%pI4', sport='%d', daddr='%pI4', dport='%d'\n", l4proto, &saddr, htons(sport), &daddr, htons(dport));
+
+	return bind_lookup_select(instance->bind_lookup, KZ_BIND_L3PROTO_IPV4, bind_lookup_get_l4proto(l4proto),
+				  bind_lookup_hash_v4(saddr, sport, daddr, dport));
 }
 EXPORT_SYMBOL(kz_instance_bind_lookup_v4);
 
-static inline unsigned int
+static inline u32
 bind_lookup_hash_v6(const struct in6_addr const *saddr, __be16 sport, const struct in6_addr const *daddr, __be16 dport)
 {
-	/* FIXME: seed */
-	return jhash_3words(jhash2(saddr->s6_addr32, ARRAY_SIZE(saddr->s6_addr32), 0),
-			    jhash2(daddr->s6_addr32, ARRAY_SIZE(daddr->s6_addr32), 0),
-			    (sport << 16) + dport, 0);
+	return jhash_3words(jhash2(saddr->s6_addr32, ARRAY_SIZE(saddr->s6_addr32), kz_bind_hash_seed),
+			    jhash2(daddr->s6_addr32, ARRAY_SIZE(daddr->s6_addr32), kz_bind_hash_seed),
+			    (sport << 16) + dport, kz_bind_hash_seed);
 }
 
 const struct kz_bind * const
@@ -2094,27 +2465,10 @@ kz_instance_bind_lookup_v6(const struct kz_instance const *instance, u8 l4proto,
 			   const struct in6_addr const *saddr, __be16 sport,
 			   const struct in6_addr const *daddr, __be16 dport)
 {
-	unsigned int bind_num;
-	unsigned int lookup_bind_num;
-	enum kz_bind_l4proto bind_l4proto = bind_lookup_get_l4proto(l4proto);
-	const struct kz_bind const *bind;
-
 	kz_debug("lookup bind; l4proto='%d', saddr='%pI6', sport='%d', daddr='%pI6', dport='%d'\n", l4proto, saddr, htons(sport), daddr, htons(dport));
 
-	bind_num = instance->bind_lookup->bind_nums[KZ_BIND_L3PROTO_IPV6][bind_l4proto];
-	if (bind_num == 0) {
-		kz_debug("no potential bind found;\n");
-		return NULL;
-	}
-
-	lookup_bind_num = bind_lookup_hash_v6(saddr, sport, daddr, dport) % bind_num;
-	kz_debug("potential bind found; bind_num='%d', selected_bind_num='%d'\n", bind_num, lookup_bind_num);
-
-	bind = instance->bind_lookup->binds_by_type[KZ_BIND_L3PROTO_IPV6][bind_l4proto][lookup_bind_num];
-
-	kz_bind_debug(bind, "bind found");
-
-	return bind;
+	return bind_lookup_select(instance->bind_lookup, KZ_BIND_L3PROTO_IPV6, bind_lookup_get_l4proto(l4proto),
+				  bind_lookup_hash_v6(saddr, sport, daddr, dport));
 }
 EXPORT_SYMBOL_GPL(kz_instance_bind_lookup_v6);
 
@@ -2155,18 +2509,412 @@ nat_in_range(const struct nf_nat_range *r,
 	return 1;
 }
 
+/* source address range of a NAT entry in host byte order, returns false if it is empty */
+static bool
+nat_entry_src_range(const struct kz_service_nat_entry *entry, u32 *from, u32 *to)
+{
+	*from = 0;
+	*to = 0xffffffffU;
+
+	if (entry->src.flags & IP_NAT_RANGE_MAP_IPS) {
+		if (entry->src.min_ip)
+			*from = ntohl(entry->src.min_ip);
+		if (entry->src.max_ip)
+			*to = ntohl(entry->src.max_ip);
+	}
+
+	return *from <= *to;
+}
+
+static int
+nat_index_bound_cmp(const void *_a, const void *_b)
+{
+	const u32 a = *(const u32 *) _a;
+	const u32 b = *(const u32 *) _b;
+
+	if (a < b)
+		return -1;
+	return a > b;
+}
+
+/* returns the segment containing addr, the first segment starts at 0 */
+static inline unsigned int
+nat_index_segment(const u32 *segment_start, unsigned int segment_num, u32 addr)
+{
+	unsigned int lo = 0, hi = segment_num;
+
+	while (hi - lo > 1) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+
+		if (segment_start[mid] <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* average number of segments a NAT entry may be copied into */
+#define KZ_NAT_INDEX_CANDIDATES_PER_ENTRY 16
+
+static int
+nat_index_build(const struct list_head * const head, struct kz_service_nat_index **p_index)
+{
+	const struct kz_service_nat_entry *i;
+	struct kz_service_nat_index *index;
+	enum KZ_ALLOC_TYPE bounds_allocator, count_allocator, index_allocator;
+	unsigned int entry_num = 0, bound_num = 0, segment_num, range_num = 0;
+	u64 candidate_num = 0;
+	unsigned int *count;
+	u32 *bounds;
+	u32 from, to;
+	unsigned int k, first, last;
+	size_t segment_size, offset_size;
+	int res = -ENOMEM;
+
+	*p_index = NULL;
+
+	list_for_each_entry(i, head, list)
+		entry_num++;
+
+	if (entry_num == 0)
+		return 0;
+
+	/* segment boundaries: 0, the first address of each range and the one after it */
+	bounds = kz_big_alloc((2 * entry_num + 1) * sizeof(*bounds), &bounds_allocator);
+	if (bounds == NULL)
+		return -ENOMEM;
+
+	bounds[bound_num++] = 0;
+	list_for_each_entry(i, head, list) {
+		if (!nat_entry_src_range(i, &from, &to))
+			continue;
+		bounds[bound_num++] = from;
+		if (to != 0xffffffffU)
+			bounds[bound_num++] = to + 1;
+	}
+
+	sort(bounds, bound_num, sizeof(*bounds), nat_index_bound_cmp, NULL);
+
+	segment_num = 1;
+	for (k = 1; k < bound_num; k++)
+		if (bounds[k] != bounds[segment_num - 1])
+			bounds[segment_num++] = bounds[k];
+
+	/* count the candidates of each segment: the ranges are added to a
+	 * difference array first, so that counting does not depend on the
+	 * number of segments a range covers */
+	count = kz_big_alloc((segment_num + 1) * sizeof(*count), &count_allocator);
+	if (count == NULL)
+		goto free_bounds;
+	memset(count, 0, (segment_num + 1) * sizeof(*count));
+
+	list_for_each_entry(i, head, list) {
+		if (!nat_entry_src_range(i, &from, &to))
+			continue;
+		first = nat_index_segment(bounds, segment_num, from);
+		last = nat_index_segment(bounds, segment_num, to);
+		count[first]++;
+		count[last + 1]--;
+		candidate_num += last - first + 1;
+		range_num++;
+	}
+
+	for (k = 1; k < segment_num; k++)
+		count[k] += count[k - 1];
+
+	/* many wide overlapping ranges would copy most entries into most
+	 * segments; above the limit a single segment holds every entry, and
+	 * the lookup is the linear scan of the list */
+	if (candidate_num > (u64) KZ_NAT_INDEX_CANDIDATES_PER_ENTRY * entry_num) {
+		kz_debug("NAT index too large, using a single segment; entries='%u', segments='%u', candidates='%llu'\n",
+			 entry_num, segment_num, (unsigned long long) candidate_num);
+		segment_num = 1;
+		count[0] = range_num;
+		candidate_num = range_num;
+	}
+
+	segment_size = ALIGN(segment_num * sizeof(*index->segment_start), sizeof(void *));
+	offset_size = ALIGN((segment_num + 1) * sizeof(*index->candidate_offset), sizeof(void *));
+	index = kz_big_alloc(sizeof(*index) + segment_size + offset_size +
+			     candidate_num * sizeof(*index->candidate),
+			     &index_allocator);
+	if (index == NULL)
+		goto free_count;
+
+	index->allocator = index_allocator;
+	index->segment_num = segment_num;
+	index->segment_start = (u32 *) (index + 1);
+	index->candidate_offset = (unsigned int *) ((char *) index->segment_start + segment_size);
+	index->candidate = (const struct kz_service_nat_entry **) ((char *) index->candidate_offset + offset_size);
+
+	memcpy(index->segment_start, bounds, segment_num * sizeof(*bounds));
+
+	/* turn the counts into fill positions; the entries are visited
+	 * in list order, so the candidates of a segment keep it */
+	index->candidate_offset[0] = 0;
+	for (k = 0; k < segment_num; k++) {
+		index->candidate_offset[k + 1] = index->candidate_offset[k] + count[k];
+		count[k] = index->candidate_offset[k];
+	}
+
+	list_for_each_entry(i, head, list) {
+		if (!nat_entry_src_range(i, &from, &to))
+			continue;
+		first = nat_index_segment(bounds, segment_num, from);
+		last = nat_index_segment(bounds, segment_num, to);
+		for (k = first; k <= last; k++)
+			index->candidate[count[k]++] = i;
+	}
+
+	kz_debug("NAT index built; entries='%u', segments='%u', candidates='%llu'\n",
+		 entry_num, segment_num, (unsigned long long) candidate_num);
+
+	*p_index = index;
+	res = 0;
+
+free_count:
+	kz_big_free(count, count_allocator);
+free_bounds:
+	kz_big_free(bounds, bounds_allocator);
+
+	return res;
+}
+
+void
+kz_service_nat_index_destroy(struct kz_service_nat_index *index)
+{
+	if (index != NULL)
+		kz_big_free(index, index->allocator);
+}
+EXPORT_SYMBOL_GPL(kz_service_nat_index_destroy);
+
+/* source address range of an IPv6 NAT entry, returns false if it is empty */
+static bool
+nat6_entry_src_range(const struct kz_service_nat6_entry *entry, struct in6_addr *from, struct in6_addr *to)
+{
+	memset(from, 0, sizeof(*from));
+	memset(to, 0xff, sizeof(*to));
+
+	if (entry->src.flags & IP_NAT_RANGE_MAP_IPS) {
+		if (!ipv6_addr_any(&entry->src.min_ip))
+			*from = entry->src.min_ip;
+		if (!ipv6_addr_any(&entry->src.max_ip))
+			*to = entry->src.max_ip;
+	}
+
+	return ipv6_addr_cmp(from, to) <= 0;
+}
+
+/* steps addr to the next address, returns false if it wrapped around */
+static bool
+nat6_addr_next(struct in6_addr *addr)
+{
+	int k;
+
+	for (k = sizeof(addr->s6_addr) - 1; k >= 0; k--)
+		if (++addr->s6_addr[k] != 0)
+			return true;
+
+	return false;
+}
+
+static int
+nat6_index_bound_cmp(const void *a, const void *b)
+{
+	return ipv6_addr_cmp((const struct in6_addr *) a, (const struct in6_addr *) b);
+}
+
+static inline unsigned int
+nat6_index_segment(const struct in6_addr *segment_start, unsigned int segment_num,
+		   const struct in6_addr * const addr)
+{
+	unsigned int lo = 0, hi = segment_num;
+
+	while (hi - lo > 1) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+
+		if (ipv6_addr_cmp(&segment_start[mid], addr) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* same as nat_index_build(), with 128 bit segment boundaries */
+static int
+nat6_index_build(const struct list_head * const head, struct kz_service_nat6_index **p_index)
+{
+	const struct kz_service_nat6_entry *i;
+	struct kz_service_nat6_index *index;
+	enum KZ_ALLOC_TYPE bounds_allocator, count_allocator, index_allocator;
+	unsigned int entry_num = 0, bound_num = 0, segment_num, range_num = 0;
+	u64 candidate_num = 0;
+	unsigned int *count;
+	struct in6_addr *bounds;
+	struct in6_addr from, to;
+	unsigned int k, first, last;
+	size_t segment_size, offset_size;
+	int res = -ENOMEM;
+
+	*p_index = NULL;
+
+	list_for_each_entry(i, head, list)
+		entry_num++;
+
+	if (entry_num == 0)
+		return 0;
+
+	bounds = kz_big_alloc((2 * entry_num + 1) * sizeof(*bounds), &bounds_allocator);
+	if (bounds == NULL)
+		return -ENOMEM;
+
+	memset(&bounds[bound_num++], 0, sizeof(*bounds));
+	list_for_each_entry(i, head, list) {
+		if (!nat6_entry_src_range(i, &from, &to))
+			continue;
+		bounds[bound_num++] = from;
+		if (nat6_addr_next(&to))
+			bounds[bound_num++] = to;
+	}
+
+	sort(bounds, bound_num, sizeof(*bounds), nat6_index_bound_cmp, NULL);
+
+	segment_num = 1;
+	for (k = 1; k < bound_num; k++)
+		if (!ipv6_addr_equal(&bounds[k], &bounds[segment_num - 1]))
+			bounds[segment_num++] = bounds[k];
+
+	count = kz_big_alloc((segment_num + 1) * sizeof(*count), &count_allocator);
+	if (count == NULL)
+		goto free_bounds;
+	memset(count, 0, (segment_num + 1) * sizeof(*count));
+
+	list_for_each_entry(i, head, list) {
+		if (!nat6_entry_src_range(i, &from, &to))
+			continue;
+		first = nat6_index_segment(bounds, segment_num, &from);
+		last = nat6_index_segment(bounds, segment_num, &to);
+		count[first]++;
+		count[last + 1]--;
+		candidate_num += last - first + 1;
+		range_num++;
+	}
+
+	for (k = 1; k < segment_num; k++)
+		count[k] += count[k - 1];
+
+	if (candidate_num > (u64) KZ_NAT_INDEX_CANDIDATES_PER_ENTRY * entry_num) {
+		kz_debug("NAT6 index too large, using a single segment; entries='%u', segments='%u', candidates='%llu'\n",
+			 entry_num, segment_num, (unsigned long long) candidate_num);
+		segment_num = 1;
+		count[0] = range_num;
+		candidate_num = range_num;
+	}
+
+	segment_size = ALIGN(segment_num * sizeof(*index->segment_start), sizeof(void *));
+	offset_size = ALIGN((segment_num + 1) * sizeof(*index->candidate_offset), sizeof(void *));
+	index = kz_big_alloc(sizeof(*index) + segment_size + offset_size +
+			     candidate_num * sizeof(*index->candidate),
+			     &index_allocator);
+	if (index == NULL)
+		goto free_count;
+
+	index->allocator = index_allocator;
+	index->segment_num = segment_num;
+	index->segment_start = (struct in6_addr *) (index + 1);
+	index->candidate_offset = (unsigned int *) ((char *) index->segment_start + segment_size);
+	index->candidate = (const struct kz_service_nat6_entry **) ((char *) index->candidate_offset + offset_size);
+
+	memcpy(index->segment_start, bounds, segment_num * sizeof(*bounds));
+
+	index->candidate_offset[0] = 0;
+	for (k = 0; k < segment_num; k++) {
+		index->candidate_offset[k + 1] = index->candidate_offset[k] + count[k];
+		count[k] = index->candidate_offset[k];
+	}
+
+	list_for_each_entry(i, head, list) {
+		if (!nat6_entry_src_range(i, &from, &to))
+			continue;
+		first = nat6_index_segment(bounds, segment_num, &from);
+		last = nat6_index_segment(bounds, segment_num, &to);
+		for (k = first; k <= last; k++)
+			index->candidate[count[k]++] = i;
+	}
+
+	kz_debug("NAT6 index built; entries='%u', segments='%u', candidates='%llu'\n",
+		 entry_num, segment_num, (unsigned long long) candidate_num);
+
+	*p_index = index;
+	res = 0;
+
+free_count:
+	kz_big_free(count, count_allocator);
+free_bounds:
+	kz_big_free(bounds, bounds_allocator);
+
+	return res;
+}
+
+void
+kz_service_nat6_index_destroy(struct kz_service_nat6_index *index)
+{
+	if (index != NULL)
+		kz_big_free(index, index->allocator);
+}
+EXPORT_SYMBOL_GPL(kz_service_nat6_index_destroy);
+
+int
+kz_head_service_build(struct kz_head_s *h)
+{
+	struct kz_service *i;
+	int res;
+
+	list_for_each_entry(i, &h->head, list) {
+		if (i->type != KZ_SERVICE_FORWARD)
+			continue;
+
+		res = nat_index_build(&i->a.fwd.snat, &i->a.fwd.snat_index);
+		if (res < 0)
+			return res;
+		res = nat_index_build(&i->a.fwd.dnat, &i->a.fwd.dnat_index);
+		if (res < 0)
+			return res;
+		res = nat6_index_build(&i->a.fwd.snat6, &i->a.fwd.snat6_index);
+		if (res < 0)
+			return res;
+		res = nat6_index_build(&i->a.fwd.dnat6, &i->a.fwd.dnat6_index);
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(kz_head_service_build);
+
 const struct nf_nat_range *
-kz_service_nat_lookup(const struct list_head * const head,
+kz_service_nat_lookup(const struct kz_service_nat_index * const index,
 		      const __be32 saddr, const __be32 daddr,
 		      const __be16 sport, const __be16 dport,
-		  const u_int8_t proto)
+		      const u_int8_t proto)
 {
-	struct kz_service_nat_entry *i;
+	const struct kz_service_nat_entry *i;
+	unsigned int segment, c;
 
 	kz_debug("proto='%u', src='%pI4:%u', dst='%pI4:%u'\n",
 		 proto, &saddr, ntohs(sport), &daddr, ntohs(dport));
 
-	list_for_each_entry(i, head, list) {
+	if (index == NULL)
+		return NULL;
+
+	segment = nat_index_segment(index->segment_start, index->segment_num, ntohl(saddr));
+
+	for (c = index->candidate_offset[segment]; c < index->candidate_offset[segment + 1]; c++) {
+		i = index->candidate[c];
 		/* source range _must_ match, destination either matches or
 		 * the destination range is empty in the rule */
 		if (nat_in_range(&i->src, saddr, sport, proto) &&
@@ -2179,25 +2927,86 @@ kz_service_nat_lookup(const struct list_head * const head,
 }
 EXPORT_SYMBOL_GPL(kz_service_nat_lookup);
 
+static inline int
+nat6_in_range(const struct kz_nat6_range *r,
+	      const struct in6_addr * const addr, const __be16 port,
+	      const u_int8_t proto)
+{
+	kz_debug("comparing range; flags='%x', start_ip='%pI6', end_ip='%pI6', start_port='%u', end_port='%u'\n",
+		 r->flags, &r->min_ip, &r->max_ip, ntohs(r->min_port), ntohs(r->max_port));
+	kz_debug("with packet; proto='%d', ip='%pI6', port='%u'\n",
+		 proto, addr, ntohs(port));
+
+	if ((proto != IPPROTO_TCP) && (proto != IPPROTO_UDP))
+		return 0;
+
+	/* addresses in network byte order compare as big endian numbers */
+	if (r->flags & IP_NAT_RANGE_MAP_IPS) {
+		if ((!ipv6_addr_any(&r->min_ip) && ipv6_addr_cmp(addr, &r->min_ip) < 0) ||
+		    (!ipv6_addr_any(&r->max_ip) && ipv6_addr_cmp(addr, &r->max_ip) > 0))
+			return 0;
+	}
+
+	if (r->flags & IP_NAT_RANGE_PROTO_SPECIFIED) {
+		if ((r->min_port && ntohs(port) < ntohs(r->min_port)) ||
+		    (r->max_port && ntohs(port) > ntohs(r->max_port)))
+			return 0;
+	}
+
+	kz_debug("match\n");
+
+	return 1;
+}
+
+const struct kz_nat6_range *
+kz_service_nat6_lookup(const struct kz_service_nat6_index * const index,
+		       const struct in6_addr * const saddr,
+		       const struct in6_addr * const daddr,
+		       const __be16 sport, const __be16 dport,
+		       const u_int8_t proto)
+{
+	const struct kz_service_nat6_entry *i;
+	unsigned int segment, c;
+
+	kz_debug("proto='%u', src='%pI6:%u', dst='%pI6:%u'\n",
+		 proto, saddr, ntohs(sport), daddr, ntohs(dport));
+
+	if (index == NULL)
+		return NULL;
+
+	segment = nat6_index_segment(index->segment_start, index->segment_num, saddr);
+
+	for (c = index->candidate_offset[segment]; c < index->candidate_offset[segment + 1]; c++) {
+		i = index->candidate[c];
+		/* source range _must_ match, destination either matches or
+		 * the destination range is empty in the rule */
+		if (nat6_in_range(&i->src, saddr, sport, proto) &&
+		    ((ipv6_addr_any(&i->dst.min_ip) && ipv6_addr_any(&i->dst.max_ip)) ||
+		     nat6_in_range(&i->dst, daddr, dport, proto))) {
+			return &i->map;
+		}
+	}
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(kz_service_nat6_lookup);
+
 /***********************************************************
  * Session lookup
  ***********************************************************/
 
 /* NOTE: ports are passed, but legal only if protocol have them! */
 void
-kz_lookup_session(const struct kz_config *cfg,
-		  const struct kz_reqids *reqids,
-		  const struct net_device *in,
-		  u_int8_t l3proto,
-		  const union nf_inet_addr * const saddr, const union nf_inet_addr * const daddr,
-		  u_int8_t l4proto, u_int16_t sport, u_int16_t dport,
-		  struct kz_dispatcher **dispatcher,
-		  struct kz_zone **clientzone, struct kz_zone **serverzone,
-		  struct kz_service **service, int reply)
+kz_lookup_session_rule(const struct kz_config *cfg,
+		       const struct kz_reqids *reqids,
+		       const struct net_device *in,
+		       u_int8_t l3proto,
+		       const union nf_inet_addr * const saddr, const union nf_inet_addr * const daddr,
+		       u_int8_t l4proto, u_int16_t sport, u_int16_t dport,
+		       struct kz_zone **clientzone, struct kz_zone **serverzone,
+		       const struct kz_dispatcher_n_dimension_rule **rule, int reply)
 {
-	struct kz_dispatcher *dpt = NULL;
 	struct kz_zone *czone = NULL, *szone = NULL;
-	struct kz_service *svc = NULL;
 	const struct kz_head_z * const zones = &cfg->zones;
 
 	switch (l3proto) {
@@ -2237,11 +3046,30 @@ kz_lookup_session(const struct kz_config *cfg,
 	}
 
 	/* evaluate n-dimensional rules */
-	svc = kz_ndim_lookup(cfg, reqids, in, l3proto, saddr, daddr, l4proto, sport, dport, czone, szone, &dpt);
+	*rule = kz_ndim_lookup(cfg, reqids, in, l3proto, saddr, daddr, l4proto, sport, dport, czone, szone);
 
-	*dispatcher = dpt;
 	*clientzone = czone;
 	*serverzone = szone;
-	*service = svc;
+}
+EXPORT_SYMBOL_GPL(kz_lookup_session_rule);
+
+void
+kz_lookup_session(const struct kz_config *cfg,
+		  const struct kz_reqids *reqids,
+		  const struct net_device *in,
+		  u_int8_t l3proto,
+		  const union nf_inet_addr * const saddr, const union nf_inet_addr * const daddr,
+		  u_int8_t l4proto, u_int16_t sport, u_int16_t dport,
+		  struct kz_dispatcher **dispatcher,
+		  struct kz_zone **clientzone, struct kz_zone **serverzone,
+		  struct kz_service **service, int reply)
+{
+	const struct kz_dispatcher_n_dimension_rule *rule;
+
+	kz_lookup_session_rule(cfg, reqids, in, l3proto, saddr, daddr, l4proto, sport, dport,
+			       clientzone, serverzone, &rule, reply);
+
+	*dispatcher = rule != NULL ? rule->dispatcher : NULL;
+	*service = rule != NULL ? rule->service : NULL;
 }
 EXPORT_SYMBOL_GPL(kz_lookup_session);
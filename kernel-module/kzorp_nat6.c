@@ -0,0 +1,36 @@
+/*
+ * KZorp IPv6 NAT support
+ *
+ * Copyright (C) 2006-2010, BalaBit IT Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_nat.h>
+#include "include/kzorp_nat6.h"
+
+#ifdef KZ_NAT_IPV6
+unsigned int
+kz_nat6_setup_info(struct nf_conn *ct, const struct kz_nat6_range *r, unsigned int manip)
+{
+	struct nf_nat_range range;
+
+	memset(&range, 0, sizeof(range));
+	range.flags = r->flags;
+	range.min_addr.in6 = r->min_ip;
+	range.max_addr.in6 = r->max_ip;
+	range.min_proto.all = r->min_port;
+	range.max_proto.all = r->max_port;
+
+	return nf_nat_setup_info(ct, &range, manip);
+}
+EXPORT_SYMBOL_GPL(kz_nat6_setup_info);
+#endif /* KZ_NAT_IPV6 */
@@ -22,8 +22,11 @@
 #include <linux/netdevice.h>
 #include <linux/netfilter.h>
 #include <linux/proc_fs.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
 #include "include/kzorp_netlink.h"
 #include "include/kzorp.h"
+#include "include/kzorp_netlink_parse.h"
 
 #include <net/ipv6.h>
 #include <net/sock.h>
@@ -34,54 +37,56 @@
  * Transactions
  ***********************************************************/
 
-/* we have at most 1 transaction running at the same time */
-/* the config only changes through transaction; when we start one,
-   we can store pointer to the config and assume it stable till closed
+/* open transactions, there is at most one for each instance and for each peer
 
-   if that changes, refcount or rcu lock must be applied to kz_transaction->cfg !
+   the config only changes through transactions, all of them running under
+   the transaction mutex; tr->cfg of the open transactions is updated on
+   each commit, so it is stable while the mutex is held
 
+   if that changes, refcount or rcu lock must be applied to kz_transaction->cfg !
 */
-static struct kz_transaction transaction;
-static bool transaction_open = 0;
-
-static void __init
-transaction_init(void)
-{
-	memset(&transaction, 0, sizeof(transaction));
-	INIT_LIST_HEAD(&transaction.op);
-	transaction_open = 0;
-}
+static LIST_HEAD(transactions);
 
 /* !!! must be called with the transaction mutex held !!! */
 inline static struct kz_transaction *
 transaction_lookup(int peer_pid)
 {
-	if (transaction_open && transaction.peer_pid == peer_pid)
-		return &transaction;
-	else
-		return NULL;
+	struct kz_transaction *tr;
+
+	list_for_each_entry(tr, &transactions, list) {
+		if (tr->peer_pid == peer_pid)
+			return tr;
+	}
+
+	return NULL;
 }
 
 /* !!! must be called with the transaction mutex held !!! */
 static struct kz_transaction *
 transaction_create(const netlink_port_t peer_pid, const unsigned int instance_id, u_int64_t config_cookie)
 {
+	struct kz_transaction *tr;
+
 	kz_debug("pid='%d', instance_id='%d', config_cookie='%llu'\n",
 		 peer_pid, instance_id, config_cookie);
 
-	if (transaction_open) {
-		kz_err("transaction already exists;\n");
+	/* zeroed hash chains are empty */
+	tr = kzalloc(sizeof(*tr), GFP_KERNEL);
+	if (tr == NULL) {
+		kz_err("failed to allocate transaction;\n");
 		return NULL;
 	}
 
-	transaction_open = 1;
-	transaction.instance_id = instance_id;
-	transaction.peer_pid = peer_pid;
-	transaction.flags = 0;
-	transaction.cookie = config_cookie;
-	transaction.cfg = kz_config_rcu; /* lock and protocol ensures no rcu_lock needed */
+	INIT_LIST_HEAD(&tr->op);
+	tr->instance_id = instance_id;
+	tr->peer_pid = peer_pid;
+	tr->flags = 0;
+	tr->cookie = config_cookie;
+	tr->cfg = kz_config_rcu; /* lock and protocol ensures no rcu_lock needed */
+	tr->generation = tr->cfg->generation;
+	list_add(&tr->list, &transactions);
 
-	return &transaction;
+	return tr;
 }
 
 static void transaction_cleanup_op(struct kz_transaction *);
@@ -92,19 +97,72 @@ transaction_destroy(struct kz_transaction *t)
 {
 	kz_debug("transaction='%p'\n", t);
 
-	BUG_ON(t != &transaction);
-
 	transaction_cleanup_op(t);
 
 	BUG_ON(!list_empty(&t->op));
 
-	transaction_open = 0;
+	list_del(&t->list);
+	kfree(t);
+}
+
+/* rebases the other open transactions on the config just installed
+ * !!! must be called with the transaction mutex held !!! */
+static void
+transaction_config_swapped(const struct kz_transaction * const committed, const struct kz_config *cfg)
+{
+	struct kz_transaction *tr;
+
+	list_for_each_entry(tr, &transactions, list) {
+		if (tr != committed)
+			tr->cfg = cfg;
+	}
 }
 
 /***********************************************************
  * Transaction operations
  ***********************************************************/
 
+static inline unsigned int
+transaction_name_hash(const char *name)
+{
+	return jhash(name, strlen(name), 0) % KZ_TRANSACTION_HASH_SIZE;
+}
+
+static inline unsigned int
+transaction_bind_hash(const struct kz_bind *bind)
+{
+	return jhash2((const u32 *) bind->addr.all, ARRAY_SIZE(bind->addr.all),
+		      jhash_3words(bind->port, bind->proto, bind->family, 0)) % KZ_TRANSACTION_HASH_SIZE;
+}
+
+/* returns the hash chain of the operation */
+static struct hlist_head *
+transaction_op_chain(struct kz_transaction *tr, enum kznl_op_data_type type, const void *data)
+{
+	const char *name;
+
+	switch (type) {
+	case KZNL_OP_ZONE:
+		name = ((const struct kz_zone *) data)->unique_name;
+		break;
+	case KZNL_OP_SERVICE:
+		name = ((const struct kz_service *) data)->name;
+		break;
+	case KZNL_OP_DISPATCHER:
+		name = ((const struct kz_dispatcher *) data)->name;
+		break;
+	case KZNL_OP_DELETE:
+		name = ((const struct kz_operation_delete *) data)->name;
+		break;
+	case KZNL_OP_BIND:
+		return &tr->op_hash[type][transaction_bind_hash((const struct kz_bind *) data)];
+	default:
+		BUG();
+	}
+
+	return &tr->op_hash[type][transaction_name_hash(name)];
+}
+
 /* caller must mutex the passed transaction! */
 static int
 transaction_add_op(struct kz_transaction *tr,
@@ -125,11 +183,25 @@ transaction_add_op(struct kz_transaction *tr,
 	o->data = data;
 	o->data_destroy = cleanup_func;
 	list_add(&o->list, &tr->op);
+	hlist_add_head(&o->hlist, transaction_op_chain(tr, type, data));
+	if (type == KZNL_OP_DISPATCHER)
+		tr->last_dispatcher = (struct kz_dispatcher *) data;
 	kz_debug("add op; type='%d'\n", type);
 
 	return 0;
 }
 
+/* unlinks the operation, the caller takes over its data
+ * caller must mutex the passed transaction! */
+static void
+transaction_remove_op(struct kz_transaction *tr, struct kz_operation *o)
+{
+	list_del(&o->list);
+	hlist_del(&o->hlist);
+	if (o->type == KZNL_OP_DISPATCHER && o->data == tr->last_dispatcher)
+		tr->last_dispatcher = NULL;
+}
+
 /* cleanup functions passed */
 static void
 transaction_destroy_zone(void *data)
@@ -155,6 +227,15 @@ transaction_destroy_bind(void *data)
 	kz_bind_destroy((struct kz_bind *)data);
 }
 
+static void
+transaction_destroy_delete(void *data)
+{
+	struct kz_operation_delete *d = (struct kz_operation_delete *) data;
+
+	kfree(d->name);
+	kfree(d);
+}
+
 /* caller must mutex the passed transaction! */
 static void
 transaction_cleanup_op(struct kz_transaction *tr)
@@ -162,7 +243,7 @@ transaction_cleanup_op(struct kz_transaction *tr)
 	struct kz_operation *o, *p;
 
 	list_for_each_entry_safe(o, p, &tr->op, list) {
-		list_del(&o->list);
+		transaction_remove_op(tr, o);
 
 		if (o->data && o->data_destroy)
 			o->data_destroy(o->data);
@@ -177,14 +258,13 @@ transaction_zone_lookup(const struct kz_transaction * const tr,
 			const char *name)
 {
 	const struct kz_operation *i;
+	struct hlist_node *n;
 
-	list_for_each_entry(i, &tr->op, list) {
-		if (i->type == KZNL_OP_ZONE) {
-			struct kz_zone *z = (struct kz_zone *)i->data;
+	hlist_for_each_entry(i, n, &tr->op_hash[KZNL_OP_ZONE][transaction_name_hash(name)], hlist) {
+		struct kz_zone *z = (struct kz_zone *)i->data;
 
-			if (strcmp(z->unique_name, name) == 0)
-				return z;
-		}
+		if (strcmp(z->unique_name, name) == 0)
+			return z;
 	}
 
 	return NULL;
@@ -196,14 +276,13 @@ transaction_service_lookup(const struct kz_transaction * const tr,
 			   const char *name)
 {
 	const struct kz_operation *i;
+	struct hlist_node *n;
 
-	list_for_each_entry(i, &tr->op, list) {
-		if (i->type == KZNL_OP_SERVICE) {
-			struct kz_service *s = (struct kz_service *)i->data;
+	hlist_for_each_entry(i, n, &tr->op_hash[KZNL_OP_SERVICE][transaction_name_hash(name)], hlist) {
+		struct kz_service *s = (struct kz_service *)i->data;
 
-			if (strcmp(s->name, name) == 0)
-				return s;
-		}
+		if (strcmp(s->name, name) == 0)
+			return s;
 	}
 
 	return NULL;
@@ -215,14 +294,17 @@ transaction_dispatcher_lookup(const struct kz_transaction * const tr,
 			   const char *name)
 {
 	const struct kz_operation *i;
+	struct hlist_node *n;
 
-	list_for_each_entry(i, &tr->op, list) {
-		if (i->type == KZNL_OP_DISPATCHER) {
-			struct kz_dispatcher *d = (struct kz_dispatcher *)i->data;
+	/* rules and entries are usually uploaded right after their dispatcher */
+	if (tr->last_dispatcher != NULL && strcmp(tr->last_dispatcher->name, name) == 0)
+		return tr->last_dispatcher;
 
-			if (strcmp(d->name, name) == 0)
-				return d;
-		}
+	hlist_for_each_entry(i, n, &tr->op_hash[KZNL_OP_DISPATCHER][transaction_name_hash(name)], hlist) {
+		struct kz_dispatcher *d = (struct kz_dispatcher *)i->data;
+
+		if (strcmp(d->name, name) == 0)
+			return d;
 	}
 
 	return NULL;
@@ -243,18 +325,17 @@ transaction_bind_lookup(const struct kz_transaction * const tr,
 			const struct kz_bind *bind)
 {
 	const struct kz_operation *i;
+	struct hlist_node *n;
 
 	kz_bind_debug(bind, "lookup item");
 
-	list_for_each_entry(i, &tr->op, list) {
-		if (i->type == KZNL_OP_BIND) {
-			struct kz_bind *b = (struct kz_bind *) i->data;
+	hlist_for_each_entry(i, n, &tr->op_hash[KZNL_OP_BIND][transaction_bind_hash(bind)], hlist) {
+		struct kz_bind *b = (struct kz_bind *) i->data;
 
-			kz_bind_debug(b, "check item");
+		kz_bind_debug(b, "check item");
 
-			if (kz_bind_eq(b, bind))
-				return b;
-		}
+		if (kz_bind_eq(b, bind))
+			return b;
 	}
 
 	return NULL;
@@ -278,32 +359,59 @@ static struct kz_dispatcher_n_dimension_rule *
 transaction_rule_lookup(const struct kz_transaction * const tr,
 			const char *dispatcher_name, u_int32_t id)
 {
-	const struct kz_operation *i;
+	struct kz_dispatcher *d;
+	struct kz_dispatcher_n_dimension_rule *rule = NULL;
 
 	kz_debug("dispatcher_name='%s', id='%u'\n", dispatcher_name, id);
 
-	list_for_each_entry(i, &tr->op, list) {
-		if (i->type == KZNL_OP_DISPATCHER) {
-			struct kz_dispatcher *d;
-			struct kz_dispatcher_n_dimension_rule *rule = NULL;
+	d = transaction_dispatcher_lookup(tr, dispatcher_name);
+	if (d == NULL)
+		return NULL;
 
-			d = (struct kz_dispatcher *) i->data;
+	/* we have found the dispatcher, check if the ID of
+	 * the last rule matches @id */
+	if (d->num_rule > 0)
+		rule = &d->rule[d->num_rule - 1];
+	if (rule && (id == rule->id))
+		return rule;
 
-			if (strcmp(d->name, dispatcher_name))
-				continue;
+	return NULL;
+}
+
+/* caller must mutex the passed transaction! */
+static bool
+transaction_deleted(const struct kz_transaction * const tr,
+		    enum kznl_op_data_type type, const char *name)
+{
+	const struct kz_operation *i;
+	struct hlist_node *n;
 
-			/* we have found the dispatcher, check if the ID of
-			 * the last rule matches @id */
-			if (d->num_rule > 0)
-				rule = &d->rule[d->num_rule - 1];
-			if (rule && (id == rule->id))
-				return rule;
+	hlist_for_each_entry(i, n, &tr->op_hash[KZNL_OP_DELETE][transaction_name_hash(name)], hlist) {
+		const struct kz_operation_delete *d = (struct kz_operation_delete *) i->data;
 
-			return NULL;
-		}
+		if (d->type == type && !d->has_rule_id && strcmp(d->name, name) == 0)
+			return true;
 	}
 
-	return NULL;
+	return false;
+}
+
+/* caller must mutex the passed transaction! */
+static bool
+transaction_rule_deleted(const struct kz_transaction * const tr,
+			 const char *dispatcher_name, u_int32_t id)
+{
+	const struct kz_operation *i;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(i, n, &tr->op_hash[KZNL_OP_DELETE][transaction_name_hash(dispatcher_name)], hlist) {
+		const struct kz_operation_delete *d = (struct kz_operation_delete *) i->data;
+
+		if (d->has_rule_id && d->rule_id == id && strcmp(d->name, dispatcher_name) == 0)
+			return true;
+	}
+
+	return false;
 }
 
 /***********************************************************
@@ -319,14 +427,16 @@ transaction_rule_lookup(const struct kz_transaction * const tr,
  * current transaction and the current configuration. It looks up the
  * config only if the transaction does not have the flush zones bit
  * set, that is, there is no chance that the looked-up service will be
- * removed by a subsequent commit.
+ * removed by a subsequent commit. Zones deleted in the transaction are
+ * not found.
  */
 static inline struct kz_zone *
 lookup_zone_merged(const struct kz_transaction * const tr, const char *name)
 {
 	struct kz_zone *zone = transaction_zone_lookup(tr, name);
 
-	if (zone == NULL && !(tr->flags & KZF_TRANSACTION_FLUSH_ZONES))
+	if (zone == NULL && !(tr->flags & KZF_TRANSACTION_FLUSH_ZONES) &&
+	    !transaction_deleted(tr, KZNL_OP_ZONE, name))
 		zone = kz_zone_lookup_name(tr->cfg, name);
 
 	return zone;
@@ -341,14 +451,16 @@ lookup_zone_merged(const struct kz_transaction * const tr, const char *name)
  * current transaction and the current configuration. It looks up the
  * config only if the transaction does not have the flush services bit
  * set, that is, there is no chance that the looked-up service will be
- * removed by a subsequent commit.
+ * removed by a subsequent commit. Services deleted in the transaction
+ * are not found.
  **/
 static inline struct kz_service *
 lookup_service_merged(const struct kz_transaction * const tr, const char *name)
 {
 	struct kz_service *service = transaction_service_lookup(tr, name);
 
-	if (service == NULL && !(tr->flags & KZF_TRANSACTION_FLUSH_SERVICES))
+	if (service == NULL && !(tr->flags & KZF_TRANSACTION_FLUSH_SERVICES) &&
+	    !transaction_deleted(tr, KZNL_OP_SERVICE, name))
 		service = kz_service_lookup_name(tr->cfg, name);
 
 	return service;
@@ -358,419 +470,215 @@ lookup_service_merged(const struct kz_transaction * const tr, const char *name)
  * Netlink attribute parsing
  ***********************************************************/
 
+/* the parsers of the common attribute types are in kzorp_netlink_parse.c */
+
 static inline int
-kznl_parse_name(const struct nlattr *attr, char *name, unsigned long nsize)
+kznl_parse_service_router_dst(struct nlattr *cda[], struct kz_service *svc)
 {
-	struct kza_name *a = nla_data(attr);
-	unsigned long length;
+	int res;
 
-	length = (unsigned long) ntohs(a->length);
-	if (nsize < length + 1) {
-		kz_err("invalid target length; dst_size='%lu', len='%lu'\n", nsize, length);
-		return -EINVAL;
+	res = kznl_parse_inet_addr(cda[KZNL_ATTR_SERVICE_ROUTER_DST_ADDR], &svc->a.fwd.router_dst_addr, &svc->a.fwd.router_dst_addr_family);
+	if (res < 0) {
+		kz_err("failed to parse dst ip nested attribute\n");
+		goto error;
+	}
+	res = kznl_parse_port(cda[KZNL_ATTR_SERVICE_ROUTER_DST_PORT], &svc->a.fwd.router_dst_port);
+	if (res < 0) {
+		kz_err("failed to parse dst port attribute\n");
+		goto error;
 	}
-
-	memcpy(name, a->name, length);
-	name[length] = 0;
 
 	return 0;
+error:
+	return res;
 }
 
-static int
-kznl_parse_name_alloc(const struct nlattr *attr, char **name)
+static inline int
+kznl_parse_service_nat_params(const struct nlattr *attr, struct nf_nat_range *range)
 {
-	struct kza_name *a = nla_data(attr);
-	char *n;
-	int res;
-	unsigned long length = ntohs(a->length);
+	const struct kza_service_nat_params *a = nla_data(attr);
+	u_int32_t flags = ntohl(a->flags);
 
-	if (length == 0 || length > KZ_ATTR_NAME_MAX_LENGTH)
+	if ((flags | KZF_SERVICE_NAT_MAP_PUBLIC_FLAGS) != KZF_SERVICE_NAT_MAP_PUBLIC_FLAGS)
 		return -EINVAL;
 
-	n = kzalloc(length + 1, GFP_KERNEL);
-	if (n == NULL)
-		return -ENOMEM;
+	if (flags & KZF_SERVICE_NAT_MAP_IPS)
+		range->flags |= IP_NAT_RANGE_MAP_IPS;
+	if (flags & KZF_SERVICE_NAT_MAP_PROTO_SPECIFIC)
+		range->flags |= IP_NAT_RANGE_PROTO_SPECIFIED;
 
-	res = kznl_parse_name(attr, n, length + 1);
-	if (res >= 0)
-		*name = n;
+	range->min_ip = a->min_ip;
+	range->max_ip = a->max_ip;
+	range->min.udp.port = a->min_port;
+	range->max.udp.port = a->max_port;
 
-	return res;
+	return 0;
 }
 
 static inline int
-kznl_parse_in_addr(const struct nlattr *attr, struct in_addr *addr)
+kznl_parse_service_nat6_params(const struct nlattr *attr, struct kz_nat6_range *range)
 {
-	struct kz_in_subnet *a = nla_data(attr);
+	const struct kza_service_nat6_params *a = nla_data(attr);
+	u_int32_t flags;
+
+	if (nla_len(attr) < sizeof(*a))
+		return -EINVAL;
 
-	addr->s_addr = a->addr.s_addr;
+	flags = ntohl(a->flags);
+	if ((flags | KZF_SERVICE_NAT_MAP_PUBLIC_FLAGS) != KZF_SERVICE_NAT_MAP_PUBLIC_FLAGS)
+		return -EINVAL;
+
+	if (flags & KZF_SERVICE_NAT_MAP_IPS)
+		range->flags |= IP_NAT_RANGE_MAP_IPS;
+	if (flags & KZF_SERVICE_NAT_MAP_PROTO_SPECIFIC)
+		range->flags |= IP_NAT_RANGE_PROTO_SPECIFIED;
 
-	kz_debug("parsed IPv4 address='%pI4'\n", addr);
+	ipv6_addr_copy(&range->min_ip, &a->min_ip);
+	ipv6_addr_copy(&range->max_ip, &a->max_ip);
+	range->min_port = a->min_port;
+	range->max_port = a->max_port;
 
 	return 0;
 }
 
 static inline int
-kznl_parse_in6_addr(const struct nlattr *attr, struct in6_addr *addr)
+kznl_parse_service_session_cnt(const struct nlattr *attr, u_int32_t *count)
 {
-	struct kz_in6_subnet *a = nla_data(attr);
-
-	ipv6_addr_copy(addr, &a->addr);
+	struct kza_service_session_cnt *a = nla_data(attr);
 
-	kz_debug("parsed IPv6 address='%pI6'\n", addr);
+	*count = ntohl(a->count);
 
 	return 0;
 }
 
-static const struct nla_policy inet_addr_nla_policy[KZNL_ATTR_TYPE_COUNT + 1] = {
-	[KZNL_ATTR_INET_ADDR]	= { .type = NLA_NESTED },
-	[KZNL_ATTR_INET6_ADDR]	= { .type = NLA_NESTED },
-};
-
 static inline int
-kznl_parse_inet_addr(const struct nlattr *attr, union nf_inet_addr *addr, sa_family_t *family)
+kznl_parse_service_reject_limit(const struct nlattr *attr, struct kz_service *svc)
 {
-	int res = 0;
-	struct nlattr *tb[KZNL_ATTR_TYPE_COUNT + 1];
+	struct kza_service_reject_limit *a = nla_data(attr);
+	u32 rate, burst, src_rate, src_burst;
 
-	res = nla_parse_nested(tb, KZNL_ATTR_TYPE_COUNT, attr, inet_addr_nla_policy);
-	if (res < 0) {
-		kz_err("failed to parse nested attribute\n");
-		return res;
-	}
+	if (nla_len(attr) < sizeof(struct kza_service_reject_limit))
+		return -EINVAL;
 
-	kz_debug ("nested attributes: %p %p", tb[KZNL_ATTR_INET_ADDR], tb[KZNL_ATTR_INET6_ADDR]);
-	if (tb[KZNL_ATTR_INET_ADDR]) {
-		res = kznl_parse_in_addr(tb[KZNL_ATTR_INET_ADDR], &addr->in);
-		if (res < 0) {
-			kz_err("failed to parse IPv4 address\n");
-			return res;
-		} else {
-			*family = AF_INET;
-		}
-	}
-	else if (tb[KZNL_ATTR_INET6_ADDR]) {
-		res = kznl_parse_in6_addr(tb[KZNL_ATTR_INET6_ADDR], &addr->in6);
-		if (res < 0) {
-			kz_err("failed to parse IPv6 address\n");
-			return res;
-		} else {
-			*family = AF_INET6;
-		}
-	} else {
-		kz_err("required attributes missing: address\n");
-		res = -EINVAL;
-	}
+	rate = ntohl(a->rate);
+	burst = ntohl(a->burst);
+	src_rate = ntohl(a->src_rate);
+	src_burst = ntohl(a->src_burst);
 
-	return res;
-}
+	if (rate > KZ_SERVICE_REJECT_LIMIT_MAX || burst > KZ_SERVICE_REJECT_LIMIT_MAX ||
+	    src_rate > KZ_SERVICE_REJECT_LIMIT_MAX || src_burst > KZ_SERVICE_REJECT_LIMIT_MAX ||
+	    (rate != 0 && burst == 0) || (src_rate != 0 && src_burst == 0))
+		return -EINVAL;
 
+	svc->reject = kz_reject_limiter_new(rate, burst, src_rate, src_burst);
+	if (svc->reject == NULL)
+		return -ENOMEM;
 
+	return 0;
+}
 
 static inline int
-kznl_parse_in_subnet(const struct nlattr *attr, struct in_addr *subnet_addr, struct in_addr *subnet_mask)
+kznl_parse_service_deny_method(const struct nlattr *attr, unsigned int *type)
 {
-	struct kz_in_subnet *a = nla_data(attr);
-	u_int32_t mask, i;
-
-	subnet_addr->s_addr = a->addr.s_addr;
-	subnet_mask->s_addr = a->mask.s_addr;
-
-	kz_debug("address='%pI4', mask='%pI4'\n", subnet_addr, subnet_mask);
-
-	mask = ntohl(subnet_mask->s_addr);
-	for (i = 1 << 31; i && (mask & i); i >>= 1)
-		;
-	if (i && (i - 1) & mask)
-		return -EINVAL;
+	*type = nla_get_u8(attr);
 
 	return 0;
 }
 
 static inline int
-kznl_parse_in6_subnet(const struct nlattr *attr, struct in6_addr *addr, struct in6_addr *mask)
+kznl_parse_service_ipv4_deny_method(const struct nlattr *attr, unsigned int *_type)
 {
-	struct kz_in6_subnet *a = nla_data(attr);
-	struct in6_addr pfx;
-	int prefixlen;
-
-	ipv6_addr_copy(addr, &a->addr);
-	ipv6_addr_copy(mask, &a->mask);
+	unsigned int type;
+	int res;
 
-	kz_debug("address='%pI6', mask='%pI6'\n", addr, mask);
+	res = kznl_parse_service_deny_method(attr, &type);
+	if (res < 0)
+		return res;
 
-	ipv6_addr_set(&pfx, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff);
-	prefixlen = ipv6_addr_diff(mask, &pfx);
-	ipv6_addr_prefix(&pfx, mask, prefixlen);
-	if (!ipv6_addr_equal(&pfx, mask))
+	if (type >= KZ_SERVICE_DENY_METHOD_V4_COUNT)
 		return -EINVAL;
 
+	*_type = type;
+
 	return 0;
 }
 
-static const struct nla_policy inet_subnet_nla_policy[KZNL_ATTR_TYPE_COUNT + 1] = {
-	[KZNL_ATTR_INET_SUBNET]		= { .type = NLA_NESTED },
-	[KZNL_ATTR_INET6_SUBNET]	= { .type = NLA_NESTED },
-};
-
 static inline int
-kznl_parse_inet_subnet(const struct nlattr *attr, union nf_inet_addr *addr, union nf_inet_addr *mask, sa_family_t *family)
+kznl_parse_service_ipv6_deny_method(const struct nlattr *attr, unsigned int *_type)
 {
-	int res = 0;
-	struct nlattr *tb[KZNL_ATTR_TYPE_COUNT + 1];
+	unsigned int type;
+	int res;
 
-	res = nla_parse_nested(tb, KZNL_ATTR_TYPE_COUNT, attr, inet_subnet_nla_policy);
-	if (res < 0) {
-		kz_err("failed to parse nested attribute\n");
+	res = kznl_parse_service_deny_method(attr, &type);
+	if (res < 0)
 		return res;
-	}
 
-	if (tb[KZNL_ATTR_INET_SUBNET]) {
-		res = kznl_parse_in_subnet(tb[KZNL_ATTR_INET_SUBNET], &addr->in, &mask->in);
-		if (res < 0) {
-			kz_err("failed to parse IPv4 subnet\n");
-			return res;
-		} else {
-			*family = AF_INET;
-		}
-	}
-	else if (tb[KZNL_ATTR_INET6_SUBNET]) {
-		res = kznl_parse_in6_subnet(tb[KZNL_ATTR_INET6_SUBNET], &addr->in6, &mask->in6);
-		if (res < 0) {
-			kz_err("failed to parse IPv6 subnet\n");
-			return res;
-		} else {
-			*family = AF_INET6;
-		}
-	} else {
-		kz_err("required attributes missing: subnet\n");
-		res = -EINVAL;
-	}
+	if (type > KZ_SERVICE_DENY_METHOD_V6_COUNT)
+		return -EINVAL;
 
-	return res;
+	*_type = type;
+
+	return 0;
 }
 
 static inline int
-kznl_parse_port(const struct nlattr *attr, __u16 *_port)
+kznl_check_port_ranges(u_int32_t num_ranges, u_int16_t ranges[])
 {
-	__u16 port;
+	unsigned int i;
 
-	port = ntohs(nla_get_be16(attr));
-	if (port == 0) {
-		kz_err("invalid port number received; port='%hu'", port);
-		return -EINVAL;
+	for (i = 0; i < num_ranges; i++) {
+		if (ranges[2 * i] > ranges[2 * i + 1])
+			return -EINVAL;
 	}
 
-	*_port = port;
-
 	return 0;
 }
 
-static inline int
-kznl_parse_port_range(const struct nlattr *attr, u_int16_t *range_from, u_int16_t *range_to)
+static int
+kznl_parse_dispatcher_n_dimension(const struct nlattr *attr, struct kz_dispatcher *n_dimension)
 {
-	struct kza_port_range *a = nla_data(attr);
-	const u_int16_t from = ntohs(a->from);
-	const u_int16_t to = ntohs(a->to);
-
-	if (to < from)
-		return -EINVAL;
-
-	*range_from = from;
-	*range_to = to;
+	struct kza_dispatcher_n_dimension_params *a = nla_data(attr);
 
-	return 0;
+	return kz_dispatcher_alloc_rule_array(n_dimension, ntohl(a->num_rules));
 }
 
-static inline int
-kznl_parse_proto(const struct nlattr *attr, __u8 *_proto)
+static int
+kznl_parse_dispatcher_n_dimension_rule(const struct nlattr *attr,
+				       struct kz_dispatcher_n_dimension_rule *rule)
 {
-	*_proto = nla_get_u8(attr);
+	struct kza_n_dimension_rule_params *a = nla_data(attr);
 
+	rule->id = ntohl(a->id);
 	return 0;
 }
 
-static inline int
-kznl_parse_reqid(const struct nlattr *attr, __u32 *_reqid)
+static int
+kznl_parse_dispatcher_n_dimension_rule_entry(const struct nlattr *attr,
+					     struct kz_dispatcher_n_dimension_rule_entry_params *rule_entry)
 {
-	*_reqid = ntohl(nla_get_be32(attr));
-
+	struct kz_dispatcher_n_dimension_rule_entry_params *a = nla_data(attr);
+	rule_entry->rule_id = ntohl(a->rule_id);
 	return 0;
 }
 
-
 static inline int
-kznl_parse_service_params(const struct nlattr *attr, struct kz_service *svc)
+kznl_parse_query_params(const struct nlattr *attr, struct kz_query *query)
 {
-	struct kza_service_params *a = nla_data(attr);
-	u_int32_t new_flags = ntohl(a->flags);
+	struct kza_query_params *a = nla_data(attr);
 
-	if (a->type <= KZ_SERVICE_INVALID || a->type >= KZ_SERVICE_TYPE_COUNT)
-		return -EINVAL;
-	if ((new_flags | KZF_SERVICE_PUBLIC_FLAGS) != KZF_SERVICE_PUBLIC_FLAGS)
+	if (a->proto != IPPROTO_TCP && a->proto != IPPROTO_UDP)
 		return -EINVAL;
 
-	svc->type = (enum kz_service_type) a->type;
-	svc->flags = new_flags;
+	query->proto = a->proto;
+	query->src_port = ntohs(a->src_port);
+	query->dst_port = ntohs(a->dst_port);
+	memcpy(&query->ifname, &a->ifname, IFNAMSIZ);
 
 	return 0;
 }
 
 static inline int
-kznl_parse_service_router_dst(struct nlattr *cda[], struct kz_service *svc)
-{
-	int res;
-
-	res = kznl_parse_inet_addr(cda[KZNL_ATTR_SERVICE_ROUTER_DST_ADDR], &svc->a.fwd.router_dst_addr, &svc->a.fwd.router_dst_addr_family);
-	if (res < 0) {
-		kz_err("failed to parse dst ip nested attribute\n");
-		goto error;
-	}
-	res = kznl_parse_port(cda[KZNL_ATTR_SERVICE_ROUTER_DST_PORT], &svc->a.fwd.router_dst_port);
-	if (res < 0) {
-		kz_err("failed to parse dst port attribute\n");
-		goto error;
-	}
-
-	return 0;
-error:
-	return res;
-}
-
-static inline int
-kznl_parse_service_nat_params(const struct nlattr *attr, struct nf_nat_range *range)
-{
-	const struct kza_service_nat_params *a = nla_data(attr);
-	u_int32_t flags = ntohl(a->flags);
-
-	if ((flags | KZF_SERVICE_NAT_MAP_PUBLIC_FLAGS) != KZF_SERVICE_NAT_MAP_PUBLIC_FLAGS)
-		return -EINVAL;
-
-	if (flags & KZF_SERVICE_NAT_MAP_IPS)
-		range->flags |= IP_NAT_RANGE_MAP_IPS;
-	if (flags & KZF_SERVICE_NAT_MAP_PROTO_SPECIFIC)
-		range->flags |= IP_NAT_RANGE_PROTO_SPECIFIED;
-
-	range->min_ip = a->min_ip;
-	range->max_ip = a->max_ip;
-	range->min.udp.port = a->min_port;
-	range->max.udp.port = a->max_port;
-
-	return 0;
-}
-
-static inline int
-kznl_parse_service_session_cnt(const struct nlattr *attr, u_int32_t *count)
-{
-	struct kza_service_session_cnt *a = nla_data(attr);
-
-	*count = ntohl(a->count);
-
-	return 0;
-}
-
-static inline int
-kznl_parse_service_deny_method(const struct nlattr *attr, unsigned int *type)
-{
-	*type = nla_get_u8(attr);
-
-	return 0;
-}
-
-static inline int
-kznl_parse_service_ipv4_deny_method(const struct nlattr *attr, unsigned int *_type)
-{
-	unsigned int type;
-	int res;
-
-	res = kznl_parse_service_deny_method(attr, &type);
-	if (res < 0)
-		return res;
-
-	if (type >= KZ_SERVICE_DENY_METHOD_V4_COUNT)
-		return -EINVAL;
-
-	*_type = type;
-
-	return 0;
-}
-
-static inline int
-kznl_parse_service_ipv6_deny_method(const struct nlattr *attr, unsigned int *_type)
-{
-	unsigned int type;
-	int res;
-
-	res = kznl_parse_service_deny_method(attr, &type);
-	if (res < 0)
-		return res;
-
-	if (type > KZ_SERVICE_DENY_METHOD_V6_COUNT)
-		return -EINVAL;
-
-	*_type = type;
-
-	return 0;
-}
-
-static inline int
-kznl_check_port_ranges(u_int32_t num_ranges, u_int16_t ranges[])
-{
-	unsigned int i;
-
-	for (i = 0; i < num_ranges; i++) {
-		if (ranges[2 * i] > ranges[2 * i + 1])
-			return -EINVAL;
-	}
-
-	return 0;
-}
-
-static int
-kznl_parse_dispatcher_n_dimension(const struct nlattr *attr, struct kz_dispatcher *n_dimension)
-{
-	struct kza_dispatcher_n_dimension_params *a = nla_data(attr);
-
-	return kz_dispatcher_alloc_rule_array(n_dimension, ntohl(a->num_rules));
-}
-
-static int
-kznl_parse_dispatcher_n_dimension_rule(const struct nlattr *attr,
-				       struct kz_dispatcher_n_dimension_rule *rule)
-{
-	struct kza_n_dimension_rule_params *a = nla_data(attr);
-
-	rule->id = ntohl(a->id);
-	return 0;
-}
-
-static int
-kznl_parse_dispatcher_n_dimension_rule_entry(const struct nlattr *attr,
-					     struct kz_dispatcher_n_dimension_rule_entry_params *rule_entry)
-{
-	struct kz_dispatcher_n_dimension_rule_entry_params *a = nla_data(attr);
-	rule_entry->rule_id = ntohl(a->rule_id);
-	return 0;
-}
-
-static inline int
-kznl_parse_query_params(const struct nlattr *attr, struct kz_query *query)
-{
-	struct kza_query_params *a = nla_data(attr);
-
-	if (a->proto != IPPROTO_TCP && a->proto != IPPROTO_UDP)
-		return -EINVAL;
-
-	query->proto = a->proto;
-	query->src_port = ntohs(a->src_port);
-	query->dst_port = ntohs(a->dst_port);
-	memcpy(&query->ifname, &a->ifname, IFNAMSIZ);
-
-	return 0;
-}
-
-static inline int
-kznl_parse_get_version_params(const struct nlattr *attr, struct kz_query *query)
+kznl_parse_get_version_params(const struct nlattr *attr, struct kz_query *query)
 {
 	return 0;
 }
@@ -946,6 +854,35 @@ nla_put_failure:
 	return -1;
 }
 
+static inline int
+kznl_dump_service_reject(struct sk_buff *skb, const struct kz_reject_limiter *limiter)
+{
+	struct kza_service_reject_limit limit;
+	struct kza_service_reject_stats counters;
+	struct kz_reject_stats stats;
+
+	if (limiter == NULL)
+		return 0;
+
+	if (limiter->rate != 0 || limiter->src_rate != 0) {
+		limit.rate = htonl(limiter->rate);
+		limit.burst = htonl(limiter->burst);
+		limit.src_rate = htonl(limiter->src_rate);
+		limit.src_burst = htonl(limiter->src_burst);
+		NLA_PUT(skb, KZNL_ATTR_SERVICE_REJECT_LIMIT, sizeof(limit), &limit);
+	}
+
+	kz_reject_limiter_stats(limiter, &stats);
+	counters.sent = cpu_to_be64(stats.sent);
+	counters.suppressed = cpu_to_be64(stats.suppressed);
+	NLA_PUT(skb, KZNL_ATTR_SERVICE_REJECT_STATS, sizeof(counters), &counters);
+
+	return 0;
+
+nla_put_failure:
+	return -1;
+}
+
 static inline int
 kznl_dump_service_nat_entry(struct kza_service_nat_params *a, struct nf_nat_range *range)
 {
@@ -1091,8 +1028,301 @@ error:
 
    this function is called having transaction_mutex
 */
+/*
+ * returns true if a rule of the dispatcher refers to the zone or service;
+ * rules deleted by the transaction are skipped if the dispatcher is the
+ * one of the running config
+ */
+static bool
+transaction_dispatcher_references(const struct kz_transaction * const tr,
+				  const struct kz_dispatcher *dpt, bool running,
+				  const char *zone_name, const char *service_name)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < dpt->num_rule; i++) {
+		const struct kz_dispatcher_n_dimension_rule *rule = &dpt->rule[i];
+
+		if (running && transaction_rule_deleted(tr, dpt->name, rule->id))
+			continue;
+
+		if (service_name != NULL && strcmp(rule->service->name, service_name) == 0)
+			return true;
+
+		if (zone_name == NULL)
+			continue;
+
+		for (j = 0; j < rule->num_src_zone; j++)
+			if (strcmp(rule->src_zone[j]->unique_name, zone_name) == 0)
+				return true;
+		for (j = 0; j < rule->num_dst_zone; j++)
+			if (strcmp(rule->dst_zone[j]->unique_name, zone_name) == 0)
+				return true;
+	}
+
+	return false;
+}
+
+/* returns true if the dispatcher of the running config is carried over to the new one */
+static bool
+transaction_dispatcher_kept(const struct kz_transaction * const tr, const struct kz_dispatcher *dpt)
+{
+	/* dispatchers of other instances are left alone */
+	if (dpt->instance->id != tr->instance_id)
+		return true;
+
+	if (tr->flags & KZF_TRANSACTION_FLUSH_DISPATCHERS)
+		return false;
+
+	/* a dispatcher may only be added again after it is deleted */
+	return !transaction_deleted(tr, KZNL_OP_DISPATCHER, dpt->name);
+}
+
+/*
+ * Deleting a zone or a service is refused while the new config would
+ * still refer to it: rules would silently match more traffic without
+ * the zone, and child zones would lose their admin parent.
+ */
 static int
-kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction *tr)
+transaction_check_deleted_in_use(const struct kz_transaction * const tr)
+{
+	const struct kz_operation *io, *jo;
+	const struct kz_config * const old = tr->cfg;
+
+	list_for_each_entry(io, &tr->op, list) {
+		const struct kz_operation_delete *del;
+		const char *zone_name = NULL, *service_name = NULL;
+		const struct kz_dispatcher *dpt;
+
+		if (io->type != KZNL_OP_DELETE)
+			continue;
+
+		del = (struct kz_operation_delete *) io->data;
+		if (del->type == KZNL_OP_ZONE && transaction_zone_lookup(tr, del->name) == NULL)
+			zone_name = del->name;
+		else if (del->type == KZNL_OP_SERVICE && transaction_service_lookup(tr, del->name) == NULL)
+			service_name = del->name;
+		else
+			continue;
+
+		if (zone_name != NULL) {
+			const struct kz_zone *zone;
+
+			list_for_each_entry(zone, &old->zones.head, list) {
+				if (zone->admin_parent != NULL &&
+				    strcmp(zone->admin_parent->unique_name, zone_name) == 0 &&
+				    !transaction_deleted(tr, KZNL_OP_ZONE, zone->unique_name)) {
+					kz_err("deleted zone is the parent of a zone; name='%s', child='%s'\n",
+					       zone_name, zone->unique_name);
+					return -EBUSY;
+				}
+			}
+
+			list_for_each_entry(jo, &tr->op, list) {
+				if (jo->type == KZNL_OP_ZONE) {
+					zone = (struct kz_zone *) jo->data;
+					if (zone->admin_parent != NULL &&
+					    strcmp(zone->admin_parent->unique_name, zone_name) == 0) {
+						kz_err("deleted zone is the parent of a zone; name='%s', child='%s'\n",
+						       zone_name, zone->unique_name);
+						return -EBUSY;
+					}
+				}
+			}
+		}
+
+		list_for_each_entry(dpt, &old->dispatchers.head, list) {
+			if (transaction_dispatcher_kept(tr, dpt) &&
+			    transaction_dispatcher_references(tr, dpt, true, zone_name, service_name)) {
+				kz_err("deleted object is referenced by a rule; name='%s', dispatcher='%s'\n",
+				       del->name, dpt->name);
+				return -EBUSY;
+			}
+		}
+
+		list_for_each_entry(jo, &tr->op, list) {
+			if (jo->type != KZNL_OP_DISPATCHER)
+				continue;
+
+			dpt = (struct kz_dispatcher *) jo->data;
+			if (transaction_dispatcher_references(tr, dpt, false, zone_name, service_name)) {
+				kz_err("deleted object is referenced by a rule; name='%s', dispatcher='%s'\n",
+				       del->name, dpt->name);
+				return -EBUSY;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* returns true if the zone is in the new config: added by the transaction or kept from the running one */
+static bool
+transaction_zone_available(const struct kz_transaction * const tr, const char *name)
+{
+	if (transaction_zone_lookup(tr, name) != NULL)
+		return true;
+
+	return !(tr->flags & KZF_TRANSACTION_FLUSH_ZONES) &&
+	       !transaction_deleted(tr, KZNL_OP_ZONE, name) &&
+	       kz_zone_lookup_name(tr->cfg, name) != NULL;
+}
+
+static bool
+transaction_service_available(const struct kz_transaction * const tr, const char *name)
+{
+	const struct kz_service *svc;
+
+	if (transaction_service_lookup(tr, name) != NULL)
+		return true;
+
+	svc = kz_service_lookup_name(tr->cfg, name);
+	if (svc == NULL || transaction_deleted(tr, KZNL_OP_SERVICE, name))
+		return false;
+
+	return svc->instance_id != tr->instance_id || !(tr->flags & KZF_TRANSACTION_FLUSH_SERVICES);
+}
+
+/* returns -EAGAIN if a zone or service referred to by the added object is not in the new config */
+static int
+transaction_check_references(const struct kz_transaction * const tr, const struct kz_operation *io)
+{
+	const struct kz_zone *zone;
+	const struct kz_dispatcher *dpt;
+	unsigned int i, j;
+
+	switch (io->type) {
+	case KZNL_OP_ZONE:
+		zone = (const struct kz_zone *) io->data;
+		if (zone->admin_parent != NULL &&
+		    !transaction_zone_available(tr, zone->admin_parent->unique_name)) {
+			kz_err("parent zone deleted by a concurrent transaction; name='%s', parent='%s'\n",
+			       zone->unique_name, zone->admin_parent->unique_name);
+			return -EAGAIN;
+		}
+		break;
+	case KZNL_OP_DISPATCHER:
+		dpt = (const struct kz_dispatcher *) io->data;
+		for (i = 0; i < dpt->num_rule; i++) {
+			const struct kz_dispatcher_n_dimension_rule *rule = &dpt->rule[i];
+
+			if (!transaction_service_available(tr, rule->service->name)) {
+				kz_err("service deleted by a concurrent transaction; name='%s', dispatcher='%s'\n",
+				       rule->service->name, dpt->name);
+				return -EAGAIN;
+			}
+
+			for (j = 0; j < rule->num_src_zone; j++)
+				if (rule->src_zone[j] != NULL &&
+				    !transaction_zone_available(tr, rule->src_zone[j]->unique_name))
+					goto zone_missing;
+			for (j = 0; j < rule->num_dst_zone; j++)
+				if (rule->dst_zone[j] != NULL &&
+				    !transaction_zone_available(tr, rule->dst_zone[j]->unique_name))
+					goto zone_missing;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+
+zone_missing:
+	kz_err("zone deleted by a concurrent transaction; dispatcher='%s', rule_id='%u'\n",
+	       dpt->name, dpt->rule[i].id);
+	return -EAGAIN;
+}
+
+/*
+ * Transactions of other instances may have been committed since the
+ * transaction was started. Its changes are applied to the config
+ * installed by them, unless it adds an object another transaction added
+ * in the meantime, or it refers to a zone or service another transaction
+ * deleted; in that case the commit fails with -EAGAIN and userspace has
+ * to upload the config again.
+ */
+static int
+transaction_check_conflicts(const struct kz_transaction * const tr)
+{
+	const struct kz_operation *io;
+	const struct kz_config * const cfg = tr->cfg;
+
+	if (cfg->generation == tr->generation)
+		return 0;
+
+	kz_debug("config changed during the transaction; generation='%u', current_generation='%u'\n",
+		 tr->generation, cfg->generation);
+
+	list_for_each_entry(io, &tr->op, list) {
+		const struct kz_zone *zone;
+		const struct kz_service *svc;
+		const struct kz_dispatcher *dpt;
+		int res;
+
+		res = transaction_check_references(tr, io);
+		if (res < 0)
+			return res;
+
+		switch (io->type) {
+		case KZNL_OP_ZONE:
+			zone = (const struct kz_zone *) io->data;
+			if (!(tr->flags & KZF_TRANSACTION_FLUSH_ZONES) &&
+			    !transaction_deleted(tr, KZNL_OP_ZONE, zone->unique_name) &&
+			    kz_zone_lookup_name(cfg, zone->unique_name) != NULL) {
+				kz_err("zone added by a concurrent transaction; name='%s'\n", zone->unique_name);
+				return -EAGAIN;
+			}
+			break;
+		case KZNL_OP_SERVICE:
+			svc = (const struct kz_service *) io->data;
+			if (transaction_deleted(tr, KZNL_OP_SERVICE, svc->name))
+				break;
+			svc = kz_service_lookup_name(cfg, svc->name);
+			if (svc != NULL &&
+			    (svc->instance_id != tr->instance_id || !(tr->flags & KZF_TRANSACTION_FLUSH_SERVICES))) {
+				kz_err("service added by a concurrent transaction; name='%s'\n", svc->name);
+				return -EAGAIN;
+			}
+			break;
+		case KZNL_OP_DISPATCHER:
+			dpt = kz_dispatcher_lookup_name(cfg, ((const struct kz_dispatcher *) io->data)->name);
+			if (dpt != NULL && transaction_dispatcher_kept(tr, dpt)) {
+				kz_err("dispatcher added by a concurrent transaction; name='%s'\n", dpt->name);
+				return -EAGAIN;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* drops a config prepared by kznl_commit_prepare(), old is NULL if it is not installed any more */
+static void
+kznl_commit_abort(const struct kz_config *old, struct kz_config *new)
+{
+	/* unlock services in old */
+	if (old != NULL) {
+		struct kz_service *i;
+		list_for_each_entry(i, &old->services.head, list) {
+			kz_service_unlock(i);
+		}
+	}
+
+	kz_config_destroy(new);
+}
+
+/*
+ * Merges the running config and the transaction into a new config without
+ * lookup structures. The objects added by the transaction are moved to the
+ * new config, unless keep_ops is set, in which case they are copied so
+ * that the merge can be repeated.
+ */
+static int
+kznl_commit_prepare(struct kz_transaction *tr, struct kz_config **p_new, bool keep_ops)
 {
 	struct kz_operation *io, *po;
 	int res = 0;
@@ -1106,13 +1336,19 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 			if (io->type == KZNL_OP_DISPATCHER) {
 				const struct kz_dispatcher *dispatcher = (struct kz_dispatcher *) io->data;
 
-				if (dispatcher->num_rule != dispatcher->alloc_rule) {
-					kz_err("rule number mismatch; dispatcher='%s', alloc_rules='%u', num_rules='%u'\n",
-						dispatcher->name, dispatcher->alloc_rule, dispatcher->num_rule);
-					return -EINVAL;
-				}
+				res = kznl_check_dispatcher_rules(dispatcher);
+				if (res < 0)
+					return res;
 			}
 		}
+
+		res = transaction_check_conflicts(tr);
+		if (res < 0)
+			return res;
+
+		res = transaction_check_deleted_in_use(tr);
+		if (res < 0)
+			return res;
 	}
 
 	/* the new config instance */
@@ -1133,6 +1369,11 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 				continue;
 			}
 
+			if (transaction_deleted(tr, KZNL_OP_SERVICE, i->name)) {
+				kz_debug("delete service; name='%s'\n", i->name);
+				continue;
+			}
+
 			svc = kz_service_clone(i);
 			if (svc == NULL)
 				goto mem_error;
@@ -1144,16 +1385,23 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 		/* add services in the transaction */
 		list_for_each_entry_safe(io, po, &tr->op, list) {
 			if (io->type == KZNL_OP_SERVICE) {
-				svc = (struct kz_service *)(io->data);
-				list_del(&io->list);
+				if (keep_ops) {
+					svc = kz_service_clone((struct kz_service *)(io->data));
+					if (svc == NULL)
+						goto mem_error;
+				} else {
+					svc = (struct kz_service *)(io->data);
+					transaction_remove_op(tr, io);
+					kfree(io);
+				}
 				list_add_tail(&svc->list, &new->services.head);
-				kfree(io);
 				kz_debug("add service; name='%s'\n", svc->name);
 				orig = kz_service_lookup_name(old, svc->name);
 				if (orig != NULL) {
 					kz_debug("migrate service session count\n");
 					atomic_set(&svc->session_cnt, kz_service_lock(orig));
 					svc->id = orig->id; /* use the original ID! */
+					kz_reject_limiter_migrate(&svc->reject, orig->reject);
 				}
 			}
 		}
@@ -1166,6 +1414,11 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 		/* clone existing zones */
 		if (!(tr->flags & KZF_TRANSACTION_FLUSH_ZONES)) {
 			list_for_each_entry(i, &old->zones.head, list) {
+				if (transaction_deleted(tr, KZNL_OP_ZONE, i->unique_name)) {
+					kz_debug("delete zone; name='%s'\n", i->unique_name);
+					continue;
+				}
+
 				zone = kz_zone_clone(i);
 				if (zone == NULL)
 					goto mem_error;
@@ -1177,10 +1430,16 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 		/* append zones created in the transaction */
 		list_for_each_entry_safe(io, po, &tr->op, list) {
 			if (io->type == KZNL_OP_ZONE) {
-				zone = (struct kz_zone *)(io->data);
-				list_del(&io->list);
+				if (keep_ops) {
+					zone = kz_zone_clone((struct kz_zone *)(io->data));
+					if (zone == NULL)
+						goto mem_error;
+				} else {
+					zone = (struct kz_zone *)(io->data);
+					transaction_remove_op(tr, io);
+					kfree(io);
+				}
 				list_add_tail(&zone->list, &new->zones.head);
-				kfree(io);
 				kz_debug("add zone; name='%s', depth='%u'\n", zone->unique_name, zone->depth);
 			}
 		}
@@ -1209,13 +1468,19 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 	/* process dispatchers */
 	{
 		struct kz_dispatcher *i, *dpt;
+		bool zones_replaced = !!(tr->flags & KZF_TRANSACTION_FLUSH_ZONES);
+
+		list_for_each_entry(io, &tr->op, list) {
+			if (io->type == KZNL_OP_DELETE &&
+			    ((struct kz_operation_delete *) io->data)->type == KZNL_OP_ZONE)
+				zones_replaced = true;
+		}
 
 		/* clone existing dispatchers */
 		list_for_each_entry(i, &old->dispatchers.head, list) {
-			/* skip service if the FLUSH flag is set and it belongs
-			 * to the same instance */
-			if ((tr->flags & KZF_TRANSACTION_FLUSH_DISPATCHERS) &&
-			    (i->instance->id == tr->instance_id))
+			/* skip dispatcher if the FLUSH flag is set and it belongs
+			 * to the same instance, or if it is deleted or replaced */
+			if (!transaction_dispatcher_kept(tr, i))
 				continue;
 
 			kz_debug("cloning dispatcher; name='%s', alloc_rules='%u'\n", i->name, i->alloc_rule);
@@ -1223,17 +1488,49 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 			dpt = kz_dispatcher_clone(i);
 			if (dpt == NULL)
 				goto mem_error;
+			/* replaced zones may have a different depth and index,
+			 * otherwise the zones keep their position, as new ones
+			 * are appended, so the lookup data can be shared until
+			 * the rules of the clone change */
+			if (zones_replaced)
+				dpt->rules_sorted = false;
+			else
+				dpt->lookup = kz_dispatcher_lookup_get(i->lookup);
 			list_add_tail(&dpt->list, &new->dispatchers.head);
 		}
 
+		/* remove rules deleted in the transaction from the clones */
+		list_for_each_entry(io, &tr->op, list) {
+			const struct kz_operation_delete *del;
+
+			if (io->type != KZNL_OP_DELETE)
+				continue;
+
+			del = (struct kz_operation_delete *) io->data;
+			if (!del->has_rule_id)
+				continue;
+
+			dpt = kz_dispatcher_lookup_name(new, del->name);
+			if (dpt == NULL || dpt->instance->id != tr->instance_id)
+				continue;
+
+			kz_dispatcher_remove_rule(dpt, del->rule_id);
+		}
+
 		/* append dispatcherss created in the transaction */
 		list_for_each_entry_safe(io, po, &tr->op, list) {
 			if (io->type == KZNL_OP_DISPATCHER) {
 				struct kz_dispatcher *dispatcher = (struct kz_dispatcher *) io->data;
 				kz_debug("add dispatcher; name='%s', alloc_rules='%u', num_rules='%u'\n", dispatcher->name, dispatcher->alloc_rule, dispatcher->num_rule);
-				list_del(&io->list);
+				if (keep_ops) {
+					dispatcher = kz_dispatcher_clone(dispatcher);
+					if (dispatcher == NULL)
+						goto mem_error;
+				} else {
+					transaction_remove_op(tr, io);
+					kfree(io);
+				}
 				list_add_tail(&dispatcher->list, &new->dispatchers.head);
-				kfree(io);
 			}
 		}
 
@@ -1243,44 +1540,205 @@ kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction
 		}
 	}
 
-	/* remove binds of transaction owner process */
-	kz_instance_remove_bind(instance, tr->peer_pid, tr);
+	*p_new = new;
+	return 0;
+
+mem_error:
+	kz_err("memory exhausted during kzorp config commit");
+	res = -ENOMEM;
+error:
+	kznl_commit_abort(old, new);
+	return res;
+}
+
+/* builds the lookup structures of a prepared config, does not need the transaction mutex */
+static int
+kznl_commit_build(struct kz_config *new)
+{
+	int res;
 
-	/* build lookup structures */
 	res = kz_head_zone_build(&new->zones);
 	if (res < 0) {
 		kz_err("failed to build zone lookup data structures, aborting\n");
-		goto error;
+		return res;
 	}
 
 	res = kz_head_dispatcher_build(&new->dispatchers);
 	if (res < 0) {
 		kz_err("error building dispatcher lookup structures\n");
-		goto error;
+		return res;
+	}
+
+	res = kz_head_service_build(&new->services);
+	if (res < 0) {
+		kz_err("error building service NAT lookup structures\n");
+		return res;
 	}
 
+	return 0;
+}
+
+static void
+kznl_commit_install(struct kz_instance *instance, struct kz_transaction *tr, struct kz_config *new)
+{
+	/* remove binds of transaction owner process */
+	kz_instance_remove_bind(instance, tr->peer_pid, tr);
+
 	/* all ok, commit finally */
 	kz_debug("install new config\n");
+	new->cookie = tr->cookie;
 	kz_config_swap(new);
-	res = 0;
-	goto free_locals;
+	transaction_config_swapped(tr, new);
+}
 
-mem_error:
-	kz_err("memory exhausted during kzorp config commit");
-	res = -ENOMEM;
+static int
+kznl_recv_commit_transaction(struct kz_instance *instance, struct kz_transaction *tr)
+{
+	struct kz_config *new;
+	int res;
+
+	res = kznl_commit_prepare(tr, &new, false);
+	if (res < 0)
+		return res;
+
+	res = kznl_commit_build(new);
+	if (res < 0) {
+		kznl_commit_abort(tr->cfg, new);
+		return res;
+	}
+
+	kznl_commit_install(instance, tr, new);
+
+	return 0;
+}
+
+/* asynchronous commit */
+
+struct kz_commit_work {
+	struct work_struct work;
+	struct kz_transaction *tr;
+	u_int32_t seq;
+};
+
+static struct workqueue_struct *kz_commit_wq;
+/* set on module unload, no asynchronous commits are queued any more */
+static bool kz_commit_shutdown;
+
+static void
+kznl_commit_notify(const struct kz_transaction * const tr, u_int32_t seq, int res,
+		   const struct kz_config *cfg)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (skb == NULL)
+		goto error;
+
+	hdr = genlmsg_put(skb, tr->peer_pid, seq, &kznl_family, 0, KZNL_MSG_COMMIT_DONE);
+	if (hdr == NULL)
+		goto nla_put_failure;
+
+	NLA_PUT_BE32(skb, KZNL_ATTR_COMMIT_RESULT, htonl(-res));
+	NLA_PUT_BE32(skb, KZNL_ATTR_CONFIG_GENERATION, htonl(cfg->generation));
+	NLA_PUT_TYPE(skb, __be64, KZNL_ATTR_CONFIG_COOKIE, cpu_to_be64(cfg->cookie));
+
+	genlmsg_end(skb, hdr);
+
+	/* the peer may have gone away in the meantime */
+	genlmsg_unicast(&init_net, skb, tr->peer_pid);
+	return;
+
+nla_put_failure:
+	nlmsg_free(skb);
 error:
-	/* unlock services in old */
-	{
-		struct kz_service *i;
-		list_for_each_entry(i, &old->services.head, list) {
-			kz_service_unlock(i);
+	kz_err("failed to send commit notification; pid='%d', res='%d'\n", tr->peer_pid, res);
+}
+
+static void
+kznl_commit_work(struct work_struct *work)
+{
+	struct kz_commit_work *w = container_of(work, struct kz_commit_work, work);
+	struct kz_transaction *tr = w->tr;
+	struct kz_instance *inst;
+	struct kz_config *new;
+	kz_generation_t generation;
+	int res;
+
+	LOCK_TRANSACTIONS();
+
+	for (;;) {
+		/* the transaction is not on the transaction list, so it is
+		 * rebased onto the running config here instead of by
+		 * transaction_config_swapped() */
+		tr->cfg = kz_config_rcu;
+		generation = tr->cfg->generation;
+
+		/* the operations are kept in case the merge has to be repeated */
+		res = kznl_commit_prepare(tr, &new, true);
+		if (res < 0)
+			break;
+
+		/* the new config is private to the work until it is installed */
+		UNLOCK_TRANSACTIONS();
+		res = kznl_commit_build(new);
+		LOCK_TRANSACTIONS();
+
+		if (kz_config_rcu->generation == generation) {
+			if (res < 0)
+				kznl_commit_abort(tr->cfg, new);
+			break;
 		}
+
+		/* another transaction has been committed during the build,
+		 * the old config is being freed, its services must not be touched */
+		kz_debug("config changed during asynchronous commit, merging again; generation='%u', current_generation='%u'\n",
+			 generation, kz_config_rcu->generation);
+		kznl_commit_abort(NULL, new);
 	}
 
-	kz_config_destroy(new);
+	inst = kz_instance_lookup_id(tr->instance_id);
+	if (res == 0)
+		kznl_commit_install(inst, tr, new);
 
-free_locals:
-	return res;
+	kznl_commit_notify(tr, w->seq, res, kz_config_rcu);
+
+	if (inst != NULL)
+		inst->flags &= ~KZF_INSTANCE_TRANS;
+	transaction_destroy(tr);
+
+	UNLOCK_TRANSACTIONS();
+
+	kfree(w);
+}
+
+/* !!! must be called with the transaction mutex held !!!
+ *
+ * Queues the merge of the transaction and the build of the lookup
+ * structures. On success the transaction is owned by the work, which
+ * destroys it.
+ */
+static int
+kznl_commit_async(struct kz_transaction *tr, u_int32_t seq)
+{
+	struct kz_commit_work *w;
+
+	if (kz_commit_shutdown)
+		return -ESHUTDOWN;
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (w == NULL)
+		return -ENOMEM;
+
+	w->tr = tr;
+	w->seq = seq;
+	INIT_WORK(&w->work, kznl_commit_work);
+
+	/* the instance keeps its transaction flag until the work is done */
+	list_del_init(&tr->list);
+	queue_work(kz_commit_wq, &w->work);
+
+	return 0;
 }
 
 static int
@@ -1300,8 +1758,15 @@ kznl_recv_commit(struct sk_buff *skb, struct genl_info *info)
 		goto error_unlock_tr;
 	}
 
+	if (info->attrs[KZNL_ATTR_COMMIT_ASYNC]) {
+		res = kznl_commit_async(tr, info->snd_seq);
+		if (res == 0)
+			goto error_unlock_tr;
+	}
+
 	inst = kz_instance_lookup_id(tr->instance_id);
-	res = kznl_recv_commit_transaction(inst, tr);
+	if (!info->attrs[KZNL_ATTR_COMMIT_ASYNC])
+		res = kznl_recv_commit_transaction(inst, tr);
 
 	if (inst != NULL)
 		inst->flags &= ~KZF_INSTANCE_TRANS;
@@ -1328,37 +1793,205 @@ kznl_recv_setflag(struct sk_buff *skb, struct genl_info *info, unsigned int flag
 		goto error_unlock_tr;
 	}
 
-	/* set the flag in the transaction */
-	tr->flags |= flag;
+	/* set the flag in the transaction */
+	tr->flags |= flag;
+
+error_unlock_tr:
+	UNLOCK_TRANSACTIONS();
+
+	return res;
+}
+
+static int
+kznl_recv_flush_z(struct sk_buff *skb, struct genl_info *info)
+{
+	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_ZONES);
+}
+
+static int
+kznl_recv_flush_s(struct sk_buff *skb, struct genl_info *info)
+{
+	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_SERVICES);
+}
+
+static int
+kznl_recv_flush_d(struct sk_buff *skb, struct genl_info *info)
+{
+	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_DISPATCHERS);
+}
+
+static int
+kznl_recv_flush_b(struct sk_buff *skb, struct genl_info *info)
+{
+	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_BIND);
+}
+
+/* object deletion */
+
+static int
+kznl_recv_delete(struct genl_info *info, enum kznl_op_data_type type,
+		 enum kznl_attr_types name_attr, bool has_rule_id)
+{
+	int res = 0;
+	struct kz_transaction *tr;
+	struct kz_operation_delete *del;
+
+	if (!info->attrs[name_attr]) {
+		kz_err("required attribute missing: name\n");
+		res = -EINVAL;
+		goto error;
+	}
+
+	if (has_rule_id && !info->attrs[KZNL_ATTR_N_DIMENSION_RULE_ID]) {
+		kz_err("required attribute missing: rule id\n");
+		res = -EINVAL;
+		goto error;
+	}
+
+	del = kzalloc(sizeof(struct kz_operation_delete), GFP_KERNEL);
+	if (del == NULL) {
+		res = -ENOMEM;
+		goto error;
+	}
+
+	del->type = type;
+	del->has_rule_id = has_rule_id;
+
+	res = kznl_parse_name_alloc(info->attrs[name_attr], &del->name);
+	if (res < 0) {
+		kz_err("failed to parse name\n");
+		goto error_free_del;
+	}
+
+	if (has_rule_id) {
+		struct kz_dispatcher_n_dimension_rule rule;
+
+		kznl_parse_dispatcher_n_dimension_rule(info->attrs[KZNL_ATTR_N_DIMENSION_RULE_ID], &rule);
+		del->rule_id = rule.id;
+	}
+
+	/* look up transaction */
+	LOCK_TRANSACTIONS();
+
+	tr = transaction_lookup(info->snd_pid);
+	if (tr == NULL) {
+		kz_err("no transaction found; pid='%d'\n", info->snd_pid);
+		res = -ENOENT;
+		goto error_unlock_tr;
+	}
+
+	/* only objects of the running config can be deleted, and each of
+	 * them only once */
+	switch (type) {
+	case KZNL_OP_ZONE:
+		if ((tr->flags & KZF_TRANSACTION_FLUSH_ZONES) ||
+		    transaction_deleted(tr, type, del->name) ||
+		    kz_zone_lookup_name(tr->cfg, del->name) == NULL) {
+			kz_err("zone not found; name='%s'\n", del->name);
+			res = -ENOENT;
+			goto error_unlock_tr;
+		}
+		break;
+
+	case KZNL_OP_SERVICE: {
+		const struct kz_service *svc;
+
+		svc = kz_service_lookup_name(tr->cfg, del->name);
+		if ((tr->flags & KZF_TRANSACTION_FLUSH_SERVICES) ||
+		    transaction_deleted(tr, type, del->name) || svc == NULL) {
+			kz_err("service not found; name='%s'\n", del->name);
+			res = -ENOENT;
+			goto error_unlock_tr;
+		}
+
+		if (svc->instance_id != tr->instance_id) {
+			kz_err("service belongs to a different instance; name='%s'\n", del->name);
+			res = -EPERM;
+			goto error_unlock_tr;
+		}
+		break;
+	}
+
+	case KZNL_OP_DISPATCHER: {
+		const struct kz_dispatcher *dpt;
+
+		dpt = kz_dispatcher_lookup_name(tr->cfg, del->name);
+		if ((tr->flags & KZF_TRANSACTION_FLUSH_DISPATCHERS) || dpt == NULL ||
+		    (has_rule_id ? transaction_rule_deleted(tr, del->name, del->rule_id) :
+				   transaction_deleted(tr, type, del->name))) {
+			kz_err("dispatcher not found; name='%s'\n", del->name);
+			res = -ENOENT;
+			goto error_unlock_tr;
+		}
+
+		if (dpt->instance->id != tr->instance_id) {
+			kz_err("dispatcher belongs to a different instance; name='%s'\n", del->name);
+			res = -EPERM;
+			goto error_unlock_tr;
+		}
+
+		if (has_rule_id) {
+			unsigned int i;
+
+			for (i = 0; i < dpt->num_rule; i++)
+				if (dpt->rule[i].id == del->rule_id)
+					break;
+
+			if (i == dpt->num_rule) {
+				kz_err("rule not found; dispatcher='%s', rule_id='%u'\n", del->name, del->rule_id);
+				res = -ENOENT;
+				goto error_unlock_tr;
+			}
+		}
+		break;
+	}
+
+	default:
+		BUG();
+	}
+
+	/* frees del on failure */
+	res = transaction_add_op(tr, KZNL_OP_DELETE, del, transaction_destroy_delete);
+	if (res < 0)
+		kz_err("failed to queue transaction operation\n");
+
+	UNLOCK_TRANSACTIONS();
+
+	return res;
 
 error_unlock_tr:
 	UNLOCK_TRANSACTIONS();
 
+	kfree(del->name);
+error_free_del:
+	kfree(del);
+
+error:
 	return res;
 }
 
 static int
-kznl_recv_flush_z(struct sk_buff *skb, struct genl_info *info)
+kznl_recv_delete_zone(struct sk_buff *skb, struct genl_info *info)
 {
-	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_ZONES);
+	return kznl_recv_delete(info, KZNL_OP_ZONE, KZNL_ATTR_ZONE_UNAME, false);
 }
 
 static int
-kznl_recv_flush_s(struct sk_buff *skb, struct genl_info *info)
+kznl_recv_delete_service(struct sk_buff *skb, struct genl_info *info)
 {
-	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_SERVICES);
+	return kznl_recv_delete(info, KZNL_OP_SERVICE, KZNL_ATTR_SERVICE_NAME, false);
 }
 
 static int
-kznl_recv_flush_d(struct sk_buff *skb, struct genl_info *info)
+kznl_recv_delete_dispatcher(struct sk_buff *skb, struct genl_info *info)
 {
-	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_DISPATCHERS);
+	return kznl_recv_delete(info, KZNL_OP_DISPATCHER, KZNL_ATTR_DISPATCHER_NAME, false);
 }
 
 static int
-kznl_recv_flush_b(struct sk_buff *skb, struct genl_info *info)
+kznl_recv_delete_rule(struct sk_buff *skb, struct genl_info *info)
 {
-	return kznl_recv_setflag(skb, info, KZF_TRANSACTION_FLUSH_BIND);
+	return kznl_recv_delete(info, KZNL_OP_DISPATCHER, KZNL_ATTR_DISPATCHER_NAME, true);
 }
 
 static int
@@ -1487,7 +2120,8 @@ error:
 
 static int
 kznl_build_zone_add(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int flags,
-		    enum kznl_msg_types msg, const struct kz_zone *zone)
+		    enum kznl_msg_types msg, const struct kz_zone *zone,
+		    const struct kz_config *cfg)
 {
 	void *hdr;
 
@@ -1495,6 +2129,9 @@ kznl_build_zone_add(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int
 	if (!hdr)
 		goto nla_put_failure;
 
+	NLA_PUT_BE32(skb, KZNL_ATTR_ZONE_INDEX, htonl(zone->index));
+	NLA_PUT_BE32(skb, KZNL_ATTR_CONFIG_GENERATION, htonl(kz_generation_get(cfg)));
+
 	kz_debug("flags='%x', family='%d'\n", zone->flags, zone->family);
 	if (zone->flags & KZF_ZONE_HAS_RANGE) {
 		if (kznl_dump_inet_subnet(skb, KZNL_ATTR_ZONE_RANGE, zone->family, &zone->addr, &zone->mask) < 0)
@@ -1522,7 +2159,7 @@ kznl_build_zone(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int flag
 		const struct kz_zone *zone, const struct kz_config * cfg)
 {
 	/* *part_idx and *entry_idx is left pointing the failed item */
-	return kznl_build_zone_add(skb, pid, seq, flags, KZNL_MSG_ADD_ZONE, zone);
+	return kznl_build_zone_add(skb, pid, seq, flags, KZNL_MSG_ADD_ZONE, zone, cfg);
 }
 
 static int
@@ -1761,6 +2398,21 @@ kznl_recv_add_service(struct sk_buff *skb, struct genl_info *info)
 			goto error_put_svc;
 		}
 
+		/* counters are kept even if there is no limit */
+		if (info->attrs[KZNL_ATTR_SERVICE_REJECT_LIMIT]) {
+			res = kznl_parse_service_reject_limit(info->attrs[KZNL_ATTR_SERVICE_REJECT_LIMIT], svc);
+			if (res < 0) {
+				kz_err("failed to parse deny service reject limit\n");
+				goto error_put_svc;
+			}
+		} else {
+			svc->reject = kz_reject_limiter_new(0, 0, 0, 0);
+			if (svc->reject == NULL) {
+				res = -ENOMEM;
+				goto error_put_svc;
+			}
+		}
+
 		kz_debug("service structure created, deny type\n");
 		break;
 
@@ -1791,7 +2443,7 @@ kznl_recv_add_service(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	p = kz_service_lookup_name(tr->cfg, svc->name);
-	if (p != NULL) {
+	if (p != NULL && !transaction_deleted(tr, KZNL_OP_SERVICE, svc->name)) {
 		if ((p->instance_id != tr->instance_id) ||
 		    !(tr->flags & KZF_TRANSACTION_FLUSH_SERVICES)) {
 			kz_err("service with the same name already present; name='%s'\n", svc->name);
@@ -1816,6 +2468,78 @@ error:
 	return res;
 }
 
+static int
+kznl_recv_add_service_nat6(struct genl_info *info, const char *service_name, bool snat)
+{
+#ifndef KZ_NAT_IPV6
+	kz_err("IPv6 NAT is not supported by the kernel; service='%s'\n", service_name);
+	return -EOPNOTSUPP;
+#else
+	int res = 0;
+	struct kz_service *svc;
+	struct kz_transaction *tr;
+	struct kz_nat6_range src, dst, map;
+
+	if (!info->attrs[KZNL_ATTR_SERVICE_NAT6_MAP]) {
+		kz_err("required attributes missing\n");
+		return -EINVAL;
+	}
+
+	memset(&src, 0, sizeof(src));
+	res = kznl_parse_service_nat6_params(info->attrs[KZNL_ATTR_SERVICE_NAT6_SRC], &src);
+	if (res < 0) {
+		kz_err("failed to parse source IPv6 range\n");
+		return res;
+	}
+
+	memset(&dst, 0, sizeof(dst));
+	if (info->attrs[KZNL_ATTR_SERVICE_NAT6_DST]) {
+		res = kznl_parse_service_nat6_params(info->attrs[KZNL_ATTR_SERVICE_NAT6_DST], &dst);
+		if (res < 0) {
+			kz_err("failed to parse destination IPv6 range\n");
+			return res;
+		}
+	}
+
+	memset(&map, 0, sizeof(map));
+	res = kznl_parse_service_nat6_params(info->attrs[KZNL_ATTR_SERVICE_NAT6_MAP], &map);
+	if (res < 0) {
+		kz_err("failed to parse IPv6 range to map to\n");
+		return res;
+	}
+
+	LOCK_TRANSACTIONS();
+
+	tr = transaction_lookup(info->snd_pid);
+	if (tr == NULL) {
+		kz_err("no transaction found; pid='%u'\n", info->snd_pid);
+		res = -ENOENT;
+		goto error_unlock_tr;
+	}
+
+	svc = transaction_service_lookup(tr, service_name);
+	if (svc == NULL) {
+		kz_err("no such service found; name='%s'\n", service_name);
+		res = -ENOENT;
+		goto error_unlock_tr;
+	}
+
+	if (svc->type != KZ_SERVICE_FORWARD) {
+		kz_err("NAT entries can only be added to forwarded services; name='%s'\n", service_name);
+		res = -EINVAL;
+		goto error_unlock_tr;
+	}
+
+	res = kz_service_add_nat6_entry(snat ? &svc->a.fwd.snat6 : &svc->a.fwd.dnat6,
+					&src, &dst, &map);
+
+error_unlock_tr:
+	UNLOCK_TRANSACTIONS();
+
+	return res;
+#endif /* KZ_NAT_IPV6 */
+}
+
 static int
 kznl_recv_add_service_nat(struct sk_buff *skb, struct genl_info *info, bool snat)
 {
@@ -1825,8 +2549,8 @@ kznl_recv_add_service_nat(struct sk_buff *skb, struct genl_info *info, bool snat
 	char *service_name = NULL;
 	struct nf_nat_range src, dst, map;
 
-	if (!info->attrs[KZNL_ATTR_SERVICE_NAME] || !info->attrs[KZNL_ATTR_SERVICE_NAT_SRC] ||
-	    !info->attrs[KZNL_ATTR_SERVICE_NAT_MAP]) {
+	if (!info->attrs[KZNL_ATTR_SERVICE_NAME] ||
+	    (!info->attrs[KZNL_ATTR_SERVICE_NAT_SRC] && !info->attrs[KZNL_ATTR_SERVICE_NAT6_SRC])) {
 		kz_err("required attributes missing\n");
 		res = -EINVAL;
 		goto error;
@@ -1839,6 +2563,18 @@ kznl_recv_add_service_nat(struct sk_buff *skb, struct genl_info *info, bool snat
 		goto error;
 	}
 
+	/* IPv6 entries come with their own set of range attributes */
+	if (info->attrs[KZNL_ATTR_SERVICE_NAT6_SRC]) {
+		res = kznl_recv_add_service_nat6(info, service_name, snat);
+		goto free_name;
+	}
+
+	if (!info->attrs[KZNL_ATTR_SERVICE_NAT_MAP]) {
+		kz_err("required attributes missing\n");
+		res = -EINVAL;
+		goto free_name;
+	}
+
 	memset(&src, 0, sizeof(src));
 	res = kznl_parse_service_nat_params(info->attrs[KZNL_ATTR_SERVICE_NAT_SRC], &src);
 	if (res < 0) {
@@ -1893,6 +2629,7 @@ error_unlock_svc:
 error_unlock_tr:
 	UNLOCK_TRANSACTIONS();
 
+free_name:
 	if (service_name != NULL)
 		kfree(service_name);
 
@@ -1994,6 +2731,8 @@ kznl_build_service_add(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, i
 		if (kznl_dump_service_deny_method(skb, KZNL_ATTR_SERVICE_DENY_IPV6_METHOD,
 						  svc->a.deny.ipv6_reject_method) < 0)
 			goto nla_put_failure;
+		if (kznl_dump_service_reject(skb, svc->reject) < 0)
+			goto nla_put_failure;
 		break;
 
 	case KZ_SERVICE_INVALID:
@@ -2012,11 +2751,63 @@ nla_put_failure:
 	return -1;
 }
 
+static inline void
+kznl_dump_service_nat6_entry(struct kza_service_nat6_params *a, const struct kz_nat6_range *range)
+{
+	u_int32_t flags = 0;
+
+	if (range->flags & IP_NAT_RANGE_MAP_IPS)
+		flags |= KZF_SERVICE_NAT_MAP_IPS;
+	if (range->flags & IP_NAT_RANGE_PROTO_SPECIFIED)
+		flags |= KZF_SERVICE_NAT_MAP_PROTO_SPECIFIC;
+
+	a->flags = htonl(flags);
+	ipv6_addr_copy(&a->min_ip, &range->min_ip);
+	ipv6_addr_copy(&a->max_ip, &range->max_ip);
+	a->min_port = range->min_port;
+	a->max_port = range->max_port;
+}
+
+static int
+kznl_build_service_add_nat6(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int flags,
+			    enum kznl_msg_types msg,
+			    const struct kz_service *svc, const struct kz_service_nat6_entry *entry)
+{
+	void *hdr;
+	struct kza_service_nat6_params nat;
+
+	hdr = genlmsg_put(skb, pid, seq, &kznl_family, flags, msg);
+	if (!hdr)
+		goto nla_put_failure;
+
+	if (kznl_dump_name(skb, KZNL_ATTR_SERVICE_NAME, svc->name) < 0)
+		goto nlmsg_failure;
+
+	kznl_dump_service_nat6_entry(&nat, &entry->src);
+	NLA_PUT(skb, KZNL_ATTR_SERVICE_NAT6_SRC, sizeof(nat), &nat);
+
+	if (!ipv6_addr_any(&entry->dst.min_ip) || !ipv6_addr_any(&entry->dst.max_ip)) {
+		kznl_dump_service_nat6_entry(&nat, &entry->dst);
+		NLA_PUT(skb, KZNL_ATTR_SERVICE_NAT6_DST, sizeof(nat), &nat);
+	}
+
+	kznl_dump_service_nat6_entry(&nat, &entry->map);
+	NLA_PUT(skb, KZNL_ATTR_SERVICE_NAT6_MAP, sizeof(nat), &nat);
+
+	return genlmsg_end(skb, hdr);
+
+nlmsg_failure:
+nla_put_failure:
+	genlmsg_cancel(skb, hdr);
+	return -1;
+}
+
 static int
 kznl_build_service(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int flags,
 		   const struct kz_service *svc)
 {
 	struct kz_service_nat_entry *entry;
+	struct kz_service_nat6_entry *entry6;
 	unsigned char *msg_start;
 
 	msg_start = skb_tail_pointer(skb);
@@ -2038,6 +2829,17 @@ kznl_build_service(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int f
 						       KZNL_MSG_ADD_SERVICE_NAT_DST,
 						       svc, entry) < 0)
 				goto nlmsg_failure;
+		/* IPv6 source and destination */
+		list_for_each_entry(entry6, &svc->a.fwd.snat6, list)
+			if (kznl_build_service_add_nat6(skb, pid, seq, flags,
+							KZNL_MSG_ADD_SERVICE_NAT_SRC,
+							svc, entry6) < 0)
+				goto nlmsg_failure;
+		list_for_each_entry(entry6, &svc->a.fwd.dnat6, list)
+			if (kznl_build_service_add_nat6(skb, pid, seq, flags,
+							KZNL_MSG_ADD_SERVICE_NAT_DST,
+							svc, entry6) < 0)
+				goto nlmsg_failure;
 	}
 
 	return skb_tail_pointer(skb) - msg_start;
@@ -2245,6 +3047,14 @@ kznl_recv_add_dispatcher(struct sk_buff *skb, struct genl_info *info)
 		goto error_unlock_op;
 	}
 
+	/* a running dispatcher is only replaced if it is deleted or flushed in the transaction */
+	p = kz_dispatcher_lookup_name(tr->cfg, dpt->name);
+	if (p != NULL && transaction_dispatcher_kept(tr, p)) {
+		kz_err("dispatcher with the same name already present; name='%s'\n", dpt->name);
+		res = -EEXIST;
+		goto error_unlock_op;
+	}
+
 	res = transaction_add_op(tr, KZNL_OP_DISPATCHER, kz_dispatcher_get(dpt), transaction_destroy_dispatcher);
 	if (res < 0) {
 		kz_err("failed to queue transaction operation\n");
@@ -2318,46 +3128,24 @@ kznl_recv_add_n_dimension_rule(struct sk_buff *skb, struct genl_info *info)
 
 		switch (attr_type) {
 		case KZNL_ATTR_N_DIMENSION_IFACE:
-			rule.alloc_ifname = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_IFGROUP:
-			rule.alloc_ifgroup = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_PROTO:
-			rule.alloc_proto = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_SRC_PORT:
-			rule.alloc_src_port = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_DST_PORT:
-			rule.alloc_dst_port = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_SRC_IP:
-			rule.alloc_src_in_subnet = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_SRC_ZONE:
-			rule.alloc_src_zone = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_DST_IP:
-			rule.alloc_dst_in_subnet = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_DST_ZONE:
-			rule.alloc_dst_zone = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_SRC_IP6:
-			rule.alloc_src_in6_subnet = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_DST_IP6:
-			rule.alloc_dst_in6_subnet = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_DST_IFACE:
-			rule.alloc_dst_ifname = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_DST_IFGROUP:
-			rule.alloc_dst_ifgroup = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
-			break;
 		case KZNL_ATTR_N_DIMENSION_REQID:
-			rule.alloc_reqid = ntohl(*(__be32 *) nla_data(info->attrs[attr_type]));
+			res = kznl_parse_rule_entry_num(info->attrs[attr_type], &rule);
+			if (res < 0) {
+				kz_err("failed to parse the number of entries; attr_type='%d'\n", attr_type);
+				goto error_free_svc_name;
+			}
 			break;
 
 		case KZNL_ATTR_DISPATCHER_NAME:
@@ -2398,6 +3186,21 @@ kznl_recv_add_n_dimension_rule(struct sk_buff *skb, struct genl_info *info)
 		case KZNL_ATTR_COMPAT_VERSION:
 		case KZNL_ATTR_SERVICE_DENY_IPV4_METHOD:
 		case KZNL_ATTR_SERVICE_DENY_IPV6_METHOD:
+		case KZNL_ATTR_SESSION_RECORDS:
+		case KZNL_ATTR_BIND_WEIGHT:
+		case KZNL_ATTR_SERVICE_NAT6_SRC:
+		case KZNL_ATTR_SERVICE_NAT6_DST:
+		case KZNL_ATTR_SERVICE_NAT6_MAP:
+		case KZNL_ATTR_SERVICE_REJECT_LIMIT:
+		case KZNL_ATTR_SERVICE_REJECT_STATS:
+		case KZNL_ATTR_N_DIMENSION_RULE_BULK:
+		case KZNL_ATTR_COMMIT_ASYNC:
+		case KZNL_ATTR_COMMIT_RESULT:
+		case KZNL_ATTR_CONFIG_GENERATION:
+		case KZNL_ATTR_QUERY_BATCH:
+		case KZNL_ATTR_QUERY_BATCH_RESULTS:
+		case KZNL_ATTR_ZONE_INDEX:
+		case KZNL_ATTR_DISPATCHER_INDEX:
 		case KZNL_ATTR_TYPE_COUNT:
 			kz_err("invalid attribute type; attr_type='%d'", attr_type);
 			res = -EINVAL;
@@ -2509,14 +3312,20 @@ kznl_recv_add_n_dimension_rule_entry(struct sk_buff *skb, struct genl_info *info
 			break;
 		}
 		case KZNL_ATTR_N_DIMENSION_IFGROUP: {
-			__be32 *ifgroup = nla_data(info->attrs[attr_type]);
-			rule_entry.ifgroup = ntohl(*ifgroup);
+			res = kznl_parse_be32(info->attrs[attr_type], &rule_entry.ifgroup);
+			if (res < 0) {
+				kz_err("failed to parse interface group\n");
+				goto error_free_names;
+			}
 			rule_entry.has_ifgroup = true;
 			break;
 		}
 		case KZNL_ATTR_N_DIMENSION_PROTO: {
-			u_int8_t *proto = nla_data(info->attrs[attr_type]);
-			rule_entry.proto = *proto;
+			res = kznl_parse_proto(info->attrs[attr_type], &rule_entry.proto);
+			if (res < 0) {
+				kz_err("failed to parse protocol\n");
+				goto error_free_names;
+			}
 			rule_entry.has_proto = true;
 			break;
 		}
@@ -2602,13 +3411,16 @@ kznl_recv_add_n_dimension_rule_entry(struct sk_buff *skb, struct genl_info *info
 			break;
 		}
 		case KZNL_ATTR_N_DIMENSION_DST_IFGROUP: {
-			__be32 *dst_ifgroup = nla_data(info->attrs[attr_type]);
-			rule_entry.dst_ifgroup = ntohl(*dst_ifgroup);
+			res = kznl_parse_be32(info->attrs[attr_type], &rule_entry.dst_ifgroup);
+			if (res < 0) {
+				kz_err("failed to parse destination interface group\n");
+				goto error_free_names;
+			}
 			rule_entry.has_dst_ifgroup = true;
 			break;
 		}
 		case KZNL_ATTR_N_DIMENSION_REQID: {
-			res = kznl_parse_reqid(info->attrs[attr_type], &rule_entry.reqid);
+			res = kznl_parse_be32(info->attrs[attr_type], &rule_entry.reqid);
 			if (res < 0) {
 				kz_err("failed to parse request id\n");
 				goto error_free_names;
@@ -2654,6 +3466,21 @@ kznl_recv_add_n_dimension_rule_entry(struct sk_buff *skb, struct genl_info *info
 		case KZNL_ATTR_COMPAT_VERSION:
 		case KZNL_ATTR_SERVICE_DENY_IPV4_METHOD:
 		case KZNL_ATTR_SERVICE_DENY_IPV6_METHOD:
+		case KZNL_ATTR_SESSION_RECORDS:
+		case KZNL_ATTR_BIND_WEIGHT:
+		case KZNL_ATTR_SERVICE_NAT6_SRC:
+		case KZNL_ATTR_SERVICE_NAT6_DST:
+		case KZNL_ATTR_SERVICE_NAT6_MAP:
+		case KZNL_ATTR_SERVICE_REJECT_LIMIT:
+		case KZNL_ATTR_SERVICE_REJECT_STATS:
+		case KZNL_ATTR_N_DIMENSION_RULE_BULK:
+		case KZNL_ATTR_COMMIT_ASYNC:
+		case KZNL_ATTR_COMMIT_RESULT:
+		case KZNL_ATTR_CONFIG_GENERATION:
+		case KZNL_ATTR_QUERY_BATCH:
+		case KZNL_ATTR_QUERY_BATCH_RESULTS:
+		case KZNL_ATTR_ZONE_INDEX:
+		case KZNL_ATTR_DISPATCHER_INDEX:
 		case KZNL_ATTR_TYPE_COUNT:
 			kz_err("invalid attribute type; attr_type='%d'", attr_type);
 			res = -EINVAL;
@@ -2671,57 +3498,234 @@ kznl_recv_add_n_dimension_rule_entry(struct sk_buff *skb, struct genl_info *info
 		goto error_unlock_tr;
 	}
 
-	rule = transaction_rule_lookup(tr, dpt_name, rule_entry.rule_id);
-	if (rule == NULL) {
-		kz_err("rule not found; id='%d'\n", rule_entry.rule_id);
+	rule = transaction_rule_lookup(tr, dpt_name, rule_entry.rule_id);
+	if (rule == NULL) {
+		kz_err("rule not found; id='%d'\n", rule_entry.rule_id);
+		res = -ENOENT;
+		goto error_unlock_tr;
+	}
+
+	/* look up zones */
+	if (src_zone_name != NULL) {
+		rule_entry.src_zone = lookup_zone_merged(tr, src_zone_name);
+		if (rule_entry.src_zone == NULL) {
+			kz_err("source zone not found; name='%s'\n", src_zone_name);
+			res = -ENOENT;
+			goto error_unlock_zone;
+		}
+	}
+	if (dst_zone_name != NULL) {
+		rule_entry.dst_zone = lookup_zone_merged(tr, dst_zone_name);
+		if (rule_entry.dst_zone == NULL) {
+			kz_err("destination zone not found; name='%s'\n", dst_zone_name);
+			res = -ENOENT;
+			goto error_unlock_zone;
+		}
+	}
+
+	/* check that we have a dispatcher with the same name */
+	dpt = transaction_dispatcher_lookup(tr, dpt_name);
+	if (dpt == NULL) {
+		kz_err("dispatcher not found for the rule; name='%s'\n", dpt_name);
+		res = -ENOENT;
+		goto error_unlock_dpt;
+	}
+
+	res = kz_dispatcher_add_rule_entry(rule, &rule_entry);
+	if (res < 0) {
+		kz_err("failed to add rule; dpt_name='%s', rule_id='%d'\n",
+		       dpt_name, rule_entry.rule_id);
+		goto error_unlock_dpt;
+	}
+
+error_unlock_dpt:
+error_unlock_zone:
+error_unlock_tr:
+	UNLOCK_TRANSACTIONS();
+
+error_free_names:
+	kfree(dpt_name);
+	if (src_zone_name)
+		kfree(src_zone_name);
+	if (dst_zone_name)
+		kfree(dst_zone_name);
+
+error:
+	return res;
+}
+
+/* bulk rule upload */
+
+/* caller must hold the transaction lock */
+static struct kz_zone *
+kznl_rule_bulk_lookup_zone(void *ctx, const char *name)
+{
+	return lookup_zone_merged(ctx, name);
+}
+
+/* caller must hold the transaction lock */
+static int
+kznl_add_rule_bulk_rule(const struct kz_transaction * const tr, struct kz_dispatcher *dpt,
+			const struct kza_rule_bulk_rule *r, int len)
+{
+	struct kz_dispatcher_n_dimension_rule params, *rule;
+	struct kz_dispatcher_n_dimension_rule_entry_params entry;
+	const struct nlattr *head = (const struct nlattr *) (r + 1);
+	const struct nlattr *service_attr, *attr;
+	struct kz_service *svc;
+	char *svc_name;
+	int res, rem;
+
+	len -= sizeof(*r);
+
+	memset(&params, 0, sizeof(params));
+	params.id = ntohl(r->id);
+
+	res = kznl_count_rule_bulk_entries(head, len, &params, &service_attr);
+	if (res < 0)
+		return res;
+
+	res = kznl_parse_name_alloc(service_attr, &svc_name);
+	if (res < 0)
+		return res;
+
+	svc = lookup_service_merged(tr, svc_name);
+	if (svc == NULL) {
+		kz_err("service not found; name='%s'\n", svc_name);
+		kfree(svc_name);
+		return -ENOENT;
+	}
+	kfree(svc_name);
+
+	res = kz_dispatcher_add_rule(dpt, svc, &params);
+	if (res < 0)
+		return res;
+
+	rule = &dpt->rule[dpt->num_rule - 1];
+
+	nla_for_each_attr(attr, head, len, rem) {
+		if (nla_type(attr) == KZNL_ATTR_N_DIMENSION_RULE_SERVICE)
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.rule_id = rule->id;
+
+		res = kznl_parse_rule_entry(attr, &entry, kznl_rule_bulk_lookup_zone, (void *) tr);
+		if (res < 0)
+			return res;
+
+		res = kz_dispatcher_add_rule_entry(rule, &entry);
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+static int
+kznl_recv_add_n_dimension_rule_bulk(struct sk_buff *skb, struct genl_info *info)
+{
+	int res = 0;
+	char *dpt_name = NULL;
+	struct kz_dispatcher *dpt;
+	struct kz_transaction *tr;
+	const struct nlattr *bulk = info->attrs[KZNL_ATTR_N_DIMENSION_RULE_BULK];
+	const struct kza_rule_bulk_header *hdr;
+	const void *pos;
+	unsigned int i, num_rules, first_rule;
+	int rem;
+
+	if (!info->attrs[KZNL_ATTR_DISPATCHER_NAME]) {
+		kz_err("required attribtues missing; attr='dispatcher name'\n");
+		res = -EINVAL;
+		goto error;
+	}
+
+	if (bulk == NULL || nla_len(bulk) < (int) sizeof(*hdr)) {
+		kz_err("required attribtues missing; attr='rule bulk'\n");
+		res = -EINVAL;
+		goto error;
+	}
+
+	hdr = nla_data(bulk);
+	if (ntohl(hdr->version) != KZ_RULE_BULK_VERSION) {
+		kz_err("unsupported rule bulk version; version='%u'\n", ntohl(hdr->version));
+		res = -EINVAL;
+		goto error;
+	}
+
+	res = kznl_parse_name_alloc(info->attrs[KZNL_ATTR_DISPATCHER_NAME], &dpt_name);
+	if (res < 0) {
+		kz_err("failed to parse dispatcher name\n");
+		goto error;
+	}
+
+	/* look up transaction */
+	LOCK_TRANSACTIONS();
+
+	tr = transaction_lookup(info->snd_pid);
+	if (tr == NULL) {
+		kz_err("no transaction found; pid='%d'\n", info->snd_pid);
+		res = -ENOENT;
+		goto error_unlock_tr;
+	}
+
+	dpt = transaction_dispatcher_lookup(tr, dpt_name);
+	if (dpt == NULL) {
+		kz_err("dispatcher not found for the rule; name='%s'\n", dpt_name);
 		res = -ENOENT;
 		goto error_unlock_tr;
 	}
 
-	/* look up zones */
-	if (src_zone_name != NULL) {
-		rule_entry.src_zone = lookup_zone_merged(tr, src_zone_name);
-		if (rule_entry.src_zone == NULL) {
-			kz_err("source zone not found; name='%s'\n", src_zone_name);
-			res = -ENOENT;
-			goto error_unlock_zone;
+	/* the rules of the message are added all or none */
+	first_rule = dpt->num_rule;
+	num_rules = ntohl(hdr->num_rules);
+	pos = hdr + 1;
+	rem = nla_len(bulk) - sizeof(*hdr);
+
+	for (i = 0; i < num_rules; i++) {
+		const struct kza_rule_bulk_rule *r = pos;
+		int len;
+
+		if (rem < (int) sizeof(*r)) {
+			res = -EINVAL;
+			goto error_truncate;
 		}
-	}
-	if (dst_zone_name != NULL) {
-		rule_entry.dst_zone = lookup_zone_merged(tr, dst_zone_name);
-		if (rule_entry.dst_zone == NULL) {
-			kz_err("destination zone not found; name='%s'\n", dst_zone_name);
-			res = -ENOENT;
-			goto error_unlock_zone;
+
+		len = ntohl(r->length);
+		if (len < (int) sizeof(*r) || len > rem || !IS_ALIGNED(len, NLA_ALIGNTO)) {
+			kz_err("invalid bulk rule length; index='%u', length='%d'\n", i, len);
+			res = -EINVAL;
+			goto error_truncate;
 		}
-	}
 
-	/* check that we have a dispatcher with the same name */
-	dpt = transaction_dispatcher_lookup(tr, dpt_name);
-	if (dpt == NULL) {
-		kz_err("dispatcher not found for the rule; name='%s'\n", dpt_name);
-		res = -ENOENT;
-		goto error_unlock_dpt;
+		res = kznl_add_rule_bulk_rule(tr, dpt, r, len);
+		if (res < 0) {
+			kz_err("failed to add bulk rule; dpt_name='%s', rule_id='%u'\n",
+			       dpt_name, ntohl(r->id));
+			goto error_truncate;
+		}
+
+		pos += len;
+		rem -= len;
 	}
 
-	res = kz_dispatcher_add_rule_entry(rule, &rule_entry);
-	if (res < 0) {
-		kz_err("failed to add rule; dpt_name='%s', rule_id='%d'\n",
-		       dpt_name, rule_entry.rule_id);
-		goto error_unlock_dpt;
+	if (rem != 0) {
+		kz_err("trailing data after bulk rules; length='%d'\n", rem);
+		res = -EINVAL;
+		goto error_truncate;
 	}
 
-error_unlock_dpt:
-error_unlock_zone:
+	kz_debug("added bulk rules; dpt_name='%s', num_rules='%u'\n", dpt_name, num_rules);
+	goto error_unlock_tr;
+
+error_truncate:
+	kz_dispatcher_truncate_rules(dpt, first_rule);
+
 error_unlock_tr:
 	UNLOCK_TRANSACTIONS();
 
-error_free_names:
 	kfree(dpt_name);
-	if (src_zone_name)
-		kfree(src_zone_name);
-	if (dst_zone_name)
-		kfree(dst_zone_name);
 
 error:
 	return res;
@@ -2817,6 +3821,15 @@ kznl_parse_bind_alloc(struct nlattr *attrs[], unsigned int instance_id, struct k
 		goto error_free_bind;
 	}
 
+	if (attrs[KZNL_ATTR_BIND_WEIGHT]) {
+		bind->weight = ntohl(nla_get_be32(attrs[KZNL_ATTR_BIND_WEIGHT]));
+		if (bind->weight == 0 || bind->weight > KZ_BIND_WEIGHT_MAX) {
+			kz_err("invalid bind weight; weight='%u', max='%u'\n", bind->weight, KZ_BIND_WEIGHT_MAX);
+			res = -EINVAL;
+			goto error_free_bind;
+		}
+	}
+
 	*_bind = bind;
 	kfree(instance_name);
 
@@ -2898,6 +3911,7 @@ kznl_dump_bind(struct sk_buff *skb, netlink_port_t pid, u_int32_t seq, int flags
 
 	NLA_PUT_U8(skb, KZNL_ATTR_BIND_PROTO, bind->proto);
 	NLA_PUT_BE16(skb, KZNL_ATTR_BIND_PORT, htons(bind->port));
+	NLA_PUT_BE32(skb, KZNL_ATTR_BIND_WEIGHT, htonl(bind->weight));
 
 	if (kznl_dump_name(skb, KZNL_ATTR_INSTANCE_NAME, instance->name) < 0)
 		goto nla_put_failure;
@@ -3123,7 +4137,8 @@ nla_put_failure:
 
 static int
 kznl_build_dispatcher_add(struct sk_buff *skb, u_int32_t pid, u_int32_t seq, int flags,
-			  enum kznl_msg_types msg, const struct kz_dispatcher *dpt)
+			  enum kznl_msg_types msg, const struct kz_dispatcher *dpt,
+			  const struct kz_config *cfg)
 {
 	void *hdr;
 	struct kza_dispatcher_n_dimension_params n_dimension;
@@ -3133,6 +4148,9 @@ kznl_build_dispatcher_add(struct sk_buff *skb, u_int32_t pid, u_int32_t seq, int
 	if (kznl_dump_name(skb, KZNL_ATTR_DISPATCHER_NAME, dpt->name) < 0)
 		goto nla_put_failure;
 
+	NLA_PUT_BE32(skb, KZNL_ATTR_DISPATCHER_INDEX, htonl(dpt->index));
+	NLA_PUT_BE32(skb, KZNL_ATTR_CONFIG_GENERATION, htonl(kz_generation_get(cfg)));
+
 	n_dimension.num_rules = htonl(dpt->num_rule);
 	NLA_PUT(skb, KZNL_ATTR_DISPATCHER_N_DIMENSION_PARAMS, sizeof(n_dimension), &n_dimension);
 
@@ -3145,7 +4163,8 @@ nla_put_failure:
 
 static int
 kznl_build_dispatcher(struct sk_buff *skb, u_int32_t pid, u_int32_t seq, int flags,
-		      const struct kz_dispatcher *dpt, long *part_idx, long *rule_entry_idx)
+		      const struct kz_dispatcher *dpt, const struct kz_config *cfg,
+		      long *part_idx, long *rule_entry_idx)
 {
 	unsigned char *msg_start, *msg_rollback;
 
@@ -3168,7 +4187,7 @@ kznl_build_dispatcher(struct sk_buff *skb, u_int32_t pid, u_int32_t seq, int fla
 
 	if(*part_idx == 0) {
 		msg_rollback = skb_tail_pointer(skb);
-		if (kznl_build_dispatcher_add(skb, pid, seq, flags, KZNL_MSG_ADD_DISPATCHER, dpt) < 0)
+		if (kznl_build_dispatcher_add(skb, pid, seq, flags, KZNL_MSG_ADD_DISPATCHER, dpt, cfg) < 0)
 			goto nlmsg_failure;
 		*part_idx = 1;
 	}
@@ -3286,7 +4305,7 @@ restart:
 		}
 
 		if (kznl_build_dispatcher(skb, NETLINK_CB(cb->skb).pid,
-					  cb->nlh->nlmsg_seq, NLM_F_MULTI, i,
+					  cb->nlh->nlmsg_seq, NLM_F_MULTI, i, cfg,
 					  &cb->args[DISPATCHER_DUMP_ARG_SUBPART],
 					  &cb->args[DISPATCHER_DUMP_ARG_RULE_ENTRY_SUBPART]) < 0) {
 			/* dispatcher dump failed, try to continue from here next time */
@@ -3321,6 +4340,7 @@ kznl_recv_get_dispatcher(struct sk_buff *skb, struct genl_info *info)
 	int netlink_return = 0;
 	char *dpt_name = NULL;
 	struct kz_dispatcher *dpt;
+	const struct kz_config *cfg;
 	struct sk_buff *nskb = NULL;
 	long dpt_item_idx = 0;
 	long rule_entry_idx = 0;
@@ -3340,7 +4360,8 @@ kznl_recv_get_dispatcher(struct sk_buff *skb, struct genl_info *info)
 
 	rcu_read_lock();
 
-	dpt = kz_dispatcher_lookup_name(rcu_dereference(kz_config_rcu), dpt_name);
+	cfg = rcu_dereference(kz_config_rcu);
+	dpt = kz_dispatcher_lookup_name(cfg, dpt_name);
 	if (dpt == NULL) {
 		kz_debug("no such dispatcher found; name='%s'\n", dpt_name);
 		res = -ENOENT;
@@ -3365,7 +4386,7 @@ kznl_recv_get_dispatcher(struct sk_buff *skb, struct genl_info *info)
 
 		ret = kznl_build_dispatcher(nskb, info->snd_pid,
 					    info->snd_seq, 0,
-					    dpt, &dpt_item_idx, &rule_entry_idx);
+					    dpt, cfg, &dpt_item_idx, &rule_entry_idx);
 		netlink_return = genlmsg_reply(nskb, info);
 
 	} while ((ret < 0) && (netlink_return >= 0));
@@ -3459,7 +4480,7 @@ kznl_recv_query(struct sk_buff *skb, struct genl_info *info)
 
 	if (info->attrs[KZNL_ATTR_QUERY_PARAMS_REQID]) {
                 query.reqids.len = 1;
-		res = kznl_parse_reqid(info->attrs[KZNL_ATTR_QUERY_PARAMS_REQID], &query.reqids.vec[0]);
+		res = kznl_parse_be32(info->attrs[KZNL_ATTR_QUERY_PARAMS_REQID], &query.reqids.vec[0]);
 		if (res < 0) {
 			kz_err("failed to parse query attribute\n");
 			goto error;
@@ -3518,6 +4539,167 @@ error:
 	return res;
 }
 
+static int
+kznl_parse_query_batch(const struct netlink_callback *cb,
+		       const struct kza_query_batch_tuple **tuples,
+		       unsigned int *num_queries)
+{
+	const struct nlattr *attr;
+	const struct kza_query_batch_header *hdr;
+	unsigned int len;
+
+	attr = nlmsg_find_attr(cb->nlh, GENL_HDRLEN, KZNL_ATTR_QUERY_BATCH);
+	if (attr == NULL) {
+		kz_err("required attributes missing: attr='query batch'\n");
+		return -EINVAL;
+	}
+
+	len = nla_len(attr);
+	if (len < sizeof(*hdr)) {
+		kz_err("query batch attribute too short; length='%u'\n", len);
+		return -EINVAL;
+	}
+
+	hdr = nla_data(attr);
+	if (ntohl(hdr->version) != KZ_QUERY_BATCH_VERSION) {
+		kz_err("unsupported query batch version; version='%u'\n", ntohl(hdr->version));
+		return -EINVAL;
+	}
+
+	*num_queries = ntohl(hdr->num_queries);
+	if (*num_queries > (len - sizeof(*hdr)) / sizeof(**tuples)) {
+		kz_err("query batch truncated; num_queries='%u', length='%u'\n", *num_queries, len);
+		return -EINVAL;
+	}
+
+	*tuples = (const struct kza_query_batch_tuple *) (hdr + 1);
+
+	return 0;
+}
+
+/* call under rcu_read_lock() */
+static void
+kznl_query_batch_eval(const struct kz_config *cfg, const struct net_device *dev,
+		      const struct kza_query_batch_tuple *t,
+		      struct kza_query_batch_result *r)
+{
+	struct kz_reqids reqids = { .len = 0 };
+	union nf_inet_addr saddr, daddr;
+	struct kz_zone *client_zone, *server_zone;
+	const struct kz_dispatcher_n_dimension_rule *rule;
+
+	r->dispatcher_id = r->client_zone_id = r->server_zone_id =
+		r->service_id = r->rule_id = htonl(KZ_QUERY_BATCH_NO_ID);
+
+	/* same restrictions as in the case of a single query */
+	if (dev == NULL ||
+	    (t->l3proto != NFPROTO_IPV4 && t->l3proto != NFPROTO_IPV6) ||
+	    (t->l4proto != IPPROTO_TCP && t->l4proto != IPPROTO_UDP))
+		return;
+
+	memcpy(&saddr, t->saddr, sizeof(saddr));
+	memcpy(&daddr, t->daddr, sizeof(daddr));
+
+	if (t->reqid != 0) {
+		reqids.vec[0] = ntohl(t->reqid);
+		reqids.len = 1;
+	}
+
+	/* lookup uses per-cpu data mutating it, we must make sure no interruptions on a CPU */
+	local_bh_disable();
+	kz_lookup_session_rule(cfg, &reqids, dev, t->l3proto, &saddr, &daddr,
+			       t->l4proto, ntohs(t->sport), ntohs(t->dport),
+			       &client_zone, &server_zone, &rule, 0);
+	local_bh_enable();
+
+	if (client_zone != NULL)
+		r->client_zone_id = htonl(client_zone->index);
+	if (server_zone != NULL)
+		r->server_zone_id = htonl(server_zone->index);
+	if (rule != NULL) {
+		r->dispatcher_id = htonl(rule->dispatcher->index);
+		r->rule_id = htonl(rule->id);
+		if (rule->service != NULL)
+			r->service_id = htonl(rule->service->id);
+	}
+}
+
+/*
+ * Each call evaluates as many queries as the results of which fit into
+ * the reply, starting at cb->args[0]. Interfaces are looked up by index
+ * without taking a reference; queries with an unknown interface or an
+ * unsupported protocol get KZ_QUERY_BATCH_NO_ID in all fields.
+ */
+static int
+kznl_dump_query_batch(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	const struct kza_query_batch_tuple *tuples;
+	const struct kz_config *cfg;
+	const struct net_device *dev = NULL;
+	struct kza_query_batch_results *results;
+	struct kza_query_batch_result *r;
+	struct nlattr *attr;
+	unsigned int num_queries, first, num_results, room, i;
+	void *hdr;
+	int res;
+
+	res = kznl_parse_query_batch(cb, &tuples, &num_queries);
+	if (res < 0)
+		return res;
+
+	first = cb->args[0];
+	if (first >= num_queries)
+		return 0;
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			  &kznl_family, NLM_F_MULTI, KZNL_MSG_QUERY_BATCH_REPLY);
+	if (hdr == NULL)
+		return -EMSGSIZE;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(kz_config_rcu);
+
+	NLA_PUT_BE32(skb, KZNL_ATTR_CONFIG_GENERATION, htonl(kz_generation_get(cfg)));
+
+	room = skb_tailroom(skb);
+	if (room < nla_total_size(sizeof(*results) + sizeof(*r)))
+		goto nla_put_failure;
+
+	num_results = min((room - nla_total_size(sizeof(*results))) / (unsigned int) sizeof(*r),
+			  num_queries - first);
+
+	attr = nla_reserve(skb, KZNL_ATTR_QUERY_BATCH_RESULTS, sizeof(*results) + num_results * sizeof(*r));
+	if (attr == NULL)
+		goto nla_put_failure;
+
+	results = nla_data(attr);
+	results->first = htonl(first);
+	results->num_results = htonl(num_results);
+	r = (struct kza_query_batch_result *) (results + 1);
+
+	for (i = 0; i < num_results; i++) {
+		const struct kza_query_batch_tuple *t = &tuples[first + i];
+
+		/* queries of a batch tend to come from the same interface */
+		if (dev == NULL || dev->ifindex != ntohl(t->ifindex))
+			dev = dev_get_by_index_rcu(&init_net, ntohl(t->ifindex));
+
+		kznl_query_batch_eval(cfg, dev, t, &r[i]);
+	}
+
+	rcu_read_unlock();
+
+	genlmsg_end(skb, hdr);
+	cb->args[0] = first + num_results;
+
+	return skb->len;
+
+nla_put_failure:
+	rcu_read_unlock();
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
 static int
 kznl_build_get_version_resp(struct sk_buff *skb, u_int32_t pid, u_int32_t seq, int flags,
 			    enum kznl_msg_types msg)
@@ -3565,6 +4747,206 @@ error:
 	return res;
 }
 
+/***********************************************************
+ * Session events
+ ***********************************************************/
+
+/* number of records collected on a CPU before they are sent */
+#define KZ_SESSION_EVENT_BATCH_SIZE 32
+/* maximum time a record may wait in a partially filled batch */
+#define KZ_SESSION_EVENT_FLUSH_DELAY (HZ / 10)
+
+struct kz_session_event_batch {
+	spinlock_t lock;
+	struct timer_list timer;
+	unsigned int count;
+	struct kza_session_record records[KZ_SESSION_EVENT_BATCH_SIZE];
+};
+
+static DEFINE_PER_CPU(struct kz_session_event_batch, kz_session_event_batch);
+
+static struct genl_multicast_group kznl_session_mcgrp = {
+	.name = KZNL_MCGRP_SESSION_EVENTS,
+};
+
+/* !!! must be called with the batch lock held !!!
+ *
+ * Builds a message from the records pending in the batch and empties
+ * the batch. The message is sent by the caller after releasing the lock.
+ */
+static struct sk_buff *
+kz_session_event_batch_build(struct kz_session_event_batch *batch)
+{
+	struct sk_buff *skb;
+	void *hdr;
+	const size_t len = batch->count * sizeof(struct kza_session_record);
+
+	if (batch->count == 0)
+		return NULL;
+
+	skb = genlmsg_new(nla_total_size(len), GFP_ATOMIC);
+	if (skb == NULL)
+		goto out;
+
+	hdr = genlmsg_put(skb, 0, 0, &kznl_family, 0, KZNL_MSG_SESSION_EVENT);
+	if (hdr == NULL)
+		goto nla_put_failure;
+
+	NLA_PUT(skb, KZNL_ATTR_SESSION_RECORDS, len, batch->records);
+
+	genlmsg_end(skb, hdr);
+	goto out;
+
+nla_put_failure:
+	nlmsg_free(skb);
+	skb = NULL;
+
+out:
+	batch->count = 0;
+	return skb;
+}
+
+static void
+kz_session_event_send(struct sk_buff *skb)
+{
+	if (skb != NULL)
+		genlmsg_multicast(skb, 0, kznl_session_mcgrp.id, GFP_ATOMIC);
+}
+
+static void
+kz_session_event_timer(unsigned long data)
+{
+	struct kz_session_event_batch *batch = (struct kz_session_event_batch *) data;
+	struct sk_buff *skb;
+
+	spin_lock_bh(&batch->lock);
+	skb = kz_session_event_batch_build(batch);
+	spin_unlock_bh(&batch->lock);
+
+	kz_session_event_send(skb);
+}
+
+static inline void
+kz_session_record_fill_addr(__be32 *dst, u8 l3proto, const union nf_inet_addr *addr)
+{
+	memset(dst, 0, sizeof(__be32) * 4);
+
+	switch (l3proto) {
+	case NFPROTO_IPV4:
+		dst[0] = addr->ip;
+		break;
+	case NFPROTO_IPV6:
+		memcpy(dst, addr->ip6, sizeof(__be32) * 4);
+		break;
+	default:
+		BUG();
+	}
+}
+
+/**
+ * kz_session_event - queue a session record for the session event multicast group
+ * @event: type of the event
+ * @verdict: netfilter verdict of the packet starting the session
+ * @sid: session id or 0 if no session id has been assigned
+ * @svc: service of the session or NULL
+ * @czone: client zone or NULL
+ * @szone: server zone or NULL
+ * @l3proto: L3 protocol (NFPROTO_IPV4 or NFPROTO_IPV6)
+ * @saddr: source address, only the first four bytes are used for IPv4
+ * @daddr: destination address, only the first four bytes are used for IPv4
+ * @l4proto: L4 protocol
+ * @sport: source port in network byte order
+ * @dport: destination port in network byte order
+ *
+ * Records are collected in a per-CPU batch which is sent either when it
+ * fills up or when KZ_SESSION_EVENT_FLUSH_DELAY elapses after the first
+ * record has been queued.
+ *
+ * Returns true if the record has been queued, false if nobody listens to
+ * the multicast group. In the latter case the caller is expected to fall
+ * back to text logging.
+ */
+bool
+kz_session_event(enum kz_session_event_type event, unsigned int verdict, unsigned long sid,
+		 const struct kz_service *svc,
+		 const struct kz_zone *czone, const struct kz_zone *szone,
+		 u8 l3proto, const union nf_inet_addr *saddr, const union nf_inet_addr *daddr,
+		 u8 l4proto, __be16 sport, __be16 dport)
+{
+	struct kz_session_event_batch *batch;
+	struct kza_session_record *rec;
+	struct sk_buff *skb = NULL;
+
+	if (!netlink_has_listeners(init_net.genl_sock, kznl_session_mcgrp.id))
+		return false;
+
+	local_bh_disable();
+	batch = &__get_cpu_var(kz_session_event_batch);
+	spin_lock(&batch->lock);
+
+	rec = &batch->records[batch->count++];
+	rec->sid = cpu_to_be64(sid);
+	rec->service_id = htonl(svc != NULL ? svc->id : 0);
+	rec->client_zone_id = htonl(czone != NULL ? czone->index : KZ_SESSION_RECORD_NO_ZONE);
+	rec->server_zone_id = htonl(szone != NULL ? szone->index : KZ_SESSION_RECORD_NO_ZONE);
+	kz_session_record_fill_addr(rec->saddr, l3proto, saddr);
+	kz_session_record_fill_addr(rec->daddr, l3proto, daddr);
+	rec->sport = sport;
+	rec->dport = dport;
+	rec->l3proto = l3proto;
+	rec->l4proto = l4proto;
+	rec->event = event;
+	rec->verdict = verdict;
+
+	if (batch->count == KZ_SESSION_EVENT_BATCH_SIZE)
+		skb = kz_session_event_batch_build(batch);
+	else if (batch->count == 1)
+		mod_timer(&batch->timer, jiffies + KZ_SESSION_EVENT_FLUSH_DELAY);
+
+	spin_unlock(&batch->lock);
+	local_bh_enable();
+
+	kz_session_event_send(skb);
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(kz_session_event);
+
+static void __init
+kz_session_event_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct kz_session_event_batch *batch = &per_cpu(kz_session_event_batch, cpu);
+
+		spin_lock_init(&batch->lock);
+		setup_timer(&batch->timer, kz_session_event_timer, (unsigned long) batch);
+		batch->count = 0;
+	}
+}
+
+/* stops the flush timers and sends the records still pending, must be
+ * called before the multicast group is unregistered */
+static void
+kz_session_event_cleanup(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct kz_session_event_batch *batch = &per_cpu(kz_session_event_batch, cpu);
+		struct sk_buff *skb;
+
+		del_timer_sync(&batch->timer);
+
+		spin_lock_bh(&batch->lock);
+		skb = kz_session_event_batch_build(batch);
+		spin_unlock_bh(&batch->lock);
+
+		kz_session_event_send(skb);
+	}
+}
+
 /***********************************************************
  * Netlink event handler
  ***********************************************************/
@@ -3725,6 +5107,36 @@ static struct genl_ops kznl_ops[] = {
 		.doit = kznl_recv_flush_b,
 		.flags = GENL_ADMIN_PERM,
 	},
+	{
+		.cmd = KZNL_MSG_DELETE_ZONE,
+		.doit = kznl_recv_delete_zone,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = KZNL_MSG_DELETE_SERVICE,
+		.doit = kznl_recv_delete_service,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = KZNL_MSG_DELETE_DISPATCHER,
+		.doit = kznl_recv_delete_dispatcher,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = KZNL_MSG_DELETE_RULE,
+		.doit = kznl_recv_delete_rule,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = KZNL_MSG_ADD_RULE_BULK,
+		.doit = kznl_recv_add_n_dimension_rule_bulk,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = KZNL_MSG_QUERY_BATCH,
+		.dumpit = kznl_dump_query_batch,
+		.flags = GENL_ADMIN_PERM,
+	},
 };
 
 static struct notifier_block kz_rtnl_notifier = {
@@ -3735,9 +5147,6 @@ int __init kz_netlink_init(void)
 {
 	int res = -ENOMEM;
 
-	/* initialize data structures */
-	transaction_init();
-
 	/* register netlink notifier and genetlink family */
 	netlink_register_notifier(&kz_rtnl_notifier);
 	res = genl_register_family_with_ops(&kznl_family, kznl_ops, ARRAY_SIZE(kznl_ops));
@@ -3746,8 +5155,26 @@ int __init kz_netlink_init(void)
 		goto cleanup_notifier;
 	}
 
+	kz_session_event_init();
+	res = genl_register_mc_group(&kznl_family, &kznl_session_mcgrp);
+	if (res < 0) {
+		kz_err("failed to register session event multicast group\n");
+		goto cleanup_family;
+	}
+
+	/* ordered, asynchronous commits are installed in the order they were sent */
+	kz_commit_wq = create_singlethread_workqueue("kzorp_commit");
+	if (kz_commit_wq == NULL) {
+		kz_err("failed to create commit workqueue\n");
+		res = -ENOMEM;
+		goto cleanup_family;
+	}
+
 	return res;
 
+cleanup_family:
+	genl_unregister_family(&kznl_family);
+
 cleanup_notifier:
 	netlink_unregister_notifier(&kz_rtnl_notifier);
 
@@ -3756,6 +5183,20 @@ cleanup_notifier:
 
 void kz_netlink_cleanup(void)
 {
+	/* refuse new asynchronous commits and finish the pending ones,
+	 * their notifications are sent through the family */
+	LOCK_TRANSACTIONS();
+	kz_commit_shutdown = true;
+	UNLOCK_TRANSACTIONS();
+
+	flush_workqueue(kz_commit_wq);
+	destroy_workqueue(kz_commit_wq);
+
+	/* session events are only queued by xt_KZORP, which is gone by
+	 * now, send what is left while the multicast group exists */
+	kz_session_event_cleanup();
+
+	/* unregistering the family removes its multicast groups as well */
 	genl_unregister_family(&kznl_family);
 	netlink_unregister_notifier(&kz_rtnl_notifier);
 
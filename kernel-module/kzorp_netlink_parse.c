@@ -0,0 +1,585 @@
+/*
+ * KZorp netlink attribute parsing
+ *
+ * Copyright (C) 2006-2010, BalaBit IT Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/*
+ * Built into the kernel module and, with KZ_USERSPACE, into
+ * libkzorp-lookup, which loads the same configuration messages and
+ * checks the rules it builds from them in the same way.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/in.h>
+#include <net/ipv6.h>
+#include "include/kzorp_netlink_parse.h"
+
+static inline bool
+kznl_name_attr_valid(const struct nlattr *attr)
+{
+	const struct kza_name *a = kznl_attr_data(attr, sizeof(struct kza_name));
+
+	return a != NULL && ntohs(a->length) <= nla_len(attr) - sizeof(struct kza_name);
+}
+
+int
+kznl_parse_name(const struct nlattr *attr, char *name, unsigned long nsize)
+{
+	const struct kza_name *a = nla_data(attr);
+	unsigned long length;
+
+	if (!kznl_name_attr_valid(attr)) {
+		kz_err("invalid name attribute\n");
+		return -EINVAL;
+	}
+
+	length = (unsigned long) ntohs(a->length);
+	if (nsize < length + 1) {
+		kz_err("invalid target length; dst_size='%lu', len='%lu'\n", nsize, length);
+		return -EINVAL;
+	}
+
+	memcpy(name, a->name, length);
+	name[length] = 0;
+
+	return 0;
+}
+
+int
+kznl_parse_name_alloc(const struct nlattr *attr, char **name)
+{
+	const struct kza_name *a = nla_data(attr);
+	unsigned long length;
+	char *n;
+	int res;
+
+	if (!kznl_name_attr_valid(attr))
+		return -EINVAL;
+
+	length = ntohs(a->length);
+	if (length == 0 || length > KZ_ATTR_NAME_MAX_LENGTH)
+		return -EINVAL;
+
+	n = kzalloc(length + 1, GFP_KERNEL);
+	if (n == NULL)
+		return -ENOMEM;
+
+	res = kznl_parse_name(attr, n, length + 1);
+	if (res < 0) {
+		kfree(n);
+		return res;
+	}
+
+	*name = n;
+
+	return 0;
+}
+
+int
+kznl_parse_in_addr(const struct nlattr *attr, struct in_addr *addr)
+{
+	const struct kz_in_subnet *a = kznl_attr_data(attr, sizeof(struct in_addr));
+
+	if (a == NULL)
+		return -EINVAL;
+
+	addr->s_addr = a->addr.s_addr;
+
+	kz_debug("parsed IPv4 address='%pI4'\n", addr);
+
+	return 0;
+}
+
+int
+kznl_parse_in6_addr(const struct nlattr *attr, struct in6_addr *addr)
+{
+	const struct kz_in6_subnet *a = kznl_attr_data(attr, sizeof(struct in6_addr));
+
+	if (a == NULL)
+		return -EINVAL;
+
+	ipv6_addr_copy(addr, &a->addr);
+
+	kz_debug("parsed IPv6 address='%pI6'\n", addr);
+
+	return 0;
+}
+
+int
+kznl_parse_inet_addr(const struct nlattr *attr, union nf_inet_addr *addr, sa_family_t *family)
+{
+	const struct nlattr *nested;
+	int res, rem;
+
+	if (kznl_attr_data(attr, NLA_HDRLEN) == NULL) {
+		kz_err("required attributes missing: address\n");
+		return -EINVAL;
+	}
+
+	nla_for_each_nested(nested, attr, rem) {
+		switch (nla_type(nested)) {
+		case KZNL_ATTR_INET_ADDR:
+			res = kznl_parse_in_addr(nested, &addr->in);
+			if (res < 0) {
+				kz_err("failed to parse IPv4 address\n");
+				return res;
+			}
+			*family = AF_INET;
+			return 0;
+		case KZNL_ATTR_INET6_ADDR:
+			res = kznl_parse_in6_addr(nested, &addr->in6);
+			if (res < 0) {
+				kz_err("failed to parse IPv6 address\n");
+				return res;
+			}
+			*family = AF_INET6;
+			return 0;
+		}
+	}
+
+	kz_err("required attributes missing: address\n");
+	return -EINVAL;
+}
+
+int
+kznl_parse_in_subnet(const struct nlattr *attr, struct in_addr *subnet_addr, struct in_addr *subnet_mask)
+{
+	const struct kz_in_subnet *a = kznl_attr_data(attr, sizeof(struct kz_in_subnet));
+	u_int32_t mask, i;
+
+	if (a == NULL)
+		return -EINVAL;
+
+	subnet_addr->s_addr = a->addr.s_addr;
+	subnet_mask->s_addr = a->mask.s_addr;
+
+	kz_debug("address='%pI4', mask='%pI4'\n", subnet_addr, subnet_mask);
+
+	mask = ntohl(subnet_mask->s_addr);
+	for (i = 1 << 31; i && (mask & i); i >>= 1)
+		;
+	if (i && (i - 1) & mask)
+		return -EINVAL;
+
+	return 0;
+}
+
+int
+kznl_parse_in6_subnet(const struct nlattr *attr, struct in6_addr *addr, struct in6_addr *mask)
+{
+	const struct kz_in6_subnet *a = kznl_attr_data(attr, sizeof(struct kz_in6_subnet));
+	struct in6_addr pfx;
+	int prefixlen;
+
+	if (a == NULL)
+		return -EINVAL;
+
+	ipv6_addr_copy(addr, &a->addr);
+	ipv6_addr_copy(mask, &a->mask);
+
+	kz_debug("address='%pI6', mask='%pI6'\n", addr, mask);
+
+	ipv6_addr_set(&pfx, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff);
+	prefixlen = ipv6_addr_diff(mask, &pfx);
+	ipv6_addr_prefix(&pfx, mask, prefixlen);
+	if (!ipv6_addr_equal(&pfx, mask))
+		return -EINVAL;
+
+	return 0;
+}
+
+int
+kznl_parse_inet_subnet(const struct nlattr *attr, union nf_inet_addr *addr,
+		       union nf_inet_addr *mask, sa_family_t *family)
+{
+	const struct nlattr *nested;
+	int res, rem;
+
+	if (kznl_attr_data(attr, NLA_HDRLEN) == NULL) {
+		kz_err("required attributes missing: subnet\n");
+		return -EINVAL;
+	}
+
+	nla_for_each_nested(nested, attr, rem) {
+		switch (nla_type(nested)) {
+		case KZNL_ATTR_INET_SUBNET:
+			res = kznl_parse_in_subnet(nested, &addr->in, &mask->in);
+			if (res < 0) {
+				kz_err("failed to parse IPv4 subnet\n");
+				return res;
+			}
+			*family = AF_INET;
+			return 0;
+		case KZNL_ATTR_INET6_SUBNET:
+			res = kznl_parse_in6_subnet(nested, &addr->in6, &mask->in6);
+			if (res < 0) {
+				kz_err("failed to parse IPv6 subnet\n");
+				return res;
+			}
+			*family = AF_INET6;
+			return 0;
+		}
+	}
+
+	kz_err("required attributes missing: subnet\n");
+	return -EINVAL;
+}
+
+int
+kznl_parse_port(const struct nlattr *attr, __u16 *_port)
+{
+	const __be16 *a = kznl_attr_data(attr, sizeof(__be16));
+	__u16 port;
+
+	if (a == NULL)
+		return -EINVAL;
+
+	port = ntohs(*a);
+	if (port == 0) {
+		kz_err("invalid port number received; port='%hu'", port);
+		return -EINVAL;
+	}
+
+	*_port = port;
+
+	return 0;
+}
+
+int
+kznl_parse_port_range(const struct nlattr *attr, u_int16_t *range_from, u_int16_t *range_to)
+{
+	const struct kza_port_range *a = kznl_attr_data(attr, sizeof(struct kza_port_range));
+	u_int16_t from, to;
+
+	if (a == NULL)
+		return -EINVAL;
+
+	from = ntohs(a->from);
+	to = ntohs(a->to);
+	if (to < from)
+		return -EINVAL;
+
+	*range_from = from;
+	*range_to = to;
+
+	return 0;
+}
+
+int
+kznl_parse_proto(const struct nlattr *attr, __u8 *_proto)
+{
+	const __u8 *a = kznl_attr_data(attr, sizeof(__u8));
+
+	if (a == NULL)
+		return -EINVAL;
+
+	*_proto = *a;
+
+	return 0;
+}
+
+int
+kznl_parse_be32(const struct nlattr *attr, __u32 *value)
+{
+	const __be32 *a = kznl_attr_data(attr, sizeof(__be32));
+
+	if (a == NULL)
+		return -EINVAL;
+
+	*value = ntohl(*a);
+
+	return 0;
+}
+
+int
+kznl_parse_service_params(const struct nlattr *attr, struct kz_service *svc)
+{
+	const struct kza_service_params *a = kznl_attr_data(attr, sizeof(struct kza_service_params));
+	u_int32_t new_flags;
+
+	if (a == NULL)
+		return -EINVAL;
+
+	new_flags = ntohl(a->flags);
+	if (a->type <= KZ_SERVICE_INVALID || a->type >= KZ_SERVICE_TYPE_COUNT)
+		return -EINVAL;
+	if ((new_flags | KZF_SERVICE_PUBLIC_FLAGS) != KZF_SERVICE_PUBLIC_FLAGS)
+		return -EINVAL;
+
+	svc->type = (enum kz_service_type) a->type;
+	svc->flags = new_flags;
+
+	return 0;
+}
+
+/* parses a single dimension attribute of a rule entry or of a bulk rule record */
+int
+kznl_parse_rule_entry(const struct nlattr *attr,
+		      struct kz_dispatcher_n_dimension_rule_entry_params *entry,
+		      kznl_zone_lookup_fn lookup_zone, void *ctx)
+{
+	char *zone_name;
+	struct kz_zone **zone;
+	int res = 0;
+
+	switch (nla_type(attr)) {
+	case KZNL_ATTR_N_DIMENSION_IFACE:
+		entry->has_ifname = true;
+		return kznl_parse_name(attr, (char *) &entry->ifname, sizeof(entry->ifname));
+	case KZNL_ATTR_N_DIMENSION_DST_IFACE:
+		entry->has_dst_ifname = true;
+		return kznl_parse_name(attr, (char *) &entry->dst_ifname, sizeof(entry->dst_ifname));
+	case KZNL_ATTR_N_DIMENSION_IFGROUP:
+		entry->has_ifgroup = true;
+		return kznl_parse_be32(attr, &entry->ifgroup);
+	case KZNL_ATTR_N_DIMENSION_DST_IFGROUP:
+		entry->has_dst_ifgroup = true;
+		return kznl_parse_be32(attr, &entry->dst_ifgroup);
+	case KZNL_ATTR_N_DIMENSION_PROTO:
+		entry->has_proto = true;
+		return kznl_parse_proto(attr, &entry->proto);
+	case KZNL_ATTR_N_DIMENSION_SRC_PORT:
+		entry->has_src_port = true;
+		return kznl_parse_port_range(attr, &entry->src_port.from, &entry->src_port.to);
+	case KZNL_ATTR_N_DIMENSION_DST_PORT:
+		entry->has_dst_port = true;
+		return kznl_parse_port_range(attr, &entry->dst_port.from, &entry->dst_port.to);
+	case KZNL_ATTR_N_DIMENSION_SRC_IP:
+		entry->has_src_in_subnet = true;
+		return kznl_parse_in_subnet(attr, &entry->src_in_subnet.addr, &entry->src_in_subnet.mask);
+	case KZNL_ATTR_N_DIMENSION_DST_IP:
+		entry->has_dst_in_subnet = true;
+		return kznl_parse_in_subnet(attr, &entry->dst_in_subnet.addr, &entry->dst_in_subnet.mask);
+	case KZNL_ATTR_N_DIMENSION_SRC_IP6:
+		entry->has_src_in6_subnet = true;
+		return kznl_parse_in6_subnet(attr, &entry->src_in6_subnet.addr, &entry->src_in6_subnet.mask);
+	case KZNL_ATTR_N_DIMENSION_DST_IP6:
+		entry->has_dst_in6_subnet = true;
+		return kznl_parse_in6_subnet(attr, &entry->dst_in6_subnet.addr, &entry->dst_in6_subnet.mask);
+	case KZNL_ATTR_N_DIMENSION_REQID:
+		entry->has_reqid = true;
+		return kznl_parse_be32(attr, &entry->reqid);
+	case KZNL_ATTR_N_DIMENSION_SRC_ZONE:
+		entry->has_src_zone = true;
+		zone = &entry->src_zone;
+		break;
+	case KZNL_ATTR_N_DIMENSION_DST_ZONE:
+		entry->has_dst_zone = true;
+		zone = &entry->dst_zone;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	res = kznl_parse_name_alloc(attr, &zone_name);
+	if (res < 0)
+		return res;
+
+	*zone = lookup_zone(ctx, zone_name);
+	if (*zone == NULL) {
+		kz_err("zone not found; name='%s'\n", zone_name);
+		res = -ENOENT;
+	}
+
+	kfree(zone_name);
+
+	return res;
+}
+
+/* parses the number of entries announced for a dimension in a rule message */
+int
+kznl_parse_rule_entry_num(const struct nlattr *attr, struct kz_dispatcher_n_dimension_rule *rule)
+{
+	switch (nla_type(attr)) {
+#define KZNL_PARSE_ENTRY_NUM(DIM_NAME, NL_ATTR_NAME, ...) \
+	case KZNL_ATTR_N_DIMENSION_##NL_ATTR_NAME: \
+		return kznl_parse_be32(attr, &rule->alloc_##DIM_NAME)
+
+	KZORP_DIM_LIST(KZNL_PARSE_ENTRY_NUM, ;);
+
+#undef KZNL_PARSE_ENTRY_NUM
+	default:
+		return -EINVAL;
+	}
+}
+
+/* attributes in a bulk record are not checked by genetlink, validate their length here */
+static bool
+kznl_rule_bulk_attr_valid(const struct nlattr *attr)
+{
+	const int len = nla_len(attr);
+
+	switch (nla_type(attr)) {
+	case KZNL_ATTR_N_DIMENSION_RULE_SERVICE:
+	case KZNL_ATTR_N_DIMENSION_IFACE:
+	case KZNL_ATTR_N_DIMENSION_DST_IFACE:
+	case KZNL_ATTR_N_DIMENSION_SRC_ZONE:
+	case KZNL_ATTR_N_DIMENSION_DST_ZONE:
+		return len >= (int) sizeof(struct kza_name) &&
+		       ntohs(((struct kza_name *) nla_data(attr))->length) <= len - sizeof(struct kza_name);
+	case KZNL_ATTR_N_DIMENSION_PROTO:
+		return len >= (int) sizeof(u_int8_t);
+	case KZNL_ATTR_N_DIMENSION_SRC_PORT:
+	case KZNL_ATTR_N_DIMENSION_DST_PORT:
+		return len >= (int) sizeof(struct kza_port_range);
+	case KZNL_ATTR_N_DIMENSION_SRC_IP:
+	case KZNL_ATTR_N_DIMENSION_DST_IP:
+		return len >= (int) sizeof(struct kz_in_subnet);
+	case KZNL_ATTR_N_DIMENSION_SRC_IP6:
+	case KZNL_ATTR_N_DIMENSION_DST_IP6:
+		return len >= (int) sizeof(struct kz_in6_subnet);
+	case KZNL_ATTR_N_DIMENSION_IFGROUP:
+	case KZNL_ATTR_N_DIMENSION_DST_IFGROUP:
+	case KZNL_ATTR_N_DIMENSION_REQID:
+		return len >= (int) sizeof(__be32);
+	default:
+		return false;
+	}
+}
+
+/* counts the entries of each dimension in a bulk record */
+int
+kznl_count_rule_bulk_entries(const struct nlattr *head, int len,
+			     struct kz_dispatcher_n_dimension_rule *rule,
+			     const struct nlattr **service)
+{
+	const struct nlattr *attr;
+	int rem;
+
+	*service = NULL;
+
+	nla_for_each_attr(attr, head, len, rem) {
+		if (!kznl_rule_bulk_attr_valid(attr)) {
+			kz_err("invalid attribute in bulk rule; rule_id='%u', attr_type='%d'\n",
+			       rule->id, nla_type(attr));
+			return -EINVAL;
+		}
+
+		switch (nla_type(attr)) {
+		case KZNL_ATTR_N_DIMENSION_RULE_SERVICE:
+			if (*service != NULL)
+				return -EINVAL;
+			*service = attr;
+			break;
+		case KZNL_ATTR_N_DIMENSION_IFACE:
+			rule->alloc_ifname++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_IFGROUP:
+			rule->alloc_ifgroup++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_PROTO:
+			rule->alloc_proto++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_SRC_PORT:
+			rule->alloc_src_port++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_DST_PORT:
+			rule->alloc_dst_port++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_SRC_IP:
+			rule->alloc_src_in_subnet++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_SRC_ZONE:
+			rule->alloc_src_zone++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_DST_IP:
+			rule->alloc_dst_in_subnet++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_DST_ZONE:
+			rule->alloc_dst_zone++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_SRC_IP6:
+			rule->alloc_src_in6_subnet++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_DST_IP6:
+			rule->alloc_dst_in6_subnet++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_DST_IFACE:
+			rule->alloc_dst_ifname++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_DST_IFGROUP:
+			rule->alloc_dst_ifgroup++;
+			break;
+		case KZNL_ATTR_N_DIMENSION_REQID:
+			rule->alloc_reqid++;
+			break;
+		}
+	}
+
+	if (rem != 0 || *service == NULL) {
+		kz_err("malformed bulk rule; rule_id='%u'\n", rule->id);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ * Rule checks
+ ***********************************************************/
+
+/* checks that a rule with the given id may be appended to the dispatcher */
+int
+kznl_check_rule_add(const struct kz_dispatcher *d, u_int32_t id)
+{
+	int64_t last_id = -1L;
+
+	if (d->num_rule + 1 > d->alloc_rule) {
+		kz_err("each rule has already been added to this dispatcher; num_rule='%d'\n",
+		       d->alloc_rule);
+		return -EINVAL;
+	}
+
+	/* check that the ID of the rule to be added is larger than
+	 * the ID of the last rule */
+	if (d->num_rule > 0)
+		last_id = d->rule[d->num_rule - 1].id;
+
+	if (id <= last_id) {
+		kz_err("rule id is not larger than the id of the last rule; id='%u', last_id='%lld'\n", id, last_id);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* checks that each dimension of the entry fits into the number of entries announced for the rule */
+int
+kznl_check_rule_entry(const struct kz_dispatcher_n_dimension_rule *rule,
+		      const struct kz_dispatcher_n_dimension_rule_entry_params *entry)
+{
+#define KZNL_CHECK_ENTRY_NUM(DIM_NAME, ...) \
+	if (entry->has_##DIM_NAME && rule->num_##DIM_NAME + 1 > rule->alloc_##DIM_NAME) { \
+		kz_err("each " #DIM_NAME " has already been added to the rule; alloc_" #DIM_NAME "='%d'", \
+		       rule->num_##DIM_NAME); \
+		return -ENOMEM; \
+	}
+
+	KZORP_DIM_LIST(KZNL_CHECK_ENTRY_NUM, ;);
+
+#undef KZNL_CHECK_ENTRY_NUM
+
+	return 0;
+}
+
+/* checks that each rule announced for the dispatcher has been added */
+int
+kznl_check_dispatcher_rules(const struct kz_dispatcher *d)
+{
+	if (d->num_rule != d->alloc_rule) {
+		kz_err("rule number mismatch; dispatcher='%s', alloc_rules='%u', num_rules='%u'\n",
+		       d->name, d->alloc_rule, d->num_rule);
+		return -EINVAL;
+	}
+
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * KZorp session accounting ring buffers
+ *
+ * Copyright (C) 2006-2010, BalaBit IT Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/capability.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+#include "include/kzorp.h"
+#include "include/kzorp_session_ring.h"
+
+static unsigned int session_ring_records = 8192;
+module_param(session_ring_records, uint, 0400);
+MODULE_PARM_DESC(session_ring_records, "Number of session records in the per-CPU accounting ring buffers");
+
+/* size of the mapping of a single CPU: header page followed by the records */
+static size_t kz_session_ring_size;
+/* number of mappings of the rings */
+static atomic_t kz_session_ring_users = ATOMIC_INIT(0);
+
+/*
+ * The header page is mapped writable into userspace, so the kernel keeps
+ * its own copy of everything it indexes the records with and only
+ * publishes head and lost in the header.
+ */
+struct kz_session_ring {
+	struct kz_session_ring_header *hdr;
+	struct kz_session_acct_record *records;
+	u64 head;
+	u64 lost;
+	u32 record_count;
+};
+
+static DEFINE_PER_CPU(struct kz_session_ring, kz_session_ring);
+
+/**
+ * kz_session_ring_write - write a session accounting record to the ring of the current CPU
+ * @event: KZ_SESSION_RING_EVENT_START or KZ_SESSION_RING_EVENT_END
+ * @ct: conntrack entry of the session, packet and byte counters are taken from here
+ * @kzorp: kzorp data of the session
+ *
+ * Does nothing if the character device is not opened. The record is
+ * dropped and counted as lost if the consumer has not kept up with the
+ * ring.
+ */
+void
+kz_session_ring_write(enum kz_session_ring_event event,
+		      const struct nf_conn *ct,
+		      const struct nf_conntrack_kzorp *kzorp)
+{
+	struct kz_session_ring *ring;
+	struct kz_session_acct_record *rec;
+	const struct nf_conntrack_tuple *tuple;
+	struct nf_conn_counter *acct;
+	u32 tail;
+
+	if (atomic_read(&kz_session_ring_users) == 0)
+		return;
+
+	/* each ring has a single producer: the CPU it belongs to with bottom halves disabled */
+	local_bh_disable();
+
+	ring = &__get_cpu_var(kz_session_ring);
+	if (ring->hdr == NULL)
+		goto out;
+
+	/*
+	 * Only the low half of tail is used: it is read with a single load
+	 * even on 32 bit, and the distance to head fits in it. A tail
+	 * ahead of head or further behind than the size of the ring is
+	 * treated as a full ring.
+	 */
+	tail = lower_32_bits(ACCESS_ONCE(ring->hdr->tail));
+	/* do not overwrite a record before the consumer has finished reading it */
+	smp_mb();
+
+	if ((u32) ring->head - tail >= ring->record_count) {
+		ring->hdr->lost = ++ring->lost;
+		goto out;
+	}
+
+	rec = &ring->records[ring->head & (ring->record_count - 1)];
+	tuple = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+	rec->sid = kzorp->sid;
+	rec->timestamp_ns = ktime_to_ns(ktime_get_real());
+	rec->service_id = kzorp->svc != NULL ? kzorp->svc->id : 0;
+	rec->client_zone_id = kzorp->czone != NULL ? kzorp->czone->index : KZ_SESSION_RECORD_NO_ZONE;
+	rec->server_zone_id = kzorp->szone != NULL ? kzorp->szone->index : KZ_SESSION_RECORD_NO_ZONE;
+	memcpy(rec->saddr, &tuple->src.u3, sizeof(rec->saddr));
+	memcpy(rec->daddr, &tuple->dst.u3, sizeof(rec->daddr));
+	rec->sport = tuple->src.u.all;
+	rec->dport = tuple->dst.u.all;
+	rec->l3proto = tuple->src.l3num;
+	rec->l4proto = tuple->dst.protonum;
+	rec->event = event;
+	rec->reserved = 0;
+
+	acct = nf_conn_acct_find(ct);
+	if (acct) {
+		rec->packets[IP_CT_DIR_ORIGINAL] = counter2long(acct[IP_CT_DIR_ORIGINAL].packets);
+		rec->packets[IP_CT_DIR_REPLY] = counter2long(acct[IP_CT_DIR_REPLY].packets);
+		rec->bytes[IP_CT_DIR_ORIGINAL] = counter2long(acct[IP_CT_DIR_ORIGINAL].bytes);
+		rec->bytes[IP_CT_DIR_REPLY] = counter2long(acct[IP_CT_DIR_REPLY].bytes);
+	} else {
+		memset(rec->packets, 0, sizeof(rec->packets));
+		memset(rec->bytes, 0, sizeof(rec->bytes));
+	}
+
+	/* publish the record */
+	smp_wmb();
+	ring->hdr->head = ++ring->head;
+
+out:
+	local_bh_enable();
+}
+EXPORT_SYMBOL_GPL(kz_session_ring_write);
+
+/***********************************************************
+ * Character device
+ ***********************************************************/
+
+static int
+kz_session_ring_open(struct inode *inode, struct file *file)
+{
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	return 0;
+}
+
+/* records are written while a ring is mapped, open is called for split and copied mappings */
+static void
+kz_session_ring_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&kz_session_ring_users);
+}
+
+static void
+kz_session_ring_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&kz_session_ring_users);
+}
+
+static const struct vm_operations_struct kz_session_ring_vm_ops = {
+	.open	= kz_session_ring_vm_open,
+	.close	= kz_session_ring_vm_close,
+};
+
+static int
+kz_session_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	const unsigned long ring_pages = kz_session_ring_size >> PAGE_SHIFT;
+	const unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long cpu;
+	int res;
+
+	if (vma->vm_pgoff % ring_pages != 0) {
+		kz_debug("mapping must start at a ring boundary; pgoff='%lu'\n", vma->vm_pgoff);
+		return -EINVAL;
+	}
+
+	cpu = vma->vm_pgoff / ring_pages;
+	if (cpu >= nr_cpu_ids || !cpu_possible(cpu) || per_cpu(kz_session_ring, cpu).hdr == NULL)
+		return -ENXIO;
+
+	if (size > kz_session_ring_size)
+		return -EINVAL;
+
+	res = remap_vmalloc_range(vma, per_cpu(kz_session_ring, cpu).hdr, 0);
+	if (res < 0)
+		return res;
+
+	/* vm_ops->open is not called for the initial mapping */
+	vma->vm_ops = &kz_session_ring_vm_ops;
+	kz_session_ring_vm_open(vma);
+
+	return 0;
+}
+
+static const struct file_operations kz_session_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= kz_session_ring_open,
+	.mmap		= kz_session_ring_mmap,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice kz_session_ring_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= KZ_SESSION_RING_DEVICE,
+	.fops	= &kz_session_ring_fops,
+};
+
+/***********************************************************
+ * Initialization
+ ***********************************************************/
+
+static void
+kz_session_ring_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu(kz_session_ring, cpu).hdr);
+		memset(&per_cpu(kz_session_ring, cpu), 0, sizeof(struct kz_session_ring));
+	}
+}
+
+int __init
+kz_session_ring_init(void)
+{
+	int res;
+	int cpu;
+	unsigned int record_count;
+
+	record_count = roundup_pow_of_two(max(session_ring_records, 2U));
+	kz_session_ring_size = PAGE_SIZE +
+		PAGE_ALIGN(record_count * sizeof(struct kz_session_acct_record));
+
+	for_each_possible_cpu(cpu) {
+		struct kz_session_ring_header *hdr;
+
+		/* zeroed and suitable for remap_vmalloc_range() */
+		hdr = vmalloc_user(kz_session_ring_size);
+		if (hdr == NULL) {
+			kz_err("failed to allocate session ring; cpu='%d', size='%zu'\n",
+			       cpu, kz_session_ring_size);
+			res = -ENOMEM;
+			goto cleanup;
+		}
+
+		hdr->version = KZ_SESSION_RING_VERSION;
+		hdr->record_size = sizeof(struct kz_session_acct_record);
+		hdr->record_count = record_count;
+		hdr->cpu = cpu;
+		hdr->size = kz_session_ring_size;
+		per_cpu(kz_session_ring, cpu).hdr = hdr;
+		per_cpu(kz_session_ring, cpu).records =
+			(struct kz_session_acct_record *) ((char *) hdr + PAGE_SIZE);
+		per_cpu(kz_session_ring, cpu).record_count = record_count;
+	}
+
+	res = misc_register(&kz_session_ring_dev);
+	if (res < 0) {
+		kz_err("failed to register session ring device\n");
+		goto cleanup;
+	}
+
+	return 0;
+
+cleanup:
+	kz_session_ring_free();
+	return res;
+}
+
+void
+kz_session_ring_cleanup(void)
+{
+	misc_deregister(&kz_session_ring_dev);
+	kz_session_ring_free();
+}
@@ -0,0 +1,102 @@
+
+/*
+ * Copyright (C) 2006-2012, BalaBit IT Ltd.
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * Userspace replacements of the kernel functions used by kzorp_lookup.c,
+ * see also tests/test_mocks.c.
+ */
+#include <kzorp.h>
+#include <kzorp_lookup_internal.h>
+
+// libc:
+void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void free(void *ptr);
+void abort(void);
+
+#define MUST_NOT_CALL abort()
+
+// linux/kernel.h: the library does not log
+int printk(const char *fmt, ...) { return 0; }
+
+// linux/dynamic_debug.h:
+int __dynamic_pr_debug(struct _ddebug *descriptor, const char *fmt, ...) { return 0; }
+
+// linux/slab.h: memory is always zeroed, kzalloc() may end up in any of these
+void kfree(const void *mem) { free((void *) mem); }
+void kzfree(const void *p) { free((void *) p); }
+void *__kmalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+#ifndef SLUB_PAGE_SHIFT
+ #define SLUB_PAGE_SHIFT 128
+
+struct cache_sizes malloc_sizes[1];
+#endif
+struct kmem_cache *kmalloc_caches[SLUB_PAGE_SHIFT] = {};
+#ifdef _LINUX_SLUB_DEF_H
+void *kmem_cache_alloc_trace(struct kmem_cache *s, gfp_t gfpflags, size_t size) { return calloc(1, size); };
+#endif
+#ifdef _LINUX_SLAB_DEF_H
+void *kmem_cache_alloc_trace(size_t size, struct kmem_cache *cachep, gfp_t flags) { return calloc(1, size); };
+#endif
+
+// linux/inetdevice.h: interfaces of queries have no addresses
+void in_dev_finish_destroy(int idev) { MUST_NOT_CALL; }
+void in6_dev_finish_destroy(int idev) { MUST_NOT_CALL; }
+
+int nr_cpu_ids = 0;
+
+// arch/x86/include/asm/percpu.h:
+unsigned long this_cpu_off = 0;
+
+// linux/cpumask.h:
+const struct cpumask *const cpu_possible_mask = 0;
+
+// asm-generic/percpu.h:
+unsigned long __per_cpu_offset[NR_CPUS] = {};
+
+// linux/bitops.h:
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long offset) { MUST_NOT_CALL; return 0; }
+
+// linux/rcupdate.h:
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) { MUST_NOT_CALL; }
+
+// linux/random.h:
+void get_random_bytes(void *buf, int nbytes) {}
+
+// asm-generic/bug.h:
+void warn_slowpath_null(const char *file, const int line) {}
+
+// kzorp.h: policies of the library have no binds, references are not counted
+void kz_bind_destroy(struct kz_bind *bind) { MUST_NOT_CALL; }
+void kz_dispatcher_destroy(struct kz_dispatcher *_) { MUST_NOT_CALL; }
+struct kz_bind *kz_bind_clone(const struct kz_bind const *_bind) { MUST_NOT_CALL; return 0; }
+void *kz_big_alloc(size_t size, enum KZ_ALLOC_TYPE *type) { return malloc(size); };
+void kz_big_free(void *ptr, enum KZ_ALLOC_TYPE type) { free(ptr); };
+void kz_session_ring_write(enum kz_session_ring_event event, const struct nf_conn *ct, const struct nf_conntrack_kzorp *kzorp) { MUST_NOT_CALL; }
+
+// kzorp_lookup.c:
+struct kz_lookup_ipv6_node *ipv6_node_new(void)
+{
+  return calloc(1, sizeof(struct kz_lookup_ipv6_node));
+}
+
+void ipv6_node_free(struct kz_lookup_ipv6_node *n)
+{
+  free(n);
+}
+
+unsigned int nf_conntrack_hash_rnd = 0;
@@ -0,0 +1,933 @@
+/*
+ * Copyright (C) 2006-2012, BalaBit IT Ltd.
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * Policy loading and session lookup of libkzorp-lookup. Built against
+ * the kernel headers like kzorp_lookup.c and kzorp_netlink_parse.c,
+ * whose lookup and attribute parsing code it uses.
+ */
+
+#include <linux/netlink.h>
+#include <linux/netdevice.h>
+#include <net/netlink.h>
+#include <net/genetlink.h>
+#include <net/ipv6.h>
+
+#include <kzorp.h>
+#include <kzorp_netlink.h>
+#include <kzorp_netlink_parse.h>
+#include <kzorp_lookup_internal.h>
+
+#include "kzorp_lookup_lib.h"
+
+// libc:
+void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void free(void *ptr);
+
+struct kzorp_lookup_policy {
+	struct kz_config cfg;
+	unsigned int num_zones;
+	unsigned int num_services;
+	unsigned int num_dispatchers;
+};
+
+/***********************************************************
+ * Loader state
+ ***********************************************************/
+
+#define KZL_NAME_HASH_SIZE 4096
+
+struct kzl_name_entry {
+	struct kzl_name_entry *next;
+	const char *name;
+	void *obj;
+};
+
+struct kzl_loader {
+	struct kzorp_lookup_policy *policy;
+	struct kzl_name_entry *zones[KZL_NAME_HASH_SIZE];
+	struct kzl_name_entry *services[KZL_NAME_HASH_SIZE];
+	struct kzl_name_entry *dispatchers[KZL_NAME_HASH_SIZE];
+	const struct nlattr *attrs[KZNL_ATTR_TYPE_COUNT + 1];
+};
+
+static inline unsigned int
+kzl_name_hash_fn(const char *name)
+{
+	return jhash(name, strlen(name), 0) % KZL_NAME_HASH_SIZE;
+}
+
+static void *
+kzl_name_lookup(struct kzl_name_entry **hash, const char *name)
+{
+	const struct kzl_name_entry *e;
+
+	for (e = hash[kzl_name_hash_fn(name)]; e != NULL; e = e->next)
+		if (strcmp(e->name, name) == 0)
+			return e->obj;
+
+	return NULL;
+}
+
+/* the name must live as long as the hash */
+static int
+kzl_name_insert(struct kzl_name_entry **hash, const char *name, void *obj)
+{
+	const unsigned int bucket = kzl_name_hash_fn(name);
+	struct kzl_name_entry *e;
+
+	if (kzl_name_lookup(hash, name) != NULL)
+		return -EEXIST;
+
+	e = malloc(sizeof(*e));
+	if (e == NULL)
+		return -ENOMEM;
+
+	e->name = name;
+	e->obj = obj;
+	e->next = hash[bucket];
+	hash[bucket] = e;
+
+	return 0;
+}
+
+static void
+kzl_name_hash_free(struct kzl_name_entry **hash)
+{
+	unsigned int i;
+
+	for (i = 0; i < KZL_NAME_HASH_SIZE; i++) {
+		struct kzl_name_entry *e = hash[i];
+
+		while (e != NULL) {
+			struct kzl_name_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+}
+
+/***********************************************************
+ * Attribute parsing
+ ***********************************************************/
+
+/* unlike nla_parse() every attribute must be well-formed, the input is not trusted;
+ * the attributes themselves are parsed by kzorp_netlink_parse.c */
+static int
+kzl_parse_attrs(const struct nlattr **tb, const void *data, int len)
+{
+	const struct nlattr *attr;
+	int rem;
+
+	memset(tb, 0, sizeof(*tb) * (KZNL_ATTR_TYPE_COUNT + 1));
+
+	nla_for_each_attr(attr, (const struct nlattr *) data, len, rem) {
+		if (nla_type(attr) <= KZNL_ATTR_TYPE_COUNT)
+			tb[nla_type(attr)] = attr;
+	}
+
+	return rem == 0 ? 0 : -EINVAL;
+}
+
+/* looks up the object named by a name attribute */
+static void *
+kzl_lookup_name_attr(struct kzl_name_entry **hash, const struct nlattr *attr, int *res)
+{
+	char name[KZ_ATTR_NAME_MAX_LENGTH + 1];
+	void *obj;
+
+	*res = kznl_parse_name(attr, name, sizeof(name));
+	if (*res < 0)
+		return NULL;
+
+	obj = kzl_name_lookup(hash, name);
+	if (obj == NULL)
+		*res = -ENOENT;
+
+	return obj;
+}
+
+/***********************************************************
+ * Configuration objects
+ ***********************************************************/
+
+static void
+kzl_zone_free(struct kz_zone *zone)
+{
+	if (zone->unique_name != zone->name)
+		free(zone->unique_name);
+	free(zone->name);
+	free(zone);
+}
+
+static void
+kzl_rule_free(struct kz_dispatcher_n_dimension_rule *rule)
+{
+#define KZL_FREE_DIM(DIM_NAME, ...) free(rule->DIM_NAME)
+	KZORP_DIM_LIST(KZL_FREE_DIM, ;);
+#undef KZL_FREE_DIM
+}
+
+static void
+kzl_dispatcher_free(struct kz_dispatcher *dpt)
+{
+	unsigned int i;
+
+	for (i = 0; i < dpt->num_rule; i++)
+		kzl_rule_free(&dpt->rule[i]);
+	free(dpt->rule);
+	free(dpt->name);
+	free(dpt);
+}
+
+/* rules are added in increasing id order, see kz_dispatcher_add_rule() */
+static struct kz_dispatcher_n_dimension_rule *
+kzl_dispatcher_rule_lookup(struct kz_dispatcher *dpt, u_int32_t id)
+{
+	unsigned int first = 0, last = dpt->num_rule;
+
+	while (first < last) {
+		const unsigned int mid = first + (last - first) / 2;
+
+		if (dpt->rule[mid].id == id)
+			return &dpt->rule[mid];
+		else if (dpt->rule[mid].id < id)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	return NULL;
+}
+
+/* see kz_dispatcher_add_rule_entry() */
+static int
+kzl_rule_add_entry(struct kz_dispatcher_n_dimension_rule *rule,
+		   const struct kz_dispatcher_n_dimension_rule_entry_params *entry)
+{
+	int res;
+
+	res = kznl_check_rule_entry(rule, entry);
+	if (res < 0)
+		return res;
+
+#define KZL_APPEND_DIM(DIM_NAME, ...) \
+	if (entry->has_##DIM_NAME) \
+		memcpy(&rule->DIM_NAME[rule->num_##DIM_NAME++], &entry->DIM_NAME, sizeof(*rule->DIM_NAME))
+
+	KZORP_DIM_LIST(KZL_APPEND_DIM, ;);
+
+#undef KZL_APPEND_DIM
+
+	return 0;
+}
+
+static struct kz_zone *
+kzl_lookup_zone(void *ctx, const char *name)
+{
+	struct kzl_loader *l = ctx;
+
+	return kzl_name_lookup(l->zones, name);
+}
+
+/***********************************************************
+ * Configuration messages
+ ***********************************************************/
+
+static int
+kzl_add_zone(struct kzl_loader *l, const struct nlattr **attrs)
+{
+	struct kz_zone *zone, *parent = NULL;
+	int res;
+
+	if (attrs[KZNL_ATTR_ZONE_NAME] == NULL)
+		return -EINVAL;
+
+	zone = calloc(1, sizeof(*zone));
+	if (zone == NULL)
+		return -ENOMEM;
+
+	res = kznl_parse_name_alloc(attrs[KZNL_ATTR_ZONE_NAME], &zone->name);
+	if (res < 0)
+		goto error;
+
+	if (attrs[KZNL_ATTR_ZONE_RANGE] != NULL) {
+		res = kznl_parse_inet_subnet(attrs[KZNL_ATTR_ZONE_RANGE], &zone->addr, &zone->mask, &zone->family);
+		if (res < 0)
+			goto error;
+		zone->flags |= KZF_ZONE_HAS_RANGE;
+	}
+
+	/* unique name and name share the string if they are the same, see kz_adjust_zone() */
+	zone->unique_name = zone->name;
+	if (attrs[KZNL_ATTR_ZONE_UNAME] != NULL) {
+		char *unique_name;
+
+		res = kznl_parse_name_alloc(attrs[KZNL_ATTR_ZONE_UNAME], &unique_name);
+		if (res < 0)
+			goto error;
+
+		if (strcmp(unique_name, zone->name) == 0)
+			free(unique_name);
+		else
+			zone->unique_name = unique_name;
+	}
+
+	if (attrs[KZNL_ATTR_ZONE_PNAME] != NULL) {
+		parent = kzl_lookup_name_attr(l->zones, attrs[KZNL_ATTR_ZONE_PNAME], &res);
+		if (parent == NULL)
+			goto error;
+	}
+
+	/* the zone depth starts with 1, see kz_zone_new() */
+	zone->admin_parent = parent;
+	zone->depth = parent != NULL ? parent->depth + 1 : 1;
+
+	res = kzl_name_insert(l->zones, zone->unique_name, zone);
+	if (res < 0)
+		goto error;
+
+	list_add_tail(&zone->list, &l->policy->cfg.zones.head);
+	l->policy->num_zones++;
+
+	return 0;
+
+error:
+	kzl_zone_free(zone);
+	return res;
+}
+
+static int
+kzl_add_service(struct kzl_loader *l, const struct nlattr **attrs)
+{
+	struct kz_service *svc;
+	int res;
+
+	if (attrs[KZNL_ATTR_SERVICE_NAME] == NULL)
+		return -EINVAL;
+
+	svc = calloc(1, sizeof(*svc));
+	if (svc == NULL)
+		return -ENOMEM;
+
+	res = kznl_parse_service_params(attrs[KZNL_ATTR_SERVICE_PARAMS], svc);
+	if (res < 0)
+		goto error;
+
+	res = kznl_parse_name_alloc(attrs[KZNL_ATTR_SERVICE_NAME], &svc->name);
+	if (res < 0)
+		goto error;
+
+	res = kzl_name_insert(l->services, svc->name, svc);
+	if (res < 0)
+		goto error;
+
+	svc->id = ++l->policy->num_services;
+	list_add_tail(&svc->list, &l->policy->cfg.services.head);
+
+	return 0;
+
+error:
+	free(svc->name);
+	free(svc);
+	return res;
+}
+
+static int
+kzl_add_dispatcher(struct kzl_loader *l, const struct nlattr **attrs)
+{
+	struct kz_dispatcher *dpt;
+	u_int32_t num_rules;
+	int res;
+
+	if (attrs[KZNL_ATTR_DISPATCHER_NAME] == NULL ||
+	    kznl_parse_be32(attrs[KZNL_ATTR_DISPATCHER_N_DIMENSION_PARAMS], &num_rules) < 0)
+		return -EINVAL;
+
+	dpt = calloc(1, sizeof(*dpt));
+	if (dpt == NULL)
+		return -ENOMEM;
+
+	res = kznl_parse_name_alloc(attrs[KZNL_ATTR_DISPATCHER_NAME], &dpt->name);
+	if (res < 0)
+		goto error;
+
+	if (num_rules > 0) {
+		dpt->rule = calloc(num_rules, sizeof(*dpt->rule));
+		if (dpt->rule == NULL) {
+			res = -ENOMEM;
+			goto error;
+		}
+		dpt->alloc_rule = num_rules;
+	}
+
+	res = kzl_name_insert(l->dispatchers, dpt->name, dpt);
+	if (res < 0)
+		goto error;
+
+	list_add_tail(&dpt->list, &l->policy->cfg.dispatchers.head);
+	l->policy->num_dispatchers++;
+
+	return 0;
+
+error:
+	kzl_dispatcher_free(dpt);
+	return res;
+}
+
+/* allocates the dimensions with the sizes given in params, see kz_dispatcher_add_rule() */
+static struct kz_dispatcher_n_dimension_rule *
+kzl_dispatcher_add_rule(struct kz_dispatcher *dpt, struct kz_service *svc,
+			const struct kz_dispatcher_n_dimension_rule *params, int *res)
+{
+	struct kz_dispatcher_n_dimension_rule *rule;
+
+	*res = kznl_check_rule_add(dpt, params->id);
+	if (*res < 0)
+		return NULL;
+
+	rule = &dpt->rule[dpt->num_rule];
+	memset(rule, 0, sizeof(*rule));
+	rule->id = params->id;
+	rule->service = svc;
+	rule->dispatcher = dpt;
+
+#define KZL_ALLOC_DIM(DIM_NAME, ...) \
+	rule->alloc_##DIM_NAME = params->alloc_##DIM_NAME; \
+	if (rule->alloc_##DIM_NAME > 0 && \
+	    (rule->DIM_NAME = calloc(rule->alloc_##DIM_NAME, sizeof(*rule->DIM_NAME))) == NULL) \
+		*res = -ENOMEM
+
+	KZORP_DIM_LIST(KZL_ALLOC_DIM, ;);
+
+#undef KZL_ALLOC_DIM
+
+	if (*res < 0) {
+		kzl_rule_free(rule);
+		return NULL;
+	}
+
+	dpt->num_rule++;
+
+	return rule;
+}
+
+static int
+kzl_add_rule(struct kzl_loader *l, const struct nlattr **attrs)
+{
+	struct kz_dispatcher_n_dimension_rule params;
+	struct kz_dispatcher *dpt;
+	struct kz_service *svc;
+	enum kznl_attr_types attr_type;
+	int res;
+
+	memset(&params, 0, sizeof(params));
+
+	if (kznl_parse_be32(attrs[KZNL_ATTR_N_DIMENSION_RULE_ID], &params.id) < 0 ||
+	    attrs[KZNL_ATTR_DISPATCHER_NAME] == NULL ||
+	    attrs[KZNL_ATTR_N_DIMENSION_RULE_SERVICE] == NULL)
+		return -EINVAL;
+
+	/* the number of entries of each dimension, see kznl_recv_add_n_dimension_rule() */
+	for (attr_type = KZNL_ATTR_INVALID; attr_type < KZNL_ATTR_TYPE_COUNT; attr_type++) {
+		if (attrs[attr_type] == NULL ||
+		    attr_type == KZNL_ATTR_DISPATCHER_NAME ||
+		    attr_type == KZNL_ATTR_N_DIMENSION_RULE_ID ||
+		    attr_type == KZNL_ATTR_N_DIMENSION_RULE_SERVICE)
+			continue;
+
+		res = kznl_parse_rule_entry_num(attrs[attr_type], &params);
+		if (res < 0)
+			return res;
+	}
+
+	dpt = kzl_lookup_name_attr(l->dispatchers, attrs[KZNL_ATTR_DISPATCHER_NAME], &res);
+	if (dpt == NULL)
+		return res;
+
+	if (kzl_dispatcher_rule_lookup(dpt, params.id) != NULL)
+		return -EEXIST;
+
+	svc = kzl_lookup_name_attr(l->services, attrs[KZNL_ATTR_N_DIMENSION_RULE_SERVICE], &res);
+	if (svc == NULL)
+		return res;
+
+	kzl_dispatcher_add_rule(dpt, svc, &params, &res);
+
+	return res;
+}
+
+static int
+kzl_add_rule_entry(struct kzl_loader *l, const struct nlattr **attrs)
+{
+	struct kz_dispatcher_n_dimension_rule_entry_params entry;
+	struct kz_dispatcher_n_dimension_rule *rule;
+	struct kz_dispatcher *dpt;
+	enum kznl_attr_types attr_type;
+	int res;
+
+	memset(&entry, 0, sizeof(entry));
+
+	if (kznl_parse_be32(attrs[KZNL_ATTR_N_DIMENSION_RULE_ID], &entry.rule_id) < 0 ||
+	    attrs[KZNL_ATTR_DISPATCHER_NAME] == NULL)
+		return -EINVAL;
+
+	dpt = kzl_lookup_name_attr(l->dispatchers, attrs[KZNL_ATTR_DISPATCHER_NAME], &res);
+	if (dpt == NULL)
+		return res;
+
+	rule = kzl_dispatcher_rule_lookup(dpt, entry.rule_id);
+	if (rule == NULL)
+		return -ENOENT;
+
+	for (attr_type = KZNL_ATTR_INVALID; attr_type < KZNL_ATTR_TYPE_COUNT; attr_type++) {
+		if (attrs[attr_type] == NULL ||
+		    attr_type == KZNL_ATTR_DISPATCHER_NAME ||
+		    attr_type == KZNL_ATTR_N_DIMENSION_RULE_ID)
+			continue;
+
+		res = kznl_parse_rule_entry(attrs[attr_type], &entry, kzl_lookup_zone, l);
+		if (res < 0)
+			return res;
+	}
+
+	return kzl_rule_add_entry(rule, &entry);
+}
+
+static int
+kzl_add_rule_bulk_rule(struct kzl_loader *l, struct kz_dispatcher *dpt,
+		       const struct kza_rule_bulk_rule *r, int len)
+{
+	struct kz_dispatcher_n_dimension_rule params, *rule;
+	struct kz_dispatcher_n_dimension_rule_entry_params entry;
+	const struct nlattr *head = (const struct nlattr *) (r + 1);
+	const struct nlattr *attr, *service_attr;
+	struct kz_service *svc;
+	int res, rem;
+
+	len -= sizeof(*r);
+
+	memset(&params, 0, sizeof(params));
+	params.id = ntohl(r->id);
+
+	res = kznl_count_rule_bulk_entries(head, len, &params, &service_attr);
+	if (res < 0)
+		return res;
+
+	svc = kzl_lookup_name_attr(l->services, service_attr, &res);
+	if (svc == NULL)
+		return res;
+
+	rule = kzl_dispatcher_add_rule(dpt, svc, &params, &res);
+	if (rule == NULL)
+		return res;
+
+	nla_for_each_attr(attr, head, len, rem) {
+		if (nla_type(attr) == KZNL_ATTR_N_DIMENSION_RULE_SERVICE)
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.rule_id = rule->id;
+
+		res = kznl_parse_rule_entry(attr, &entry, kzl_lookup_zone, l);
+		if (res < 0)
+			return res;
+
+		res = kzl_rule_add_entry(rule, &entry);
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+static int
+kzl_add_rule_bulk(struct kzl_loader *l, const struct nlattr **attrs)
+{
+	const struct kza_rule_bulk_header *hdr;
+	struct kz_dispatcher *dpt;
+	const void *pos;
+	unsigned int i, num_rules;
+	int res, rem;
+
+	hdr = kznl_attr_data(attrs[KZNL_ATTR_N_DIMENSION_RULE_BULK], sizeof(struct kza_rule_bulk_header));
+	if (hdr == NULL || attrs[KZNL_ATTR_DISPATCHER_NAME] == NULL ||
+	    ntohl(hdr->version) != KZ_RULE_BULK_VERSION)
+		return -EINVAL;
+
+	dpt = kzl_lookup_name_attr(l->dispatchers, attrs[KZNL_ATTR_DISPATCHER_NAME], &res);
+	if (dpt == NULL)
+		return res;
+
+	num_rules = ntohl(hdr->num_rules);
+	pos = hdr + 1;
+	rem = nla_len(attrs[KZNL_ATTR_N_DIMENSION_RULE_BULK]) - sizeof(*hdr);
+
+	for (i = 0; i < num_rules; i++) {
+		const struct kza_rule_bulk_rule *r = pos;
+		int len;
+
+		if (rem < (int) sizeof(*r))
+			return -EINVAL;
+
+		len = ntohl(r->length);
+		if (len < (int) sizeof(*r) || len > rem || !IS_ALIGNED(len, NLA_ALIGNTO))
+			return -EINVAL;
+
+		res = kzl_add_rule_bulk_rule(l, dpt, r, len);
+		if (res < 0)
+			return res;
+
+		pos += len;
+		rem -= len;
+	}
+
+	return rem == 0 ? 0 : -EINVAL;
+}
+
+/* applies a configuration message to the policy being loaded */
+static int
+kzl_apply_message(struct kzl_loader *l, unsigned int command, const void *data, int len)
+{
+	int res;
+
+	res = kzl_parse_attrs(l->attrs, data, len);
+	if (res < 0)
+		return res;
+
+	switch (command) {
+	case KZNL_MSG_ADD_ZONE:
+		return kzl_add_zone(l, l->attrs);
+	case KZNL_MSG_ADD_SERVICE:
+		return kzl_add_service(l, l->attrs);
+	case KZNL_MSG_ADD_DISPATCHER:
+		return kzl_add_dispatcher(l, l->attrs);
+	case KZNL_MSG_ADD_RULE:
+		return kzl_add_rule(l, l->attrs);
+	case KZNL_MSG_ADD_RULE_ENTRY:
+		return kzl_add_rule_entry(l, l->attrs);
+	case KZNL_MSG_ADD_RULE_BULK:
+		return kzl_add_rule_bulk(l, l->attrs);
+	case KZNL_MSG_DELETE_ZONE:
+	case KZNL_MSG_DELETE_SERVICE:
+	case KZNL_MSG_DELETE_DISPATCHER:
+	case KZNL_MSG_DELETE_RULE:
+		/* a loaded policy is complete, there is no previous config to delete from */
+		return -EOPNOTSUPP;
+	default:
+		/* transaction control, flushes, NAT mappings and binds do not affect lookups */
+		return 0;
+	}
+}
+
+/***********************************************************
+ * Policies
+ ***********************************************************/
+
+unsigned int
+kzorp_lookup_api_version(void)
+{
+	return KZORP_LOOKUP_API_VERSION;
+}
+
+void
+kzorp_lookup_policy_free(struct kzorp_lookup_policy *policy)
+{
+	struct kz_dispatcher *dpt, *dpt_next;
+	struct kz_service *svc, *svc_next;
+	struct kz_zone *zone, *zone_next;
+
+	if (policy == NULL)
+		return;
+
+	kz_head_dispatcher_destroy(&policy->cfg.dispatchers);
+	kz_head_zone_destroy(&policy->cfg.zones);
+
+	list_for_each_entry_safe(dpt, dpt_next, &policy->cfg.dispatchers.head, list)
+		kzl_dispatcher_free(dpt);
+
+	list_for_each_entry_safe(svc, svc_next, &policy->cfg.services.head, list) {
+		free(svc->name);
+		free(svc);
+	}
+
+	list_for_each_entry_safe(zone, zone_next, &policy->cfg.zones.head, list)
+		kzl_zone_free(zone);
+
+	free(policy);
+}
+
+static struct kzl_loader *
+kzl_loader_new(void)
+{
+	struct kzl_loader *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return NULL;
+
+	l->policy = calloc(1, sizeof(*l->policy));
+	if (l->policy == NULL) {
+		free(l);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&l->policy->cfg.zones.head);
+	INIT_LIST_HEAD(&l->policy->cfg.services.head);
+	INIT_LIST_HEAD(&l->policy->cfg.dispatchers.head);
+	INIT_LIST_HEAD(&l->policy->cfg.instances.head);
+	kz_head_zone_init(&l->policy->cfg.zones);
+
+	return l;
+}
+
+/* builds the lookup structures on success, frees the policy on failure */
+static struct kzorp_lookup_policy *
+kzl_loader_finish(struct kzl_loader *l, int res, int *error)
+{
+	struct kzorp_lookup_policy *policy = l->policy;
+	const struct kz_dispatcher *dpt;
+
+	kzl_name_hash_free(l->zones);
+	kzl_name_hash_free(l->services);
+	kzl_name_hash_free(l->dispatchers);
+	free(l);
+
+	/* each announced rule must have been added, like on committing a transaction */
+	list_for_each_entry(dpt, &policy->cfg.dispatchers.head, list) {
+		if (res == 0)
+			res = kznl_check_dispatcher_rules(dpt);
+	}
+
+	if (res == 0 && policy->cfg.zones.luzone.root == NULL)
+		res = -ENOMEM;
+	if (res == 0)
+		res = kz_head_zone_build(&policy->cfg.zones);
+	if (res == 0)
+		res = kz_head_dispatcher_build(&policy->cfg.dispatchers);
+
+	if (error != NULL)
+		*error = res;
+
+	if (res < 0) {
+		kzorp_lookup_policy_free(policy);
+		return NULL;
+	}
+
+	return policy;
+}
+
+struct kzorp_lookup_policy *
+kzorp_lookup_policy_load_messages(const void *buf, unsigned long length, int *error)
+{
+	struct kzl_loader *l;
+	const struct nlmsghdr *nlh = buf;
+	int rem = length;
+	int res = 0;
+
+	if (length > INT_MAX) {
+		if (error != NULL)
+			*error = -EINVAL;
+		return NULL;
+	}
+
+	l = kzl_loader_new();
+	if (l == NULL) {
+		if (error != NULL)
+			*error = -ENOMEM;
+		return NULL;
+	}
+
+	for (; res == 0 && nlmsg_ok(nlh, rem); nlh = nlmsg_next(nlh, &rem)) {
+		const struct genlmsghdr *genlh = nlmsg_data(nlh);
+
+		/* netlink control messages, like acknowledgements of a captured exchange */
+		if (nlh->nlmsg_type < NLMSG_MIN_TYPE)
+			continue;
+
+		if (nlmsg_len(nlh) < GENL_HDRLEN) {
+			res = -EINVAL;
+			break;
+		}
+
+		res = kzl_apply_message(l, genlh->cmd, nlmsg_data(nlh) + GENL_HDRLEN,
+					nlmsg_len(nlh) - GENL_HDRLEN);
+	}
+
+	if (res == 0 && rem != 0)
+		res = -EINVAL;
+
+	return kzl_loader_finish(l, res, error);
+}
+
+/***********************************************************
+ * Lookups
+ ***********************************************************/
+
+/* work area of the lookups of a thread, see struct kz_percpu_env */
+struct kzl_lookup_env {
+	struct kz_percpu_env lenv;
+	const struct kz_dispatcher_n_dimension_rule *result_rules[1];
+	unsigned long src_mask[KZ_ZONE_BF_SIZE / sizeof(unsigned long)];
+	unsigned long dst_mask[KZ_ZONE_BF_SIZE / sizeof(unsigned long)];
+	struct net_device dev;
+};
+
+static struct kzl_lookup_env *
+kzl_lookup_env_new(void)
+{
+	struct kzl_lookup_env *env;
+
+	/* the zone masks are cleared after each lookup by kz_ndim_eval() */
+	env = calloc(1, sizeof(*env));
+	if (env == NULL)
+		return NULL;
+
+	env->lenv.max_result_size = ARRAY_SIZE(env->result_rules);
+	env->lenv.result_rules = env->result_rules;
+	env->lenv.src_mask = env->src_mask;
+	env->lenv.dst_mask = env->dst_mask;
+
+	return env;
+}
+
+static int
+kzl_lookup_session_env(const struct kzorp_lookup_policy *policy, struct kzl_lookup_env *env,
+		       const struct kzorp_lookup_query *query, struct kzorp_lookup_result *result)
+{
+	const struct kz_dispatcher_n_dimension_rule *rule;
+	struct kz_zone *czone, *szone;
+	union nf_inet_addr saddr, daddr;
+	struct kz_reqids reqids;
+	u_int8_t l3proto;
+
+	switch (query->family) {
+	case AF_INET:
+		l3proto = NFPROTO_IPV4;
+		break;
+	case AF_INET6:
+		l3proto = NFPROTO_IPV6;
+		break;
+	default:
+		return -EAFNOSUPPORT;
+	}
+
+	memset(&saddr, 0, sizeof(saddr));
+	memset(&daddr, 0, sizeof(daddr));
+	memcpy(&saddr, query->saddr, l3proto == NFPROTO_IPV4 ? sizeof(saddr.in) : sizeof(saddr.in6));
+	memcpy(&daddr, query->daddr, l3proto == NFPROTO_IPV4 ? sizeof(daddr.in) : sizeof(daddr.in6));
+
+	reqids.len = query->reqid != 0 ? 1 : 0;
+	reqids.vec[0] = query->reqid;
+
+	memcpy(env->dev.name, query->ifname, IFNAMSIZ);
+	env->dev.name[IFNAMSIZ - 1] = '\0';
+	env->dev.group = query->ifgroup;
+
+	kz_lookup_thread_env = &env->lenv;
+	kz_lookup_session_rule(&policy->cfg, &reqids, &env->dev, l3proto, &saddr, &daddr,
+			       query->proto, query->sport, query->dport,
+			       &czone, &szone, &rule, 0);
+	kz_lookup_thread_env = NULL;
+
+	result->client_zone_id = czone != NULL ? czone->index : KZORP_LOOKUP_NO_ID;
+	result->client_zone = czone != NULL ? czone->unique_name : NULL;
+	result->server_zone_id = szone != NULL ? szone->index : KZORP_LOOKUP_NO_ID;
+	result->server_zone = szone != NULL ? szone->unique_name : NULL;
+
+	if (rule != NULL) {
+		result->rule_id = rule->id;
+		result->dispatcher_id = rule->dispatcher->index;
+		result->dispatcher = rule->dispatcher->name;
+		result->service_id = rule->service->id;
+		result->service = rule->service->name;
+	} else {
+		result->rule_id = KZORP_LOOKUP_NO_ID;
+		result->dispatcher_id = KZORP_LOOKUP_NO_ID;
+		result->dispatcher = NULL;
+		result->service_id = KZORP_LOOKUP_NO_ID;
+		result->service = NULL;
+	}
+
+	return 0;
+}
+
+int
+kzorp_lookup_session(const struct kzorp_lookup_policy *policy,
+		     const struct kzorp_lookup_query *query,
+		     struct kzorp_lookup_result *result)
+{
+	struct kzl_lookup_env *env;
+	int res;
+
+	env = kzl_lookup_env_new();
+	if (env == NULL)
+		return -ENOMEM;
+
+	res = kzl_lookup_session_env(policy, env, query, result);
+
+	free(env);
+
+	return res;
+}
+
+struct kzl_lookup_sessions_ctx {
+	const struct kzorp_lookup_policy *policy;
+	const struct kzorp_lookup_query *queries;
+	struct kzorp_lookup_result *results;
+	/* first error of any thread */
+	int res;
+};
+
+static void
+kzl_lookup_sessions_range(void *_ctx, unsigned int first, unsigned int last)
+{
+	struct kzl_lookup_sessions_ctx *ctx = _ctx;
+	struct kzl_lookup_env *env;
+	unsigned int i;
+	int res = 0;
+
+	env = kzl_lookup_env_new();
+	if (env == NULL)
+		res = -ENOMEM;
+
+	for (i = first; res == 0 && i < last; i++)
+		res = kzl_lookup_session_env(ctx->policy, env, &ctx->queries[i], &ctx->results[i]);
+
+	if (res < 0)
+		__sync_bool_compare_and_swap(&ctx->res, 0, res);
+
+	free(env);
+}
+
+int
+kzorp_lookup_sessions(const struct kzorp_lookup_policy *policy,
+		      const struct kzorp_lookup_query *queries,
+		      struct kzorp_lookup_result *results,
+		      unsigned int num, unsigned int threads)
+{
+	struct kzl_lookup_sessions_ctx ctx = {
+		.policy = policy,
+		.queries = queries,
+		.results = results,
+		.res = 0,
+	};
+
+	kz_parallel_run(num, threads ? threads : kz_parallel_online_cpus(), kzl_lookup_sessions_range, &ctx);
+
+	return ctx.res;
+}
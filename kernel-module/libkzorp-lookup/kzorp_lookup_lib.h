@@ -0,0 +1,102 @@
+#ifndef _KZORP_LOOKUP_LIB_H
+#define _KZORP_LOOKUP_LIB_H
+
+/*
+ * Copyright (C) 2006-2012, BalaBit IT Ltd.
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * libkzorp-lookup: the session lookup of the KZorp kernel module in
+ * userspace.
+ *
+ * A policy is loaded from the configuration messages that would be sent
+ * to the kernel (KZNL_MSG_ADD_ZONE, KZNL_MSG_ADD_SERVICE, ..., each with
+ * its netlink and generic netlink header). Loaded policies are
+ * immutable, so any number of threads may look up sessions in the same
+ * policy at the same time.
+ *
+ * Lookups evaluate the zones and the n-dimensional rules of the
+ * dispatchers with the same code as the kernel module. Destination
+ * interface dimensions never match, as the addresses of the interfaces
+ * are not known here.
+ *
+ * Functions returning int return zero or a negative errno value.
+ */
+
+#define KZORP_LOOKUP_API_VERSION 1
+
+/* id of a missing dispatcher, zone, service or rule in a result */
+#define KZORP_LOOKUP_NO_ID 0xffffffffU
+
+struct kzorp_lookup_policy;
+
+/*
+ * Addresses are in network byte order, IPv4 ones in the first four
+ * bytes. Ports are in host byte order. An empty interface name matches
+ * no interface name dimension, zero reqid means no IPsec request id.
+ */
+struct kzorp_lookup_query {
+	unsigned char family;
+	unsigned char proto;
+	unsigned short sport;
+	unsigned short dport;
+	unsigned char saddr[16];
+	unsigned char daddr[16];
+	char ifname[16];
+	unsigned int ifgroup;
+	unsigned int reqid;
+};
+
+/*
+ * Ids are the positions of the dispatchers and zones in the policy, as
+ * in the batched query replies of the kernel module, and the positions
+ * of the services counted from one. Service ids of the kernel module
+ * are kept across configuration reloads, so they are not the same:
+ * compare services by name. Names point into the policy and are valid
+ * until it is freed, NULL if the id is KZORP_LOOKUP_NO_ID. Zone names
+ * are unique names.
+ */
+struct kzorp_lookup_result {
+	unsigned int dispatcher_id;
+	unsigned int client_zone_id;
+	unsigned int server_zone_id;
+	unsigned int service_id;
+	unsigned int rule_id;
+	const char *dispatcher;
+	const char *client_zone;
+	const char *server_zone;
+	const char *service;
+};
+
+unsigned int kzorp_lookup_api_version(void);
+
+struct kzorp_lookup_policy *
+kzorp_lookup_policy_load_messages(const void *buf, unsigned long length, int *error);
+
+void kzorp_lookup_policy_free(struct kzorp_lookup_policy *policy);
+
+/* a session without a matching rule is not an error, its ids are KZORP_LOOKUP_NO_ID */
+int kzorp_lookup_session(const struct kzorp_lookup_policy *policy,
+			 const struct kzorp_lookup_query *query,
+			 struct kzorp_lookup_result *result);
+
+/* looks up num sessions using at most threads threads (zero: one for each online CPU) */
+int kzorp_lookup_sessions(const struct kzorp_lookup_policy *policy,
+			  const struct kzorp_lookup_query *queries,
+			  struct kzorp_lookup_result *results,
+			  unsigned int num, unsigned int threads);
+
+#endif /* _KZORP_LOOKUP_LIB_H */
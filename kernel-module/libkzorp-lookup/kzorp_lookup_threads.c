@@ -0,0 +1,93 @@
+
+/*
+ * Copyright (C) 2006-2012, BalaBit IT Ltd.
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * Threads of libkzorp-lookup, built without the kernel headers: the
+ * userspace kz_parallel_for(), the kernel one uses work items on the
+ * online CPUs. The tests in tests/ build the lookup code with it, too.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef void (*kz_parallel_fn_t)(void *ctx, unsigned int first, unsigned int last);
+
+/* zero means one thread for each online CPU */
+unsigned int kz_parallel_threads = 0;
+
+struct kz_parallel_thread {
+  pthread_t thread;
+  kz_parallel_fn_t fn;
+  void *ctx;
+  unsigned int first;
+  unsigned int last;
+};
+
+unsigned int kz_parallel_online_cpus(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+static void *kz_parallel_thread_fn(void *arg)
+{
+  struct kz_parallel_thread *t = arg;
+  t->fn(t->ctx, t->first, t->last);
+  return NULL;
+}
+
+/* processes [0, n) in at most thread_num ranges, the last one in the calling thread */
+void kz_parallel_run(unsigned int n, unsigned int thread_num, kz_parallel_fn_t fn, void *ctx)
+{
+  unsigned int chunk, started = 0, i;
+  struct kz_parallel_thread *threads;
+
+  if (thread_num > n)
+    thread_num = n;
+
+  if (thread_num <= 1 || !(threads = calloc(thread_num - 1, sizeof(*threads))))
+    {
+      fn(ctx, 0, n);
+      return;
+    }
+
+  chunk = (n + thread_num - 1) / thread_num;
+  for (i = 0; i < thread_num - 1; i++)
+    {
+      struct kz_parallel_thread *t = &threads[started];
+      t->fn = fn;
+      t->ctx = ctx;
+      t->first = i * chunk < n ? i * chunk : n;
+      t->last = (i + 1) * chunk < n ? (i + 1) * chunk : n;
+      if (pthread_create(&t->thread, NULL, kz_parallel_thread_fn, t) != 0)
+        break;
+      started++;
+    }
+
+  /* the ranges of the threads that could not be started are done here */
+  fn(ctx, started * chunk < n ? started * chunk : n, n);
+
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i].thread, NULL);
+  free(threads);
+}
+
+void kz_parallel_for(unsigned int n, kz_parallel_fn_t fn, void *ctx)
+{
+  kz_parallel_run(n, kz_parallel_threads ? kz_parallel_threads : kz_parallel_online_cpus(), fn, ctx);
+}
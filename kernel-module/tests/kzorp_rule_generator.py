@@ -279,37 +279,41 @@ num_max_protocols = 2
 num_max_sample_subnets = num_subnets / 20
 num_max_sample_subnets6 = num_subnets6 / 25
 
-random.seed(12)
-zones = generate_zones(num_zones)
-interfaces = generate_interfaces(num_interfaces)
-subnets = [Subnet() for _ in xrange(num_subnets)]
-subnets6 = [Subnet(socket.AF_INET6) for _ in xrange(num_subnets6)]
-
-print '// Generated by kzorp_rule_generator.py'
-if 1:
-    print cs_define_interfaces(interfaces)
-    print
-    print cs_define_zones(zones)
-    print
-    print cs_define_subnets(subnets)
-    print
-    print cs_define_subnets(subnets6)
-    print
-    print cs_define_rules(
-        num_rules=num_rules,
-        interfaces=interfaces,
-        num_interfaces=num_max_sample_interfaces,
-        num_port_ranges=num_max_port_ranges,
-        zones=zones,
-        num_zones=num_max_sample_zones,
-        num_protocols=num_max_protocols,
-        subnets=subnets,
-        num_subnets=num_max_sample_subnets,
-        subnets6=subnets6,
-        num_subnets6=num_max_sample_subnets6
-    )
-    print
-    print cs_define_inputs(num_inputs, interfaces, num_zones, num_subnets, num_subnets6)
+def main():
+    random.seed(12)
+    zones = generate_zones(num_zones)
+    interfaces = generate_interfaces(num_interfaces)
+    subnets = [Subnet() for _ in xrange(num_subnets)]
+    subnets6 = [Subnet(socket.AF_INET6) for _ in xrange(num_subnets6)]
+
+    print '// Generated by kzorp_rule_generator.py'
+    if 1:
+        print cs_define_interfaces(interfaces)
+        print
+        print cs_define_zones(zones)
+        print
+        print cs_define_subnets(subnets)
+        print
+        print cs_define_subnets(subnets6)
+        print
+        print cs_define_rules(
+            num_rules=num_rules,
+            interfaces=interfaces,
+            num_interfaces=num_max_sample_interfaces,
+            num_port_ranges=num_max_port_ranges,
+            zones=zones,
+            num_zones=num_max_sample_zones,
+            num_protocols=num_max_protocols,
+            subnets=subnets,
+            num_subnets=num_max_sample_subnets,
+            subnets6=subnets6,
+            num_subnets6=num_max_sample_subnets6
+        )
+        print
+        print cs_define_inputs(num_inputs, interfaces, num_zones, num_subnets, num_subnets6)
+
+if __name__ == '__main__':
+    main()
 
 # Local Variables:
 # mode: python
@@ -16,6 +16,7 @@
  * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 #include <sys/resource.h>
+#include <sys/time.h>
 
 long long get_user_time()
 {
@@ -23,3 +24,10 @@ long long get_user_time()
   getrusage(RUSAGE_SELF, &rusage);
   return rusage.ru_utime.tv_sec * 1000000 + rusage.ru_utime.tv_usec;
 }
+
+long long get_wall_time()
+{
+  struct timeval tv = {};
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000ll + tv.tv_usec;
+}
@@ -0,0 +1,143 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2006-2012, BalaBit IT Ltd.
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program/include file is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+# of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+"""Measure the serialization of bulk rule uploads.
+
+The rules are generated from the zones, interfaces and subnets of
+kzorp_rule_generator.py and serialized both entry by entry
+(KZorpAddRuleBulkMessage) and from tabular input
+(KZorpAddRuleBulkTableMessage). The two must produce the same messages.
+
+"""
+
+import sys
+import time
+import random
+import struct
+import socket
+from optparse import OptionParser
+
+import kzorp_rule_generator as gen
+import kzorp.kzorp_netlink as kznl
+
+def pack_subnet(subnet):
+    num_words = len(subnet.address)
+    fmt = '>%dI' % num_words
+    mask = subnet.mask + [0] * (num_words - len(subnet.mask))
+    return (struct.pack(fmt, *subnet.address).ljust(4 * num_words, '\0'),
+            struct.pack(fmt, *mask))
+
+def port_ranges(num_ranges):
+    points = sorted(random.sample(xrange(1, 0x10000), 2 * num_ranges))
+    return [(points[2 * i], points[2 * i + 1]) for i in xrange(num_ranges)]
+
+def generate_rule_table(num_rules):
+    random.seed(12)
+    zones = gen.generate_zones(gen.num_zones)
+    interfaces = gen.generate_interfaces(gen.num_interfaces)
+    subnets = [pack_subnet(gen.Subnet()) for _ in xrange(gen.num_subnets)]
+    subnets6 = [pack_subnet(gen.Subnet(socket.AF_INET6)) for _ in xrange(gen.num_subnets6)]
+
+    samplers = {
+        kznl.KZNL_ATTR_N_DIMENSION_IFACE    : lambda n: [i.name for i in random.sample(interfaces, n)],
+        kznl.KZNL_ATTR_N_DIMENSION_IFGROUP  : lambda n: [i.group for i in random.sample(interfaces, n)],
+        kznl.KZNL_ATTR_N_DIMENSION_PROTO    : lambda n: random.sample((socket.IPPROTO_TCP, socket.IPPROTO_UDP), n),
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_PORT : port_ranges,
+        kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : port_ranges,
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : lambda n: [z.name for z in random.sample(zones, n)],
+        kznl.KZNL_ATTR_N_DIMENSION_DST_ZONE : lambda n: [z.name for z in random.sample(zones, n)],
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_IP   : lambda n: random.sample(subnets, n),
+        kznl.KZNL_ATTR_N_DIMENSION_DST_IP   : lambda n: random.sample(subnets, n),
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_IP6  : lambda n: random.sample(subnets6, n),
+        kznl.KZNL_ATTR_N_DIMENSION_DST_IP6  : lambda n: random.sample(subnets6, n),
+    }
+    max_counts = {
+        kznl.KZNL_ATTR_N_DIMENSION_IFACE    : gen.num_max_sample_interfaces,
+        kznl.KZNL_ATTR_N_DIMENSION_IFGROUP  : gen.num_max_sample_interfaces,
+        kznl.KZNL_ATTR_N_DIMENSION_PROTO    : gen.num_max_protocols,
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_PORT : gen.num_max_port_ranges,
+        kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : gen.num_max_port_ranges,
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : gen.num_max_sample_zones,
+        kznl.KZNL_ATTR_N_DIMENSION_DST_ZONE : gen.num_max_sample_zones,
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_IP   : gen.num_max_sample_subnets,
+        kznl.KZNL_ATTR_N_DIMENSION_DST_IP   : gen.num_max_sample_subnets,
+        kznl.KZNL_ATTR_N_DIMENSION_SRC_IP6  : gen.num_max_sample_subnets6,
+        kznl.KZNL_ATTR_N_DIMENSION_DST_IP6  : gen.num_max_sample_subnets6,
+    }
+
+    rule_ids = range(1, num_rules + 1)
+    services = ["service%d" % random.randint(1, 100) for _ in rule_ids]
+    columns = dict([(dim_type, [sampler(random.randint(0, max_counts[dim_type])) for _ in rule_ids])
+                    for (dim_type, sampler) in samplers.items()])
+
+    return (rule_ids, services, columns)
+
+def rule_table_to_rules(rule_ids, services, columns):
+    dim_types = sorted(columns.keys())
+    rules = []
+    for i in xrange(len(rule_ids)):
+        entries = [(dim_type, value) for dim_type in dim_types for value in columns[dim_type][i]]
+        rules.append((rule_ids[i], services[i], entries))
+    return rules
+
+def chunks(num_rules, chunk_size):
+    return [(first, min(first + chunk_size, num_rules)) for first in xrange(0, num_rules, chunk_size)]
+
+def measure(name, function):
+    start = time.time()
+    result = function()
+    elapsed = time.time() - start
+    print "%-12s %8.3f s" % (name, elapsed)
+    return (result, elapsed)
+
+def main(args):
+    parser = OptionParser(usage="usage: %prog [options]")
+    parser.add_option("-n", "--rules", type="int", dest="num_rules", default=100000,
+                      help="number of rules to serialize (default: %default)")
+    parser.add_option("-c", "--chunk", type="int", dest="chunk_size", default=16,
+                      help="number of rules in one message, 0 to split the rules at "
+                           "the attribute size limit (default: %default)")
+    (options, args) = parser.parse_args(args)
+
+    (rule_ids, services, columns) = generate_rule_table(options.num_rules)
+    rules = rule_table_to_rules(rule_ids, services, columns)
+    if options.chunk_size == 0:
+        print "Serializing %d rules in messages split at the size limit..." % options.num_rules
+        (per_entry, per_entry_time) = measure("per entry", lambda:
+            [m.dump() for m in kznl.KZorpAddRuleBulkMessage.create_messages("dispatcher", rules)])
+        (table, table_time) = measure("table", lambda:
+            [m.dump() for m in kznl.KZorpAddRuleBulkTableMessage.create_messages("dispatcher", rule_ids, services, columns)])
+    else:
+        ranges = chunks(options.num_rules, options.chunk_size)
+
+        print "Serializing %d rules in messages of %d rules..." % (options.num_rules, options.chunk_size)
+        (per_entry, per_entry_time) = measure("per entry", lambda:
+            [kznl.KZorpAddRuleBulkMessage("dispatcher", rules[first:last]).dump() for (first, last) in ranges])
+        (table, table_time) = measure("table", lambda:
+            [kznl.KZorpAddRuleBulkTableMessage("dispatcher", rule_ids[first:last], services[first:last],
+                                               dict([(dim_type, column[first:last]) for (dim_type, column) in columns.items()])).dump()
+             for (first, last) in ranges])
+
+    if per_entry != table:
+        print "FAILED: the serialized messages differ"
+        return 1
+
+    print "%d bytes, speedup %.2fx" % (sum(map(len, table)), per_entry_time / max(table_time, 1e-6))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
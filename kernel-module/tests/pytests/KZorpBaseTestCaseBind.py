@@ -103,6 +103,35 @@ class KZorpBaseTestCaseBind(KZorpComm):
             msg_add_bind = kznl.KZorpAddBindMessage(**self._bind_addrs[i])
             self.assertEqual(vars(msg_add_bind), vars(self._dumped_binds[i]))
 
+    def test_add_weighted(self):
+        self.flush_all()
+
+        bind_addr = dict(self._bind_addrs[0], weight = 3)
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddBindMessage(**bind_addr))
+        self.end_transaction()
+
+        self._dumped_binds = []
+        self.get_bind()
+
+        self.assertEqual(len(self._dumped_binds), 1)
+        self.assertEqual(self._dumped_binds[0].weight, 3)
+
+    def test_add_invalid_weight(self):
+        self.flush_all()
+
+        self.start_transaction()
+        for weight in (0, kznl.KZ_BIND_WEIGHT_MAX + 1):
+            bind_addr = dict(self._bind_addrs[0], weight = weight)
+            try:
+                self.send_message(kznl.KZorpAddBindMessage(**bind_addr))
+            except AssertionError as e:
+                if e.args[0] != "talk with KZorp failed: result='-22' error='Invalid argument'":
+                    raise e
+            else:
+                self.fail("bind with invalid weight accepted; weight='%d'" % weight)
+        self.end_transaction()
+
     def test_auto_flush(self):
         bind_addr_num = len(self._bind_addrs)
         self._dumped_binds = []
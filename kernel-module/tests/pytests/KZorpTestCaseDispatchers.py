@@ -21,6 +21,7 @@ import kzorp.netlink as netlink
 import kzorp.kzorp_netlink as kznl
 import errno
 import socket
+import struct
 import testutil
 
 class KZorpTestCaseDispatchers(KZorpBaseTestCaseDispatchers, KZorpBaseTestCaseZones):
@@ -337,6 +338,193 @@ class KZorpTestCaseDispatchers(KZorpBaseTestCaseDispatchers, KZorpBaseTestCaseZo
 
         self.check_dispatcher_num(num_rules + num_rule_entries + len(self._dispatchers))
 
+    def test_add_rule_bulk(self):
+        rules = [ (1, 'A_A', [ (kznl.KZNL_ATTR_N_DIMENSION_DST_PORT, (12, 12)),
+                               (kznl.KZNL_ATTR_N_DIMENSION_DST_PORT, (23, 44)),
+                               (kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE, 'AAA'),
+                               (kznl.KZNL_ATTR_N_DIMENSION_SRC_IP, (testutil.addr_packed('1.2.3.4/24'), testutil.netmask_packed('1.2.3.4/24'))) ]),
+                  (2, 'A_A', [ (kznl.KZNL_ATTR_N_DIMENSION_IFACE, 'eth0') ]),
+                ]
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddDispatcherMessage('n_dimension_bulk', len(rules)))
+
+        # a failing rule rolls back the whole message
+        res = self.send_message(kznl.KZorpAddRuleBulkMessage('n_dimension_bulk', rules[:1] + [(2, 'nonexistent', [])]), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+
+        self.send_message(kznl.KZorpAddRuleBulkMessage('n_dimension_bulk', rules))
+        self.end_transaction()
+
+        self.send_message(kznl.KZorpGetDispatcherMessage('n_dimension_bulk'), message_handler = self._get_dispatchers_message_handler)
+        commands = [message.command for message in self._add_dispatcher_messages]
+        self.assertEqual(commands.count(kznl.KZNL_MSG_ADD_RULE), len(rules))
+        # one entry message for each row of the longest dimension of the rules
+        self.assertEqual(commands.count(kznl.KZNL_MSG_ADD_RULE_ENTRY), 3)
+
+    def test_add_rule_bulk_split(self):
+        rules = [ (i, 'A_A', [ (kznl.KZNL_ATTR_N_DIMENSION_DST_PORT, (i, i)) ]) for i in range(1, 3001) ]
+
+        self.assertRaises(ValueError, kznl.KZorpAddRuleBulkMessage, 'n_dimension_bulk', rules)
+
+        messages = kznl.KZorpAddRuleBulkMessage.create_messages('n_dimension_bulk', rules)
+        self.assertTrue(len(messages) > 1)
+        self.assertEqual(sum([len(message.rules) for message in messages]), len(rules))
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddDispatcherMessage('n_dimension_bulk', len(rules)))
+        for message in messages:
+            self.send_message(message)
+        self.end_transaction()
+
+        self.send_message(kznl.KZorpGetDispatcherMessage('n_dimension_bulk'), message_handler = self._get_dispatchers_message_handler)
+        commands = [message.command for message in self._add_dispatcher_messages]
+        self.assertEqual(commands.count(kznl.KZNL_MSG_ADD_RULE), len(rules))
+
+    def test_add_rule_bulk_table(self):
+        subnet = (testutil.addr_packed('1.2.3.4/24'), testutil.netmask_packed('1.2.3.4/24'))
+        columns = { kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : [ [(12, 12), (23, 44)], [] ],
+                    kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : [ ['AAA'], None ],
+                    kznl.KZNL_ATTR_N_DIMENSION_SRC_IP   : [ [subnet], [] ],
+                    kznl.KZNL_ATTR_N_DIMENSION_IFACE    : [ [], ['eth0'] ] }
+        message = kznl.KZorpAddRuleBulkTableMessage('n_dimension_bulk', [1, 2], ['A_A', 'A_A'], columns)
+
+        # the same as the per entry serialization with entries in dimension type order
+        rules = [ (rule_id, 'A_A', [ (dim_type, value) for dim_type in sorted(columns.keys()) for value in columns[dim_type][i] or [] ])
+                  for (i, rule_id) in enumerate([1, 2]) ]
+        self.assertEqual(message.dump(), kznl.KZorpAddRuleBulkMessage('n_dimension_bulk', rules).dump())
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddDispatcherMessage('n_dimension_bulk', 2))
+        self.send_message(message)
+        self.end_transaction()
+
+        self.send_message(kznl.KZorpGetDispatcherMessage('n_dimension_bulk'), message_handler = self._get_dispatchers_message_handler)
+        commands = [message.command for message in self._add_dispatcher_messages]
+        self.assertEqual(commands.count(kznl.KZNL_MSG_ADD_RULE), 2)
+
+    def test_add_rule_bulk_table_split(self):
+        rule_ids = range(1, 3001)
+        services = [ 'A_A' ] * len(rule_ids)
+        columns = { kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : [ [(i, i)] for i in rule_ids ] }
+
+        self.assertRaises(ValueError, kznl.KZorpAddRuleBulkTableMessage, 'n_dimension_bulk', rule_ids, services, columns)
+
+        messages = kznl.KZorpAddRuleBulkTableMessage.create_messages('n_dimension_bulk', rule_ids, services, columns)
+        rules = [ (i, 'A_A', [ (kznl.KZNL_ATTR_N_DIMENSION_DST_PORT, (i, i)) ]) for i in rule_ids ]
+        self.assertEqual([message.dump() for message in messages],
+                         [message.dump() for message in kznl.KZorpAddRuleBulkMessage.create_messages('n_dimension_bulk', rules)])
+
+    def test_add_rule_bulk_invalid(self):
+        class KZorpAddRuleBulkInvalidVersionMessage(kznl.KZorpAddRuleBulkMessage):
+            def _build_payload(self):
+                self.append_attribute(kznl.create_name_attr(kznl.KZNL_ATTR_DPT_NAME, self.dpt_name))
+                self.append_attribute(netlink.NetlinkAttribute(kznl.KZNL_ATTR_N_DIMENSION_RULE_BULK,
+                                                               data = struct.pack('>II', kznl.KZ_RULE_BULK_VERSION + 1, 0)))
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddDispatcherMessage('n_dimension_bulk', 1))
+
+        res = self.send_message(KZorpAddRuleBulkInvalidVersionMessage('n_dimension_bulk', []), assert_on_error = False)
+        self.assertEqual(res, -errno.EINVAL)
+
+    def _add_rules(self, dpt_name, services):
+        self.send_message(kznl.KZorpAddDispatcherMessage(dpt_name, len(services)))
+        for (rule_id, service) in enumerate(services, 1):
+            self.send_message(kznl.KZorpAddRuleMessage(dpt_name, rule_id, service,
+                                                       { kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : 1 }))
+            self.send_message(kznl.KZorpAddRuleEntryMessage(dpt_name, rule_id,
+                                                            { kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : (rule_id, rule_id) }))
+
+    def _commit(self):
+        res = self.send_message(kznl.KZorpCommitTransactionMessage(), assert_on_error = False)
+        self._in_transaction = False
+        return res
+
+    def test_delete_dispatcher(self):
+        self.start_transaction()
+        self._add_rules('dpt_delete', ['A_A'])
+        self.end_transaction()
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteDispatcherMessage('dpt_delete'))
+        res = self.send_message(kznl.KZorpDeleteDispatcherMessage('dpt_delete'), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+        self.end_transaction()
+
+        res = self.send_message(kznl.KZorpGetDispatcherMessage('dpt_delete'), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+        # the other dispatchers are kept
+        res = self.send_message(kznl.KZorpGetDispatcherMessage('n_dimension'), assert_on_error = False)
+        self.assertEqual(res, 0)
+
+    def test_add_existing_dispatcher(self):
+        self.start_transaction()
+        self._add_rules('dpt_replace', ['A_A'])
+        self.end_transaction()
+
+        # the running dispatcher is not replaced by adding it again
+        self.start_transaction()
+        res = self.send_message(kznl.KZorpAddDispatcherMessage('dpt_replace', 1), assert_on_error = False)
+        self.assertEqual(res, -errno.EEXIST)
+        self.end_transaction()
+
+        # but it is after deleting it in the same transaction
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteDispatcherMessage('dpt_replace'))
+        self._add_rules('dpt_replace', ['Z_Z', 'A_A'])
+        self.end_transaction()
+
+        self.send_message(kznl.KZorpGetDispatcherMessage('dpt_replace'), message_handler = self._get_dispatchers_message_handler)
+        rules = [message for message in self._add_dispatcher_messages if message.command == kznl.KZNL_MSG_ADD_RULE]
+        self.assertEqual([(rule.rule_id, rule.service) for rule in rules], [(1, 'Z_Z'), (2, 'A_A')])
+
+    def test_delete_rule(self):
+        self.start_transaction()
+        self._add_rules('dpt_delete', ['A_A', 'Z_Z'])
+        self.end_transaction()
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteRuleMessage('dpt_delete', 1))
+        res = self.send_message(kznl.KZorpDeleteRuleMessage('dpt_delete', 1), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+        res = self.send_message(kznl.KZorpDeleteRuleMessage('dpt_delete', 3), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+        self.end_transaction()
+
+        self.send_message(kznl.KZorpGetDispatcherMessage('dpt_delete'), message_handler = self._get_dispatchers_message_handler)
+        rules = [message for message in self._add_dispatcher_messages if message.command == kznl.KZNL_MSG_ADD_RULE]
+        self.assertEqual([rule.rule_id for rule in rules], [2])
+
+    def test_delete_referenced_service(self):
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddProxyServiceMessage('svc_delete'))
+        self._add_rules('dpt_delete', ['svc_delete', 'A_A'])
+        self.end_transaction()
+
+        # the rule still refers to the service
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteServiceMessage('svc_delete'))
+        self.assertEqual(self._commit(), -errno.EBUSY)
+
+        # the rule of the dispatcher replacing the running one refers to it as well
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteServiceMessage('svc_delete'))
+        self.send_message(kznl.KZorpDeleteDispatcherMessage('dpt_delete'))
+        self._add_rules('dpt_delete', ['svc_delete'])
+        self.assertEqual(self._commit(), -errno.EBUSY)
+
+        # the config is unchanged by the failed commits
+        self.send_message(kznl.KZorpGetServiceMessage('svc_delete'))
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteServiceMessage('svc_delete'))
+        self.send_message(kznl.KZorpDeleteRuleMessage('dpt_delete', 1))
+        self.assertEqual(self._commit(), 0)
+
+        res = self.send_message(kznl.KZorpGetServiceMessage('svc_delete'), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+
     def test_get_dispatcher_by_name(self):
         #get a not existent dispatcher
         res = self.send_message(kznl.KZorpGetDispatcherMessage('nonexistentdispatchername'), assert_on_error = False)
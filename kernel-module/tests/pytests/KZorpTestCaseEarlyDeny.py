@@ -0,0 +1,169 @@
+#
+# Copyright (C) 2006-2012, BalaBit IT Ltd.
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program/include file is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+# of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+import kzorp.kzorp_netlink as kznl
+import socket
+import errno
+import select
+import testutil
+from KZorpComm import KZorpComm
+
+class KZorpTestCaseEarlyDeny(KZorpComm):
+    """Connection attempts rejected by the early_deny hook of xt_KZORP."""
+
+    port = 50090
+
+    def setUp(self):
+        try:
+            with open('/sys/module/xt_KZORP/parameters/early_deny') as f:
+                enabled = f.read().strip() == 'Y'
+        except IOError:
+            enabled = False
+        if not enabled:
+            self.skipTest("xt_KZORP is not loaded with early_deny=1")
+
+        self._upload_policy()
+
+    def _upload_policy(self, reject_limit=None):
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddDenyServiceMessage('deny-reset', True, 0,
+                                                          kznl.DenyIPv4.TCP_RESET,
+                                                          kznl.DenyIPv6.TCP_RESET,
+                                                          reject_limit=reject_limit))
+        self.send_message(kznl.KZorpAddDispatcherMessage('early-deny', 1))
+        self.send_message(kznl.KZorpAddRuleMessage('early-deny', 1, 'deny-reset',
+                                                   { kznl.KZNL_ATTR_N_DIMENSION_PROTO : 1,
+                                                     kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : 1 }))
+        self.send_message(kznl.KZorpAddRuleEntryMessage('early-deny', 1,
+                                                        { kznl.KZNL_ATTR_N_DIMENSION_PROTO : socket.IPPROTO_TCP,
+                                                          kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : (self.port, self.port) }))
+        self.end_transaction()
+
+    def tearDown(self):
+        self.flush_all()
+
+    def _listen(self):
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(('127.0.0.1', self.port))
+        listener.listen(1)
+        return listener
+
+    def _connect_refused(self):
+        client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        client.settimeout(5)
+        try:
+            client.connect(('127.0.0.1', self.port))
+            self.fail("connection to a deny service succeeded")
+        except socket.error as e:
+            self.assertEqual(e.errno, errno.ECONNREFUSED)
+        finally:
+            client.close()
+
+    def test_tcp_reset(self):
+        # the port is listened on, so a refused connection means the SYN
+        # was answered by the deny service
+        listener = self._listen()
+
+        # several attempts, the later ones are served from the lookup cache
+        try:
+            for i in range(3):
+                self._connect_refused()
+        finally:
+            listener.close()
+
+    def test_session_event(self):
+        # the rejected session is reported to the session event multicast
+        # group instead of the kernel log once somebody listens to it
+        events = kznl.Handle()
+        listener = self._listen()
+        try:
+            events.join_group(kznl.KZNL_MCGRP_SESSION_EVENTS)
+            self._connect_refused()
+
+            records = []
+            while not records:
+                for message in events.receive(timeout=5):
+                    if isinstance(message, kznl.KZorpSessionEventMessage):
+                        records.extend(message.records)
+        finally:
+            listener.close()
+            events.close()
+
+        record = records[0]
+        self.assertEqual(record['event'], kznl.SessionEvent.REJECT)
+        self.assertEqual(record['verdict'], 0) # NF_DROP
+        self.assertEqual(record['family'], socket.AF_INET)
+        self.assertEqual(record['proto'], socket.IPPROTO_TCP)
+        self.assertEqual(record['saddr'], socket.inet_aton('127.0.0.1'))
+        self.assertEqual(record['daddr'], socket.inet_aton('127.0.0.1'))
+        self.assertEqual(record['dport'], self.port)
+
+    def _connect_refused_count(self, count):
+        # non-blocking connects send a single SYN each, the sockets are
+        # closed before the first retransmission
+        clients = []
+        try:
+            for i in range(count):
+                client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                clients.append(client)
+                client.setblocking(0)
+                self.assertEqual(client.connect_ex(('127.0.0.1', self.port)), errno.EINPROGRESS)
+
+            # resets arrive right away over the loopback interface
+            select.select([], clients, [], 0.5)
+            return len([client for client in clients
+                        if client.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) == errno.ECONNREFUSED])
+        finally:
+            for client in clients:
+                client.close()
+
+    def _reject_stats(self):
+        response = []
+        self.start_transaction()
+        self.send_message(kznl.KZorpGetServiceMessage('deny-reset'), message_handler = response.append, dump = True)
+        self.end_transaction()
+        return response[0].reject_stats
+
+    def test_reject_limit(self):
+        # (rate, burst, src_rate, src_burst) of the limit, and the number of
+        # resets expected from a flood, one more may be refilled meanwhile
+        attempts = 50
+        limits = (
+            ((1, 5, 0, 0), 5),
+            ((0, 0, 1, 3), 3),
+            ((1, 4, 1, 8), 4),
+            ((1, 8, 1, 2), 2),
+            )
+
+        listener = self._listen()
+        try:
+            for reject_limit, resets in limits:
+                self.flush_all()
+                self._upload_policy(reject_limit)
+
+                refused = self._connect_refused_count(attempts)
+                self.assertTrue(resets <= refused <= resets + 1,
+                                "%d resets instead of %d with limit %s" % (refused, resets, reject_limit))
+
+                sent, suppressed = self._reject_stats()
+                self.assertEqual(sent, refused)
+                self.assertEqual(sent + suppressed, attempts)
+        finally:
+            listener.close()
+
+if __name__ == "__main__":
+    testutil.main()
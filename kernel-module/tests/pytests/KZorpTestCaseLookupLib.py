@@ -0,0 +1,95 @@
+
+#
+# Copyright (C) 2006-2012, BalaBit IT Ltd.
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program/include file is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+# of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+import unittest
+import socket
+
+import kzorp.kzorp_netlink as kznl
+import kzorp.lookup as kzlookup
+
+class KZorpTestCaseLookupLib(unittest.TestCase):
+    """Lookups of libkzorp-lookup, these do not need the kernel module."""
+
+    def setUp(self):
+        try:
+            kzlookup._load_library()
+        except OSError:
+            self.skipTest("libkzorp-lookup is not installed")
+
+        messages = [
+            kznl.KZorpAddZoneMessage('internet', family=socket.AF_INET,
+                                     address=socket.inet_pton(socket.AF_INET, '0.0.0.0'),
+                                     mask=socket.inet_pton(socket.AF_INET, '0.0.0.0')),
+            kznl.KZorpAddZoneMessage('office', family=socket.AF_INET,
+                                     address=socket.inet_pton(socket.AF_INET, '10.0.0.0'),
+                                     mask=socket.inet_pton(socket.AF_INET, '255.0.0.0')),
+            kznl.KZorpAddProxyServiceMessage('web'),
+            kznl.KZorpAddProxyServiceMessage('ssh'),
+            kznl.KZorpAddDispatcherMessage('dpt', 2),
+            kznl.KZorpAddRuleMessage('dpt', 1, 'web',
+                                     { kznl.KZNL_ATTR_N_DIMENSION_PROTO : 1,
+                                       kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : 1 }),
+            kznl.KZorpAddRuleEntryMessage('dpt', 1,
+                                          { kznl.KZNL_ATTR_N_DIMENSION_PROTO : socket.IPPROTO_TCP,
+                                            kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : (80, 80) }),
+            kznl.KZorpAddRuleMessage('dpt', 2, 'ssh',
+                                     { kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : 1,
+                                       kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : 1 }),
+            kznl.KZorpAddRuleEntryMessage('dpt', 2,
+                                          { kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : 'office',
+                                            kznl.KZNL_ATTR_N_DIMENSION_DST_PORT : (22, 22) }),
+        ]
+        self.policy = kzlookup.Policy.from_messages(messages)
+
+    def tearDown(self):
+        self.policy.close()
+
+    def _query(self, saddr, daddr, dport, proto=socket.IPPROTO_TCP):
+        return { 'family' : socket.AF_INET, 'proto' : proto,
+                 'saddr' : socket.inet_pton(socket.AF_INET, saddr), 'sport' : 1024,
+                 'daddr' : socket.inet_pton(socket.AF_INET, daddr), 'dport' : dport,
+                 'iface' : 'eth0' }
+
+    def test_lookup(self):
+        result = self.policy.lookup(self._query('10.1.2.3', '1.2.3.4', 22))
+        self.assertEqual(result['dispatcher'], 'dpt')
+        self.assertEqual(result['service'], 'ssh')
+        self.assertEqual(result['rule_id'], 2)
+        self.assertEqual(result['client_zone'], 'office')
+        self.assertEqual(result['server_zone'], 'internet')
+
+    def test_lookup_without_match(self):
+        result = self.policy.lookup(self._query('1.2.3.4', '10.1.2.3', 22))
+        self.assertEqual(result['service'], None)
+        self.assertEqual(result['service_id'], kzlookup.KZORP_LOOKUP_NO_ID)
+        self.assertEqual(result['client_zone'], 'internet')
+
+    def test_lookup_many(self):
+        queries = [ self._query('10.1.2.3', '1.2.3.4', 80),
+                    self._query('10.1.2.3', '1.2.3.4', 22),
+                    self._query('1.2.3.4', '10.1.2.3', 80, socket.IPPROTO_UDP) ] * 100
+        results = self.policy.lookup_many(queries, threads=4)
+        self.assertEqual(len(results), len(queries))
+        for query, result in zip(queries, results):
+            self.assertEqual(result, self.policy.lookup(query))
+        self.assertEqual([ r['service'] for r in results[:3] ], ['web', 'ssh', None])
+
+    def test_load_invalid_stream(self):
+        self.assertRaises(kzlookup.LookupException, kzlookup.Policy.from_netlink_stream, 'invalid stream')
+
+if __name__ == "__main__":
+    unittest.main()
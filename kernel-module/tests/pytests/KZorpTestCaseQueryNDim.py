@@ -19,6 +19,8 @@ from KZorpBaseTestCaseQuery import KZorpBaseTestCaseQuery
 import testutil
 import kzorp.kzorp_netlink as kznl
 import socket
+import struct
+import errno
 
 class KZorpTestCaseQueryNDim(KZorpBaseTestCaseQuery):
 
@@ -1049,6 +1051,130 @@ class KZorpTestCaseQueryNDim(KZorpBaseTestCaseQuery):
         self.setup_service_dispatcher(_services, _dispatchers)
         self._run_query(_queries, _answers)
 
+    def test_n_dim_query_after_incremental_commit(self):
+        _dispatchers = [{ 'name' : 'n_dimension_src_zone', 'num_rules' : 1,
+                          'rules' : [ { 'rule_id'      : 1, 'service' : 'A_A',
+                                        'entry_nums'   : { kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : 1},
+                                        'entry_values' : { kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : ['AAA'] }
+                                      },
+                                    ]
+                        },
+                        { 'name' : 'n_dimension_dst_zone', 'num_rules' : 2,
+                          'rules' : [ { 'rule_id'      : 1, 'service' : 'Z_Z',
+                                        'entry_nums'   : { kznl.KZNL_ATTR_N_DIMENSION_DST_ZONE : 1},
+                                        'entry_values' : { kznl.KZNL_ATTR_N_DIMENSION_DST_ZONE : ['ZAA'] }
+                                      },
+                                      { 'rule_id'      : 2, 'service' : 'AA_AA',
+                                        'entry_nums'   : { kznl.KZNL_ATTR_N_DIMENSION_DST_ZONE : 1},
+                                        'entry_values' : { kznl.KZNL_ATTR_N_DIMENSION_DST_ZONE : ['ZBA'] }
+                                      },
+                                    ]
+                        }]
+
+        _services = ['A_A', 'Z_Z', 'AA_AA']
+        _queries = [
+                     { 'proto' : socket.IPPROTO_UDP, 'sport' : 5, 'saddr' : '10.99.101.1', 'dport' : 5, 'family' : socket.AF_INET, 'daddr' : '1.2.3.4', 'iface' : 'dummy0', 'service' : 'A_A'},
+                     { 'proto' : socket.IPPROTO_UDP, 'sport' : 5, 'saddr' : '1.1.1.1', 'dport' : 5, 'family' : socket.AF_INET, 'daddr' : '10.99.101.129', 'iface' : 'dummy0', 'service' : 'Z_Z'},
+                     { 'proto' : socket.IPPROTO_UDP, 'sport' : 5, 'saddr' : '1.1.1.1', 'dport' : 5, 'family' : socket.AF_INET, 'daddr' : '10.99.101.193', 'iface' : 'dummy0', 'service' : 'AA_AA'},
+                   ]
+
+        self.setup_service_dispatcher(_services, _dispatchers)
+        self._run_query2(_queries)
+
+        # the first dispatcher is carried over with its lookup data, the
+        # second one is rebuilt, and the new zone gets the last index
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddZoneMessage('new_zone', family = socket.AF_INET, uname = 'new_zone',
+                                                   address = socket.inet_pton(socket.AF_INET, '192.168.77.0'),
+                                                   mask = socket.inet_pton(socket.AF_INET, '255.255.255.0')))
+        self.send_message(kznl.KZorpDeleteRuleMessage('n_dimension_dst_zone', 2))
+        self.end_transaction()
+
+        _queries[2]['service'] = None
+        self._run_query2(_queries)
+
+    def _get_ifindex(self, iface):
+        f = open('/sys/class/net/%s/ifindex' % (iface, ))
+        try:
+            return int(f.read())
+        finally:
+            f.close()
+
+    def test_n_dim_query_batch(self):
+        _dispatchers = [{ 'name' : 'n_dimension_specific', 'num_rules' : 2,
+                          'rules' : [ { 'rule_id'      : 1, 'service' : 'A_A',
+                                        'entry_nums'   : { kznl.KZNL_ATTR_N_DIMENSION_IFACE : 2},
+                                        'entry_values' : { kznl.KZNL_ATTR_N_DIMENSION_IFACE : ['dummy0', 'dummy1'] }
+                                      },
+                                      { 'rule_id'      : 2, 'service' : 'AA_AA',
+                                       'entry_nums'   : { kznl.KZNL_ATTR_N_DIMENSION_IFGROUP : 1},
+                                       'entry_values' : { kznl.KZNL_ATTR_N_DIMENSION_IFGROUP : [1] }
+                                      },
+                                    ]
+                        }]
+
+        _services = ['A_A', 'AA_AA']
+        _ifaces = ['dummy0', 'dummy1', 'dummy2', 'dummy3', 'dummy4']
+        _answers = [ 1, 1, kznl.KZ_QUERY_BATCH_NO_ID, 2, 2 ]
+
+        self.setup_service_dispatcher(_services, _dispatchers)
+
+        # enough queries to span several reply messages
+        queries = []
+        for i in range(200):
+            queries.append({ 'proto' : socket.IPPROTO_UDP, 'sport' : 5, 'dport' : 5, 'family' : socket.AF_INET,
+                             'saddr' : socket.inet_pton(socket.AF_INET, '10.99.101.1'),
+                             'daddr' : socket.inet_pton(socket.AF_INET, '10.99.201.65'),
+                             'ifindex' : self._get_ifindex(_ifaces[i % len(_ifaces)]) })
+
+        replies = []
+        self.send_message(kznl.KZorpQueryBatchMessage(queries), message_handler = replies.append, dump = True)
+
+        # zone and dispatcher ids are the indexes in the dumps of the same generation
+        zones = []
+        self.send_message(kznl.KZorpGetZoneMessage(None), message_handler = zones.append, dump = True)
+        dispatchers = []
+        self.send_message(kznl.KZorpGetDispatcherMessage(None), message_handler = dispatchers.append, dump = True)
+        zone_unames = dict([(zone.index, zone.uname) for zone in zones])
+        dispatcher_names = dict([(dispatcher.index, dispatcher.name) for dispatcher in dispatchers
+                                 if dispatcher.command == kznl.KZNL_MSG_ADD_DISPATCHER])
+
+        results = []
+        for reply in replies:
+            self.assertEqual(reply.first, len(results))
+            self.assertEqual(reply.generation, zones[0].generation)
+            results.extend(reply.results)
+        self.assertEqual(len(results), len(queries))
+        self.assertEqual(len(zone_unames), len(zones))
+        for message in zones + dispatchers[:1]:
+            self.assertEqual(message.generation, zones[0].generation)
+
+        for i in range(len(results)):
+            self.assertEqual(zone_unames[results[i]['client_zone_id']], 'AAA-#1')
+            self.assertEqual(zone_unames[results[i]['server_zone_id']], 'ABA-#2')
+            self.assertEqual(results[i]['rule_id'], _answers[i % len(_answers)])
+            if results[i]['rule_id'] == kznl.KZ_QUERY_BATCH_NO_ID:
+                self.assertEqual(results[i]['dispatcher_id'], kznl.KZ_QUERY_BATCH_NO_ID)
+                self.assertEqual(results[i]['service_id'], kznl.KZ_QUERY_BATCH_NO_ID)
+            else:
+                self.assertEqual(dispatcher_names[results[i]['dispatcher_id']], 'n_dimension_specific')
+                self.assertNotEqual(results[i]['service_id'], kznl.KZ_QUERY_BATCH_NO_ID)
+
+    def test_n_dim_query_batch_invalid(self):
+        class KZorpQueryBatchInvalidVersionMessage(kznl.KZorpQueryBatchMessage):
+            def _build_payload(self):
+                data = struct.pack('>II', kznl.KZ_QUERY_BATCH_VERSION + 1, 0)
+                self.append_attribute(kznl.NetlinkAttribute(kznl.KZNL_ATTR_QUERY_BATCH, data = data))
+
+        class KZorpQueryBatchTruncatedMessage(kznl.KZorpQueryBatchMessage):
+            def _build_payload(self):
+                data = struct.pack('>II', kznl.KZ_QUERY_BATCH_VERSION, 1)
+                self.append_attribute(kznl.NetlinkAttribute(kznl.KZNL_ATTR_QUERY_BATCH, data = data))
+
+        for message in (KZorpQueryBatchInvalidVersionMessage([]), KZorpQueryBatchTruncatedMessage([])):
+            res = self.send_message(message, dump = True, assert_on_error = False)
+            self.assertEqual(res, -errno.EINVAL)
+
 if __name__ == "__main__":
         testutil.main()
 
@@ -162,6 +162,58 @@ class KZorpTestCaseServices(KZorpComm):
         self.newSetUp()
         self._test_add_service_nat(kznl.KZorpAddServiceSourceNATMappingMessage)
 
+    def _test_add_service_nat6(self, nat_message_class):
+        nat_src = (kznl.KZ_SVC_NAT_MAP_IPS + kznl.KZ_SVC_NAT_MAP_PROTO_SPECIFIC,
+                   socket.inet_pton(socket.AF_INET6, 'fd00::1'), socket.inet_pton(socket.AF_INET6, 'fd00::ff'), 1024, 1025)
+        nat_map = (kznl.KZ_SVC_NAT_MAP_IPS,
+                   socket.inet_pton(socket.AF_INET6, 'fd01::1'), socket.inet_pton(socket.AF_INET6, 'fd01::1'), 0, 0)
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddForwardServiceMessage('test-nat6', flags=kznl.KZF_SVC_TRANSPARENT))
+        res = self.send_message(nat_message_class('test-nat6', nat_src=nat_src, nat_map=nat_map, family=socket.AF_INET6),
+                                assert_on_error=False)
+        self.end_transaction()
+
+        if res == -errno.EOPNOTSUPP:
+            # the NAT core of the running kernel cannot handle IPv6
+            return
+        self.assertEqual(res, 0)
+
+        dumped = []
+        self.send_message(kznl.KZorpGetServiceMessage(None), message_handler = dumped.append, dump = True)
+        nat_messages = filter(lambda m: isinstance(m, kznl.KZorpAddServiceNATMappingMessage) and m.name == 'test-nat6', dumped)
+        self.assertEqual(len(nat_messages), 1)
+        self.assertEqual(nat_messages[0].command, nat_message_class.command)
+        self.assertEqual(nat_messages[0].family, socket.AF_INET6)
+        self.assertEqual(nat_messages[0].nat_src, nat_src)
+        self.assertEqual(nat_messages[0].nat_map, nat_map)
+        self.assertEqual(nat_messages[0].nat_dst, None)
+
+    def test_add_service_nat6_dst(self):
+        self.newSetUp()
+        self._test_add_service_nat6(kznl.KZorpAddServiceDestinationNATMappingMessage)
+
+    def test_add_service_nat6_src(self):
+        self.newSetUp()
+        self._test_add_service_nat6(kznl.KZorpAddServiceSourceNATMappingMessage)
+
+    def test_add_service_nat6_not_forwarded(self):
+        self.newSetUp()
+        nat_src = (kznl.KZ_SVC_NAT_MAP_IPS,
+                   socket.inet_pton(socket.AF_INET6, 'fd00::1'), socket.inet_pton(socket.AF_INET6, 'fd00::ff'), 0, 0)
+        nat_map = (kznl.KZ_SVC_NAT_MAP_IPS,
+                   socket.inet_pton(socket.AF_INET6, 'fd01::1'), socket.inet_pton(socket.AF_INET6, 'fd01::1'), 0, 0)
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddDenyServiceMessage('test-nat6-deny', False, 0, kznl.DenyIPv4.DROP, kznl.DenyIPv6.DROP))
+        res = self.send_message(kznl.KZorpAddServiceSourceNATMappingMessage('test-nat6-deny', nat_src=nat_src,
+                                                                            nat_map=nat_map, family=socket.AF_INET6),
+                                assert_on_error=False)
+        self.end_transaction()
+
+        if res != -errno.EOPNOTSUPP:
+            self.assertEqual(res, -errno.EINVAL)
+
     def test_add_deny_service(self):
         response = []
         m = kznl.KZorpAddDenyServiceMessage("denyservice", False, 0, kznl.DenyIPv4.DROP, kznl.DenyIPv6.DROP)
@@ -174,5 +226,56 @@ class KZorpTestCaseServices(KZorpComm):
 
         self.assertEqual(1, len(response))
 
+    def test_add_deny_service_reject_limit(self):
+        response = []
+        m = kznl.KZorpAddDenyServiceMessage("denyservice", False, 0, kznl.DenyIPv4.TCP_RESET, kznl.DenyIPv6.TCP_RESET,
+                                            reject_limit=(100, 200, 10, 20))
+        self.start_transaction()
+        self.send_message(m)
+        self.end_transaction()
+        self.start_transaction()
+        self.send_message(kznl.KZorpGetServiceMessage("denyservice"), message_handler = response.append, dump = True)
+        self.end_transaction()
+
+        self.assertEqual(1, len(response))
+        self.assertEqual((100, 200, 10, 20), response[0].reject_limit)
+        self.assertEqual((0, 0), response[0].reject_stats)
+
+    def test_add_deny_service_invalid_reject_limit(self):
+        # a rate without a burst can never send a reject
+        m = kznl.KZorpAddDenyServiceMessage("denyservice", False, 0, kznl.DenyIPv4.TCP_RESET, kznl.DenyIPv6.TCP_RESET,
+                                            reject_limit=(100, 0, 0, 0))
+        self.check_send(m, -errno.EINVAL)
+
+        m = kznl.KZorpAddDenyServiceMessage("denyservice", False, 0, kznl.DenyIPv4.TCP_RESET, kznl.DenyIPv6.TCP_RESET,
+                                            reject_limit=(kznl.KZ_SVC_REJECT_LIMIT_MAX + 1, 1, 0, 0))
+        self.check_send(m, -errno.EINVAL)
+
+    def test_delete_service(self):
+        self.newSetUp()
+        service_cnt = len(self.services)
+
+        self.check_send(kznl.KZorpDeleteServiceMessage("test-proxy"), 0)
+        self.check_svc_num(service_cnt - 1)
+        self.assertEqual(-errno.ENOENT, self.send_message(kznl.KZorpGetServiceMessage("test-proxy"), assert_on_error=False))
+
+        # deleted already
+        self.check_send(kznl.KZorpDeleteServiceMessage("test-proxy"), -errno.ENOENT)
+
+    def test_replace_service(self):
+        self.newSetUp()
+        service_cnt = len(self.services)
+
+        self.start_transaction()
+        self.send_message(kznl.KZorpDeleteServiceMessage("test3"))
+        self.send_message(kznl.KZorpAddProxyServiceMessage("test3"))
+        self.end_transaction()
+
+        self.check_svc_num(service_cnt)
+        response = []
+        self.send_message(kznl.KZorpGetServiceMessage("test3"), message_handler = response.append, dump = True)
+        self.assertEqual(1, len(response))
+        self.assertEqual(kznl.KZ_SVC_PROXY, response[0].service_type)
+
 if __name__ == "__main__":
     testutil.main()
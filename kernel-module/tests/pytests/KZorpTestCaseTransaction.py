@@ -19,6 +19,7 @@ from KZorpBaseTestCaseZones import KZorpBaseTestCaseZones
 import testutil
 import errno
 import kzorp.kzorp_netlink as kznl
+import kzorp.netlink as netlink
 
 class KZorpTestCaseTransaction(KZorpBaseTestCaseZones):
     def tearDown(self):
@@ -66,5 +67,154 @@ class KZorpTestCaseTransaction(KZorpBaseTestCaseZones):
 
         self.check_zone_num(1, False)
 
+    def _talk(self, handle, message):
+        return list(handle.talk(message))
+
+    def test_concurrent_transactions(self):
+        other = kznl.Handle()
+        try:
+            self.start_transaction()
+            self._talk(other, kznl.KZorpStartTransactionMessage('other_instance'))
+
+            self.send_message(kznl.KZorpAddZoneMessage('a'))
+            self._talk(other, kznl.KZorpAddZoneMessage('b'))
+
+            self.end_transaction()
+            self._talk(other, kznl.KZorpCommitTransactionMessage())
+        finally:
+            other.close()
+
+        self.check_zone_num(2)
+
+    def test_concurrent_transaction_conflict(self):
+        other = kznl.Handle()
+        try:
+            self.start_transaction()
+            self._talk(other, kznl.KZorpStartTransactionMessage('other_instance'))
+
+            self.send_message(kznl.KZorpAddZoneMessage('a'))
+            self._talk(other, kznl.KZorpAddZoneMessage('a'))
+
+            self.end_transaction()
+            try:
+                self._talk(other, kznl.KZorpCommitTransactionMessage())
+                self.fail("conflicting commit succeeded")
+            except netlink.NetlinkException as e:
+                self.assertEqual(e.detail, -errno.EAGAIN)
+        finally:
+            other.close()
+
+        self.check_zone_num(1)
+
+    def _check_deleted_reference(self, messages):
+        self.start_transaction()
+        self.send_message(kznl.KZorpAddZoneMessage('z'))
+        self.end_transaction()
+
+        other = kznl.Handle()
+        try:
+            self._talk(other, kznl.KZorpStartTransactionMessage('other_instance'))
+            for message in messages:
+                self._talk(other, message)
+
+            # the zone is deleted while the other transaction refers to it
+            self.start_transaction()
+            self.send_message(kznl.KZorpDeleteZoneMessage('z'))
+            self.end_transaction()
+
+            try:
+                self._talk(other, kznl.KZorpCommitTransactionMessage())
+                self.fail("commit referring to a deleted zone succeeded")
+            except netlink.NetlinkException as e:
+                self.assertEqual(e.detail, -errno.EAGAIN)
+        finally:
+            other.close()
+
+        self.check_zone_num(0)
+
+    def test_concurrent_delete_parent_zone(self):
+        self._check_deleted_reference([ kznl.KZorpAddZoneMessage('child', pname = 'z') ])
+
+    def test_concurrent_delete_rule_zone(self):
+        self._check_deleted_reference([ kznl.KZorpAddProxyServiceMessage('svc'),
+                                        kznl.KZorpAddDispatcherMessage('dpt', 1),
+                                        kznl.KZorpAddRuleMessage('dpt', 1, 'svc', { kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : 1 }),
+                                        kznl.KZorpAddRuleEntryMessage('dpt', 1, { kznl.KZNL_ATTR_N_DIMENSION_SRC_ZONE : 'z' }) ])
+
+    def test_async_commit(self):
+        self.send_message(kznl.KZorpStartTransactionMessage(kznl.KZ_INSTANCE_GLOBAL, 42L))
+        self._in_transaction = True
+        self.send_message(kznl.KZorpAddZoneMessage('a'))
+
+        replies = list(self.handle.talk(kznl.KZorpCommitTransactionMessage(asynchronous = True)))
+        self._in_transaction = False
+        # the notification may arrive before the acknowledgement
+        if not replies:
+            replies = self.handle.receive()
+
+        self.assertEqual(len(replies), 1)
+        self.assertEqual(replies[0].command, kznl.KZNL_MSG_COMMIT_DONE)
+        self.assertEqual(replies[0].result, 0)
+        self.assertEqual(replies[0].config_cookie, 42L)
+
+        self.check_zone_num(1)
+
+    def test_async_commit_concurrent(self):
+        other = kznl.Handle()
+        try:
+            self._talk(other, kznl.KZorpStartTransactionMessage('other_instance'))
+            self._talk(other, kznl.KZorpAddZoneMessage('other'))
+
+            # enough zones to keep the build of the lookup structures busy
+            self.send_message(kznl.KZorpStartTransactionMessage(kznl.KZ_INSTANCE_GLOBAL))
+            self._in_transaction = True
+            self.handle.exchange([ kznl.KZorpAddZoneMessage('zone%d' % i) for i in range(1000) ])
+
+            replies = list(self.handle.talk(kznl.KZorpCommitTransactionMessage(asynchronous = True)))
+            self._in_transaction = False
+
+            # the asynchronous commit is merged again with the config
+            # installed by this one instead of failing
+            self._talk(other, kznl.KZorpCommitTransactionMessage())
+        finally:
+            other.close()
+
+        if not replies:
+            replies = self.handle.receive()
+
+        self.assertEqual(len(replies), 1)
+        self.assertEqual(replies[0].command, kznl.KZNL_MSG_COMMIT_DONE)
+        self.assertEqual(replies[0].result, 0)
+
+        self.check_zone_num(1001)
+
+    def test_pipelined_exchange(self):
+        self.start_transaction()
+        replies = self.handle.exchange([ kznl.KZorpAddZoneMessage('zone%d' % i) for i in range(300) ], window = 16)
+        self.end_transaction()
+
+        self.assertEqual(replies, [ [] ] * 300)
+        self.check_zone_num(300)
+
+    def test_pipelined_exchange_error(self):
+        messages = [ kznl.KZorpAddZoneMessage('zone%d' % i) for i in range(300) ]
+        messages[150] = kznl.KZorpAddZoneMessage('orphan', pname = 'nonexistent')
+
+        self.start_transaction()
+        try:
+            self.handle.exchange(messages)
+            self.fail("exchange of a failing message succeeded")
+        except netlink.NetlinkPipelineException as e:
+            self.assertEqual(e.index, 150)
+            self.assertEqual(e.detail, -errno.ENOENT)
+            self.assertEqual(e.errors, [ (150, -errno.ENOENT) ])
+            # messages sent before the failure was noticed are applied
+            self.assertEqual(e.applied[:150], range(150))
+            self.assertFalse(150 in e.applied)
+
+        # the handle is still in sync with the kernel
+        res = self.send_message(kznl.KZorpAddZoneMessage('last'), assert_on_error = False)
+        self.assertEqual(res, 0)
+
 if __name__ == "__main__":
     testutil.main()
@@ -138,6 +138,29 @@ class KZorpTestCaseZones(KZorpBaseTestCaseZones):
             else:
                 self.assert_(True, "zone with name %s could not find in the dump" % self.get_zone_uname(add_zone_message))
 
+    def test_delete_zone(self):
+        self.newSetUp()
+
+        self.start_transaction()
+        self.send_message(kzorp_netlink.KZorpDeleteZoneMessage('k6'))
+        res = self.send_message(kzorp_netlink.KZorpDeleteZoneMessage('k6'), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+        self.end_transaction()
+
+        self.check_zone_num(len(self._zones) - 1)
+        res = self.send_message(kzorp_netlink.KZorpGetZoneMessage('k6'), assert_on_error = False)
+        self.assertEqual(res, -errno.ENOENT)
+
+    def test_delete_zone_with_children(self):
+        self.newSetUp()
+
+        self.start_transaction()
+        self.send_message(kzorp_netlink.KZorpDeleteZoneMessage('g'))
+        res = self.send_message(kzorp_netlink.KZorpCommitTransactionMessage(), assert_on_error = False)
+        self.assertEqual(res, -errno.EBUSY)
+        self._in_transaction = False
+
+        self.check_zone_num(len(self._zones))
 
 if __name__ == "__main__":
     testutil.main()
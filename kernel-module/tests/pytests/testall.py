@@ -16,6 +16,8 @@
 # Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #
 from KZorpTestCaseDispatchers import KZorpTestCaseDispatchers
+from KZorpTestCaseEarlyDeny import KZorpTestCaseEarlyDeny
+from KZorpTestCaseLookupLib import KZorpTestCaseLookupLib
 from KZorpTestCaseQueryNDim import KZorpTestCaseQueryNDim
 from KZorpTestCaseServices import KZorpTestCaseServices
 from KZorpTestCaseTransaction import KZorpTestCaseTransaction
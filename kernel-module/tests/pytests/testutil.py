@@ -130,6 +130,10 @@ attrmap = {
             kznl.KZNL_ATTR_SVC_NAT_SRC: (kznl.create_nat_range_attr, kznl.parse_nat_range_attr),
             kznl.KZNL_ATTR_SVC_NAT_DST: (kznl.create_nat_range_attr, kznl.parse_nat_range_attr),
             kznl.KZNL_ATTR_SVC_NAT_MAP: (kznl.create_nat_range_attr, kznl.parse_nat_range_attr),
+            kznl.KZNL_ATTR_SVC_NAT6_SRC: (kznl.create_nat6_range_attr, kznl.parse_nat6_range_attr),
+            kznl.KZNL_ATTR_SVC_NAT6_DST: (kznl.create_nat6_range_attr, kznl.parse_nat6_range_attr),
+            kznl.KZNL_ATTR_SVC_NAT6_MAP: (kznl.create_nat6_range_attr, kznl.parse_nat6_range_attr),
+            kznl.KZNL_ATTR_SVC_REJECT_LIMIT: (kznl.create_reject_limit_attr, kznl.parse_reject_limit_attr),
             kznl.KZNL_ATTR_SVC_SESSION_COUNT: (netlink.NetlinkAttribute.create_be32, netlink.NetlinkAttribute.parse_be32),
           }
 
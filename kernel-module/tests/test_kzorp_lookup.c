@@ -20,6 +20,7 @@
  */
 
 #define NUM_RULES 10000
+#define NUM_BUILD_RULES 1000000
 #define NUM_INPUTS 5000
 #define NUM_INTERFACES 50
 #define NUM_ZONES 500
@@ -36,8 +37,10 @@
 #include "rand-lfsr258.h"
 #include <linux/sort.h>
 long long get_user_time();
+long long get_wall_time();
 
 int opt_dump = 0;
+int opt_build = 0;
 #define DUMP(FORMAT, PARAMS...) ((void)(opt_dump && printf(FORMAT, ##PARAMS)))
 
 #define RAND_INT(MAX) \
@@ -94,6 +97,9 @@ void generate_zones(struct kz_zone *dst, int num_zones)
   for(i = 0; i < num_zones; i++)
     {
       dst[i].index = kz_zone_index++;
+      /* zones of the same depth are sorted by name when building the lookup data */
+      dst[i].unique_name = malloc(sizeof("zone") + 10);
+      snprintf(dst[i].unique_name, sizeof("zone") + 10, "zone%d", i);
 
       if(i > 5 && kz_random_int(&seed, 99) < 90)
         {
@@ -327,6 +333,446 @@ void generate_input(struct input *dst)
 #undef GENERATE_AF_DEP_FIELDS
 }
 
+/*
+ * NAT interval index: each case is a NAT list given by the source
+ * ranges of its entries and lookups with the index of the entry
+ * expected to match, -1 meaning none
+ */
+#define NAT_TEST_MAX_ENTRIES 8
+#define NAT_TEST_MAX_QUERIES 8
+#define NAT_TEST_ANY 0, 0
+
+struct nat_test_range {
+  /* in host byte order, both zero means an entry without source address range */
+  u32 from;
+  u32 to;
+};
+
+struct nat_test_query {
+  u32 addr;
+  int match;
+};
+
+struct nat_test {
+  const char *name;
+  unsigned int entry_num;
+  struct nat_test_range entry[NAT_TEST_MAX_ENTRIES];
+  unsigned int query_num;
+  struct nat_test_query query[NAT_TEST_MAX_QUERIES];
+};
+
+#define IP(A, B, C, D) (((u32) (A) << 24) | ((B) << 16) | ((C) << 8) | (D))
+
+const struct nat_test nat_tests[] = {
+  {
+    "empty list", 0, {},
+    2, { { IP(10, 0, 0, 1), -1 }, { 0, -1 } }
+  },
+  {
+    "disjoint ranges", 3,
+    { { IP(10, 0, 0, 0), IP(10, 0, 0, 255) }, { IP(10, 0, 2, 0), IP(10, 0, 2, 255) }, { IP(192, 168, 0, 1), IP(192, 168, 0, 1) } },
+    7, { { IP(9, 255, 255, 255), -1 }, { IP(10, 0, 0, 0), 0 }, { IP(10, 0, 0, 255), 0 }, { IP(10, 0, 1, 0), -1 },
+         { IP(10, 0, 2, 128), 1 }, { IP(192, 168, 0, 1), 2 }, { IP(192, 168, 0, 2), -1 } }
+  },
+  {
+    "overlapping ranges", 3,
+    { { IP(10, 0, 0, 0), IP(10, 0, 0, 255) }, { IP(10, 0, 0, 128), IP(10, 0, 1, 0) }, { IP(10, 0, 0, 64), IP(10, 0, 0, 191) } },
+    6, { { IP(10, 0, 0, 0), 0 }, { IP(10, 0, 0, 100), 0 }, { IP(10, 0, 0, 200), 0 }, { IP(10, 0, 1, 0), 1 },
+         { IP(10, 0, 1, 1), -1 }, { IP(9, 0, 0, 0), -1 } }
+  },
+  {
+    "narrow range first", 2,
+    { { IP(10, 0, 0, 5), IP(10, 0, 0, 5) }, { IP(10, 0, 0, 0), IP(10, 0, 0, 255) } },
+    4, { { IP(10, 0, 0, 4), 1 }, { IP(10, 0, 0, 5), 0 }, { IP(10, 0, 0, 6), 1 }, { IP(10, 0, 1, 0), -1 } }
+  },
+  {
+    "wide range first shadows the rest", 3,
+    { { IP(10, 0, 0, 0), IP(10, 0, 0, 255) }, { IP(10, 0, 0, 5), IP(10, 0, 0, 5) }, { NAT_TEST_ANY } },
+    3, { { IP(10, 0, 0, 5), 0 }, { IP(10, 0, 0, 6), 0 }, { IP(172, 16, 0, 1), 2 } }
+  },
+  {
+    "entry without address range matches everywhere", 2,
+    { { NAT_TEST_ANY }, { IP(10, 0, 0, 0), IP(10, 0, 0, 255) } },
+    3, { { 0, 0 }, { IP(10, 0, 0, 1), 0 }, { 0xffffffffU, 0 } }
+  },
+  {
+    "range up to the last address", 2,
+    { { IP(255, 255, 255, 0), 0xffffffffU }, { IP(128, 0, 0, 0), IP(255, 255, 255, 127) } },
+    4, { { 0xffffffffU, 0 }, { IP(255, 255, 255, 0), 0 }, { IP(255, 255, 254, 255), 1 }, { IP(127, 255, 255, 255), -1 } }
+  },
+};
+
+/* the entry of the list that a linear scan would find */
+int nat_list_entry_index(const struct list_head *head, const struct nf_nat_range *map)
+{
+  const struct kz_service_nat_entry *i;
+  int n = 0;
+
+  list_for_each_entry(i, head, list)
+    {
+      if(&i->map == map)
+        return n;
+      n++;
+    }
+
+  return -1;
+}
+
+void nat_test_add_entry(struct kz_service *svc, u32 from, u32 to)
+{
+  struct kz_service_nat_entry *entry = calloc(1, sizeof(*entry));
+
+  if(from || to)
+    {
+      entry->src.flags = IP_NAT_RANGE_MAP_IPS;
+      entry->src.min_ip = htonl(from);
+      entry->src.max_ip = htonl(to);
+    }
+  list_add_tail(&entry->list, &svc->a.fwd.snat);
+}
+
+void nat_test_clear(struct kz_service *svc)
+{
+  struct kz_service_nat_entry *i, *next;
+
+  list_for_each_entry_safe(i, next, &svc->a.fwd.snat, list)
+    {
+      list_del(&i->list);
+      free(i);
+    }
+  kz_service_nat_index_destroy(svc->a.fwd.snat_index);
+  svc->a.fwd.snat_index = NULL;
+}
+
+int nat_test_lookup(const struct kz_service *svc, u32 addr)
+{
+  const struct nf_nat_range *map;
+
+  map = kz_service_nat_lookup(svc->a.fwd.snat_index, htonl(addr), htonl(IP(192, 0, 2, 1)),
+                              htons(1024), htons(80), IPPROTO_TCP);
+  return map ? nat_list_entry_index(&svc->a.fwd.snat, map) : -1;
+}
+
+/* builds the NAT indexes of the services */
+int nat_test_build(const char *name, struct kz_head_s *services)
+{
+  if(kz_head_service_build(services) < 0)
+    {
+      printf("NAT index test '%s': failed to build the index\n", name);
+      return 1;
+    }
+  return 0;
+}
+
+int nat_index_test(void)
+{
+  struct kz_service svc = { .type = KZ_SERVICE_FORWARD };
+  struct kz_head_s services = { .head = LIST_HEAD_INIT(services.head) };
+  const struct nat_test *t;
+  unsigned int k;
+  int failed = 0;
+
+  INIT_LIST_HEAD(&svc.a.fwd.snat);
+  INIT_LIST_HEAD(&svc.a.fwd.dnat);
+  INIT_LIST_HEAD(&svc.a.fwd.snat6);
+  INIT_LIST_HEAD(&svc.a.fwd.dnat6);
+  list_add(&svc.list, &services.head);
+
+  for(t = nat_tests; t < nat_tests + ARRAY_SIZE(nat_tests); t++)
+    {
+      for(k = 0; k < t->entry_num; k++)
+        nat_test_add_entry(&svc, t->entry[k].from, t->entry[k].to);
+
+      if(nat_test_build(t->name, &services))
+        return 1;
+
+      if((t->entry_num == 0) != (svc.a.fwd.snat_index == NULL))
+        {
+          printf("NAT index test '%s': index expected only for non-empty lists\n", t->name);
+          failed++;
+        }
+
+      for(k = 0; k < t->query_num; k++)
+        {
+          int match = nat_test_lookup(&svc, t->query[k].addr);
+          if(match != t->query[k].match)
+            {
+              printf("NAT index test '%s': address %08x matched entry %d instead of %d\n",
+                     t->name, t->query[k].addr, match, t->query[k].match);
+              failed++;
+            }
+        }
+
+      nat_test_clear(&svc);
+    }
+
+  /* nested ranges, the innermost first: too many candidates, so a
+   * single segment is used, which still keeps the list order */
+  {
+    const unsigned int entry_num = 40;
+    const u32 center = IP(10, 0, 0, 100);
+
+    for(k = 0; k < entry_num; k++)
+      nat_test_add_entry(&svc, center - k, center + k);
+
+    if(nat_test_build("nested ranges", &services))
+      return 1;
+
+    if(svc.a.fwd.snat_index->segment_num != 1)
+      {
+        printf("NAT index test 'nested ranges': %u segments instead of a single one\n",
+               svc.a.fwd.snat_index->segment_num);
+        failed++;
+      }
+
+    for(k = 0; k <= entry_num; k++)
+      {
+        const int expected = k < entry_num ? (int) k : -1;
+        int match_below = nat_test_lookup(&svc, center - k);
+        int match_above = nat_test_lookup(&svc, center + k);
+        if(match_below != expected || match_above != expected)
+          {
+            printf("NAT index test 'nested ranges': distance %u matched entries %d and %d instead of %d\n",
+                   k, match_below, match_above, expected);
+            failed++;
+          }
+      }
+
+    nat_test_clear(&svc);
+  }
+
+  return failed;
+}
+
+#undef IP
+
+/*
+ * Maglev tables of the binds: each case is a set of bind weights; the
+ * table is checked for the share of each bind, and for the entries
+ * that move when one of the binds is removed
+ */
+#define MAGLEV_TEST_MAX_BINDS 16
+
+struct maglev_test {
+  const char *name;
+  unsigned int bind_num;
+  unsigned int weight[MAGLEV_TEST_MAX_BINDS];
+};
+
+const struct maglev_test maglev_tests[] = {
+  { "single bind", 1, { 1 } },
+  { "two binds", 2, { 1, 1 } },
+  { "seven binds", 7, { 1, 1, 1, 1, 1, 1, 1 } },
+  { "sixteen binds", 16, { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 } },
+  { "weighted binds", 3, { 1, 2, 1 } },
+  { "unweighted bind counts as one", 3, { 0, 1, 4 } },
+};
+
+void maglev_test_binds(const struct maglev_test *t, struct kz_bind *bind, const struct kz_bind **binds)
+{
+  unsigned int k;
+
+  for(k = 0; k < t->bind_num; k++)
+    {
+      memset(&bind[k], 0, sizeof(bind[k]));
+      bind[k].family = AF_INET;
+      bind[k].addr.ip = htonl(0x7f000001);
+      bind[k].port = 50080 + k;
+      bind[k].proto = IPPROTO_TCP;
+      bind[k].weight = t->weight[k];
+      binds[k] = &bind[k];
+    }
+}
+
+int maglev_test(void)
+{
+  u16 table[KZ_BIND_MAGLEV_SIZE], reduced[KZ_BIND_MAGLEV_SIZE];
+  struct kz_bind bind[MAGLEV_TEST_MAX_BINDS];
+  const struct kz_bind *binds[MAGLEV_TEST_MAX_BINDS];
+  const struct maglev_test *t;
+  unsigned int k, e;
+  int failed = 0;
+
+  for(t = maglev_tests; t < maglev_tests + ARRAY_SIZE(maglev_tests); t++)
+    {
+      unsigned int count[MAGLEV_TEST_MAX_BINDS] = {};
+      unsigned int weight_sum = 0;
+
+      maglev_test_binds(t, bind, binds);
+      if(kz_bind_lookup_maglev_fill(table, binds, t->bind_num) < 0)
+        {
+          printf("Maglev test '%s': failed to fill the table\n", t->name);
+          return 1;
+        }
+
+      for(e = 0; e < KZ_BIND_MAGLEV_SIZE; e++)
+        {
+          if(table[e] >= t->bind_num)
+            {
+              printf("Maglev test '%s': entry %u is %u\n", t->name, e, table[e]);
+              return 1;
+            }
+          count[table[e]]++;
+        }
+
+      /* the binds claim entries in turns, so the shares differ from the
+       * weighted ones by the entries of the last turn at most */
+      for(k = 0; k < t->bind_num; k++)
+        weight_sum += max(t->weight[k], 1U);
+      for(k = 0; k < t->bind_num; k++)
+        {
+          const unsigned int weight = max(t->weight[k], 1U);
+          const unsigned int share = KZ_BIND_MAGLEV_SIZE * weight / weight_sum;
+          if(count[k] + weight < share || count[k] > share + weight)
+            {
+              printf("Maglev test '%s': bind %u owns %u entries instead of about %u\n",
+                     t->name, k, count[k], share);
+              failed++;
+            }
+        }
+
+      /* removing a bind moves its own entries, and only a few of the others */
+      for(k = 0; t->bind_num > 1 && k < t->bind_num; k++)
+        {
+          const struct kz_bind *rest[MAGLEV_TEST_MAX_BINDS];
+          const unsigned int share = KZ_BIND_MAGLEV_SIZE * max(t->weight[k], 1U) / weight_sum;
+          unsigned int i, rest_num = 0, moved = 0;
+
+          for(i = 0; i < t->bind_num; i++)
+            if(i != k)
+              rest[rest_num++] = binds[i];
+
+          if(kz_bind_lookup_maglev_fill(reduced, rest, rest_num) < 0)
+            {
+              printf("Maglev test '%s': failed to fill the table without bind %u\n", t->name, k);
+              return 1;
+            }
+
+          for(e = 0; e < KZ_BIND_MAGLEV_SIZE; e++)
+            if(table[e] != k && rest[reduced[e]] != binds[table[e]])
+              moved++;
+
+          if(moved > 2 * share)
+            {
+              printf("Maglev test '%s': removing bind %u moved %u entries of the other binds\n",
+                     t->name, k, moved);
+              failed++;
+            }
+        }
+    }
+
+  return failed;
+}
+
+/* the threaded build is verified with at least this many threads */
+#define VERIFY_THREADS 4
+
+/* copies the lookup data of the dispatcher, the records are chained by bytes_to_next */
+void *copy_lookup_data(const struct kz_dispatcher *dispatcher, size_t *size)
+{
+  const struct kz_rule_lookup_data *rule = (const void *) dispatcher->lookup->data;
+  size_t len = 0;
+
+  while(rule->bytes_to_next)
+    {
+      len += rule->bytes_to_next;
+      rule = (const void *) ((const char *) rule + rule->bytes_to_next);
+    }
+  len += kz_generate_lookup_data_rule_size(&dispatcher->rule[rule->rule_index]);
+
+  *size = len;
+  return memcpy(malloc(len), dispatcher->lookup->data, len);
+}
+
+/* checks that the lookup data of the dispatcher is the same as the serially built one */
+int lookup_data_matches(const struct kz_dispatcher *dispatcher, const void *serial_data, size_t serial_size)
+{
+  size_t size;
+  void *data = copy_lookup_data(dispatcher, &size);
+  int res = size == serial_size && memcmp(data, serial_data, size) == 0;
+
+  free(data);
+  return res;
+}
+
+/* builds the lookup data of NUM_BUILD_RULES rules with 1, 2, 4, ... max_threads threads */
+int build_benchmark(int max_threads)
+{
+  struct kz_dispatcher_n_dimension_rule *rules = calloc(NUM_BUILD_RULES, sizeof(*rules));
+  {
+    int count = NUM_BUILD_RULES;
+    while(count--)
+      generate_rule(&rules[count], MAX_INTERFACES, MAX_PORT_RANGE_COUNT, MAX_ZONE_COUNT, MAX_SUBNET_COUNT, MAX_SUBNET6_COUNT);
+  }
+
+  struct kz_dispatcher dispatcher = {
+    .name = "test_dispatcher",
+    .num_rule = NUM_BUILD_RULES,
+    .rule = rules
+  };
+  struct kz_head_d dispatchers = { .head = LIST_HEAD_INIT(dispatchers.head) };
+  list_add(&dispatcher.list, &dispatchers.head);
+
+  printf("Build time of the lookup data of %d rules:\n", NUM_BUILD_RULES);
+  void *serial_data = NULL;
+  size_t serial_size = 0;
+  unsigned int threads;
+  for(threads = 1; threads <= (unsigned int) max_threads; threads *= 2)
+    {
+      kz_parallel_threads = threads;
+      dispatcher.rules_sorted = false;
+
+      long long start_time = get_wall_time();
+      if(kz_head_dispatcher_build(&dispatchers) < 0)
+        {
+          printf("failed to build lookup data\n");
+          return 1;
+        }
+      long long time_elapsed = get_wall_time() - start_time;
+
+      printf("threads: %u, wall time: %lld us\n", threads, time_elapsed);
+
+      if(threads == 1)
+        serial_data = copy_lookup_data(&dispatcher, &serial_size);
+      else if(!lookup_data_matches(&dispatcher, serial_data, serial_size))
+        {
+          printf("lookup data built with %u threads differs from the serial one\n", threads);
+          return 1;
+        }
+      kz_head_dispatcher_destroy(&dispatchers);
+    }
+
+  free(serial_data);
+  return 0;
+}
+
+/* evaluates the inputs, storing the number of matching rules and the best ones of each */
+void eval_inputs(const struct input *in, const struct kz_head_d *dispatchers, struct kz_percpu_env *lenv,
+                 int *matches, const struct kz_dispatcher_n_dimension_rule **results)
+{
+  const struct input *i;
+  for(i = in; i < in + NUM_INPUTS; ++i)
+    {
+      const size_t pos = i - in;
+      matches[pos] = kz_ndim_eval(
+        0,
+        &i->iface,
+        i->l3proto,
+        &i->src_addr,
+        &i->dst_addr,
+        i->l4proto,
+        i->src_port,
+        i->dst_port,
+        &i->src_zone,
+        &i->dst_zone,
+        dispatchers,
+        lenv
+      );
+      const size_t stored = (size_t) matches[pos] < lenv->max_result_size ? (size_t) matches[pos] : lenv->max_result_size;
+      memcpy(&results[pos * lenv->max_result_size], lenv->result_rules, stored * sizeof(*results));
+    }
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -341,9 +787,19 @@ int main(int argc, char *argv[])
   while(argc-- > 0)
     {
       PARSE_OPTION(dump);
+      PARSE_OPTION(build);
     }
 #undef PARSE_OPTION
 
+  {
+    int failed = nat_index_test() + maglev_test();
+    if(failed)
+      {
+        printf("%d unit test checks failed\n", failed);
+        return 1;
+      }
+  }
+
   kz_random_init(13, &seed);
 
   struct net_device _interface[NUM_INTERFACES] = {};
@@ -366,6 +822,9 @@ int main(int argc, char *argv[])
   num_subnets6 = NUM_SUBNETS6;
   generate_subnets6(subnet6, num_subnets6);
 
+  if(opt_build)
+    return build_benchmark(opt_build);
+
   struct kz_dispatcher_n_dimension_rule *rules = calloc(NUM_RULES, sizeof(*rules));
   {
     int count = NUM_RULES;
@@ -401,35 +860,61 @@ int main(int argc, char *argv[])
       }
   }
 
-  kz_generate_lookup_data(&dispatchers);
+  /* the timed lookups use the serially built lookup data */
+  kz_parallel_threads = 1;
+  if(kz_head_dispatcher_build(&dispatchers) < 0)
+    {
+      printf("failed to build lookup data\n");
+      return 1;
+    }
+
+  int *matches = calloc(NUM_INPUTS, sizeof(*matches));
+  const struct kz_dispatcher_n_dimension_rule **results = calloc(NUM_INPUTS * lenv.max_result_size, sizeof(*results));
 
   long long start_time = get_user_time();
 
   {
-    struct input *i = in;
-    printf("Number of matching rules:\n");
-    for(; i < in + NUM_INPUTS; ++i)
-      {
-        printf("%d ",
-          kz_ndim_eval(
-            0,
-            &i->iface,
-            i->l3proto,
-            &i->src_addr,
-            &i->dst_addr,
-            i->l4proto,
-            i->src_port,
-            i->dst_port,
-            &i->src_zone,
-            &i->dst_zone,
-            &dispatchers,
-            &lenv
-          )
-        );
-      }
+    int i;
+    eval_inputs(in, &dispatchers, &lenv, matches, results);
     long long time_elapsed = get_user_time() - start_time;
+    printf("Number of matching rules:\n");
+    for(i = 0; i < NUM_INPUTS; ++i)
+      printf("%d ", matches[i]);
     printf("\nuser time: %lld us\n", time_elapsed);
     printf("%lld lookup/s\n", NUM_INPUTS * 1000000ll / time_elapsed);
   }
+
+  /* the threaded build has to produce the same lookup data and results */
+  {
+    unsigned int threads = kz_parallel_online_cpus() > VERIFY_THREADS ? kz_parallel_online_cpus() : VERIFY_THREADS;
+    int *parallel_matches = calloc(NUM_INPUTS, sizeof(*parallel_matches));
+    const struct kz_dispatcher_n_dimension_rule **parallel_results = calloc(NUM_INPUTS * lenv.max_result_size, sizeof(*parallel_results));
+    size_t serial_size;
+    void *serial_data = copy_lookup_data(&dispatcher, &serial_size);
+
+    kz_head_dispatcher_destroy(&dispatchers);
+    dispatcher.rules_sorted = false;
+    kz_parallel_threads = threads;
+    if(kz_head_dispatcher_build(&dispatchers) < 0)
+      {
+        printf("failed to build lookup data with %u threads\n", threads);
+        return 1;
+      }
+
+    if(!lookup_data_matches(&dispatcher, serial_data, serial_size))
+      {
+        printf("lookup data built with %u threads differs from the serial one\n", threads);
+        return 1;
+      }
+
+    eval_inputs(in, &dispatchers, &lenv, parallel_matches, parallel_results);
+    if(memcmp(parallel_matches, matches, NUM_INPUTS * sizeof(*matches)) ||
+       memcmp(parallel_results, results, NUM_INPUTS * lenv.max_result_size * sizeof(*results)))
+      {
+        printf("lookup results with %u threads differ from the serial ones\n", threads);
+        return 1;
+      }
+    printf("lookup data and results of %u threads match the serial build\n", threads);
+  }
   return 0;
 }
@@ -0,0 +1,604 @@
+/*
+ * Copyright (C) 2006-2012, BalaBit IT Ltd.
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * Compares the lookups of libkzorp-lookup with kz_lookup_session_rule()
+ * on the same policy: the policy is built here from the kernel
+ * structures and loaded into the library from the configuration
+ * messages describing it. Only the API of the library is exported, so
+ * its copy of the lookup code does not clash with the one linked here.
+ */
+#include "test.h"
+#include <linux/netlink.h>
+#include <net/netlink.h>
+#include <net/genetlink.h>
+#include <kzorp_netlink.h>
+#include <kzorp_lookup_lib.h>
+
+int inet_pton(int af, const char *src, void *dst);
+
+/* configuration messages */
+
+struct policy_messages {
+  char buf[1 << 16];
+  unsigned int len;
+  struct nlmsghdr *nlh;
+};
+
+static void
+msg_begin(struct policy_messages *m, u_int8_t cmd)
+{
+  struct genlmsghdr *genlh;
+
+  m->nlh = (struct nlmsghdr *) (m->buf + m->len);
+  m->nlh->nlmsg_type = NLMSG_MIN_TYPE;
+  m->nlh->nlmsg_len = NLMSG_HDRLEN + GENL_HDRLEN;
+  genlh = nlmsg_data(m->nlh);
+  genlh->cmd = cmd;
+}
+
+static void
+msg_put(struct policy_messages *m, int type, const void *data, int len)
+{
+  struct nlattr *attr = (struct nlattr *) ((char *) m->nlh + NLMSG_ALIGN(m->nlh->nlmsg_len));
+
+  g_assert(m->len + NLMSG_ALIGN(m->nlh->nlmsg_len) + nla_total_size(len) <= sizeof(m->buf));
+
+  attr->nla_type = type;
+  attr->nla_len = nla_attr_size(len);
+  memcpy(nla_data(attr), data, len);
+  m->nlh->nlmsg_len = NLMSG_ALIGN(m->nlh->nlmsg_len) + nla_total_size(len);
+}
+
+static void
+msg_put_name(struct policy_messages *m, int type, const char *name)
+{
+  char buf[sizeof(struct kza_name) + KZ_ATTR_NAME_MAX_LENGTH];
+  struct kza_name *a = (struct kza_name *) buf;
+
+  a->length = htons(strlen(name));
+  memcpy(a->name, name, strlen(name));
+  msg_put(m, type, buf, sizeof(*a) + strlen(name));
+}
+
+static void
+msg_put_be32(struct policy_messages *m, int type, u_int32_t value)
+{
+  __be32 a = htonl(value);
+
+  msg_put(m, type, &a, sizeof(a));
+}
+
+static void
+msg_put_port_range(struct policy_messages *m, int type, const struct kz_port_range *range)
+{
+  struct kza_port_range a = { .from = htons(range->from), .to = htons(range->to) };
+
+  msg_put(m, type, &a, sizeof(a));
+}
+
+static void
+msg_end(struct policy_messages *m)
+{
+  m->len += NLMSG_ALIGN(m->nlh->nlmsg_len);
+}
+
+static void
+upload_zone(struct policy_messages *m, const struct kz_zone *zone)
+{
+  char range[NLA_HDRLEN + sizeof(struct kz_in6_subnet)];
+  struct nlattr *subnet = (struct nlattr *) range;
+
+  msg_begin(m, KZNL_MSG_ADD_ZONE);
+  msg_put_name(m, KZNL_ATTR_ZONE_NAME, zone->name);
+  msg_put_name(m, KZNL_ATTR_ZONE_UNAME, zone->unique_name);
+  if (zone->admin_parent)
+    msg_put_name(m, KZNL_ATTR_ZONE_PNAME, zone->admin_parent->unique_name);
+  if (zone->flags & KZF_ZONE_HAS_RANGE)
+    {
+      if (zone->family == AF_INET)
+        {
+          struct kz_in_subnet *a = nla_data(subnet);
+          subnet->nla_type = KZNL_ATTR_INET_SUBNET;
+          subnet->nla_len = nla_attr_size(sizeof(*a));
+          a->addr = zone->addr.in;
+          a->mask = zone->mask.in;
+        }
+      else
+        {
+          struct kz_in6_subnet *a = nla_data(subnet);
+          subnet->nla_type = KZNL_ATTR_INET6_SUBNET;
+          subnet->nla_len = nla_attr_size(sizeof(*a));
+          a->addr = zone->addr.in6;
+          a->mask = zone->mask.in6;
+        }
+      msg_put(m, KZNL_ATTR_ZONE_RANGE, range, nla_total_size(nla_len(subnet)));
+    }
+  msg_end(m);
+}
+
+static void
+upload_service(struct policy_messages *m, const struct kz_service *service)
+{
+  struct kza_service_params params = { .flags = 0, .type = KZ_SERVICE_PROXY };
+
+  msg_begin(m, KZNL_MSG_ADD_SERVICE);
+  msg_put_name(m, KZNL_ATTR_SERVICE_NAME, service->name);
+  msg_put(m, KZNL_ATTR_SERVICE_PARAMS, &params, sizeof(params));
+  msg_end(m);
+}
+
+static void
+upload_rule_entry(struct policy_messages *m, const struct kz_dispatcher_n_dimension_rule *rule, u_int32_t i)
+{
+  msg_begin(m, KZNL_MSG_ADD_RULE_ENTRY);
+  msg_put_name(m, KZNL_ATTR_DISPATCHER_NAME, rule->dispatcher->name);
+  msg_put_be32(m, KZNL_ATTR_N_DIMENSION_RULE_ID, rule->id);
+  if (i < rule->num_reqid)
+    msg_put_be32(m, KZNL_ATTR_N_DIMENSION_REQID, rule->reqid[i]);
+  if (i < rule->num_ifname)
+    msg_put_name(m, KZNL_ATTR_N_DIMENSION_IFACE, rule->ifname[i]);
+  if (i < rule->num_ifgroup)
+    msg_put_be32(m, KZNL_ATTR_N_DIMENSION_IFGROUP, rule->ifgroup[i]);
+  if (i < rule->num_proto)
+    msg_put(m, KZNL_ATTR_N_DIMENSION_PROTO, &rule->proto[i], sizeof(rule->proto[i]));
+  if (i < rule->num_src_port)
+    msg_put_port_range(m, KZNL_ATTR_N_DIMENSION_SRC_PORT, &rule->src_port[i]);
+  if (i < rule->num_dst_port)
+    msg_put_port_range(m, KZNL_ATTR_N_DIMENSION_DST_PORT, &rule->dst_port[i]);
+  if (i < rule->num_src_in_subnet)
+    msg_put(m, KZNL_ATTR_N_DIMENSION_SRC_IP, &rule->src_in_subnet[i], sizeof(rule->src_in_subnet[i]));
+  if (i < rule->num_src_in6_subnet)
+    msg_put(m, KZNL_ATTR_N_DIMENSION_SRC_IP6, &rule->src_in6_subnet[i], sizeof(rule->src_in6_subnet[i]));
+  if (i < rule->num_src_zone)
+    msg_put_name(m, KZNL_ATTR_N_DIMENSION_SRC_ZONE, rule->src_zone[i]->unique_name);
+  if (i < rule->num_dst_in_subnet)
+    msg_put(m, KZNL_ATTR_N_DIMENSION_DST_IP, &rule->dst_in_subnet[i], sizeof(rule->dst_in_subnet[i]));
+  if (i < rule->num_dst_in6_subnet)
+    msg_put(m, KZNL_ATTR_N_DIMENSION_DST_IP6, &rule->dst_in6_subnet[i], sizeof(rule->dst_in6_subnet[i]));
+  if (i < rule->num_dst_ifname)
+    msg_put_name(m, KZNL_ATTR_N_DIMENSION_DST_IFACE, rule->dst_ifname[i]);
+  if (i < rule->num_dst_ifgroup)
+    msg_put_be32(m, KZNL_ATTR_N_DIMENSION_DST_IFGROUP, rule->dst_ifgroup[i]);
+  if (i < rule->num_dst_zone)
+    msg_put_name(m, KZNL_ATTR_N_DIMENSION_DST_ZONE, rule->dst_zone[i]->unique_name);
+  msg_end(m);
+}
+
+static void
+upload_dispatcher(struct policy_messages *m, const struct kz_dispatcher *dispatcher)
+{
+  unsigned int i;
+
+  msg_begin(m, KZNL_MSG_ADD_DISPATCHER);
+  msg_put_name(m, KZNL_ATTR_DISPATCHER_NAME, dispatcher->name);
+  msg_put_be32(m, KZNL_ATTR_DISPATCHER_N_DIMENSION_PARAMS, dispatcher->num_rule);
+  msg_end(m);
+
+  for (i = 0; i < dispatcher->num_rule; i++)
+    {
+      const struct kz_dispatcher_n_dimension_rule *rule = &dispatcher->rule[i];
+      u_int32_t num_entries = 0, entry;
+
+      msg_begin(m, KZNL_MSG_ADD_RULE);
+      msg_put_name(m, KZNL_ATTR_DISPATCHER_NAME, dispatcher->name);
+      msg_put_be32(m, KZNL_ATTR_N_DIMENSION_RULE_ID, rule->id);
+      msg_put_name(m, KZNL_ATTR_N_DIMENSION_RULE_SERVICE, rule->service->name);
+#define PUT_ENTRY_NUM(DIM_NAME, NL_ATTR_NAME, ...) \
+      if (rule->num_##DIM_NAME > 0) \
+        msg_put_be32(m, KZNL_ATTR_N_DIMENSION_##NL_ATTR_NAME, rule->num_##DIM_NAME); \
+      if (rule->num_##DIM_NAME > num_entries) \
+        num_entries = rule->num_##DIM_NAME
+
+      KZORP_DIM_LIST(PUT_ENTRY_NUM, ;);
+#undef PUT_ENTRY_NUM
+      msg_end(m);
+
+      for (entry = 0; entry < num_entries; entry++)
+        upload_rule_entry(m, rule, entry);
+    }
+}
+
+/* policy */
+
+static struct kz_in_subnet
+in_subnet(const char *addr, int prefix)
+{
+  struct kz_in_subnet subnet;
+
+  g_assert(inet_pton(AF_INET, addr, &subnet.addr));
+  subnet.mask.s_addr = prefix ? htonl(~0U << (32 - prefix)) : 0;
+
+  return subnet;
+}
+
+static struct kz_in6_subnet
+in6_subnet(const char *addr, int prefix)
+{
+  struct kz_in6_subnet subnet;
+  int i;
+
+  g_assert(inet_pton(AF_INET6, addr, &subnet.addr));
+  for (i = 0; i < 16; i++, prefix -= 8)
+    subnet.mask.s6_addr[i] = prefix >= 8 ? 0xff : prefix > 0 ? (0xff << (8 - prefix)) & 0xff : 0;
+
+  return subnet;
+}
+
+static void
+zone_init(struct kz_zone *zone, const char *name, struct kz_zone *parent, const char *addr, int prefix)
+{
+  zone->name = zone->unique_name = (char *) name;
+  zone->admin_parent = parent;
+  // The zone depth starts with 1, see kz_zone_new in kzorp_core.c:
+  zone->depth = parent ? parent->depth + 1 : 1;
+
+  if (addr == NULL)
+    return;
+
+  zone->flags |= KZF_ZONE_HAS_RANGE;
+  if (strchr(addr, ':'))
+    {
+      struct kz_in6_subnet subnet = in6_subnet(addr, prefix);
+      zone->family = AF_INET6;
+      zone->addr.in6 = subnet.addr;
+      zone->mask.in6 = subnet.mask;
+    }
+  else
+    {
+      struct kz_in_subnet subnet = in_subnet(addr, prefix);
+      zone->family = AF_INET;
+      zone->addr.in = subnet.addr;
+      zone->mask.in = subnet.mask;
+    }
+}
+
+enum { ZONE_INTERNET, ZONE_OFFICE, ZONE_DEV, ZONE_LAB, ZONE_DMZ, ZONE_SITE6, ZONE_LAB6, ZONE_NO_RANGE, NUM_ZONES };
+enum { SERVICE_HTTP, SERVICE_SSH, SERVICE_ANY, SERVICE_DENY, NUM_SERVICES };
+
+struct test_policy {
+  struct kz_config cfg;
+  struct kz_zone zone[NUM_ZONES];
+  struct kz_service service[NUM_SERVICES];
+  struct kz_dispatcher dispatcher[2];
+};
+
+static void
+dispatcher_init(struct kz_dispatcher *dispatcher, const char *name,
+                const struct kz_dispatcher_n_dimension_rule *rules, size_t size)
+{
+  unsigned int i;
+
+  dispatcher->name = (char *) name;
+  dispatcher->rule = memcpy(malloc(size), rules, size);
+  dispatcher->num_rule = dispatcher->alloc_rule = size / sizeof(*rules);
+  for (i = 0; i < dispatcher->num_rule; i++)
+    dispatcher->rule[i].dispatcher = dispatcher;
+}
+
+static struct test_policy *
+test_policy_new(void)
+{
+  struct test_policy *p = calloc(1, sizeof(*p));
+  struct kz_zone *zone = p->zone;
+  struct kz_service *service = p->service;
+  unsigned int i;
+
+  zone_init(&zone[ZONE_INTERNET], "internet", NULL, "0.0.0.0", 0);
+  zone_init(&zone[ZONE_OFFICE], "office", NULL, "10.0.0.0", 8);
+  zone_init(&zone[ZONE_DEV], "office.dev", &zone[ZONE_OFFICE], "10.1.0.0", 16);
+  zone_init(&zone[ZONE_LAB], "office.dev.lab", &zone[ZONE_DEV], "10.1.2.0", 24);
+  zone_init(&zone[ZONE_DMZ], "dmz", NULL, "192.168.0.0", 16);
+  zone_init(&zone[ZONE_SITE6], "site6", NULL, "2001:db8::", 32);
+  zone_init(&zone[ZONE_LAB6], "site6.lab", &zone[ZONE_SITE6], "2001:db8:1::", 48);
+  zone_init(&zone[ZONE_NO_RANGE], "office.remote", &zone[ZONE_OFFICE], NULL, 0);
+
+  service[SERVICE_HTTP].name = "http";
+  service[SERVICE_SSH].name = "ssh";
+  service[SERVICE_ANY].name = "any";
+  service[SERVICE_DENY].name = "deny";
+
+  const struct kz_dispatcher_n_dimension_rule rules0[] = {
+    { .id = 1, .service = &service[SERVICE_HTTP],
+      KZ_RULE_ENTRY_INITIALIZER(src_zone, &zone[ZONE_OFFICE]),
+      KZ_RULE_ENTRY_INITIALIZER(dst_zone, &zone[ZONE_DMZ], &zone[ZONE_INTERNET]),
+      KZ_RULE_ENTRY_INITIALIZER(proto, IPPROTO_TCP),
+      KZ_RULE_ENTRY_INITIALIZER(dst_port, { 80, 80 }, { 8080, 8090 }) },
+    { .id = 2, .service = &service[SERVICE_SSH],
+      KZ_RULE_ENTRY_INITIALIZER(src_zone, &zone[ZONE_DEV]),
+      KZ_RULE_ENTRY_INITIALIZER(proto, IPPROTO_TCP),
+      KZ_RULE_ENTRY_INITIALIZER(dst_port, { 22, 22 }) },
+    { .id = 5, .service = &service[SERVICE_ANY],
+      KZ_RULE_ENTRY_INITIALIZER(src_in_subnet, in_subnet("10.1.2.128", 25), in_subnet("192.168.1.0", 24)),
+      KZ_RULE_ENTRY_INITIALIZER(dst_port, { 1000, 2000 }) },
+    { .id = 7, .service = &service[SERVICE_DENY],
+      KZ_RULE_ENTRY_INITIALIZER(ifname, "eth1"),
+      KZ_RULE_ENTRY_INITIALIZER(dst_in_subnet, in_subnet("8.8.8.0", 24)) },
+    { .id = 9, .service = &service[SERVICE_ANY],
+      KZ_RULE_ENTRY_INITIALIZER(proto, IPPROTO_UDP) },
+  };
+  const struct kz_dispatcher_n_dimension_rule rules1[] = {
+    { .id = 10, .service = &service[SERVICE_HTTP],
+      KZ_RULE_ENTRY_INITIALIZER(ifgroup, 5),
+      KZ_RULE_ENTRY_INITIALIZER(dst_zone, &zone[ZONE_INTERNET]) },
+    { .id = 20, .service = &service[SERVICE_SSH],
+      KZ_RULE_ENTRY_INITIALIZER(src_in6_subnet, in6_subnet("2001:db8:1::", 48)),
+      KZ_RULE_ENTRY_INITIALIZER(dst_zone, &zone[ZONE_SITE6]) },
+    { .id = 30, .service = &service[SERVICE_DENY],
+      KZ_RULE_ENTRY_INITIALIZER(src_zone, &zone[ZONE_LAB6], &zone[ZONE_NO_RANGE]),
+      KZ_RULE_ENTRY_INITIALIZER(proto, IPPROTO_UDP) },
+  };
+
+  dispatcher_init(&p->dispatcher[0], "first", rules0, sizeof(rules0));
+  dispatcher_init(&p->dispatcher[1], "second", rules1, sizeof(rules1));
+
+  INIT_LIST_HEAD(&p->cfg.zones.head);
+  INIT_LIST_HEAD(&p->cfg.services.head);
+  INIT_LIST_HEAD(&p->cfg.dispatchers.head);
+  kz_head_zone_init(&p->cfg.zones);
+
+  for (i = 0; i < NUM_ZONES; i++)
+    list_add_tail(&zone[i].list, &p->cfg.zones.head);
+  for (i = 0; i < NUM_SERVICES; i++)
+    list_add_tail(&service[i].list, &p->cfg.services.head);
+  for (i = 0; i < ARRAY_SIZE(p->dispatcher); i++)
+    list_add_tail(&p->dispatcher[i].list, &p->cfg.dispatchers.head);
+
+  return p;
+}
+
+static struct policy_messages *
+test_policy_upload(const struct test_policy *p)
+{
+  struct policy_messages *m = calloc(1, sizeof(*m));
+  unsigned int i;
+
+  for (i = 0; i < NUM_ZONES; i++)
+    upload_zone(m, &p->zone[i]);
+  for (i = 0; i < NUM_SERVICES; i++)
+    upload_service(m, &p->service[i]);
+  for (i = 0; i < ARRAY_SIZE(p->dispatcher); i++)
+    upload_dispatcher(m, &p->dispatcher[i]);
+
+  return m;
+}
+
+/* queries */
+
+static const char *const query_addrs[] = {
+  "10.1.2.200", "10.1.2.5", "10.1.7.7", "10.9.9.9", "192.168.1.1", "8.8.8.8",
+  "2001:db8:1::1", "2001:db8:2::1", "2001:db9::1",
+};
+
+static const u_int16_t query_ports[] = { 22, 80, 1500, 8085, 40000 };
+static const u_int8_t query_protos[] = { IPPROTO_TCP, IPPROTO_UDP };
+static const struct { const char *name; unsigned int group; } query_ifaces[] = { { "eth0", 0 }, { "eth1", 5 } };
+
+static unsigned int
+generate_queries(struct kzorp_lookup_query **queries)
+{
+  const unsigned int num_addrs = ARRAY_SIZE(query_addrs);
+  unsigned int s, d, port, proto, iface, num = 0;
+
+  *queries = calloc(num_addrs * num_addrs * ARRAY_SIZE(query_ports) * ARRAY_SIZE(query_protos) * ARRAY_SIZE(query_ifaces),
+                    sizeof(**queries));
+
+  for (s = 0; s < num_addrs; s++)
+    for (d = 0; d < num_addrs; d++)
+      {
+        const int family = strchr(query_addrs[s], ':') ? AF_INET6 : AF_INET;
+
+        if (family != (strchr(query_addrs[d], ':') ? AF_INET6 : AF_INET))
+          continue;
+
+        for (port = 0; port < ARRAY_SIZE(query_ports); port++)
+          for (proto = 0; proto < ARRAY_SIZE(query_protos); proto++)
+            for (iface = 0; iface < ARRAY_SIZE(query_ifaces); iface++)
+              {
+                struct kzorp_lookup_query *q = &(*queries)[num++];
+
+                q->family = family;
+                q->proto = query_protos[proto];
+                q->sport = 1024 + num;
+                q->dport = query_ports[port];
+                g_assert(inet_pton(family, query_addrs[s], q->saddr));
+                g_assert(inet_pton(family, query_addrs[d], q->daddr));
+                strcpy(q->ifname, query_ifaces[iface].name);
+                q->ifgroup = query_ifaces[iface].group;
+              }
+      }
+
+  return num;
+}
+
+static void
+assert_name_equal(const char *lib_name, const char *name)
+{
+  if (name == NULL)
+    g_assert(lib_name == NULL);
+  else
+    g_assert_cmpstr(lib_name, ==, name);
+}
+
+/* checks the result of the library against kz_lookup_session_rule() on the kernel structures */
+static void
+assert_result(const struct test_policy *p, const struct kzorp_lookup_query *q, const struct kzorp_lookup_result *result)
+{
+  const struct kz_dispatcher_n_dimension_rule *result_rules[1];
+  const struct kz_dispatcher_n_dimension_rule *rule;
+  struct kz_percpu_env lenv = {
+    .max_result_size = ARRAY_SIZE(result_rules),
+    .result_rules = result_rules,
+    .src_mask = calloc(1, KZ_ZONE_BF_SIZE),
+    .dst_mask = calloc(1, KZ_ZONE_BF_SIZE),
+  };
+  struct kz_reqids reqids = { .len = 0 };
+  struct net_device dev = {};
+  union nf_inet_addr saddr = {}, daddr = {};
+  struct kz_zone *czone, *szone;
+
+  memcpy(&saddr, q->saddr, q->family == AF_INET ? sizeof(saddr.in) : sizeof(saddr.in6));
+  memcpy(&daddr, q->daddr, q->family == AF_INET ? sizeof(daddr.in) : sizeof(daddr.in6));
+  memcpy(dev.name, q->ifname, IFNAMSIZ);
+  dev.group = q->ifgroup;
+
+  kz_lookup_thread_env = &lenv;
+  kz_lookup_session_rule(&p->cfg, &reqids, &dev, q->family == AF_INET ? NFPROTO_IPV4 : NFPROTO_IPV6,
+                         &saddr, &daddr, q->proto, q->sport, q->dport, &czone, &szone, &rule, 0);
+  kz_lookup_thread_env = NULL;
+
+  assert_name_equal(result->client_zone, czone ? czone->unique_name : NULL);
+  assert_name_equal(result->server_zone, szone ? szone->unique_name : NULL);
+  g_assert_cmpuint(result->client_zone_id, ==, czone ? czone->index : KZORP_LOOKUP_NO_ID);
+  g_assert_cmpuint(result->server_zone_id, ==, szone ? szone->index : KZORP_LOOKUP_NO_ID);
+  g_assert_cmpuint(result->rule_id, ==, rule ? rule->id : KZORP_LOOKUP_NO_ID);
+  assert_name_equal(result->dispatcher, rule ? rule->dispatcher->name : NULL);
+  assert_name_equal(result->service, rule ? rule->service->name : NULL);
+
+  free(lenv.src_mask);
+  free(lenv.dst_mask);
+}
+
+static void
+test_lookup_matches_module()
+{
+  struct test_policy *p = test_policy_new();
+  struct policy_messages *m = test_policy_upload(p);
+  struct kzorp_lookup_policy *policy;
+  struct kzorp_lookup_query *queries;
+  struct kzorp_lookup_result *results;
+  unsigned int num, i, matching = 0;
+  int error;
+
+  policy = kzorp_lookup_policy_load_messages(m->buf, m->len, &error);
+  g_assert_cmpint(error, ==, 0);
+  g_assert(policy != NULL);
+
+  g_assert(kz_head_zone_build(&p->cfg.zones) == 0);
+  g_assert(kz_head_dispatcher_build(&p->cfg.dispatchers) == 0);
+
+  num = generate_queries(&queries);
+  results = calloc(num, sizeof(*results));
+
+  for (i = 0; i < num; i++)
+    {
+      g_assert(kzorp_lookup_session(policy, &queries[i], &results[i]) == 0);
+      assert_result(p, &queries[i], &results[i]);
+      if (results[i].rule_id != KZORP_LOOKUP_NO_ID)
+        matching++;
+    }
+
+  /* the policy has to match some of the queries to make the comparison meaningful */
+  g_assert(matching > 0 && matching < num);
+
+  /* the batched lookup returns the same results in each thread */
+  memset(results, 0, num * sizeof(*results));
+  g_assert(kzorp_lookup_sessions(policy, queries, results, num, 4) == 0);
+  for (i = 0; i < num; i++)
+    assert_result(p, &queries[i], &results[i]);
+
+  kzorp_lookup_policy_free(policy);
+  free(results);
+  free(queries);
+  free(m);
+}
+
+/* the announced number of rules and entries are checked like in the module */
+
+struct announced_numbers_case {
+  const char *name;
+  u_int32_t num_rules;
+  u_int32_t rule_ids[3];
+  unsigned int num_rule_ids;
+  u_int32_t num_ports;
+  unsigned int num_port_entries;
+  int error;
+};
+
+static const struct announced_numbers_case announced_numbers_cases[] = {
+  { "complete", 2, { 1, 2 }, 2, 2, 2, 0 },
+  { "fewer entries than announced", 1, { 1 }, 1, 2, 1, 0 },
+  { "more rules than announced", 1, { 1, 2 }, 2, 1, 1, -EINVAL },
+  { "fewer rules than announced", 2, { 1 }, 1, 1, 1, -EINVAL },
+  { "more entries than announced", 1, { 1 }, 1, 1, 2, -ENOMEM },
+  { "decreasing rule ids", 2, { 2, 1 }, 2, 1, 1, -EINVAL },
+  { "repeated rule id", 2, { 1, 1 }, 2, 1, 1, -EEXIST },
+};
+
+static void
+test_announced_numbers()
+{
+  const struct kz_port_range port = { 80, 80 };
+  unsigned int c, i, j;
+
+  for (c = 0; c < ARRAY_SIZE(announced_numbers_cases); c++)
+    {
+      const struct announced_numbers_case *t = &announced_numbers_cases[c];
+      struct policy_messages *m = calloc(1, sizeof(*m));
+      struct kzorp_lookup_policy *policy;
+      int error;
+
+      msg_begin(m, KZNL_MSG_ADD_SERVICE);
+      msg_put_name(m, KZNL_ATTR_SERVICE_NAME, "service");
+      msg_put(m, KZNL_ATTR_SERVICE_PARAMS, &(struct kza_service_params) { .type = KZ_SERVICE_PROXY },
+              sizeof(struct kza_service_params));
+      msg_end(m);
+
+      msg_begin(m, KZNL_MSG_ADD_DISPATCHER);
+      msg_put_name(m, KZNL_ATTR_DISPATCHER_NAME, "dispatcher");
+      msg_put_be32(m, KZNL_ATTR_DISPATCHER_N_DIMENSION_PARAMS, t->num_rules);
+      msg_end(m);
+
+      for (i = 0; i < t->num_rule_ids; i++)
+        {
+          msg_begin(m, KZNL_MSG_ADD_RULE);
+          msg_put_name(m, KZNL_ATTR_DISPATCHER_NAME, "dispatcher");
+          msg_put_be32(m, KZNL_ATTR_N_DIMENSION_RULE_ID, t->rule_ids[i]);
+          msg_put_name(m, KZNL_ATTR_N_DIMENSION_RULE_SERVICE, "service");
+          msg_put_be32(m, KZNL_ATTR_N_DIMENSION_DST_PORT, t->num_ports);
+          msg_end(m);
+
+          for (j = 0; j < t->num_port_entries; j++)
+            {
+              msg_begin(m, KZNL_MSG_ADD_RULE_ENTRY);
+              msg_put_name(m, KZNL_ATTR_DISPATCHER_NAME, "dispatcher");
+              msg_put_be32(m, KZNL_ATTR_N_DIMENSION_RULE_ID, t->rule_ids[i]);
+              msg_put_port_range(m, KZNL_ATTR_N_DIMENSION_DST_PORT, &port);
+              msg_end(m);
+            }
+        }
+
+      policy = kzorp_lookup_policy_load_messages(m->buf, m->len, &error);
+      if (error != t->error)
+        g_error("case '%s': expected error %d, got %d", t->name, t->error, error);
+      g_assert((policy != NULL) == (t->error == 0));
+
+      kzorp_lookup_policy_free(policy);
+      free(m);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/kzorp/lookup_lib/lookup_matches_module", test_lookup_matches_module);
+  g_test_add_func("/kzorp/lookup_lib/announced_numbers", test_announced_numbers);
+
+  g_test_run();
+
+  return 0;
+}
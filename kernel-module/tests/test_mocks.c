@@ -67,7 +67,9 @@ void kz_bind_destroy(struct kz_bind *bind) { MUST_NOT_CALL; }
 void kz_dispatcher_destroy(struct kz_dispatcher *_) { MUST_NOT_CALL; }
 struct kz_bind *kz_bind_clone(const struct kz_bind const *_bind) { MUST_NOT_CALL; return 0; }
 void *kz_big_alloc(size_t size, enum KZ_ALLOC_TYPE *type) { return malloc(size); };
-void kz_big_free(void *ptr, enum KZ_ALLOC_TYPE type) { MUST_NOT_CALL; };
+void kz_big_free(void *ptr, enum KZ_ALLOC_TYPE type) { free(ptr); };
+void get_random_bytes(void *buf, int nbytes) {}
+void kz_session_ring_write(enum kz_session_ring_event event, const struct nf_conn *ct, const struct nf_conntrack_kzorp *kzorp) {}
 
 // linux/dynamic_debug.h:
 int __dynamic_pr_debug(struct _ddebug *descriptor, const char *fmt, ...) { MUST_NOT_CALL; return 0; }
@@ -14,6 +14,8 @@
 #include <linux/module.h>
 #include <linux/skbuff.h>
 #include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 #include <net/checksum.h>
 #include <net/tcp.h>
 #include <net/udp.h>
@@ -33,6 +35,7 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv6.h>
 #include "include/xt_KZORP.h"
 
 #include <net/netfilter/nf_conntrack.h>
@@ -116,10 +119,15 @@ v4_lookup_instance_bind_address(const struct kz_dispatcher *dpt,
 		__be16 proxy_port = htons(bind->port);
 		__be32 proxy_addr = bind->addr.in.s_addr;
 
-		sk = nf_tproxy_get_sock_v4(&init_net, l4proto,
-					   iph->saddr, proxy_addr,
-					   sport, proxy_port,
-					   skb->dev, NFT_LOOKUP_LISTENER);
+		sk = kz_bind_listener_get(bind);
+		if (sk == NULL) {
+			sk = nf_tproxy_get_sock_v4(&init_net, l4proto,
+						   iph->saddr, proxy_addr,
+						   sport, proxy_port,
+						   skb->dev, NFT_LOOKUP_LISTENER);
+			if (sk)
+				kz_bind_listener_cache(bind, sk);
+		}
 		if (sk)
 			kz_debug("found instance bind socket; l4proto='%hhu', bind_address='%pI4:%hu'",
 				 l4proto, &proxy_addr, proxy_port);
@@ -171,11 +179,23 @@ v4_get_socket_to_redirect_to(const struct kz_dispatcher *dpt,
 	return sk;
 }
 
+/*
+ * Once a proxied TCP flow has been assigned to an established socket,
+ * the socket lookup of the stack finds that socket by the packet
+ * addresses on its own, so later packets of the flow only need the mark.
+ */
+static inline bool
+redirect_sk_established(const struct sock *sk, u8 l4proto)
+{
+	return l4proto == IPPROTO_TCP && sk->sk_state == TCP_ESTABLISHED;
+}
+
 static inline unsigned int
 redirect_v4(struct sk_buff *skb, u8 l4proto,
 	    __be16 sport, __be16 dport,
 	    const struct kz_dispatcher *dpt,
-	    const struct xt_kzorp_target_info * tgi)
+	    const struct xt_kzorp_target_info * tgi,
+	    bool *established)
 {
 	unsigned int verdict = NF_DROP;
 	struct sock *sk = NULL;
@@ -185,6 +205,7 @@ redirect_v4(struct sk_buff *skb, u8 l4proto,
 
 	sk = v4_get_socket_to_redirect_to(dpt, skb, l4proto, sport, dport);
 	if (sk != NULL) {
+		*established = redirect_sk_established(sk, l4proto);
 		nf_tproxy_assign_sock(skb, sk);
 		skb->mark = (skb->mark & ~tgi->mark_mask) ^ tgi->mark_value;
 
@@ -286,7 +307,8 @@ static inline unsigned int
 redirect_v6(struct sk_buff *skb, u8 l4proto,
 	    __be16 sport, __be16 dport,
 	    const struct kz_dispatcher *dpt,
-	    const struct xt_kzorp_target_info * tgi)
+	    const struct xt_kzorp_target_info * tgi,
+	    bool *established)
 {
 	const struct ipv6hdr * const iph = ipv6_hdr(skb);
 	int thoff;
@@ -332,14 +354,19 @@ redirect_v6(struct sk_buff *skb, u8 l4proto,
 			proxy_port = htons(bind->port);
 			proxy_addr = &bind->addr.in6;
 			/* UDP has no TCP_TIME_WAIT state, so we never enter here */
-			if (sk == NULL)
+			if (sk == NULL) {
 				/* no there's no established connection, check if
 				 * there's a listener on the redirected addr/port */
-				sk = nf_tproxy_get_sock_v6(dev_net(skb->dev), tproto,
-							   &iph->saddr, proxy_addr,
-							   hp->source, proxy_port,
-							   skb->dev, NFT_LOOKUP_LISTENER);
-			else /* sk->sk_state == TIME_WAIT */
+				sk = kz_bind_listener_get(bind);
+				if (sk == NULL) {
+					sk = nf_tproxy_get_sock_v6(dev_net(skb->dev), tproto,
+								   &iph->saddr, proxy_addr,
+								   hp->source, proxy_port,
+								   skb->dev, NFT_LOOKUP_LISTENER);
+					if (sk)
+						kz_bind_listener_cache(bind, sk);
+				}
+			} else /* sk->sk_state == TIME_WAIT */
 				/* reopening a TIME_WAIT connection needs special handling */
 				sk = relookup_time_wait6(skb, tproto, thoff, proxy_addr, proxy_port, sk);
 		} else {
@@ -363,6 +390,7 @@ redirect_v6(struct sk_buff *skb, u8 l4proto,
 				 &inet6_sk(sk)->rcv_saddr, inet_sk(sk)->inet_num, skb->mark);
 		}
 
+		*established = redirect_sk_established(sk, l4proto);
 		nf_tproxy_assign_sock(skb, sk);
 		return NF_ACCEPT;
 	}
@@ -378,7 +406,7 @@ static inline unsigned int
 process_proxy_session(unsigned int hooknum, struct sk_buff *skb, const struct net_device *in,
 		      u8 l3proto, u8 l4proto,
 		      __be16 sport, __be16 dport, const struct kz_dispatcher *dpt,
-		      const struct xt_kzorp_target_info * tgi)
+		      const struct xt_kzorp_target_info * tgi, bool *established)
 {
 	unsigned int verdict = NF_DROP;
 
@@ -393,10 +421,10 @@ process_proxy_session(unsigned int hooknum, struct sk_buff *skb, const struct ne
 
 	switch (l3proto) {
 	case NFPROTO_IPV4:
-		verdict = redirect_v4(skb, l4proto, sport, dport, dpt, tgi);
+		verdict = redirect_v4(skb, l4proto, sport, dport, dpt, tgi, established);
 		break;
 	case NFPROTO_IPV6:
-		verdict = redirect_v6(skb, l4proto, sport, dport, dpt, tgi);
+		verdict = redirect_v6(skb, l4proto, sport, dport, dpt, tgi, established);
 		break;
 	default:
 		BUG();
@@ -405,6 +433,128 @@ process_proxy_session(unsigned int hooknum, struct sk_buff *skb, const struct ne
 	return verdict;
 }
 
+#ifdef KZ_NAT_IPV6
+/* IPv6 counterpart of the NAT part of process_forwarded_session() */
+static unsigned int
+process_forwarded_session_v6(unsigned int hooknum, struct sk_buff *skb,
+			     const struct net_device *out,
+			     const struct kz_config *cfg,
+			     u8 l4proto, __be16 sport,
+			     struct nf_conn * const ct,
+			     struct kz_zone ** const szone,
+			     struct kz_service *svc)
+{
+	const struct ipv6hdr * const iph = ipv6_hdr(skb);
+	const struct kz_nat6_range *map;
+	struct kz_nat6_range fakemap;
+	const struct kz_service_nat6_index *index;
+	struct in6_addr raddr;
+	__be16 rport;
+
+	/* destination address:
+	 *   - original destination if the service is transparent
+	 *   - specified destination otherwise */
+	if (svc->flags & KZF_SERVICE_TRANSPARENT) {
+		raddr = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.in6;
+		rport = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.udp.port;
+	} else {
+		/* without an IPv6 router address the session is left
+		 * alone, as it was before IPv6 NAT support */
+		if (svc->a.fwd.router_dst_addr_family != AF_INET6) {
+			kz_debug("no IPv6 router destination for service, not translating; service='%s'\n", svc->name);
+			return NF_ACCEPT;
+		}
+		raddr = svc->a.fwd.router_dst_addr.in6;
+		rport = htons(svc->a.fwd.router_dst_port);
+	}
+
+	kz_debug("processing forwarded session; remote_address='%pI6:%u'\n", &raddr, ntohs(rport));
+
+	switch (hooknum) {
+	case NF_INET_PRE_ROUTING:
+		index = svc->a.fwd.dnat6_index;
+		break;
+	case NF_INET_POST_ROUTING:
+		index = svc->a.fwd.snat6_index;
+		break;
+	default:
+		BUG();
+	}
+
+	map = kz_service_nat6_lookup(index, &iph->saddr, &raddr, sport, rport, l4proto);
+	kz_debug("NAT rule lookup done; map='%p'\n", map);
+
+	if (hooknum == NF_INET_PRE_ROUTING) {
+		if (map == NULL) {
+			if (!(svc->flags & KZF_SERVICE_TRANSPARENT)) {
+				/* PFService with DirectedRouter, we have to DNAT to
+				 * the specified address */
+				memset(&fakemap, 0, sizeof(fakemap));
+				fakemap.flags = IP_NAT_RANGE_MAP_IPS | IP_NAT_RANGE_PROTO_SPECIFIED;
+				fakemap.min_ip = fakemap.max_ip = raddr;
+				fakemap.min_port = fakemap.max_port = rport;
+				map = &fakemap;
+			}
+		} else if (!(map->flags & IP_NAT_RANGE_PROTO_SPECIFIED)) {
+			/* DNAT entry with no specified destination port */
+			fakemap = *map;
+			fakemap.flags |= IP_NAT_RANGE_PROTO_SPECIFIED;
+			fakemap.min_port = fakemap.max_port = rport;
+			map = &fakemap;
+		}
+	}
+
+	if (map != NULL) {
+		kz_debug("NAT rule found; hooknum='%d', min_ip='%pI6', max_ip='%pI6', min_port='%u', max_port='%u'\n",
+			 hooknum, &map->min_ip, &map->max_ip,
+			 ntohs(map->min_port), ntohs(map->max_port));
+
+		if (hooknum == NF_INET_PRE_ROUTING) {
+			struct kz_zone *fzone;
+
+			/* XXX: Assumed: map->min_ip == map->max_ip */
+			fzone = kz_head_zone_ipv6_lookup(&cfg->zones, &map->min_ip);
+
+			kz_debug("re-lookup zone after NAT; old_zone='%s', new_zone='%s'\n",
+				 *szone ? (*szone)->name : kz_log_null,
+				 fzone ? fzone->name : kz_log_null);
+
+			if (fzone != *szone) {
+				*szone = fzone;
+				if (*szone)
+					*szone = kz_zone_get(*szone);
+			}
+		}
+
+		return kz_nat6_setup_info(ct, map, HOOK2MANIP(hooknum));
+	}
+
+	kz_debug("no NAT rule found; hooknum='%d'\n", hooknum);
+
+	/* we have to SNAT the session if the service
+	 * has no FORGE flag */
+	if ((hooknum == NF_INET_POST_ROUTING) &&
+	    !(svc->flags & KZF_SERVICE_FORGE_ADDR)) {
+		struct in6_addr laddr;
+
+		if (out == NULL || ipv6_dev_get_saddr(dev_net(out), out, &iph->daddr, 0, &laddr) != 0) {
+			kz_debug("failed to select source address; out_iface='%s'\n",
+				 out ? out->name : kz_log_null);
+			return NF_ACCEPT;
+		}
+
+		memset(&fakemap, 0, sizeof(fakemap));
+		fakemap.flags = IP_NAT_RANGE_MAP_IPS;
+		fakemap.min_ip = fakemap.max_ip = laddr;
+
+		kz_debug("setting up implicit SNAT as FORGE_ADDR is off; new_src='%pI6'\n", &laddr);
+		return kz_nat6_setup_info(ct, &fakemap, HOOK2MANIP(hooknum));
+	}
+
+	return NF_ACCEPT;
+}
+#endif /* KZ_NAT_IPV6 */
+
 static inline unsigned int
 process_forwarded_session(unsigned int hooknum, struct sk_buff *skb,
 			  const struct net_device *in, const struct net_device *out,
@@ -421,9 +571,16 @@ process_forwarded_session(unsigned int hooknum, struct sk_buff *skb,
 	struct nf_nat_range fakemap;
 	__be32 raddr;
 	__be16 rport;
-	const struct list_head *head = NULL;
+	const struct kz_service_nat_index *index = NULL;
+
+#ifdef KZ_NAT_IPV6
+	if (l3proto == NFPROTO_IPV6 && ct && (ctinfo == IP_CT_NEW) &&
+	    !nf_nat_initialized(ct, HOOK2MANIP(hooknum)))
+		return process_forwarded_session_v6(hooknum, skb, out, cfg, l4proto, sport,
+						    ct, szone, svc);
+#endif
 
-	/* new IPv4 connections only */
+	/* new IPv4 connections */
 	if (l3proto == NFPROTO_IPV4 && ct && (ctinfo == IP_CT_NEW) &&
 	    !nf_nat_initialized(ct, HOOK2MANIP(hooknum))) {
 
@@ -445,18 +602,18 @@ process_forwarded_session(unsigned int hooknum, struct sk_buff *skb,
 		switch (hooknum) {
 		case NF_INET_PRE_ROUTING:
 			/* we apply DNAT rules on PREROUTING */
-			head = &svc->a.fwd.dnat;
+			index = svc->a.fwd.dnat_index;
 			break;
 		case NF_INET_POST_ROUTING:
 			/* and SNAT rules on POSTROUTING */
-			head = &svc->a.fwd.snat;
+			index = svc->a.fwd.snat_index;
 			break;
 		default:
 			verdict = NF_DROP;
 			BUG();
 		}
 
-		map = kz_service_nat_lookup(head, iph->saddr, raddr,
+		map = kz_service_nat_lookup(index, iph->saddr, raddr,
 					sport, rport, l4proto);
 		kz_debug("NAT rule lookup done; map='%p'\n", map);
 
@@ -541,17 +698,54 @@ done:
 	return verdict;
 }
 
+/* queue a session record for the session event multicast group,
+ * addresses are taken from the packet */
+static inline bool
+kz_session_event_skb(enum kz_session_event_type event, unsigned int verdict,
+		     unsigned long sid, const struct kz_service *svc,
+		     const struct kz_zone *client_zone, const struct kz_zone *server_zone,
+		     const u8 l3proto, const u8 l4proto,
+		     const struct sk_buff *skb,
+		     const __be16 src_port, const __be16 dst_port)
+{
+	union nf_inet_addr saddr, daddr;
+
+	switch (l3proto) {
+	case NFPROTO_IPV4:
+		saddr.ip = ip_hdr(skb)->saddr;
+		daddr.ip = ip_hdr(skb)->daddr;
+		break;
+	case NFPROTO_IPV6:
+		ipv6_addr_copy(&saddr.in6, &ipv6_hdr(skb)->saddr);
+		ipv6_addr_copy(&daddr.in6, &ipv6_hdr(skb)->daddr);
+		break;
+	default:
+		BUG();
+	}
+
+	return kz_session_event(event, verdict, sid, svc, client_zone, server_zone,
+				l3proto, &saddr, &daddr, l4proto, src_port, dst_port);
+}
+
+/* sessions are reported through the session event multicast group if
+ * anybody listens to it, otherwise a ratelimited text message is logged */
 static inline void
 kz_session_log(const char *msg,
-	       const char *svc_name,
+	       enum kz_session_event_type event, unsigned int verdict,
+	       const struct kz_service *svc, unsigned long sid,
 	       const u8 l3proto, const u8 l4proto,
 	       const struct kz_zone *client_zone, const struct kz_zone *server_zone,
 	       const struct sk_buff *skb,
 	       const __be16 src_port, const __be16 dst_port)
 {
+	const char *svc_name = svc != NULL ? svc->name : NULL;
 	const char *client_zone_name = (client_zone && client_zone->name) ? client_zone->name : kz_log_null;
 	const char *server_zone_name = (server_zone && server_zone->name) ? server_zone->name : kz_log_null;
 
+	if (kz_session_event_skb(event, verdict, sid, svc, client_zone, server_zone,
+				 l3proto, l4proto, skb, src_port, dst_port))
+		return;
+
 	if (kz_log_ratelimit()) {
 		char _buf[L4PROTOCOL_STRING_SIZE];
 
@@ -874,6 +1068,39 @@ send_unreach_v6(struct net *net, struct sk_buff *skb_in, unsigned char code,
 	icmpv6_send(skb_in, ICMPV6_DEST_UNREACH, code, 0);
 }
 
+/* returns true if the reject method of the service sends a packet in reply */
+static bool
+denied_session_generates_reject(const struct kz_service *svc, u8 l3proto, u8 l4proto)
+{
+	switch (l3proto) {
+	case NFPROTO_IPV4:
+		if (svc->a.deny.ipv4_reject_method == KZ_SERVICE_DENY_METHOD_V4_TCP_RESET)
+			return l4proto == IPPROTO_TCP;
+		return svc->a.deny.ipv4_reject_method != KZ_SERVICE_DENY_METHOD_V4_DROP;
+	case NFPROTO_IPV6:
+		if (svc->a.deny.ipv6_reject_method == KZ_SERVICE_DENY_METHOD_V6_TCP_RESET)
+			return l4proto == IPPROTO_TCP;
+		return svc->a.deny.ipv6_reject_method != KZ_SERVICE_DENY_METHOD_V6_DROP;
+	}
+
+	return false;
+}
+
+/* the token buckets are checked before any reject skb is allocated or routed */
+static bool
+denied_session_reject_allowed(const struct sk_buff *skb, const struct kz_service *svc, u8 l3proto)
+{
+	union nf_inet_addr saddr;
+
+	memset(&saddr, 0, sizeof(saddr));
+	if (l3proto == NFPROTO_IPV4)
+		saddr.ip = ip_hdr(skb)->saddr;
+	else
+		saddr.in6 = ipv6_hdr(skb)->saddr;
+
+	return kz_reject_limiter_allow(svc->reject, &saddr);
+}
+
 static unsigned int
 process_denied_session(unsigned int hooknum, struct sk_buff *skb,
 		       const struct net_device *in,
@@ -885,10 +1112,14 @@ process_denied_session(unsigned int hooknum, struct sk_buff *skb,
 	struct net *net = dev_net(in);
 
 	if (svc->flags & KZF_SERVICE_LOGGING) {
-		kz_session_log("Rejecting session", svc->name, l3proto, l4proto,
-			       kzorp->czone, kzorp->szone, skb, sport, dport);
+		kz_session_log("Rejecting session", KZ_SESSION_EVENT_REJECT, NF_DROP, svc, kzorp->sid,
+			       l3proto, l4proto, kzorp->czone, kzorp->szone, skb, sport, dport);
 	}
 
+	if (denied_session_generates_reject(svc, l3proto, l4proto) &&
+	    !denied_session_reject_allowed(skb, svc, l3proto))
+		return NF_DROP;
+
 	switch (l3proto) {
 	case NFPROTO_IPV4:
 		switch (svc->a.deny.ipv4_reject_method) {
@@ -982,18 +1213,22 @@ static bool
 service_assign_session_id(struct sk_buff *skb,
 			  u8 l3proto, u8 l4proto,
 			  u16 sport, u16 dport,
+			  const struct nf_conn *ct,
 			  const struct nf_conntrack_kzorp *kzorp)
 {
 	struct kz_service *svc = kzorp->svc;
 
 	if  (svc->flags & KZF_SERVICE_CNT_LOCKED) {
 		kz_session_log("Service is locked during reload, dropping packet",
-			       svc->name, l3proto, l4proto, NULL, NULL, skb, sport, dport);
+			       KZ_SESSION_EVENT_DROP, NF_DROP, svc, 0,
+			       l3proto, l4proto, NULL, NULL, skb, sport, dport);
 		return false;
 	}
 	else
 		patch_kzorp(kzorp)->sid = atomic_add_return(1, &svc->session_cnt);
 
+	kz_session_ring_write(KZ_SESSION_RING_EVENT_START, ct, kzorp);
+
 	return true;
 }
 
@@ -1020,7 +1255,7 @@ kz_prerouting_verdict(struct sk_buff *skb,
 	if (ctinfo == IP_CT_NEW) {
 		/* proxy sessions have their session id assigned on prerouting */
 		if ((svc != NULL) && (svc->type == KZ_SERVICE_PROXY) && (kzorp->sid == 0))
-			if (!service_assign_session_id(skb, l3proto, l4proto, sport, dport, kzorp))
+			if (!service_assign_session_id(skb, l3proto, l4proto, sport, dport, ct, kzorp))
 				return NF_DROP;
 	}
 
@@ -1043,11 +1278,21 @@ kz_prerouting_verdict(struct sk_buff *skb,
 					verdict = NF_DROP;
 
 					kz_session_log("Proxy service found for non TCP/UDP traffic, dropping packet",
-						       NULL, l3proto, l4proto, czone, szone, skb, sport, dport);
-				} else
+						       KZ_SESSION_EVENT_DROP, verdict, NULL, 0,
+						       l3proto, l4proto, czone, szone, skb, sport, dport);
+				} else if (kzorp->redirected && ctinfo == IP_CT_ESTABLISHED) {
+					/* the local socket is found by the stack, only mark for routing */
+					skb->mark = (skb->mark & ~tgi->mark_mask) ^ tgi->mark_value;
+					verdict = NF_ACCEPT;
+				} else {
+					bool established = false;
+
 					verdict = process_proxy_session(NF_INET_PRE_ROUTING, skb, in,
 									l3proto, l4proto, sport, dport,
-									dpt, tgi);
+									dpt, tgi, &established);
+					if (established)
+						patch_kzorp(kzorp)->redirected = true;
+				}
 				break;
 
 			case KZ_SERVICE_FORWARD:
@@ -1070,17 +1315,17 @@ kz_prerouting_verdict(struct sk_buff *skb,
 			}
 		} else {
 			/* no service was found, log and drop packet */
+			verdict = NF_DROP;
+
 			if (!czone || !szone) {
 				kz_session_log("Dispatcher found without valid (client zone, server zone, service) triplet; dropping packet",
-					       NULL, l3proto, l4proto, NULL, NULL, skb, sport, dport);
-				} else  {
-				if (kz_log_ratelimit()) {
-					kz_session_log("No applicable service found for this client & server zone, dropping packet",
-						       NULL, l3proto, l4proto, czone, szone, skb, sport, dport);
-				}
+					       KZ_SESSION_EVENT_DROP, verdict, NULL, 0,
+					       l3proto, l4proto, NULL, NULL, skb, sport, dport);
+			} else {
+				kz_session_log("No applicable service found for this client & server zone, dropping packet",
+					       KZ_SESSION_EVENT_DROP, verdict, NULL, 0,
+					       l3proto, l4proto, czone, szone, skb, sport, dport);
 			}
-
-			verdict = NF_DROP;
 		}
 	}
 
@@ -1123,7 +1368,7 @@ kz_forward_newconn_verdict(struct sk_buff *skb,
 
 		/* forwarded and denied session have their session id assigned on forward */
 		if (kzorp->sid == 0) {
-			if (!service_assign_session_id(skb, l3proto, l4proto, sport, dport, kzorp))
+			if (!service_assign_session_id(skb, l3proto, l4proto, sport, dport, ct, kzorp))
 				return NF_DROP;
 
 			new_session = true;
@@ -1132,7 +1377,11 @@ kz_forward_newconn_verdict(struct sk_buff *skb,
 		switch (svc->type) {
 		case KZ_SERVICE_FORWARD:
 			/* log new sessions */
-			if (new_session && kz_log_ratelimit()) {
+			if (new_session &&
+			    !kz_session_event_skb(KZ_SESSION_EVENT_START, verdict, kzorp->sid, svc,
+						  kzorp->czone, kzorp->szone, l3proto, l4proto,
+						  skb, sport, dport) &&
+			    kz_log_ratelimit()) {
 				char _buf[L4PROTOCOL_STRING_SIZE];
 
 				switch (l3proto) {
@@ -1205,7 +1454,7 @@ kz_postrouting_newconn_verdict(struct sk_buff *skb,
 
 	/* assign session id and do SNAT on new connections */
 	if ((svc != NULL) && (kzorp->sid == 0))
-		if (!service_assign_session_id(skb, l3proto, l4proto, sport, dport, kzorp))
+		if (!service_assign_session_id(skb, l3proto, l4proto, sport, dport, ct, kzorp))
 			return NF_DROP;
 
 	if (dpt != NULL && svc != NULL) {
@@ -1219,88 +1468,41 @@ kz_postrouting_newconn_verdict(struct sk_buff *skb,
 	return NF_ACCEPT;
 }
 
+/* common packet processing of the KZORP target and the native hooks */
 static unsigned int
-kzorp_tg(struct sk_buff *skb, const struct xt_action_param *par)
+kzorp_process(struct sk_buff *skb, unsigned int hooknum, u_int8_t family,
+	      const struct net_device * const in, const struct net_device * const out,
+	      const struct xt_kzorp_target_info * const tgi)
 {
-	const struct xt_kzorp_target_info * const tgi = par->targinfo;
-	const struct net_device * const in = par->in;
-	const struct net_device * const out = par->out;
-
 	unsigned int verdict = NF_ACCEPT;
+	struct kz_packet_ctx *ctx;
 	enum ip_conntrack_info ctinfo;
 	struct nf_conn *ct;
 	const struct nf_conntrack_kzorp *kzorp;
 	struct nf_conntrack_kzorp local_kzorp;
-	const struct kz_config *cfg = NULL;
-	u_int8_t l4proto = 0;
-	struct {
-		u16 src;
-		u16 dst;
-	} __attribute__((packed)) *ports, _ports = { .src = 0, .dst = 0, };
-
-	ports = &_ports;
-
-	switch (par->family) {
-	case NFPROTO_IPV4:
-	{
-		const struct iphdr * const iph = ip_hdr(skb);
+	const struct kz_config *cfg;
+	const struct kz_packet_tuple *tuple;
+	u_int8_t l4proto;
+	__be16 sport, dport;
 
-		l4proto = iph->protocol;
+	ctx = kz_packet_ctx_get(skb, hooknum, family);
+	tuple = &ctx->tuple;
 
-		if ((l4proto == IPPROTO_TCP) || (l4proto == IPPROTO_UDP)) {
-			ports = skb_header_pointer(skb, ip_hdrlen(skb), sizeof(_ports), &_ports);
-			if (unlikely(ports == NULL)) {
-				/* unexpected ill case */
-				kz_debug("failed to get ports, dropped packet; src='%pI4', dst='%pI4'\n",
-					 &iph->saddr, &iph->daddr);
-				return NF_DROP;
-			}
-		}
-
-		kz_debug("kzorp hook processing packet: hook='%u', protocol='%u', src='%pI4:%u', dst='%pI4:%u'\n",
-			 par->hooknum, l4proto, &iph->saddr, ntohs(ports->src), &iph->daddr, ntohs(ports->dst));
+	if (unlikely(!ctx->tuple_valid)) {
+		/* unexpected ill case */
+		kz_debug("failed to parse packet headers, dropped packet; hook='%u'\n", hooknum);
+		return NF_DROP;
 	}
-		break;
-	case NFPROTO_IPV6:
-	{
-		const struct ipv6hdr * const iph = ipv6_hdr(skb);
-		int thoff;
-		u8 tproto = iph->nexthdr;
-
-		/* find transport header */
-#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0) )
-		__be16 frag_offp;
-		thoff = ipv6_skip_exthdr(skb, sizeof(*iph), &tproto,&frag_offp);
-#else
-		thoff = ipv6_skip_exthdr(skb, sizeof(*iph), &tproto);
-#endif
-		if (unlikely(thoff < 0)) {
-			kz_debug("unable to find transport header in IPv6 packet, dropped; src='%pI6', dst='%pI6'\n",
-				 &iph->saddr, &iph->daddr);
-			return NF_DROP;
-		}
-
-		l4proto = tproto;
-
-		if ((l4proto == IPPROTO_TCP) || (l4proto == IPPROTO_UDP)) {
-			/* get info from transport header */
-			ports = skb_header_pointer(skb, thoff, sizeof(_ports), &_ports);
-			if (unlikely(ports == NULL)) {
-				kz_debug("failed to get ports, dropped packet; src='%pI6', dst='%pI6'\n",
-					 &iph->saddr, &iph->daddr);
-				return NF_DROP;
-			}
-		}
 
+	if (family == NFPROTO_IPV4)
+		kz_debug("kzorp hook processing packet: hook='%u', protocol='%u', src='%pI4:%u', dst='%pI4:%u'\n",
+			 hooknum, tuple->l4proto, &tuple->saddr.ip, ntohs(tuple->sport), &tuple->daddr.ip, ntohs(tuple->dport));
+	else
 		kz_debug("kzorp hook processing packet: hook='%u', protocol='%u', src='%pI6:%u', dst='%pI6:%u'\n",
-			 par->hooknum, l4proto, &iph->saddr, ntohs(ports->src), &iph->daddr, ntohs(ports->dst));
-	}
-		break;
-	default:
-		BUG();
-	}
+			 hooknum, tuple->l4proto, &tuple->saddr.in6, ntohs(tuple->sport), &tuple->daddr.in6, ntohs(tuple->dport));
 
-	ct = nf_ct_get(skb, &ctinfo);
+	ct = ctx->ct;
+	ctinfo = ctx->ctinfo;
 	/* no conntrack or this is a reply packet: we simply accept it
 	   we don't want to mark the reply packages with tproxy mark
 	   in iptables there could be a condition so reply does not get here 
@@ -1311,13 +1513,19 @@ kzorp_tg(struct sk_buff *skb, const struct xt_action_param *par)
 		return NF_ACCEPT;
 
 	rcu_read_lock();
-	kzorp = nfct_kzorp_cached_lookup_rcu(ct, ctinfo, skb, in, par->family, &cfg);
-
-	if (kzorp == NULL)
-	{
+	kzorp = kz_packet_ctx_kzorp_rcu(ctx, in);
+	cfg = ctx->cfg;
+
+	/* rejecting sends packets through the hooks, reusing the context
+	   of this CPU, so keep our own copy of what is used below */
+	l4proto = tuple->l4proto;
+	sport = tuple->sport;
+	dport = tuple->dport;
+	if (kzorp == &ctx->local_kzorp) {
+		local_kzorp = ctx->local_kzorp;
+		memset(&ctx->local_kzorp, 0, sizeof(ctx->local_kzorp));
+		ctx->kzorp = NULL;
 		kzorp = &local_kzorp;
-		memset(&local_kzorp, 0, sizeof(local_kzorp));
-		nfct_kzorp_lookup_rcu(&local_kzorp, ctinfo, skb, in, par->family, &cfg);
 	}
 
 	kz_debug("lookup data for kzorp hook; dpt='%s', client_zone='%s', server_zone='%s', svc='%s'\n",
@@ -1326,31 +1534,31 @@ kzorp_tg(struct sk_buff *skb, const struct xt_action_param *par)
 		 kzorp->szone ? kzorp->szone->name : kz_log_null,
 		 kzorp->svc ? kzorp->svc->name : kz_log_null);
 
-	switch (par->hooknum)
+	switch (hooknum)
 	{
 	case NF_INET_PRE_ROUTING:
 		verdict = kz_prerouting_verdict(skb, in, out, cfg,
-						par->family, l4proto,
-						ports->src, ports->dst, 
+						family, l4proto,
+						sport, dport, 
 						ctinfo, ct, kzorp, tgi);
 		break;
 	case NF_INET_LOCAL_IN:
 		if (ctinfo == IP_CT_NEW)
-			verdict = kz_input_newconn_verdict(skb, in, par->family, l4proto,
-							   ports->src, ports->dst,
+			verdict = kz_input_newconn_verdict(skb, in, family, l4proto,
+							   sport, dport,
 							   ct, kzorp);
 		break;
 	case NF_INET_FORWARD:
 		if (ctinfo == IP_CT_NEW)
-			verdict = kz_forward_newconn_verdict(skb, in, par->family, l4proto,
-							     ports->src, ports->dst,
+			verdict = kz_forward_newconn_verdict(skb, in, family, l4proto,
+							     sport, dport,
 							     ct, kzorp);
 		break;
 	case NF_INET_POST_ROUTING:
 		if (ctinfo == IP_CT_NEW)
 			verdict = kz_postrouting_newconn_verdict(skb, in, out, cfg,
-								 par->family, l4proto,
-								 ports->src, ports->dst,
+								 family, l4proto,
+								 sport, dport,
 								 ct, kzorp, tgi);
 		break;
 	default:
@@ -1365,6 +1573,11 @@ kzorp_tg(struct sk_buff *skb, const struct xt_action_param *par)
 	return verdict;
 }
 
+static unsigned int
+kzorp_tg(struct sk_buff *skb, const struct xt_action_param *par)
+{
+	return kzorp_process(skb, par->hooknum, par->family, par->in, par->out, par->targinfo);
+}
 
 static int kzorp_tg_check(const struct xt_tgchk_param *par)
 {
@@ -1379,7 +1592,12 @@ static int kzorp_tg_check(const struct xt_tgchk_param *par)
 
    we accept everything here until a more suitable check emerges
 */
-	return 0;
+	return kz_packet_ctx_users_get();
+}
+
+static void kzorp_tg_destroy(const struct xt_tgdtor_param *par)
+{
+	kz_packet_ctx_users_put();
 }
 
 static struct xt_target kzorp_tg_reg[] __read_mostly = {
@@ -1390,6 +1608,7 @@ static struct xt_target kzorp_tg_reg[] __read_mostly = {
 		.target		= kzorp_tg,
 		.targetsize	= sizeof(struct xt_kzorp_target_info),
 		.checkentry	= kzorp_tg_check,
+		.destroy	= kzorp_tg_destroy,
 		.hooks		= (1 << NF_INET_PRE_ROUTING) |
 				  (1 << NF_INET_LOCAL_IN) |
 				  (1 << NF_INET_FORWARD) |
@@ -1403,6 +1622,7 @@ static struct xt_target kzorp_tg_reg[] __read_mostly = {
 		.target		= kzorp_tg,
 		.targetsize	= sizeof(struct xt_kzorp_target_info),
 		.checkentry	= kzorp_tg_check,
+		.destroy	= kzorp_tg_destroy,
 		.hooks		= (1 << NF_INET_PRE_ROUTING) |
 				  (1 << NF_INET_LOCAL_IN) |
 				  (1 << NF_INET_FORWARD) |
@@ -1411,15 +1631,433 @@ static struct xt_target kzorp_tg_reg[] __read_mostly = {
 	},
 };
 
+/***********************************************************
+ * Native netfilter hooks
+ ***********************************************************/
+
+/*
+ * When the native_hooks module parameter is set, kzorp processes every
+ * packet from its own netfilter hooks right after the mangle table and
+ * no iptables KZORP rule is needed. The TPROXY mark the KZORP target
+ * would take from its target info is set with the mark_value and
+ * mark_mask parameters.
+ *
+ * The KZORP target is not registered in this mode, so that a packet is
+ * never processed twice: rulesets still using -j KZORP fail to load
+ * instead of running kzorp once more after the hooks.
+ */
+
+static bool native_hooks;
+module_param(native_hooks, bool, 0400);
+MODULE_PARM_DESC(native_hooks, "Register kzorp on the netfilter hooks directly instead of the KZORP iptables target, which is not available then");
+
+static struct xt_kzorp_target_info kz_native_tgi __read_mostly;
+module_param_named(mark_value, kz_native_tgi.mark_value, uint, 0644);
+MODULE_PARM_DESC(mark_value, "Mark value set on proxied packets in native hook mode");
+module_param_named(mark_mask, kz_native_tgi.mark_mask, uint, 0644);
+MODULE_PARM_DESC(mark_mask, "Mark mask used on proxied packets in native hook mode");
+
+/* the packet context requires bottom halves disabled, as they are in iptables */
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0) )
+static unsigned int
+kzorp_nf_hook(const struct nf_hook_ops *ops, struct sk_buff *skb,
+	      const struct net_device *in, const struct net_device *out,
+	      int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+
+	local_bh_disable();
+	verdict = kzorp_process(skb, ops->hooknum, ops->pf, in, out, &kz_native_tgi);
+	local_bh_enable();
+
+	return verdict;
+}
+
+#define kzorp_nf_hook_v4 kzorp_nf_hook
+#define kzorp_nf_hook_v6 kzorp_nf_hook
+#else
+static unsigned int
+kzorp_nf_hook_v4(unsigned int hooknum, struct sk_buff *skb,
+		 const struct net_device *in, const struct net_device *out,
+		 int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+
+	local_bh_disable();
+	verdict = kzorp_process(skb, hooknum, NFPROTO_IPV4, in, out, &kz_native_tgi);
+	local_bh_enable();
+
+	return verdict;
+}
+
+static unsigned int
+kzorp_nf_hook_v6(unsigned int hooknum, struct sk_buff *skb,
+		 const struct net_device *in, const struct net_device *out,
+		 int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+
+	local_bh_disable();
+	verdict = kzorp_process(skb, hooknum, NFPROTO_IPV6, in, out, &kz_native_tgi);
+	local_bh_enable();
+
+	return verdict;
+}
+#endif
+
+/* right after the mangle table: before DNAT on PRE_ROUTING and SNAT on POST_ROUTING */
+#define KZ_NF_HOOK_OPS(_hook, _pf, _fn, _priority) \
+	{ \
+		.hook		= _fn, \
+		.owner		= THIS_MODULE, \
+		.pf		= _pf, \
+		.hooknum	= _hook, \
+		.priority	= _priority, \
+	}
+
+static struct nf_hook_ops kzorp_nf_ops[] __read_mostly = {
+	KZ_NF_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV4, kzorp_nf_hook_v4, NF_IP_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_LOCAL_IN, NFPROTO_IPV4, kzorp_nf_hook_v4, NF_IP_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_FORWARD, NFPROTO_IPV4, kzorp_nf_hook_v4, NF_IP_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_POST_ROUTING, NFPROTO_IPV4, kzorp_nf_hook_v4, NF_IP_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV6, kzorp_nf_hook_v6, NF_IP6_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_LOCAL_IN, NFPROTO_IPV6, kzorp_nf_hook_v6, NF_IP6_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_FORWARD, NFPROTO_IPV6, kzorp_nf_hook_v6, NF_IP6_PRI_MANGLE + 1),
+	KZ_NF_HOOK_OPS(NF_INET_POST_ROUTING, NFPROTO_IPV6, kzorp_nf_hook_v6, NF_IP6_PRI_MANGLE + 1),
+};
+
+/***********************************************************
+ * Early deny
+ ***********************************************************/
+
+/*
+ * When the early_deny module parameter is set, connection attempts to
+ * deny services are rejected on PRE_ROUTING right after the raw table,
+ * before conntrack allocates an entry for them. Only TCP SYN segments
+ * are evaluated: without conntrack the direction of any other packet is
+ * unknown. Everything else, and every session not hitting a deny
+ * service, is left to the regular processing. Packets are not routed
+ * yet at this point, so the input route is looked up before a TCP
+ * reset or an ICMP error is sent in reply; if that fails, the packet is
+ * dropped silently.
+ *
+ * The result of the lookup is kept in a small direct-mapped cache on
+ * each CPU, so that repeated probes of the same tuple skip the lookup.
+ * Entries are valid in the config generation they were filled in; the
+ * objects they point to are not freed before the RCU grace period
+ * following the config swap that changes the generation.
+ */
+
+static bool early_deny;
+module_param(early_deny, bool, 0400);
+MODULE_PARM_DESC(early_deny, "Reject connection attempts to deny services before conntrack entries are created");
+
+#define KZ_EARLY_DENY_CACHE_SIZE 256
+
+struct kz_early_deny_entry {
+	kz_generation_t generation;
+	int ifindex;
+	union nf_inet_addr saddr;
+	union nf_inet_addr daddr;
+	__be16 sport;
+	__be16 dport;
+	u8 l3proto;
+	u8 l4proto;
+	struct kz_service *svc;
+	struct kz_zone *czone;
+	struct kz_zone *szone;
+};
+
+struct kz_early_deny_cache {
+	struct kz_early_deny_entry entries[KZ_EARLY_DENY_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct kz_early_deny_cache, kz_early_deny_cache);
+static u32 kz_early_deny_hash_seed __read_mostly;
+
+/* returns true if the packet is the first fragment of a TCP connection attempt */
+static bool
+early_deny_tcp_syn(const struct sk_buff *skb, u8 l3proto)
+{
+	const struct tcphdr *th;
+	struct tcphdr _th;
+	int thoff;
+
+	switch (l3proto) {
+	case NFPROTO_IPV4:
+		if (ip_hdr(skb)->protocol != IPPROTO_TCP ||
+		    (ip_hdr(skb)->frag_off & htons(IP_OFFSET)))
+			return false;
+		thoff = ip_hdrlen(skb);
+		break;
+	case NFPROTO_IPV6:
+	{
+		u8 tproto = ipv6_hdr(skb)->nexthdr;
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0) )
+		__be16 frag_off;
+
+		thoff = ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &tproto, &frag_off);
+		if (thoff < 0 || tproto != IPPROTO_TCP || (frag_off & htons(~0x7)))
+			return false;
+#else
+		thoff = ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &tproto);
+		if (thoff < 0 || tproto != IPPROTO_TCP)
+			return false;
+#endif
+	}
+		break;
+	default:
+		return false;
+	}
+
+	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+	if (th == NULL)
+		return false;
+
+	return th->syn && !th->ack && !th->rst && !th->fin;
+}
+
+static inline u32
+early_deny_hash(const struct kz_packet_tuple *tuple, int ifindex)
+{
+	u32 hash;
+
+	hash = jhash2((const u32 *) tuple->saddr.all, ARRAY_SIZE(tuple->saddr.all), kz_early_deny_hash_seed);
+	hash = jhash2((const u32 *) tuple->daddr.all, ARRAY_SIZE(tuple->daddr.all), hash);
+
+	return jhash_3words(((u32) tuple->sport << 16) | tuple->dport,
+			    ((u32) tuple->l3proto << 8) | tuple->l4proto,
+			    ifindex, hash);
+}
+
+static inline bool
+early_deny_entry_match(const struct kz_early_deny_entry *entry,
+		       const struct kz_config *cfg,
+		       const struct kz_packet_tuple *tuple, int ifindex)
+{
+	return kz_generation_valid(cfg, entry->generation) &&
+	       entry->l3proto == tuple->l3proto &&
+	       entry->l4proto == tuple->l4proto &&
+	       entry->sport == tuple->sport &&
+	       entry->dport == tuple->dport &&
+	       entry->ifindex == ifindex &&
+	       nf_inet_addr_cmp(&entry->saddr, &tuple->saddr) &&
+	       nf_inet_addr_cmp(&entry->daddr, &tuple->daddr);
+}
+
+/* call with bottom halves disabled, under rcu_read_lock() */
+static const struct kz_early_deny_entry *
+early_deny_lookup_rcu(const struct sk_buff *skb, const struct net_device *in,
+		      const struct kz_config *cfg, const struct kz_packet_tuple *tuple)
+{
+	struct kz_early_deny_entry *entry;
+	struct kz_dispatcher *dpt = NULL;
+	struct kz_zone *czone = NULL;
+	struct kz_zone *szone = NULL;
+	struct kz_service *svc = NULL;
+	struct kz_reqids reqids;
+
+	entry = &__get_cpu_var(kz_early_deny_cache).entries[early_deny_hash(tuple, in->ifindex) &
+							     (KZ_EARLY_DENY_CACHE_SIZE - 1)];
+	if (early_deny_entry_match(entry, cfg, tuple, in->ifindex))
+		return entry;
+
+	/* secpath was checked by the caller, there are no IPSEC reqids */
+	reqids.len = 0;
+	kz_lookup_session(cfg, &reqids, in, tuple->l3proto,
+			  &tuple->saddr, &tuple->daddr,
+			  tuple->l4proto, ntohs(tuple->sport), ntohs(tuple->dport),
+			  &dpt, &czone, &szone, &svc, 0);
+
+	entry->generation = kz_generation_get(cfg);
+	entry->ifindex = in->ifindex;
+	entry->saddr = tuple->saddr;
+	entry->daddr = tuple->daddr;
+	entry->sport = tuple->sport;
+	entry->dport = tuple->dport;
+	entry->l3proto = tuple->l3proto;
+	entry->l4proto = tuple->l4proto;
+	entry->svc = svc;
+	entry->czone = czone;
+	entry->szone = szone;
+
+	return entry;
+}
+
+/* sets the input route of the packet, as ip_rcv_finish() and ip6_rcv_finish() would */
+static bool
+early_deny_route(struct sk_buff *skb, u8 l3proto, const struct net_device *in)
+{
+	if (skb_dst(skb) != NULL)
+		return true;
+
+	switch (l3proto) {
+	case NFPROTO_IPV4:
+	{
+		const struct iphdr * const iph = ip_hdr(skb);
+
+		if (ip_route_input_noref(skb, iph->daddr, iph->saddr, iph->tos, (struct net_device *) in) != 0)
+			return false;
+	}
+		break;
+	case NFPROTO_IPV6:
+		ip6_route_input(skb);
+		break;
+	default:
+		return false;
+	}
+
+	return skb_dst(skb) != NULL && skb_dst(skb)->error == 0;
+}
+
+static unsigned int
+early_deny_process(struct sk_buff *skb, u8 l3proto, const struct net_device *in)
+{
+	const struct kz_early_deny_entry *entry;
+	const struct kz_config *cfg;
+	struct kz_packet_tuple tuple;
+	struct nf_conntrack_kzorp kzorp;
+	unsigned int verdict = NF_ACCEPT;
+
+	/* IPSEC reqids take part in the lookup, leave those packets to the regular path */
+	if (in == NULL || skb->nfct != NULL || skb->sp != NULL)
+		return NF_ACCEPT;
+
+	if (!early_deny_tcp_syn(skb, l3proto) || !kz_packet_tuple_parse(skb, l3proto, &tuple))
+		return NF_ACCEPT;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(kz_config_rcu);
+
+	entry = early_deny_lookup_rcu(skb, in, cfg, &tuple);
+	if (entry->svc != NULL && entry->svc->type == KZ_SERVICE_DENY) {
+		memset(&kzorp, 0, sizeof(kzorp));
+		kzorp.svc = entry->svc;
+		kzorp.czone = entry->czone;
+		kzorp.szone = entry->szone;
+
+		/* the reject is routed after the original packet, which
+		 * has no route yet this early */
+		if (denied_session_generates_reject(kzorp.svc, l3proto, tuple.l4proto) &&
+		    !early_deny_route(skb, l3proto, in))
+			verdict = NF_DROP;
+		else
+			verdict = process_denied_session(NF_INET_PRE_ROUTING, skb, in, l3proto, tuple.l4proto,
+							 tuple.sport, tuple.dport, &kzorp);
+	}
+
+	rcu_read_unlock();
+
+	return verdict;
+}
+
+#if ( LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0) )
+static unsigned int
+kzorp_early_deny_hook(const struct nf_hook_ops *ops, struct sk_buff *skb,
+		      const struct net_device *in, const struct net_device *out,
+		      int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+
+	local_bh_disable();
+	verdict = early_deny_process(skb, ops->pf, in);
+	local_bh_enable();
+
+	return verdict;
+}
+
+#define kzorp_early_deny_hook_v4 kzorp_early_deny_hook
+#define kzorp_early_deny_hook_v6 kzorp_early_deny_hook
+#else
+static unsigned int
+kzorp_early_deny_hook_v4(unsigned int hooknum, struct sk_buff *skb,
+			 const struct net_device *in, const struct net_device *out,
+			 int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+
+	local_bh_disable();
+	verdict = early_deny_process(skb, NFPROTO_IPV4, in);
+	local_bh_enable();
+
+	return verdict;
+}
+
+static unsigned int
+kzorp_early_deny_hook_v6(unsigned int hooknum, struct sk_buff *skb,
+			 const struct net_device *in, const struct net_device *out,
+			 int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+
+	local_bh_disable();
+	verdict = early_deny_process(skb, NFPROTO_IPV6, in);
+	local_bh_enable();
+
+	return verdict;
+}
+#endif
+
+/* after the raw table and defragmentation, before conntrack */
+static struct nf_hook_ops kzorp_early_deny_ops[] __read_mostly = {
+	KZ_NF_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV4, kzorp_early_deny_hook_v4, NF_IP_PRI_RAW + 1),
+	KZ_NF_HOOK_OPS(NF_INET_PRE_ROUTING, NFPROTO_IPV6, kzorp_early_deny_hook_v6, NF_IP6_PRI_RAW + 1),
+};
+
+#undef KZ_NF_HOOK_OPS
+
 static int __init kzorp_tg_init(void)
 {
+	int res;
+
 	nf_defrag_ipv4_enable();
-	return xt_register_targets(kzorp_tg_reg, ARRAY_SIZE(kzorp_tg_reg));
+
+	if (native_hooks) {
+		res = kz_packet_ctx_users_get();
+		if (res < 0)
+			return res;
+
+		res = nf_register_hooks(kzorp_nf_ops, ARRAY_SIZE(kzorp_nf_ops));
+		if (res < 0) {
+			kz_err("failed to register netfilter hooks\n");
+			kz_packet_ctx_users_put();
+			return res;
+		}
+	} else {
+		res = xt_register_targets(kzorp_tg_reg, ARRAY_SIZE(kzorp_tg_reg));
+		if (res < 0)
+			return res;
+	}
+
+	if (early_deny) {
+		get_random_bytes(&kz_early_deny_hash_seed, sizeof(kz_early_deny_hash_seed));
+
+		res = nf_register_hooks(kzorp_early_deny_ops, ARRAY_SIZE(kzorp_early_deny_ops));
+		if (res < 0) {
+			kz_err("failed to register early deny netfilter hooks\n");
+			if (native_hooks) {
+				nf_unregister_hooks(kzorp_nf_ops, ARRAY_SIZE(kzorp_nf_ops));
+				kz_packet_ctx_users_put();
+			} else {
+				xt_unregister_targets(kzorp_tg_reg, ARRAY_SIZE(kzorp_tg_reg));
+			}
+			return res;
+		}
+	}
+
+	return res;
 }
 
 static void __exit kzorp_tg_exit(void)
 {
-	xt_unregister_targets(kzorp_tg_reg, ARRAY_SIZE(kzorp_tg_reg));
+	if (early_deny)
+		nf_unregister_hooks(kzorp_early_deny_ops, ARRAY_SIZE(kzorp_early_deny_ops));
+	if (native_hooks) {
+		nf_unregister_hooks(kzorp_nf_ops, ARRAY_SIZE(kzorp_nf_ops));
+		kz_packet_ctx_users_put();
+	} else {
+		xt_unregister_targets(kzorp_tg_reg, ARRAY_SIZE(kzorp_tg_reg));
+	}
 }
 
 module_init(kzorp_tg_init);
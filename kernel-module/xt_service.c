@@ -12,126 +12,241 @@
 
 #include <linux/module.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
 
 #include <linux/netfilter/x_tables.h>
 #include "include/xt_service.h"
 #include "include/kzorp.h"
 
-static bool
-service_mt(const struct sk_buff *skb, struct xt_action_param *par)
+/* returns the service of the packet, call under rcu_read_lock() */
+static const struct kz_service *
+service_mt_packet_service_rcu(const struct sk_buff *skb, const struct xt_action_param *par,
+			      const struct kz_config **cfg)
 {
-	struct ipt_service_info *info = (struct ipt_service_info *) par->matchinfo;
-	enum ip_conntrack_info ctinfo;
-	struct nf_conn *ct;
-	const struct kz_service *s_svc, *p_svc;
+	struct kz_packet_ctx *ctx;
 	const struct nf_conntrack_kzorp *kzorp;
-	struct nf_conntrack_kzorp local_kzorp;
-	const struct kz_config *cfg = NULL;
-	bool res;
 
 	/* NOTE: unlike previous version, we provide match even for invalid and --notrack packets */
 
-	rcu_read_lock();
-	ct = nf_ct_get((struct sk_buff *)skb, &ctinfo);
-	if (ct == NULL) /* we're really only interested if REPLY or not... */
-		ctinfo = IP_CT_NEW;
-	kzorp = ct ? nfct_kzorp_cached_lookup_rcu(ct, ctinfo, skb, par->in, par->family, &cfg) : NULL;
+	ctx = kz_packet_ctx_get(skb, par->hooknum, par->family);
+	kzorp = kz_packet_ctx_kzorp_rcu(ctx, par->in);
+	*cfg = ctx->cfg;
 
-	if (kzorp == NULL)
-	{
-		kz_debug("cannot add kzorp extension, doing local lookup\n");
-		kzorp = &local_kzorp;
-		memset(&local_kzorp, 0, sizeof(local_kzorp));
-		nfct_kzorp_lookup_rcu(&local_kzorp, ctinfo, skb, par->in, par->family, &cfg);
+	return kzorp->svc;
+}
+
+static bool
+service_mt_type_match(const struct kz_service *svc, u_int8_t type)
+{
+	switch (type) {
+	case IPT_SERVICE_TYPE_PROXY:
+		return svc->type == KZ_SERVICE_PROXY;
+	case IPT_SERVICE_TYPE_FORWARD:
+		return svc->type == KZ_SERVICE_FORWARD;
+	default:
+		/* since info->type has been range-checked in
+		 * checkentry() default is equivalent to
+		 * IPT_SERVICE_TYPE_ANY */
+		return true;
 	}
+}
+
+static unsigned int
+service_mt_lookup_id(const struct kz_config *cfg, const unsigned char *name)
+{
+	const struct kz_service *svc;
+	unsigned int service_id;
+
+	kz_debug("looking up service id; name='%s'\n", name);
+
+	svc = kz_service_lookup_name(cfg, name);
+	service_id = svc != NULL ? svc->id : 0;
+
+	kz_debug("lookup done; id='%u'\n", service_id);
+
+	return service_id;
+}
+
+static bool
+service_mt(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	struct ipt_service_info *info = (struct ipt_service_info *) par->matchinfo;
+	const struct kz_service *p_svc;
+	const struct kz_config *cfg;
+
+	rcu_read_lock();
 
-	if ((p_svc = kzorp->svc) == NULL) {
+	if ((p_svc = service_mt_packet_service_rcu(skb, par, &cfg)) == NULL) {
 		/* no service for this packet => no match */
 		rcu_read_unlock();
-		goto ret_false;
+		return false;
 	}
 
 	if (info->name_match == IPT_SERVICE_NAME_MATCH) {
 		/* check cached service id validity */
 		if (unlikely(!kz_generation_valid(cfg, info->generation))) {
-			kz_debug("looking up service id; name='%s'\n", info->name);
 			/* id invalid, try to look up again */
 			info->generation = kz_generation_get(cfg);
-			s_svc = kz_service_lookup_name(cfg, info->name);
-			if (s_svc != NULL)
-				info->service_id = s_svc->id;
-			else
-				info->service_id = 0;
-
-			kz_debug("lookup done; id='%u'\n", info->service_id);
+			info->service_id = service_mt_lookup_id(cfg, info->name);
 		}
 	}
 	rcu_read_unlock();
 
 	kz_debug("service lookup done; type='%d', id='%u'\n", p_svc->type, p_svc->id);
 
-	switch (info->type) {
-	case IPT_SERVICE_TYPE_PROXY:
-		if (p_svc->type != KZ_SERVICE_PROXY)
-			goto ret_false;
-		break;
-	case IPT_SERVICE_TYPE_FORWARD:
-		if (p_svc->type != KZ_SERVICE_FORWARD)
-			goto ret_false;
-		break;
-	default:
-		/* since info->type has been range-checked in
-		 * checkentry() default is equivalent to
-		 * IPT_SERVICE_TYPE_ANY */
-		break;
-	}
+	if (!service_mt_type_match(p_svc, info->type))
+		return false;
 
 	switch (info->name_match) {
 	case IPT_SERVICE_NAME_MATCH:
 		return (p_svc->id == info->service_id);
-		break;
 	case IPT_SERVICE_NAME_WILDCARD:
 	default:
-		goto ret_true;
+		return true;
 	}
-ret_false:
-	res = false;
-	goto done;
-ret_true:
-	res = true;
-done:
-	if (kzorp == &local_kzorp)
-		kz_destroy_kzorp(&local_kzorp);
-	return res;
 }
 
-static int
-service_mt_checkentry(const struct xt_mtchk_param *par)
+/*
+ * Revision 1 keeps the resolved service id in per-CPU storage owned by
+ * the rule instead of the shared matchinfo, so matching a packet never
+ * writes memory another CPU reads.
+ */
+
+struct xt_service_cache {
+	kz_generation_t generation;
+	unsigned int service_id;
+};
+
+struct xt_service_priv {
+	struct xt_service_cache __percpu *cache;
+};
+
+static bool
+service_mt_v1(const struct sk_buff *skb, struct xt_action_param *par)
 {
-	struct ipt_service_info *info = (struct ipt_service_info *) par->matchinfo;
+	const struct ipt_service_info_v1 *info = (const struct ipt_service_info_v1 *) par->matchinfo;
+	const struct kz_service *p_svc;
+	const struct kz_config *cfg;
+	struct xt_service_cache *cache;
+	bool res;
 
-	info->name[IPT_SERVICE_NAME_LENGTH] = 0;
+	rcu_read_lock();
 
-	if ((info->name_match == IPT_SERVICE_NAME_MATCH) &&
-	    (info->name[0] == '\0'))
+	p_svc = service_mt_packet_service_rcu(skb, par, &cfg);
+	if (p_svc == NULL || !service_mt_type_match(p_svc, info->type)) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	if (info->name_match != IPT_SERVICE_NAME_MATCH) {
+		rcu_read_unlock();
+		return true;
+	}
+
+	/* matches run with bottom halves disabled, the cache of this CPU is ours */
+	cache = this_cpu_ptr(info->priv->cache);
+	if (unlikely(!kz_generation_valid(cfg, cache->generation))) {
+		cache->service_id = service_mt_lookup_id(cfg, info->name);
+		cache->generation = kz_generation_get(cfg);
+	}
+	res = p_svc->id == cache->service_id;
+
+	rcu_read_unlock();
+
+	return res;
+}
+
+static int
+service_mt_check_info(u_int8_t type, u_int8_t name_match, const unsigned char *name)
+{
+	if ((name_match == IPT_SERVICE_NAME_MATCH) &&
+	    (name[0] == '\0'))
 		return -EINVAL;
 
-	if ((info->type == IPT_SERVICE_TYPE_ANY) &&
-	    (info->name_match == IPT_SERVICE_NAME_ANY))
+	if ((type == IPT_SERVICE_TYPE_ANY) &&
+	    (name_match == IPT_SERVICE_NAME_ANY))
 		return -EINVAL;
 
-	if (info->type > IPT_SERVICE_TYPE_FORWARD)
+	if (type > IPT_SERVICE_TYPE_FORWARD)
 		return -EINVAL;
 
-	if (info->name_match > IPT_SERVICE_NAME_MATCH)
+	if (name_match > IPT_SERVICE_NAME_MATCH)
 		return -EINVAL;
 
+	return 0;
+}
+
+static int
+service_mt_checkentry(const struct xt_mtchk_param *par)
+{
+	struct ipt_service_info *info = (struct ipt_service_info *) par->matchinfo;
+	int res;
+
+	info->name[IPT_SERVICE_NAME_LENGTH] = 0;
+
+	res = service_mt_check_info(info->type, info->name_match, info->name);
+	if (res < 0)
+		return res;
+
 	info->generation = -1;
 	info->service_id = 0;
 
+	return kz_packet_ctx_users_get();
+}
+
+static void
+service_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	kz_packet_ctx_users_put();
+}
+
+static int
+service_mt_v1_checkentry(const struct xt_mtchk_param *par)
+{
+	struct ipt_service_info_v1 *info = (struct ipt_service_info_v1 *) par->matchinfo;
+	int cpu;
+	int res;
+
+	info->name[IPT_SERVICE_NAME_LENGTH] = 0;
+
+	res = service_mt_check_info(info->type, info->name_match, info->name);
+	if (res < 0)
+		return res;
+
+	info->priv = kzalloc(sizeof(*info->priv), GFP_KERNEL);
+	if (info->priv == NULL)
+		return -ENOMEM;
+
+	info->priv->cache = alloc_percpu(struct xt_service_cache);
+	if (info->priv->cache == NULL) {
+		kfree(info->priv);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(info->priv->cache, cpu)->generation = -1;
+
+	res = kz_packet_ctx_users_get();
+	if (res < 0) {
+		free_percpu(info->priv->cache);
+		kfree(info->priv);
+		return res;
+	}
+
 	return 0;
 }
 
+static void
+service_mt_v1_destroy(const struct xt_mtdtor_param *par)
+{
+	struct ipt_service_info_v1 *info = (struct ipt_service_info_v1 *) par->matchinfo;
+
+	kz_packet_ctx_users_put();
+	free_percpu(info->priv->cache);
+	kfree(info->priv);
+}
+
 static struct xt_match service_match[] = {
 	{
 		.family		= NFPROTO_IPV4,
@@ -139,6 +254,7 @@ static struct xt_match service_match[] = {
 		.match		= service_mt,
 		.matchsize	= sizeof(struct ipt_service_info),
 		.checkentry	= service_mt_checkentry,
+		.destroy	= service_mt_destroy,
 		.me		= THIS_MODULE,
 	},
 	{
@@ -147,6 +263,27 @@ static struct xt_match service_match[] = {
 		.match		= service_mt,
 		.matchsize	= sizeof(struct ipt_service_info),
 		.checkentry	= service_mt_checkentry,
+		.destroy	= service_mt_destroy,
+		.me		= THIS_MODULE,
+	},
+	{
+		.family		= NFPROTO_IPV4,
+		.name		= "service",
+		.revision	= 1,
+		.match		= service_mt_v1,
+		.matchsize	= sizeof(struct ipt_service_info_v1),
+		.checkentry	= service_mt_v1_checkentry,
+		.destroy	= service_mt_v1_destroy,
+		.me		= THIS_MODULE,
+	},
+	{
+		.family		= NFPROTO_IPV6,
+		.name		= "service",
+		.revision	= 1,
+		.match		= service_mt_v1,
+		.matchsize	= sizeof(struct ipt_service_info_v1),
+		.checkentry	= service_mt_v1_checkentry,
+		.destroy	= service_mt_v1_destroy,
 		.me		= THIS_MODULE,
 	},
 };
@@ -12,48 +12,43 @@
 #include <linux/module.h>
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
+#include <linux/slab.h>
 
 #include <linux/netfilter/x_tables.h>
 #include "include/xt_zone.h"
 #include "include/kzorp.h"
 
-static bool
-zone_mt_v1_eval(const struct sk_buff *skb, const struct ipt_zone_info_v1 *info, const struct xt_action_param *par)
+/* the zone and the config are valid until rcu_read_unlock() */
+static const struct kz_zone *
+zone_mt_packet_zone_rcu(const struct sk_buff *skb, u_int8_t flags,
+			const struct xt_action_param *par, const struct kz_config **cfg)
 {
-	enum ip_conntrack_info ctinfo;
-	struct nf_conn *ct;
-	struct kz_zone *zone;
+	struct kz_packet_ctx *ctx;
 	const struct nf_conntrack_kzorp *kzorp;
 	int reply;
-	struct nf_conntrack_kzorp local_kzorp;
-	bool res;
 
-	rcu_read_lock();
-	ct = nf_ct_get((struct sk_buff *)skb, &ctinfo);
-	if (ct == NULL) /* we're really only interested if REPLY or not... */
-		ctinfo = IP_CT_NEW;
-	kzorp = ct ? nfct_kzorp_cached_lookup_rcu(ct, ctinfo, skb, par->in, par->family, NULL) : NULL;
+	ctx = kz_packet_ctx_get(skb, par->hooknum, par->family);
 
-	if (kzorp == NULL)
-	{
-		kzorp = &local_kzorp;
-		memset(&local_kzorp, 0, sizeof(local_kzorp));
-		nfct_kzorp_lookup_rcu(&local_kzorp, ctinfo, skb, par->in, par->family, NULL);
-	}
-	rcu_read_unlock();
+	kzorp = kz_packet_ctx_kzorp_rcu(ctx, par->in);
+	if (cfg != NULL)
+		*cfg = ctx->cfg;
 
-	reply = ctinfo >= IP_CT_IS_REPLY;
-	if (info->flags & IPT_ZONE_SRC)
-		zone = reply ? kzorp->szone : kzorp->czone;
+	reply = ctx->ctinfo >= IP_CT_IS_REPLY;
+	if (flags & IPT_ZONE_SRC)
+		return reply ? kzorp->szone : kzorp->czone;
 	else
-		zone = reply ? kzorp->czone : kzorp->szone;
+		return reply ? kzorp->czone : kzorp->szone;
+}
 
+static bool
+zone_mt_names_match(const struct kz_zone *zone, const struct ipt_zone_info_v1 *info)
+{
 	while (zone != NULL) {
 		int i;
 
 		for (i = 0; i != info->count; ++i)
 			if (strcmp(zone->name, info->names[i]) == 0)
-				goto ret_true;
+				return true;
 
 		if (info->flags & IPT_ZONE_CHILDREN)
 			zone = zone->admin_parent;
@@ -61,14 +56,18 @@ zone_mt_v1_eval(const struct sk_buff *skb, const struct ipt_zone_info_v1 *info,
 			zone = NULL;
 	}
 
-/* ret_false: */
-	res = false;
-	goto done;
-ret_true:
-	res = true;
-done:
-	if (kzorp == &local_kzorp)
-		kz_destroy_kzorp(&local_kzorp);
+	return false;
+}
+
+static bool
+zone_mt_v1_eval(const struct sk_buff *skb, const struct ipt_zone_info_v1 *info, const struct xt_action_param *par)
+{
+	bool res;
+
+	rcu_read_lock();
+	res = zone_mt_names_match(zone_mt_packet_zone_rcu(skb, info->flags, par, NULL), info);
+	rcu_read_unlock();
+
 	return res;
 }
 
@@ -78,6 +77,157 @@ zone_mt_v1(const struct sk_buff *skb, struct xt_action_param *par)
 	return zone_mt_v1_eval(skb, (const struct ipt_zone_info_v1 *) par->matchinfo, par);
 }
 
+/*
+ * Revision 2 resolves the zone names of the rule to the set of matching
+ * zone indexes once per config generation, so the per-packet check is a
+ * single bit test. The set is replaced under RCU when the generation
+ * changes. Only one CPU compiles the new set, the others match by name
+ * until it is published.
+ */
+
+struct xt_zone_compiled {
+	struct rcu_head rcu;
+	kz_generation_t generation;
+	unsigned int zone_count;
+	unsigned long zones[0];
+};
+
+struct xt_zone_priv {
+	struct xt_zone_compiled *compiled;
+	/* bit 0 is set while a CPU is compiling the set */
+	unsigned long compiling;
+};
+
+static struct xt_zone_compiled *
+zone_mt_compile(const struct ipt_zone_info_v2 *info, const struct kz_config *cfg)
+{
+	struct xt_zone_compiled *compiled;
+	const struct kz_zone *zone;
+	unsigned int zone_count = 0;
+
+	list_for_each_entry(zone, &cfg->zones.head, list)
+		zone_count = max(zone_count, zone->index + 1);
+
+	compiled = kzalloc(sizeof(*compiled) + BITS_TO_LONGS(zone_count) * sizeof(unsigned long), GFP_ATOMIC);
+	if (compiled == NULL)
+		return NULL;
+
+	compiled->generation = kz_generation_get(cfg);
+	compiled->zone_count = zone_count;
+
+	/* v2 begins with the fields of v1 */
+	list_for_each_entry(zone, &cfg->zones.head, list)
+		if (zone_mt_names_match(zone, (const struct ipt_zone_info_v1 *) info))
+			set_bit(zone->index, compiled->zones);
+
+	kz_debug("zone match compiled; generation='%u', zones='%u'\n",
+		 compiled->generation, zone_count);
+
+	return compiled;
+}
+
+static bool
+zone_mt_v2(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct ipt_zone_info_v2 *info = (const struct ipt_zone_info_v2 *) par->matchinfo;
+	const struct kz_config *cfg;
+	const struct kz_zone *zone;
+	struct xt_zone_compiled *compiled, *old;
+	bool res;
+
+	rcu_read_lock();
+
+	zone = zone_mt_packet_zone_rcu(skb, info->flags, par, &cfg);
+	if (zone == NULL) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	compiled = rcu_dereference(info->priv->compiled);
+	if (unlikely(compiled == NULL || !kz_generation_valid(cfg, compiled->generation))) {
+		/* another CPU is compiling the set */
+		if (test_and_set_bit_lock(0, &info->priv->compiling))
+			goto match_names;
+
+		/* the set may have been published since we looked */
+		compiled = rcu_dereference(info->priv->compiled);
+		if (compiled == NULL || !kz_generation_valid(cfg, compiled->generation)) {
+			compiled = zone_mt_compile(info, cfg);
+			if (unlikely(compiled == NULL)) {
+				clear_bit_unlock(0, &info->priv->compiling);
+				goto match_names;
+			}
+
+			/* xchg() implies a full barrier, which is enough to publish the set */
+			old = xchg(&info->priv->compiled, compiled);
+			if (old != NULL)
+				kfree_rcu(old, rcu);
+		}
+
+		clear_bit_unlock(0, &info->priv->compiling);
+	}
+
+	res = zone->index < compiled->zone_count && test_bit(zone->index, compiled->zones);
+
+	rcu_read_unlock();
+
+	return res;
+
+match_names:
+	res = zone_mt_names_match(zone, (const struct ipt_zone_info_v1 *) info);
+
+	rcu_read_unlock();
+
+	return res;
+}
+
+static int
+zone_mt_check(const struct xt_mtchk_param *par)
+{
+	return kz_packet_ctx_users_get();
+}
+
+static void
+zone_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	kz_packet_ctx_users_put();
+}
+
+static int
+zone_mt_v2_check(const struct xt_mtchk_param *par)
+{
+	struct ipt_zone_info_v2 *info = (struct ipt_zone_info_v2 *) par->matchinfo;
+	int res;
+
+	if (info->count > IPT_ZONE_NAME_COUNT)
+		return -EINVAL;
+
+	info->priv = kzalloc(sizeof(*info->priv), GFP_KERNEL);
+	if (info->priv == NULL)
+		return -ENOMEM;
+
+	res = kz_packet_ctx_users_get();
+	if (res < 0) {
+		kfree(info->priv);
+		return res;
+	}
+
+	return 0;
+}
+
+static void
+zone_mt_v2_destroy(const struct xt_mtdtor_param *par)
+{
+	struct ipt_zone_info_v2 *info = (struct ipt_zone_info_v2 *) par->matchinfo;
+
+	kz_packet_ctx_users_put();
+
+	/* packets may still be evaluating the rule in their RCU read side section */
+	if (info->priv->compiled != NULL)
+		kfree_rcu(info->priv->compiled, rcu);
+	kfree(info->priv);
+}
+
 static bool
 zone_mt_v0(const struct sk_buff *skb, struct xt_action_param *par)
 {
@@ -98,6 +248,8 @@ static struct xt_match xt_zone_match[] __read_mostly = {
 		.name		= "zone",
 		.family		= NFPROTO_IPV4,
 		.match		= zone_mt_v0,
+		.checkentry	= zone_mt_check,
+		.destroy	= zone_mt_destroy,
 		.matchsize	= sizeof(struct ipt_zone_info),
 		.me		= THIS_MODULE,
 	},
@@ -106,6 +258,8 @@ static struct xt_match xt_zone_match[] __read_mostly = {
 		.revision	= 1,
 		.family		= NFPROTO_IPV4,
 		.match		= zone_mt_v1,
+		.checkentry	= zone_mt_check,
+		.destroy	= zone_mt_destroy,
 		.matchsize	= sizeof(struct ipt_zone_info_v1),
 		.me		= THIS_MODULE,
 	},
@@ -114,8 +268,29 @@ static struct xt_match xt_zone_match[] __read_mostly = {
 		.revision	= 1,
 		.family		= NFPROTO_IPV6,
 		.match		= zone_mt_v1,
+		.checkentry	= zone_mt_check,
+		.destroy	= zone_mt_destroy,
 		.matchsize	= sizeof(struct ipt_zone_info_v1),
 		.me		= THIS_MODULE,
+	},	{
+		.name		= "zone",
+		.revision	= 2,
+		.family		= NFPROTO_IPV4,
+		.match		= zone_mt_v2,
+		.checkentry	= zone_mt_v2_check,
+		.destroy	= zone_mt_v2_destroy,
+		.matchsize	= sizeof(struct ipt_zone_info_v2),
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "zone",
+		.revision	= 2,
+		.family		= NFPROTO_IPV6,
+		.match		= zone_mt_v2,
+		.checkentry	= zone_mt_v2_check,
+		.destroy	= zone_mt_v2_destroy,
+		.matchsize	= sizeof(struct ipt_zone_info_v2),
+		.me		= THIS_MODULE,
 	},
 };
 
@@ -33,8 +33,12 @@ def exchangeMessage(h, payload):
         raise kzorp.netlink.NetlinkException, "Error while talking to kernel; result='%s'" % (e.what())
 
 def exchangeMessages(h, messages):
-    for payload in messages:
-        exchangeMessage(h, payload)
+    try:
+        h.exchange(messages)
+    except kzorp.netlink.NetlinkPipelineException as e:
+        raise kzorp.netlink.NetlinkException, "Error while talking to kernel; result='%s', message='%s'" % (e.detail, e.message)
+    except kzorp.netlink.NetlinkException as e:
+        raise kzorp.netlink.NetlinkException, "Error while talking to kernel; result='%s'" % (e.detail)
 
 def startTransaction(h, instance_name):
     tries = 7
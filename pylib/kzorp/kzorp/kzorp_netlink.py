@@ -55,7 +55,16 @@ KZNL_MSG_ADD_BIND            = 18
 KZNL_MSG_GET_BIND            = 19
 KZNL_MSG_FLUSH_BIND          = 20
 KZNL_MSG_QUERY_REPLY         = 21
-KZNL_MSG_MAX                 = 22
+KZNL_MSG_SESSION_EVENT       = 22
+KZNL_MSG_DELETE_ZONE         = 23
+KZNL_MSG_DELETE_SERVICE      = 24
+KZNL_MSG_DELETE_DISPATCHER   = 25
+KZNL_MSG_DELETE_RULE         = 26
+KZNL_MSG_ADD_RULE_BULK       = 27
+KZNL_MSG_COMMIT_DONE         = 28
+KZNL_MSG_QUERY_BATCH         = 29
+KZNL_MSG_QUERY_BATCH_REPLY   = 30
+KZNL_MSG_MAX                 = 31
 
 # attribute types
 KZNL_ATTR_INVALID                       = 0
@@ -108,7 +117,31 @@ KZNL_ATTR_N_DIMENSION_DST_IFACE         = 46
 KZNL_ATTR_N_DIMENSION_DST_IFGROUP       = 47
 KZNL_ATTR_N_DIMENSION_REQID             = 48
 KZNL_ATTR_QUERY_PARAMS_REQID            = 49
-KZNL_ATTR_MAX                           = 50
+KZNL_ATTR_SESSION_RECORDS               = 50
+KZNL_ATTR_BIND_WEIGHT                   = 51
+KZNL_ATTR_SVC_NAT6_SRC                  = 52
+KZNL_ATTR_SVC_NAT6_DST                  = 53
+KZNL_ATTR_SVC_NAT6_MAP                  = 54
+KZNL_ATTR_SVC_REJECT_LIMIT              = 55
+KZNL_ATTR_SVC_REJECT_STATS              = 56
+KZNL_ATTR_N_DIMENSION_RULE_BULK         = 57
+KZNL_ATTR_COMMIT_ASYNC                  = 58
+KZNL_ATTR_COMMIT_RESULT                 = 59
+KZNL_ATTR_CONFIG_GENERATION             = 60
+KZNL_ATTR_QUERY_BATCH                   = 61
+KZNL_ATTR_QUERY_BATCH_RESULTS           = 62
+KZNL_ATTR_ZONE_INDEX                    = 63
+KZNL_ATTR_DISPATCHER_INDEX              = 64
+KZNL_ATTR_MAX                           = 65
+
+KZ_BIND_WEIGHT_MAX                      = 256
+KZ_SVC_REJECT_LIMIT_MAX                 = 1000000
+KZ_RULE_BULK_VERSION                    = 1
+# the length of the rule bulk attribute, header included, must fit in the
+# 16 bit nla_len field
+KZ_RULE_BULK_MAX_SIZE                   = (0xffff - 4) & ~(NFA_ALIGNTO - 1)
+KZ_QUERY_BATCH_VERSION                  = 1
+KZ_QUERY_BATCH_NO_ID                    = 0xffffffff
 
 # list of attributes in an N dimension rule
 N_DIMENSION_ATTRS = [
@@ -169,6 +202,23 @@ DenyIPv6 = enum(DROP=0,
 KZ_SVC_NAT_MAP_IPS = 1
 KZ_SVC_NAT_MAP_PROTO_SPECIFIC = 2
 
+# session event multicast group
+KZNL_MCGRP_SESSION_EVENTS = "sessions"
+
+SessionEvent = enum(INVALID=0,
+                    START=1,
+                    REJECT=2,
+                    DROP=3)
+
+# struct kza_session_record
+KZA_SESSION_RECORD_FORMAT = '>QIII16s16sHHBBBB'
+KZA_SESSION_RECORD_SIZE = struct.calcsize(KZA_SESSION_RECORD_FORMAT)
+
+# query batch tuples and results
+KZA_QUERY_BATCH_TUPLE_FORMAT = '>16s16sIIHHBBxx'
+KZA_QUERY_BATCH_RESULT_FORMAT = '>IIIII'
+KZA_QUERY_BATCH_RESULT_SIZE = struct.calcsize(KZA_QUERY_BATCH_RESULT_FORMAT)
+
 # dispatcher bind address port ranges
 KZF_DPT_PORT_RANGE_SIZE = 8
 
@@ -332,6 +382,14 @@ def create_nat_range_attr(type, flags, min_ip, max_ip, min_port, max_port):
 def parse_nat_range_attr(attr):
     return struct.unpack('>IIIHH', attr.get_data()[:16])
 
+# IPv6 ranges carry the addresses as 16 byte packed strings
+def create_nat6_range_attr(type, flags, min_ip, max_ip, min_port, max_port):
+    data = struct.pack('>I16s16sHH', flags, min_ip, max_ip, min_port, max_port)
+    return NetlinkAttribute(type, data = data)
+
+def parse_nat6_range_attr(attr):
+    return struct.unpack('>I16s16sHH', attr.get_data()[:40])
+
 def create_address_attr(type, proto, ip, port):
     return NetlinkAttribute(type, data = struct.pack('>IHB', ip, port, proto))
 
@@ -415,6 +473,225 @@ def parse_rule_entry_attrs(attr):
 
     return (dpt_name, rule_id, rule_entries)
 
+def create_rule_entry_attr(dim_type, value):
+    if dim_type == KZNL_ATTR_N_DIMENSION_PROTO:
+        return NetlinkAttribute.create_int8(dim_type, value)
+    elif dim_type == KZNL_ATTR_N_DIMENSION_DST_PORT or \
+         dim_type == KZNL_ATTR_N_DIMENSION_SRC_PORT:
+        return create_port_range_attr(dim_type, value[0], value[1])
+    elif dim_type == KZNL_ATTR_N_DIMENSION_DST_IP or \
+         dim_type == KZNL_ATTR_N_DIMENSION_SRC_IP:
+        return create_inet_subnet_attr(dim_type, socket.AF_INET, value[0], value[1])
+    elif dim_type == KZNL_ATTR_N_DIMENSION_DST_IP6 or \
+         dim_type == KZNL_ATTR_N_DIMENSION_SRC_IP6:
+        return create_inet_subnet_attr(dim_type, socket.AF_INET6, value[0], value[1])
+    elif dim_type == KZNL_ATTR_N_DIMENSION_IFGROUP or \
+         dim_type == KZNL_ATTR_N_DIMENSION_DST_IFGROUP or \
+         dim_type == KZNL_ATTR_N_DIMENSION_REQID:
+        return NetlinkAttribute.create_be32(dim_type, value)
+    elif dim_type == KZNL_ATTR_N_DIMENSION_IFACE    or \
+         dim_type == KZNL_ATTR_N_DIMENSION_DST_ZONE or \
+         dim_type == KZNL_ATTR_N_DIMENSION_SRC_ZONE or \
+         dim_type == KZNL_ATTR_N_DIMENSION_DST_IFACE:
+        return create_name_attr(dim_type, value)
+    else:
+        raise ValueError, "dispatcher dimension type is invalid; type='%d'" % dim_type
+
+def _create_rule_bulk_record(rule_id, service, entries):
+    body = create_name_attr(KZNL_ATTR_N_DIMENSION_RULE_SERVICE, service).dump()
+    body += "".join([create_rule_entry_attr(dim_type, value).dump() for (dim_type, value) in entries])
+    return struct.pack('>II', 8 + len(body), rule_id) + body
+
+def _check_rule_bulk_size(size):
+    if size > KZ_RULE_BULK_MAX_SIZE:
+        raise ValueError, "rule bulk upload too large, split the rules into several messages; size='%d', max_size='%d'" % (size, KZ_RULE_BULK_MAX_SIZE)
+
+def _split_rule_bulk(lengths):
+    """Return the (first, last) ranges of rule records of the given lengths
+    that fit in one rule bulk attribute each."""
+    ranges = []
+    first = 0
+    size = 8
+    for (i, length) in enumerate(lengths):
+        if 8 + length > KZ_RULE_BULK_MAX_SIZE:
+            raise ValueError, "rule too large for a rule bulk upload; index='%d', size='%d'" % (i, length)
+        if size + length > KZ_RULE_BULK_MAX_SIZE:
+            ranges.append((first, i))
+            first = i
+            size = 8
+        size += length
+    if first < len(lengths) or not ranges:
+        ranges.append((first, len(lengths)))
+    return ranges
+
+def create_rule_bulk_attr(type, rules):
+    """Create the packed attribute of a bulk rule upload.
+
+    The whole upload is one attribute, so its size is limited to
+    KZ_RULE_BULK_MAX_SIZE bytes; ValueError is raised above that. Use
+    KZorpAddRuleBulkMessage.create_messages() to split larger uploads.
+
+    Keyword arguments:
+    rules -- list of (rule_id, service, entries) tuples, where entries is a
+             list of (dimension attribute type, value) pairs
+
+    """
+    records = [_create_rule_bulk_record(rule_id, service, entries) for (rule_id, service, entries) in rules]
+
+    data = struct.pack('>II', KZ_RULE_BULK_VERSION, len(rules)) + "".join(records)
+    _check_rule_bulk_size(len(data))
+    return NetlinkAttribute(type, data = data)
+
+# fixed size rule entries: dimension attribute type -> (data format, whether the value is a tuple)
+_fixed_rule_entry_formats = {
+    KZNL_ATTR_N_DIMENSION_PROTO       : ('B3x', False),
+    KZNL_ATTR_N_DIMENSION_SRC_PORT    : ('HH', True),
+    KZNL_ATTR_N_DIMENSION_DST_PORT    : ('HH', True),
+    KZNL_ATTR_N_DIMENSION_SRC_IP      : ('4s4s', True),
+    KZNL_ATTR_N_DIMENSION_DST_IP      : ('4s4s', True),
+    KZNL_ATTR_N_DIMENSION_SRC_IP6     : ('16s16s', True),
+    KZNL_ATTR_N_DIMENSION_DST_IP6     : ('16s16s', True),
+    KZNL_ATTR_N_DIMENSION_IFGROUP     : ('I', False),
+    KZNL_ATTR_N_DIMENSION_DST_IFGROUP : ('I', False),
+    KZNL_ATTR_N_DIMENSION_REQID       : ('I', False),
+}
+
+_name_rule_entry_types = frozenset((KZNL_ATTR_N_DIMENSION_IFACE, KZNL_ATTR_N_DIMENSION_DST_IFACE,
+                                    KZNL_ATTR_N_DIMENSION_SRC_ZONE, KZNL_ATTR_N_DIMENSION_DST_ZONE))
+
+def _encode_name_attr(type, name):
+    data = struct.pack('>H', len(name)) + name
+    padding = nfa_align(len(data)) - len(data)
+    return "".join((struct.pack('HH', 4 + len(data) + padding, type), data, '\0' * padding))
+
+# struct.Struct objects packing n entries of a format at once: (data format, n) -> Struct
+_rule_entry_structs = {}
+
+def _rule_entry_struct(data_format, num_entries):
+    entries = _rule_entry_structs.get((data_format, num_entries))
+    if entries is None:
+        entries = _rule_entry_structs[(data_format, num_entries)] = struct.Struct('>' + ('4s' + data_format) * num_entries)
+    return entries
+
+def _rule_bulk_table_layout(rule_ids, services, columns):
+    """Check the tabular input of a bulk rule upload and return the
+    dimension types, the length of each rule record and the encoded
+    service and name attributes. Each distinct name is encoded once."""
+    num_rules = len(rule_ids)
+    if len(services) != num_rules:
+        raise ValueError, "number of services differs from the number of rules"
+
+    dim_types = sorted(columns.keys())
+    for dim_type in dim_types:
+        if dim_type not in _fixed_rule_entry_formats and dim_type not in _name_rule_entry_types:
+            raise ValueError, "dispatcher dimension type is invalid; type='%d'" % dim_type
+        if len(columns[dim_type]) != num_rules:
+            raise ValueError, "number of rows differs from the number of rules; type='%d'" % dim_type
+
+    service_attrs = {}
+    for service in services:
+        if service not in service_attrs:
+            service_attrs[service] = _encode_name_attr(KZNL_ATTR_N_DIMENSION_RULE_SERVICE, service)
+    lengths = [8 + len(service_attrs[service]) for service in services]
+
+    name_attrs = {}
+    for dim_type in dim_types:
+        column = columns[dim_type]
+        if dim_type in _name_rule_entry_types:
+            names = name_attrs[dim_type] = {}
+            for i in xrange(num_rules):
+                for name in column[i] or ():
+                    data = names.get(name)
+                    if data is None:
+                        data = names[name] = _encode_name_attr(dim_type, name)
+                    lengths[i] += len(data)
+        else:
+            entry_length = 4 + struct.calcsize('>' + _fixed_rule_entry_formats[dim_type][0])
+            for i in xrange(num_rules):
+                if column[i]:
+                    lengths[i] += entry_length * len(column[i])
+
+    return (dim_types, lengths, service_attrs, name_attrs)
+
+def create_rule_bulk_attr_from_table(type, rule_ids, services, columns, layout = None):
+    """Create the packed attribute of a bulk rule upload from tabular input.
+
+    The result is the same as that of create_rule_bulk_attr() with the
+    entries of each rule in increasing order of dimension type, but no
+    attribute object is created per rule entry: the size of the attribute
+    is computed first, then the entries are packed column by column into
+    one preallocated buffer, the fixed size entries of a rule in one
+    dimension at once. Name attributes are encoded once per distinct name.
+    ValueError is raised above KZ_RULE_BULK_MAX_SIZE bytes, use
+    KZorpAddRuleBulkTableMessage.create_messages() to split larger uploads.
+
+    Keyword arguments:
+    rule_ids -- list of the rule ids
+    services -- list of the service names of the rules
+    columns -- dict of dimension attribute type -> list of the lists of
+               values of the dimension, one list per rule; values are in
+               the format accepted by create_rule_entry_attr()
+    layout -- the result of _rule_bulk_table_layout() for the rules, if it
+              has already been computed
+
+    """
+    num_rules = len(rule_ids)
+
+    # first pass: the length of each rule record
+    if layout is None:
+        layout = _rule_bulk_table_layout(rule_ids, services, columns)
+    (dim_types, lengths, service_attrs, name_attrs) = layout
+
+    ends = [0] * num_rules
+    offset = 8
+    for i in xrange(num_rules):
+        ends[i] = offset
+        offset += lengths[i]
+    _check_rule_bulk_size(offset)
+
+    buf = bytearray(offset)
+    struct.pack_into('>II', buf, 0, KZ_RULE_BULK_VERSION, num_rules)
+
+    # second pass: record headers and services, then the entries column by column
+    for i in xrange(num_rules):
+        offset = ends[i]
+        struct.pack_into('>II', buf, offset, lengths[i], rule_ids[i])
+        data = service_attrs[services[i]]
+        buf[offset + 8:offset + 8 + len(data)] = data
+        ends[i] = offset + 8 + len(data)
+
+    for dim_type in dim_types:
+        column = columns[dim_type]
+        if dim_type in _name_rule_entry_types:
+            names = name_attrs[dim_type]
+            for i in xrange(num_rules):
+                offset = ends[i]
+                for name in column[i] or ():
+                    data = names[name]
+                    buf[offset:offset + len(data)] = data
+                    offset += len(data)
+                ends[i] = offset
+            continue
+
+        (data_format, is_tuple) = _fixed_rule_entry_formats[dim_type]
+        header = struct.pack('HH', 4 + struct.calcsize('>' + data_format), dim_type)
+        for i in xrange(num_rules):
+            values = column[i]
+            if not values:
+                continue
+            entries = _rule_entry_struct(data_format, len(values))
+            if is_tuple:
+                args = []
+                for value in values:
+                    args.append(header)
+                    args.extend(value)
+            else:
+                args = [x for value in values for x in (header, value)]
+            entries.pack_into(buf, ends[i], *args)
+            ends[i] += entries.size
+
+    return NetlinkAttribute(type, data = str(buf))
+
 def create_service_params_attr(type, svc_type, svc_flags):
     return NetlinkAttribute(type, data = struct.pack('>IB', svc_flags, svc_type))
 
@@ -432,6 +709,15 @@ def create_deny_setting_attr(type, setting):
 def parse_deny_setting_attr(attr):
     return attr.parse_int8()
 
+def create_reject_limit_attr(type, rate, burst, src_rate, src_burst):
+    return NetlinkAttribute(type, data = struct.pack('>IIII', rate, burst, src_rate, src_burst))
+
+def parse_reject_limit_attr(attr):
+    return struct.unpack('>IIII', attr.get_data()[:16])
+
+def parse_reject_stats_attr(attr):
+    return struct.unpack('>QQ', attr.get_data()[:16])
+
 
 # transactions
 class KZorpStartTransactionMessage(GenericNetlinkMessage):
@@ -453,9 +739,49 @@ class KZorpStartTransactionMessage(GenericNetlinkMessage):
 class KZorpCommitTransactionMessage(GenericNetlinkMessage):
     command = KZNL_MSG_COMMIT
 
-    def __init__(self):
+    def __init__(self, asynchronous = False):
         super(KZorpCommitTransactionMessage, self).__init__(self.command, version = 1)
 
+        self.asynchronous = asynchronous
+
+        self._build_payload()
+
+    def _build_payload(self):
+        if self.asynchronous:
+            self.append_attribute(NetlinkAttribute(KZNL_ATTR_COMMIT_ASYNC, data = ""))
+
+class KZorpCommitDoneMessage(GenericNetlinkMessage):
+    command = KZNL_MSG_COMMIT_DONE
+
+    def __init__(self, result, generation, config_cookie):
+        super(KZorpCommitDoneMessage, self).__init__(self.command, version = 1)
+
+        self.result = result
+        self.generation = generation
+        self.config_cookie = config_cookie
+
+        self._build_payload()
+
+    def _build_payload(self):
+        self.append_attribute(NetlinkAttribute.create_be32(KZNL_ATTR_COMMIT_RESULT, self.result))
+        self.append_attribute(NetlinkAttribute.create_be32(KZNL_ATTR_CONFIG_GENERATION, self.generation))
+        self.append_attribute(NetlinkAttribute.create_be64(KZNL_ATTR_CONFIG_COOKIE, self.config_cookie))
+
+    @staticmethod
+    def parse(version, data):
+        attrs = NetlinkAttribute.parse(NetlinkAttributeFactory, data)
+
+        for attr in (KZNL_ATTR_COMMIT_RESULT, KZNL_ATTR_CONFIG_GENERATION, KZNL_ATTR_CONFIG_COOKIE):
+            if not attrs.has_key(attr):
+                raise AttributeRequiredError, "attr_type='%d'" % (attr, )
+
+        return KZorpCommitDoneMessage(attrs[KZNL_ATTR_COMMIT_RESULT].parse_be32(),
+                                      attrs[KZNL_ATTR_CONFIG_GENERATION].parse_be32(),
+                                      attrs[KZNL_ATTR_CONFIG_COOKIE].parse_be64())
+
+    def __str__(self):
+        return "Commit done result='%d', generation='%d', config_cookie='%d'" % (self.result, self.generation, self.config_cookie)
+
 # flush
 class KZorpFlushMessage(GenericNetlinkMessage):
     command = KZNL_MSG_INVALID
@@ -617,11 +943,18 @@ class KZorpAddDenyServiceMessage(KZorpAddServiceMessage):
         DenyIPv6.ICMP_PORT_UNREACHABLE: 'Port unreachable',
         }
 
-    def __init__(self, name, logging, count, ipv4_settings, ipv6_settings):
+    def __init__(self, name, logging, count, ipv4_settings, ipv6_settings, reject_limit=None, reject_stats=None):
+        """
+        reject_limit is a (rate, burst, src_rate, src_burst) tuple of
+        rejects per second, a zero rate means unlimited. reject_stats is
+        the (sent, suppressed) counter pair dumped by the kernel.
+        """
         super(KZorpAddDenyServiceMessage, self).__init__(name, KZ_SVC_DENY, KZF_SVC_LOGGING if logging else 0, count)
         self.logging = logging
         self.ipv4_settings = ipv4_settings
         self.ipv6_settings = ipv6_settings
+        self.reject_limit = reject_limit
+        self.reject_stats = reject_stats
 
         self._build_payload()
 
@@ -629,6 +962,8 @@ class KZorpAddDenyServiceMessage(KZorpAddServiceMessage):
         super(KZorpAddDenyServiceMessage, self)._build_payload()
         self.append_attribute(create_deny_setting_attr(KZNL_ATTR_SVC_INET4_DENY_SETTING, self.ipv4_settings))
         self.append_attribute(create_deny_setting_attr(KZNL_ATTR_SVC_INET6_DENY_SETTING, self.ipv6_settings))
+        if self.reject_limit is not None:
+            self.append_attribute(create_reject_limit_attr(KZNL_ATTR_SVC_REJECT_LIMIT, *self.reject_limit))
 
     @classmethod
     def parse(cls, version, data):
@@ -639,15 +974,23 @@ class KZorpAddDenyServiceMessage(KZorpAddServiceMessage):
 
         ipv4_setting = cls.get_kz_attr(attrs, KZNL_ATTR_SVC_INET4_DENY_SETTING, parse_deny_setting_attr)
         ipv6_setting = cls.get_kz_attr(attrs, KZNL_ATTR_SVC_INET6_DENY_SETTING, parse_deny_setting_attr)
+        reject_limit = cls.get_kz_attr(attrs, KZNL_ATTR_SVC_REJECT_LIMIT, parse_reject_limit_attr)
+        reject_stats = cls.get_kz_attr(attrs, KZNL_ATTR_SVC_REJECT_STATS, parse_reject_stats_attr)
 
-        return cls(name, logging, count, ipv4_setting, ipv6_setting)
+        return cls(name, logging, count, ipv4_setting, ipv6_setting, reject_limit, reject_stats)
 
     def __str__(self):
         parent = super(KZorpAddDenyServiceMessage, self).__str__()
         deny_ipv4_line = "        deny_ipv4='%s'" % self.deny_ipv4_types[self.ipv4_settings]
         deny_ipv6_line = "        deny_ipv6='%s'" % self.deny_ipv6_types[self.ipv6_settings]
+        lines = [parent, deny_ipv4_line, deny_ipv6_line]
+
+        if self.reject_limit is not None:
+            lines.append("        reject_limit='rate=%d, burst=%d, src_rate=%d, src_burst=%d'" % self.reject_limit)
+        if self.reject_stats is not None:
+            lines.append("        rejects_sent='%d', rejects_suppressed='%d'" % self.reject_stats)
 
-        return "\n".join((parent, deny_ipv4_line, deny_ipv6_line))
+        return "\n".join(lines)
 
 
 class KZorpGetServiceMessage(GenericNetlinkMessage):
@@ -666,28 +1009,36 @@ class KZorpGetServiceMessage(GenericNetlinkMessage):
 
 class KZorpAddServiceNATMappingMessage(GenericNetlinkMessage):
 
-    def __init__(self, name, nat_src, nat_map, nat_dst=None):
+    def __init__(self, name, nat_src, nat_map, nat_dst=None, family=socket.AF_INET):
         super(KZorpAddServiceNATMappingMessage, self).__init__(self.command, version = 1)
 
         self.name = name
         self.nat_src = nat_src
         self.nat_dst = nat_dst
         self.nat_map = nat_map
+        self.family = family
 
         self._build_payload()
 
     def _build_payload(self):
         self.append_attribute(create_name_attr(KZNL_ATTR_SVC_NAME, self.name))
 
+        if self.family == socket.AF_INET6:
+            create_attr = create_nat6_range_attr
+            src_type, dst_type, map_type = KZNL_ATTR_SVC_NAT6_SRC, KZNL_ATTR_SVC_NAT6_DST, KZNL_ATTR_SVC_NAT6_MAP
+        else:
+            create_attr = create_nat_range_attr
+            src_type, dst_type, map_type = KZNL_ATTR_SVC_NAT_SRC, KZNL_ATTR_SVC_NAT_DST, KZNL_ATTR_SVC_NAT_MAP
+
         (flags, min_ip, max_ip, min_port, max_port) = self.nat_src
-        self.append_attribute(create_nat_range_attr(KZNL_ATTR_SVC_NAT_SRC, flags, min_ip, max_ip, min_port, max_port))
+        self.append_attribute(create_attr(src_type, flags, min_ip, max_ip, min_port, max_port))
 
         (flags, min_ip, max_ip, min_port, max_port) = self.nat_map
-        self.append_attribute(create_nat_range_attr(KZNL_ATTR_SVC_NAT_MAP, flags, min_ip, max_ip, min_port, max_port))
+        self.append_attribute(create_attr(map_type, flags, min_ip, max_ip, min_port, max_port))
 
         if self.nat_dst:
             (flags, min_ip, max_ip, min_port, max_port) = self.nat_dst
-            self.append_attribute(create_nat_range_attr(KZNL_ATTR_SVC_NAT_DST, flags, min_ip, max_ip, min_port, max_port))
+            self.append_attribute(create_attr(dst_type, flags, min_ip, max_ip, min_port, max_port))
 
     @classmethod
     def parse(cls, version, data):
@@ -697,28 +1048,39 @@ class KZorpAddServiceNATMappingMessage(GenericNetlinkMessage):
         else:
             raise AttributeRequiredError, "KZNL_ATTR_SVC_NAME"
 
-        if attrs.has_key(KZNL_ATTR_SVC_NAT_SRC):
-            nat_src = parse_nat_range_attr(attrs[KZNL_ATTR_SVC_NAT_SRC])
+        if attrs.has_key(KZNL_ATTR_SVC_NAT6_SRC):
+            family = socket.AF_INET6
+            parse_attr = parse_nat6_range_attr
+            src_type, dst_type, map_type = KZNL_ATTR_SVC_NAT6_SRC, KZNL_ATTR_SVC_NAT6_DST, KZNL_ATTR_SVC_NAT6_MAP
+        else:
+            family = socket.AF_INET
+            parse_attr = parse_nat_range_attr
+            src_type, dst_type, map_type = KZNL_ATTR_SVC_NAT_SRC, KZNL_ATTR_SVC_NAT_DST, KZNL_ATTR_SVC_NAT_MAP
+
+        if attrs.has_key(src_type):
+            nat_src = parse_attr(attrs[src_type])
         else:
             raise AttributeRequiredError, "KZNL_ATTR_SVC_NAT_SRC"
 
-        if attrs.has_key(KZNL_ATTR_SVC_NAT_DST):
-            nat_dst = parse_nat_range_attr(attrs[KZNL_ATTR_SVC_NAT_DST])
+        if attrs.has_key(dst_type):
+            nat_dst = parse_attr(attrs[dst_type])
         else:
             nat_dst = None
 
-        if attrs.has_key(KZNL_ATTR_SVC_NAT_MAP):
-            nat_map = parse_nat_range_attr(attrs[KZNL_ATTR_SVC_NAT_MAP])
+        if attrs.has_key(map_type):
+            nat_map = parse_attr(attrs[map_type])
         else:
             raise AttributeRequiredError, "KZNL_ATTR_SVC_NAT_MAP"
 
-        return cls(name, nat_src, nat_map, nat_dst)
+        return cls(name, nat_src, nat_map, nat_dst, family)
 
     def __str__(self):
 
         def nat_range_str(nat):
 
             def inet_ntoa(a):
+                if self.family == socket.AF_INET6:
+                    return socket.inet_ntop(socket.AF_INET6, a)
                 return "%s.%s.%s.%s" % ((a >> 24) & 0xff, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff)
 
             flags, ip1, ip2, p1, p2 = nat
@@ -766,7 +1128,8 @@ class KZorpGetServiceMessage(GenericNetlinkMessage):
 class KZorpAddZoneMessage(GenericNetlinkMessage):
     command = KZNL_MSG_ADD_ZONE
 
-    def __init__(self, name, family=socket.AF_INET, address = None, mask = None, uname = None, pname = None):
+    def __init__(self, name, family=socket.AF_INET, address = None, mask = None, uname = None, pname = None,
+                 index = None, generation = None):
         super(KZorpAddZoneMessage, self).__init__(self.command, version = 1)
 
         self.name = name
@@ -775,6 +1138,9 @@ class KZorpAddZoneMessage(GenericNetlinkMessage):
         self.family = family
         self.address = address
         self.mask = mask
+        # only set in dumps, never uploaded
+        self.index = index
+        self.generation = generation
 
         self._build_payload()
 
@@ -809,6 +1175,12 @@ class KZorpAddZoneMessage(GenericNetlinkMessage):
             kw['address'] = address
             kw['mask'] = mask
 
+        if attrs.has_key(KZNL_ATTR_ZONE_INDEX):
+            kw['index'] = attrs[KZNL_ATTR_ZONE_INDEX].parse_be32()
+
+        if attrs.has_key(KZNL_ATTR_CONFIG_GENERATION):
+            kw['generation'] = attrs[KZNL_ATTR_CONFIG_GENERATION].parse_be32()
+
         return KZorpAddZoneMessage(name, **kw)
 
     def __str__(self):
@@ -836,11 +1208,14 @@ class KZorpGetZoneMessage(GenericNetlinkMessage):
 class KZorpAddDispatcherMessage(GenericNetlinkMessage):
     command = KZNL_MSG_ADD_DISPATCHER
 
-    def __init__(self, name, num_rules):
+    def __init__(self, name, num_rules, index = None, generation = None):
         super(KZorpAddDispatcherMessage, self).__init__(self.command, version = 1)
 
         self.name = name
         self.num_rules = num_rules
+        # only set in dumps, never uploaded
+        self.index = index
+        self.generation = generation
 
         self._build_payload()
 
@@ -862,7 +1237,14 @@ class KZorpAddDispatcherMessage(GenericNetlinkMessage):
         else:
             raise AttributeRequiredError, "KZNL_ATTR_DISPATCHER_N_DIMENSION_PARAMS"
 
-        return KZorpAddDispatcherMessage(name, num_rules)
+        kw = {}
+        if attrs.has_key(KZNL_ATTR_DISPATCHER_INDEX):
+            kw['index'] = attrs[KZNL_ATTR_DISPATCHER_INDEX].parse_be32()
+
+        if attrs.has_key(KZNL_ATTR_CONFIG_GENERATION):
+            kw['generation'] = attrs[KZNL_ATTR_CONFIG_GENERATION].parse_be32()
+
+        return KZorpAddDispatcherMessage(name, num_rules, **kw)
 
     def __str__(self):
         addr_str = "        num_rules='%d'" % (self.num_rules)
@@ -918,28 +1300,7 @@ class KZorpAddRuleEntryMessage(GenericNetlinkMessage):
         self.append_attribute(NetlinkAttribute.create_be32(KZNL_ATTR_N_DIMENSION_RULE_ID, self.rule_id))
 
         for dim_type, value in self.entry_values.items():
-            if dim_type == KZNL_ATTR_N_DIMENSION_PROTO:
-                self.append_attribute(NetlinkAttribute.create_int8(dim_type, value))
-            elif dim_type == KZNL_ATTR_N_DIMENSION_DST_PORT or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_SRC_PORT:
-                self.append_attribute(create_port_range_attr(dim_type, value[0], value[1]))
-            elif dim_type == KZNL_ATTR_N_DIMENSION_DST_IP or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_SRC_IP:
-                self.append_attribute(create_inet_subnet_attr(dim_type, socket.AF_INET, value[0], value[1]))
-            elif dim_type == KZNL_ATTR_N_DIMENSION_DST_IP6 or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_SRC_IP6:
-                self.append_attribute(create_inet_subnet_attr(dim_type, socket.AF_INET6, value[0], value[1]))
-            elif dim_type == KZNL_ATTR_N_DIMENSION_IFGROUP or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_DST_IFGROUP or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_REQID:
-                self.append_attribute(NetlinkAttribute.create_be32(dim_type, value))
-            elif dim_type == KZNL_ATTR_N_DIMENSION_IFACE    or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_DST_ZONE or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_SRC_ZONE or \
-                 dim_type == KZNL_ATTR_N_DIMENSION_DST_IFACE:
-                self.append_attribute(create_name_attr(dim_type, value))
-            else:
-                raise ValueError, "dispatcher dimension type is invalid; type='%d'" % dim_type
+            self.append_attribute(create_rule_entry_attr(dim_type, value))
 
     @staticmethod
     def parse(version, data):
@@ -967,6 +1328,66 @@ class KZorpAddRuleEntryMessage(GenericNetlinkMessage):
             else:
                 rule_entries[dim_type].append(value)
 
+class KZorpAddRuleBulkMessage(GenericNetlinkMessage):
+    command = KZNL_MSG_ADD_RULE_BULK
+
+    def __init__(self, dpt_name, rules):
+        super(KZorpAddRuleBulkMessage, self).__init__(self.command, version = 1)
+
+        self.dpt_name = dpt_name
+        self.rules = rules
+
+        self._build_payload()
+
+    def _build_payload(self):
+        self.append_attribute(create_name_attr(KZNL_ATTR_DPT_NAME, self.dpt_name))
+        self.append_attribute(create_rule_bulk_attr(KZNL_ATTR_N_DIMENSION_RULE_BULK, self.rules))
+
+    def __str__(self):
+        return "Rule bulk dispatcher='%s', num_rules='%d'" % (self.dpt_name, len(self.rules))
+
+    @classmethod
+    def create_messages(cls, dpt_name, rules):
+        """Create the messages uploading the rules, split so that each of
+        them stays under the attribute size limit."""
+        lengths = [len(_create_rule_bulk_record(rule_id, service, entries)) for (rule_id, service, entries) in rules]
+        return [cls(dpt_name, rules[first:last]) for (first, last) in _split_rule_bulk(lengths)]
+
+class KZorpAddRuleBulkTableMessage(KZorpAddRuleBulkMessage):
+    """
+    Bulk rule upload built from tabular input, see create_rule_bulk_attr_from_table().
+    """
+
+    def __init__(self, dpt_name, rule_ids, services, columns, layout = None):
+        self.rule_ids = rule_ids
+        self.services = services
+        self.columns = columns
+        self._layout = layout
+
+        super(KZorpAddRuleBulkTableMessage, self).__init__(dpt_name, None)
+
+    def _build_payload(self):
+        self.append_attribute(create_name_attr(KZNL_ATTR_DPT_NAME, self.dpt_name))
+        self.append_attribute(create_rule_bulk_attr_from_table(KZNL_ATTR_N_DIMENSION_RULE_BULK,
+                                                               self.rule_ids, self.services, self.columns,
+                                                               self._layout))
+        # only needed to build the payload
+        self._layout = None
+
+    def __str__(self):
+        return "Rule bulk dispatcher='%s', num_rules='%d'" % (self.dpt_name, len(self.rule_ids))
+
+    @classmethod
+    def create_messages(cls, dpt_name, rule_ids, services, columns):
+        """Create the messages uploading the rules, split so that each of
+        them stays under the attribute size limit. The layout of the rules
+        is computed once and shared by the messages."""
+        (dim_types, lengths, service_attrs, name_attrs) = _rule_bulk_table_layout(rule_ids, services, columns)
+        return [cls(dpt_name, rule_ids[first:last], services[first:last],
+                    dict([(dim_type, column[first:last]) for (dim_type, column) in columns.items()]),
+                    (dim_types, lengths[first:last], service_attrs, name_attrs))
+                for (first, last) in _split_rule_bulk(lengths)]
+
 class KZorpGetDispatcherMessage(GenericNetlinkMessage):
     command = KZNL_MSG_GET_DISPATCHER
 
@@ -1006,6 +1427,71 @@ class KZorpQueryMessage(GenericNetlinkMessage):
             self.append_attribute(NetlinkAttribute.create_be32(KZNL_ATTR_QUERY_PARAMS_REQID, self.reqid))
         self.append_attribute(create_query_params_attr(KZNL_ATTR_QUERY_PARAMS, self.proto, self.sport, self.dport, self.iface))
 
+class KZorpQueryBatchMessage(GenericNetlinkMessage):
+    """Dump request evaluating many queries at once.
+
+    Keyword arguments:
+    queries -- list of dicts with the keys 'family', 'proto', 'saddr', 'sport',
+               'daddr', 'dport', 'ifindex' and optionally 'reqid'; addresses
+               are in packed form as returned by socket.inet_pton()
+
+    """
+    command = KZNL_MSG_QUERY_BATCH
+
+    def __init__(self, queries):
+        super(KZorpQueryBatchMessage, self).__init__(self.command, version = 1)
+
+        self.queries = queries
+
+        self._build_payload()
+
+    def _build_payload(self):
+        tuples = [struct.pack(KZA_QUERY_BATCH_TUPLE_FORMAT, q['saddr'], q['daddr'], q['ifindex'], q.get('reqid', 0),
+                              q['sport'], q['dport'], q['family'], q['proto'])
+                  for q in self.queries]
+        data = struct.pack('>II', KZ_QUERY_BATCH_VERSION, len(self.queries)) + "".join(tuples)
+        self.append_attribute(NetlinkAttribute(KZNL_ATTR_QUERY_BATCH, data = data))
+
+    def __str__(self):
+        return "Query batch num_queries='%d'" % (len(self.queries), )
+
+class KZorpQueryBatchReplyMessage(GenericNetlinkMessage):
+    command = KZNL_MSG_QUERY_BATCH_REPLY
+
+    def __init__(self, generation, first, results):
+        super(KZorpQueryBatchReplyMessage, self).__init__(self.command, version = 1)
+
+        self.generation = generation
+        self.first = first
+        self.results = results
+
+    @staticmethod
+    def parse_results(data):
+        (first, num_results) = struct.unpack('>II', data[:8])
+        results = []
+        for offset in range(8, 8 + num_results * KZA_QUERY_BATCH_RESULT_SIZE, KZA_QUERY_BATCH_RESULT_SIZE):
+            (dispatcher_id, client_zone_id, server_zone_id, service_id, rule_id) = \
+                struct.unpack(KZA_QUERY_BATCH_RESULT_FORMAT, data[offset : offset + KZA_QUERY_BATCH_RESULT_SIZE])
+            results.append({'dispatcher_id' : dispatcher_id, 'client_zone_id' : client_zone_id,
+                            'server_zone_id' : server_zone_id, 'service_id' : service_id,
+                            'rule_id' : rule_id})
+        return (first, results)
+
+    @staticmethod
+    def parse(version, data):
+        attrs = NetlinkAttribute.parse(NetlinkAttributeFactory, data)
+
+        for attr in (KZNL_ATTR_CONFIG_GENERATION, KZNL_ATTR_QUERY_BATCH_RESULTS):
+            if not attrs.has_key(attr):
+                raise AttributeRequiredError, "attr_type='%d'" % (attr, )
+
+        (first, results) = KZorpQueryBatchReplyMessage.parse_results(attrs[KZNL_ATTR_QUERY_BATCH_RESULTS].get_data())
+
+        return KZorpQueryBatchReplyMessage(attrs[KZNL_ATTR_CONFIG_GENERATION].parse_be32(), first, results)
+
+    def __str__(self):
+        return "Query batch reply generation='%d', first='%d', num_results='%d'" % (self.generation, self.first, len(self.results))
+
 class KZorpQueryReplyMessage(GenericNetlinkMessage):
     command = KZNL_MSG_QUERY_REPLY
 
@@ -1061,6 +1547,50 @@ class KZorpQueryReplyMessage(GenericNetlinkMessage):
         return "Client zone: %s\nServer zone: %s\nService: %s\nDispatcher: %s" % \
                (client_zone, server_zone, service, dispatcher)
 
+# session events
+class KZorpSessionEventMessage(GenericNetlinkMessage):
+    command = KZNL_MSG_SESSION_EVENT
+
+    def __init__(self, records):
+        super(KZorpSessionEventMessage, self).__init__(self.command, version = 1)
+
+        self.records = records
+
+    @staticmethod
+    def parse_records(data):
+        records = []
+        for offset in range(0, len(data) - KZA_SESSION_RECORD_SIZE + 1, KZA_SESSION_RECORD_SIZE):
+            (sid, service_id, client_zone_id, server_zone_id, saddr, daddr,
+             sport, dport, l3proto, l4proto, event, verdict) = \
+                struct.unpack(KZA_SESSION_RECORD_FORMAT, data[offset : offset + KZA_SESSION_RECORD_SIZE])
+            if l3proto == socket.AF_INET:
+                saddr = saddr[:4]
+                daddr = daddr[:4]
+            records.append({'sid' : sid, 'service_id' : service_id,
+                            'client_zone_id' : client_zone_id, 'server_zone_id' : server_zone_id,
+                            'family' : l3proto, 'saddr' : saddr, 'daddr' : daddr,
+                            'sport' : sport, 'dport' : dport, 'proto' : l4proto,
+                            'event' : event, 'verdict' : verdict})
+        return records
+
+    @staticmethod
+    def parse(version, data):
+        attrs = NetlinkAttribute.parse(NetlinkAttributeFactory, data)
+
+        if attrs.has_key(KZNL_ATTR_SESSION_RECORDS):
+            records = KZorpSessionEventMessage.parse_records(attrs[KZNL_ATTR_SESSION_RECORDS].get_data())
+        else:
+            raise AttributeRequiredError, "KZNL_ATTR_SESSION_RECORDS"
+
+        return KZorpSessionEventMessage(records)
+
+    def __str__(self):
+        return "\n".join(["Session event='%s', sid='%d', service_id='%d', client='%s:%d', server='%s:%d', proto='%d'" % \
+                          (SessionEvent.to_string(r['event']), r['sid'], r['service_id'],
+                           socket.inet_ntop(r['family'], r['saddr']), r['sport'],
+                           socket.inet_ntop(r['family'], r['daddr']), r['dport'], r['proto'])
+                          for r in self.records])
+
 class NetlinkAttributePort(NetlinkAttribute):
     def __init__(self, type, port):
         NetlinkAttribute.__init__(self, type, data=struct.pack('>H', port))
@@ -1081,7 +1611,7 @@ class NetlinkAttributeProto(NetlinkAttribute):
 class KZorpAddBindMessage(GenericNetlinkMessage):
     command = KZNL_MSG_ADD_BIND
 
-    def __init__(self, family, instance, addr, port, proto):
+    def __init__(self, family, instance, addr, port, proto, weight=1):
         super(KZorpAddBindMessage, self).__init__(self.command, version = 1)
 
         self.instance = instance
@@ -1089,6 +1619,7 @@ class KZorpAddBindMessage(GenericNetlinkMessage):
         self.addr = addr
         self.port = port
         self.proto = proto
+        self.weight = weight
 
         self._build_payload()
 
@@ -1097,6 +1628,8 @@ class KZorpAddBindMessage(GenericNetlinkMessage):
         self.append_attribute(create_inet_addr_attr(KZNL_ATTR_BIND_ADDR, self.family, self.addr))
         self.append_attribute(NetlinkAttributePort(KZNL_ATTR_BIND_PORT, self.port))
         self.append_attribute(NetlinkAttributeProto(KZNL_ATTR_BIND_PROTO, self.proto))
+        if self.weight != 1:
+            self.append_attribute(NetlinkAttribute.create_be32(KZNL_ATTR_BIND_WEIGHT, self.weight))
 
     @staticmethod
     def parse(version, data):
@@ -1111,11 +1644,15 @@ class KZorpAddBindMessage(GenericNetlinkMessage):
         if proto != socket.IPPROTO_TCP and proto != socket.IPPROTO_UDP:
             raise NetlinkAttributeException, "invalid attribute value of protocol, protocol='%d'" % (proto, )
 
-        return KZorpAddBindMessage(family, instance, address, port, proto)
+        weight = 1
+        if attrs.has_key(KZNL_ATTR_BIND_WEIGHT):
+            weight = attrs[KZNL_ATTR_BIND_WEIGHT].parse_be32()
+
+        return KZorpAddBindMessage(family, instance, address, port, proto, weight)
 
     def __str__(self):
-        return "Bind instance='%s' protocol='%s', address='%s', port='%d'" % \
-               (self.instance, self.proto, socket.inet_ntop(self.family, self.addr), self.port)
+        return "Bind instance='%s' protocol='%s', address='%s', port='%d', weight='%d'" % \
+               (self.instance, self.proto, socket.inet_ntop(self.family, self.addr), self.port, self.weight)
 
 class KZorpGetBindMessage(GenericNetlinkMessage):
     command = KZNL_MSG_GET_BIND
@@ -1131,6 +1668,75 @@ class KZorpGetBindMessage(GenericNetlinkMessage):
         if self.instance:
             self.append_attribute(create_name_attr(KZNL_ATTR_INSTANCE_NAME, self.instance))
 
+# delete
+class KZorpDeleteMessage(GenericNetlinkMessage):
+    command = KZNL_MSG_INVALID
+    name_attr = KZNL_ATTR_INVALID
+
+    def __init__(self, name):
+        super(KZorpDeleteMessage, self).__init__(self.command, version = 1)
+
+        self.name = name
+
+        self._build_payload()
+
+    def _build_payload(self):
+        self.append_attribute(create_name_attr(self.name_attr, self.name))
+
+    @classmethod
+    def parse(cls, version, data):
+        attrs = NetlinkAttribute.parse(NetlinkAttributeFactory, data)
+
+        if not attrs.has_key(cls.name_attr):
+            raise AttributeRequiredError, "name"
+
+        return cls(parse_name_attr(attrs[cls.name_attr]))
+
+    def __str__(self):
+        return "Delete name='%s'" % (self.name, )
+
+class KZorpDeleteZoneMessage(KZorpDeleteMessage):
+    command = KZNL_MSG_DELETE_ZONE
+    name_attr = KZNL_ATTR_ZONE_UNAME
+
+class KZorpDeleteServiceMessage(KZorpDeleteMessage):
+    command = KZNL_MSG_DELETE_SERVICE
+    name_attr = KZNL_ATTR_SVC_NAME
+
+class KZorpDeleteDispatcherMessage(KZorpDeleteMessage):
+    command = KZNL_MSG_DELETE_DISPATCHER
+    name_attr = KZNL_ATTR_DPT_NAME
+
+class KZorpDeleteRuleMessage(GenericNetlinkMessage):
+    command = KZNL_MSG_DELETE_RULE
+
+    def __init__(self, dpt_name, rule_id):
+        super(KZorpDeleteRuleMessage, self).__init__(self.command, version = 1)
+
+        self.dpt_name = dpt_name
+        self.rule_id = rule_id
+
+        self._build_payload()
+
+    def _build_payload(self):
+        self.append_attribute(create_name_attr(KZNL_ATTR_DPT_NAME, self.dpt_name))
+        self.append_attribute(NetlinkAttribute.create_be32(KZNL_ATTR_N_DIMENSION_RULE_ID, self.rule_id))
+
+    @staticmethod
+    def parse(version, data):
+        attrs = NetlinkAttribute.parse(NetlinkAttributeFactory, data)
+
+        if not attrs.has_key(KZNL_ATTR_DPT_NAME):
+            raise AttributeRequiredError, "KZNL_ATTR_DPT_NAME"
+        if not attrs.has_key(KZNL_ATTR_N_DIMENSION_RULE_ID):
+            raise AttributeRequiredError, "KZNL_ATTR_N_DIMENSION_RULE_ID"
+
+        return KZorpDeleteRuleMessage(parse_name_attr(attrs[KZNL_ATTR_DPT_NAME]),
+                                      attrs[KZNL_ATTR_N_DIMENSION_RULE_ID].parse_be32())
+
+    def __str__(self):
+        return "Delete rule dispatcher='%s', rule_id='%d'" % (self.dpt_name, self.rule_id)
+
 class KZorpMessageFactory(object):
     known_classes = {
       KZNL_MSG_ADD_BIND            : KZorpAddBindMessage,
@@ -1141,6 +1747,10 @@ class KZorpMessageFactory(object):
       KZNL_MSG_ADD_SERVICE_NAT_DST : KZorpAddServiceDestinationNATMappingMessage,
       KZNL_MSG_ADD_SERVICE_NAT_SRC : KZorpAddServiceSourceNATMappingMessage,
       KZNL_MSG_ADD_ZONE            : KZorpAddZoneMessage,
+      KZNL_MSG_DELETE_DISPATCHER   : KZorpDeleteDispatcherMessage,
+      KZNL_MSG_DELETE_RULE         : KZorpDeleteRuleMessage,
+      KZNL_MSG_DELETE_SERVICE      : KZorpDeleteServiceMessage,
+      KZNL_MSG_DELETE_ZONE         : KZorpDeleteZoneMessage,
       KZNL_MSG_FLUSH_BIND          : KZorpFlushBindsMessage,
       KZNL_MSG_FLUSH_DISPATCHER    : KZorpFlushDispatchersMessage,
       KZNL_MSG_FLUSH_SERVICE       : KZorpFlushServicesMessage,
@@ -1150,9 +1760,13 @@ class KZorpMessageFactory(object):
       KZNL_MSG_GET_SERVICE         : KZorpGetServiceMessage,
       KZNL_MSG_GET_ZONE            : KZorpGetZoneMessage,
       KZNL_MSG_COMMIT              : KZorpCommitTransactionMessage,
+      KZNL_MSG_COMMIT_DONE         : KZorpCommitDoneMessage,
       KZNL_MSG_START               : KZorpStartTransactionMessage,
       KZNL_MSG_QUERY               : KZorpQueryMessage,
       KZNL_MSG_QUERY_REPLY         : KZorpQueryReplyMessage,
+      KZNL_MSG_QUERY_BATCH         : KZorpQueryBatchMessage,
+      KZNL_MSG_QUERY_BATCH_REPLY   : KZorpQueryBatchReplyMessage,
+      KZNL_MSG_SESSION_EVENT       : KZorpSessionEventMessage,
     }
 
     @staticmethod
@@ -1169,3 +1783,9 @@ class Handle(netlink.Handle):
 
     def talk(self, message, is_dump_request=False, factory=KZorpMessageFactory):
         return super(Handle, self).talk(message, is_dump_request, factory)
+
+    def receive(self, factory=KZorpMessageFactory, timeout=None):
+        return super(Handle, self).receive(factory, timeout)
+
+    def exchange(self, messages, window=netlink.PIPELINE_WINDOW, factory=KZorpMessageFactory):
+        return super(Handle, self).exchange(messages, window, factory)
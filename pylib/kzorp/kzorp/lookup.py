@@ -0,0 +1,171 @@
+
+#
+# Copyright (C) 2006-2012, BalaBit IT Ltd.
+# This program/include file is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as published
+# by the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program/include file is distributed in the hope that it will be
+# useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+# of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+"""Bindings of libkzorp-lookup: KZorp session lookups without the kernel module."""
+
+import ctypes
+import ctypes.util
+import errno
+import os
+from netlink import NetlinkMessage, NLMSG_MIN_TYPE, NLM_F_REQUEST
+
+KZORP_LOOKUP_API_VERSION = 1
+KZORP_LOOKUP_NO_ID = 0xffffffff
+
+class LookupException(Exception):
+    def __init__(self, what, error):
+        self.what = what
+        self.error = error
+
+    def __str__(self):
+        return '%s: %s' % (self.what, os.strerror(-self.error))
+
+class _Query(ctypes.Structure):
+    _fields_ = [('family', ctypes.c_ubyte),
+                ('proto', ctypes.c_ubyte),
+                ('sport', ctypes.c_ushort),
+                ('dport', ctypes.c_ushort),
+                ('saddr', ctypes.c_char * 16),
+                ('daddr', ctypes.c_char * 16),
+                ('ifname', ctypes.c_char * 16),
+                ('ifgroup', ctypes.c_uint),
+                ('reqid', ctypes.c_uint)]
+
+class _Result(ctypes.Structure):
+    _fields_ = [('dispatcher_id', ctypes.c_uint),
+                ('client_zone_id', ctypes.c_uint),
+                ('server_zone_id', ctypes.c_uint),
+                ('service_id', ctypes.c_uint),
+                ('rule_id', ctypes.c_uint),
+                ('dispatcher', ctypes.c_char_p),
+                ('client_zone', ctypes.c_char_p),
+                ('server_zone', ctypes.c_char_p),
+                ('service', ctypes.c_char_p)]
+
+_library = None
+
+def _load_library(name=None):
+    global _library
+
+    if _library is not None:
+        return _library
+
+    if name is None:
+        name = ctypes.util.find_library('kzorp-lookup') or 'libkzorp-lookup.so.1'
+
+    lib = ctypes.CDLL(name)
+    lib.kzorp_lookup_api_version.restype = ctypes.c_uint
+    lib.kzorp_lookup_api_version.argtypes = []
+    lib.kzorp_lookup_policy_load_messages.restype = ctypes.c_void_p
+    lib.kzorp_lookup_policy_load_messages.argtypes = [ctypes.c_char_p, ctypes.c_ulong, ctypes.POINTER(ctypes.c_int)]
+    lib.kzorp_lookup_policy_free.restype = None
+    lib.kzorp_lookup_policy_free.argtypes = [ctypes.c_void_p]
+    lib.kzorp_lookup_session.restype = ctypes.c_int
+    lib.kzorp_lookup_session.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Query), ctypes.POINTER(_Result)]
+    lib.kzorp_lookup_sessions.restype = ctypes.c_int
+    lib.kzorp_lookup_sessions.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Query), ctypes.POINTER(_Result),
+                                          ctypes.c_uint, ctypes.c_uint]
+
+    if lib.kzorp_lookup_api_version() != KZORP_LOOKUP_API_VERSION:
+        raise LookupException('unsupported library version', -errno.ENOSYS)
+
+    _library = lib
+    return _library
+
+def _create_query(query):
+    q = _Query()
+    q.family = query['family']
+    q.proto = query['proto']
+    q.sport = query['sport']
+    q.dport = query['dport']
+    q.saddr = query['saddr']
+    q.daddr = query['daddr']
+    q.ifname = query.get('iface', '')
+    q.ifgroup = query.get('ifgroup', 0)
+    q.reqid = query.get('reqid', 0)
+    return q
+
+def _parse_result(result):
+    return {'dispatcher_id' : result.dispatcher_id, 'dispatcher' : result.dispatcher,
+            'client_zone_id' : result.client_zone_id, 'client_zone' : result.client_zone,
+            'server_zone_id' : result.server_zone_id, 'server_zone' : result.server_zone,
+            'service_id' : result.service_id, 'service' : result.service,
+            'rule_id' : result.rule_id}
+
+class Policy(object):
+    """A KZorp policy loaded into libkzorp-lookup.
+
+    Queries are dicts with the keys 'family', 'proto', 'saddr', 'sport',
+    'daddr', 'dport' and optionally 'iface', 'ifgroup' and 'reqid';
+    addresses are in packed form as returned by socket.inet_pton(). The
+    results are dicts with the names and ids of the dispatcher, the zones,
+    the service and the id of the rule, names are None and ids are
+    KZORP_LOOKUP_NO_ID if there is no such object. Service ids are the
+    positions of the services in the policy, not the ids used by the
+    kernel module.
+
+    """
+    def __init__(self, handle, library):
+        self._handle = handle
+        self._library = library
+
+    @classmethod
+    def _load(cls, loader, data, library):
+        lib = _load_library(library)
+        error = ctypes.c_int(0)
+        handle = getattr(lib, loader)(data, len(data), ctypes.byref(error))
+        if not handle:
+            raise LookupException('failed to load policy', error.value)
+        return cls(handle, lib)
+
+    @classmethod
+    def from_messages(cls, messages, library=None):
+        """Load the policy of configuration messages (KZorpAddZoneMessage,
+        KZorpAddServiceMessage, ...) in the order they would be sent."""
+        buf = "".join([NetlinkMessage(NLMSG_MIN_TYPE, NLM_F_REQUEST, seq, 0, message.dump()).dump()
+                       for (seq, message) in enumerate(messages)])
+        return cls.from_netlink_stream(buf, library)
+
+    @classmethod
+    def from_netlink_stream(cls, buf, library=None):
+        """Load the policy of netlink messages as they would be sent to the kernel."""
+        return cls._load('kzorp_lookup_policy_load_messages', buf, library)
+
+    def close(self):
+        if self._handle:
+            self._library.kzorp_lookup_policy_free(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+    def lookup(self, query):
+        result = _Result()
+        res = self._library.kzorp_lookup_session(self._handle, ctypes.byref(_create_query(query)), ctypes.byref(result))
+        if res < 0:
+            raise LookupException('lookup failed', res)
+        return _parse_result(result)
+
+    def lookup_many(self, queries, threads=0):
+        """Look up many sessions at once, using all online CPUs by default."""
+        num = len(queries)
+        q = (_Query * num)(*[_create_query(query) for query in queries])
+        results = (_Result * num)()
+        res = self._library.kzorp_lookup_sessions(self._handle, q, results, num, threads)
+        if res < 0:
+            raise LookupException('lookup failed', res)
+        return [_parse_result(result) for result in results]
@@ -33,6 +33,26 @@ class NetlinkException(NetlinkBaseException):
         super(NetlinkException, self).__init__(detail)
         self.what = 'netlink error'
 
+class NetlinkPipelineException(NetlinkException):
+    """Failure of some messages of a pipelined exchange.
+
+    The detail is the error code of the first failed message; errors is the
+    list of (index, error) pairs of all failed messages. applied is the
+    sorted list of the indices of the messages processed successfully,
+    including the ones after the first failure that had already been sent.
+
+    """
+    def __init__(self, errors, messages, applied):
+        (index, error) = errors[0]
+        super(NetlinkPipelineException, self).__init__(error)
+        self.index = index
+        self.message = messages[index]
+        self.errors = errors
+        self.applied = applied
+
+    def __str__(self):
+        return '%s: %s; message_index=\'%d\', message=\'%s\'' % (self.what, self.detail, self.index, self.message)
+
 class NetlinkAttributeException(NetlinkBaseException):
     def __init__(self, detail):
         super(NetlinkAttributeException, self).__init__(detail)
@@ -81,6 +101,10 @@ NFA_ALIGNTO = 4
 
 MAX_NLMSGSIZE = 65535
 
+# pipelined exchanges: messages waiting for an ack and bytes of one send
+PIPELINE_WINDOW = 64
+PIPELINE_MAX_SEND_SIZE = 32768
+
 # generic netlink constants
 GENL_NAMSIZ = 16     # length of family name
 GENL_ID_CTRL = NLMSG_MIN_TYPE
@@ -109,6 +133,15 @@ CTRL_ATTR_OPS = 6
 CTRL_ATTR_MCAST_GROUPS = 7
 CTRL_ATTR_MAX = 8             # always keep last
 
+# generic netlink controller multicast group attribute types
+CTRL_ATTR_MCAST_GRP_UNSPEC = 0
+CTRL_ATTR_MCAST_GRP_NAME = 1
+CTRL_ATTR_MCAST_GRP_ID = 2
+
+# netlink socket options
+SOL_NETLINK = 270
+NETLINK_ADD_MEMBERSHIP = 1
+
 def nfa_align(len):
     return (len + NFA_ALIGNTO - 1) & ~(NFA_ALIGNTO - 1)
 
@@ -326,10 +359,31 @@ class GenericNetlinkNewFamilyMessage(GenericNetlinkMessage):
 
     command = CTRL_CMD_NEWFAMILY
 
+    @staticmethod
+    def _parse_nested(data):
+        # the controller does not flag its nested attributes and the
+        # payload of the outer attribute is padded with zeroes
+        attrs = {}
+        i = 0
+        while i + 4 <= len(data):
+            (length, type) = struct.unpack('HH', data[i:i + 4])
+            if length < 4:
+                break
+            attrs[type & NLA_TYPE_MASK] = data[i + 4:i + length]
+            i = i + nfa_align(length)
+        return attrs
+
     def parse(self):
         attrs = self.get_attributes()
         self.family_id = attrs[CTRL_ATTR_FAMILY_ID].parse_u16()
 
+        self.mcast_groups = {}
+        if attrs.has_key(CTRL_ATTR_MCAST_GROUPS):
+            for group in self._parse_nested(attrs[CTRL_ATTR_MCAST_GROUPS].get_data()).values():
+                group_attrs = self._parse_nested(group)
+                name = group_attrs[CTRL_ATTR_MCAST_GRP_NAME].rstrip('\0')
+                (self.mcast_groups[name],) = struct.unpack('I', group_attrs[CTRL_ATTR_MCAST_GRP_ID][:4])
+
         return self
 
 class NetlinkMessage(object):
@@ -372,6 +426,9 @@ class Handle(object):
         # get local netlink port id
         self._netlink_port_id = self._fd.getsockname()[0]
         self._family_id = GENL_ID_CTRL
+        self._mcast_groups = {}
+        # messages received during an exchange not in reply to its requests
+        self._unsolicited = []
 
         self._lookup_genetlink_family_id(family_name)
 
@@ -379,6 +436,13 @@ class Handle(object):
         msg = GenericNetlinkGetFamilyMessage(family_name)
         for reply in self.talk(msg, factory=GenericNetlinkControlMessageFactory):
             self._family_id = reply.family_id
+            self._mcast_groups = reply.mcast_groups
+
+    def join_group(self, group_name):
+        """Subscribe to a multicast group of the family."""
+        if not self._mcast_groups.has_key(group_name):
+            raise NetlinkException, -errno.ENOENT
+        self._fd.setsockopt(SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, self._mcast_groups[group_name])
 
     @staticmethod
     def parse_messages(buf):
@@ -428,6 +492,11 @@ class Handle(object):
             for m in self.parse_messages(answer):
                 # check for special messages
                 if m.type == NLMSG_DONE:
+                    # a failed dump reports the error in the done message
+                    if len(m.payload) >= 4:
+                        (error,) = struct.unpack('i', m.payload[:4])
+                        if error < 0:
+                            raise NetlinkException, error
                     quit = True
                     break
                 if m.type == NLMSG_ERROR:
@@ -440,6 +509,87 @@ class Handle(object):
 
                 yield m
 
+    def receive(self, factory=None, timeout=None):
+        """Wait for messages not sent in reply to a request, like notifications.
+
+        Raises socket.timeout if nothing arrives in timeout seconds."""
+        if self._unsolicited:
+            messages = self._unsolicited
+            self._unsolicited = []
+        else:
+            self._fd.settimeout(timeout)
+            try:
+                (answer, peer) = self._fd.recvfrom(MAX_NLMSGSIZE)
+            finally:
+                self._fd.settimeout(None)
+            messages = self.parse_messages(answer)
+        return [GenericNetlinkMessage.parse(factory, m.payload) for m in messages]
+
+    def exchange(self, messages, window=PIPELINE_WINDOW, factory=None):
+        """Send messages without waiting for the ack of each before the next.
+
+        Many messages are packed into each send and at most window messages
+        are waiting for their ack at a time, so that the replies fit in the
+        receive buffer of the socket. The kernel processes the messages in
+        order. Once a message fails no more messages are sent, but the ones
+        already sent are still processed and waited for; then
+        NetlinkPipelineException reports every failed message and the ones
+        that were applied, even after the first failure.
+
+        A short send raises NetlinkException with -EPIPE; the messages sent
+        before are in an unknown state then.
+
+        Returns the list of the replies to each message, not including acks.
+
+        """
+        pending = {}
+        replies = [[] for message in messages]
+        errors = []
+        applied = []
+        next_index = 0
+
+        while True:
+            batch = []
+            batch_size = 0
+            while not errors and next_index < len(messages) and \
+                  len(pending) < window and batch_size < PIPELINE_MAX_SEND_SIZE:
+                netlink_message = self._create_netlink_message(NLM_F_REQUEST | NLM_F_ACK, messages[next_index])
+                data = netlink_message.dump()
+                batch.append(data)
+                batch_size = batch_size + len(data)
+                pending[netlink_message.seq] = next_index
+                next_index = next_index + 1
+
+            if batch:
+                data = "".join(batch)
+                if self._fd.send(data) != len(data):
+                    raise NetlinkException, -errno.EPIPE
+
+            if not pending:
+                break
+
+            (answer, peer) = self._fd.recvfrom(MAX_NLMSGSIZE)
+            for m in self.parse_messages(answer):
+                index = pending.get(m.seq)
+                if index is None:
+                    self._unsolicited.append(m)
+                elif m.type == NLMSG_ERROR:
+                    del pending[m.seq]
+                    error = m.get_errorcode()
+                    if error < 0:
+                        errors.append((index, error))
+                    else:
+                        applied.append(index)
+                else:
+                    replies[index].append(GenericNetlinkMessage.parse(factory, m.payload))
+
+        if errors:
+            errors.sort()
+            applied.sort()
+            raise NetlinkPipelineException(errors, messages, applied)
+
+        return replies
+
     def talk(self, message, is_dump_request=False, factory=None):
         self.send(message, is_dump_request)
         for m in self.listen():